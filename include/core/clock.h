@@ -0,0 +1,66 @@
+/**
+ * @file clock.h
+ * @author horse-dog (horsedog@whu.edu.cn)
+ * @brief piorun 单调时钟
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef PIORUN_CORE_CLOCK_H_
+#define PIORUN_CORE_CLOCK_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace pio {
+
+// 运行时统一使用的单调时钟(微秒级)，满足 std::chrono 的 Clock 要求.
+// 运行调度循环的线程缓存一份当前时间，由调度循环每轮刷新，热路径上读取时间不需要访问时钟源；
+// 其他线程上 now() 每次都读取时钟源.
+// 时钟源默认是 CLOCK_MONOTONIC，不受系统时间调整的影响；校准 TSC 后改为直接读取 TSC.
+class MonotonicClock {
+ public:
+  using rep = int64_t;
+  using period = std::micro;
+  using duration = std::chrono::duration<rep, period>;
+  using time_point = std::chrono::time_point<MonotonicClock>;
+  static constexpr bool is_steady = true;
+
+  /**
+   * @brief 获取当前时间. 当前线程的缓存由调度循环负责刷新时返回缓存的时间，
+   * 否则读取时钟源.
+   *
+   * @return time_point
+   */
+  static time_point now() noexcept;
+
+  /**
+   * @brief 读取时钟源，刷新当前线程缓存的时间.
+   *
+   * @return time_point 刷新后的时间
+   */
+  static time_point Refresh() noexcept;
+
+  /**
+   * @brief 声明当前线程的调度循环会定期调用 Refresh，之后 now() 直接返回缓存的时间.
+   * 调度循环开始时以 true 调用，退出时以 false 调用.
+   *
+   * @param owned 当前线程是否负责刷新缓存
+   */
+  static void OwnThreadCache(bool owned) noexcept;
+
+  /**
+   * @brief 校准 TSC，成功后所有线程改为从 TSC 读取时间.
+   * 校准需要阻塞约 10ms，应当在启动时调用.
+   *
+   * @return bool CPU 不支持恒定速率的 TSC 时返回false
+   */
+  static bool EnableTsc();
+};
+
+}  // namespace pio
+
+#endif
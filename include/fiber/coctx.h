@@ -13,6 +13,8 @@
 
 #include <stdlib.h>
 
+#include <vector>
+
 namespace pio::fiber {
 
 // 协程的上下文
@@ -21,13 +23,32 @@ struct FiberContext {
     int stackSize_; /*> 栈的大小 */
     char* bp_;      /*> 栈基址 */
     char* buffer_;  /*> 栈顶，stack_bp = stack_buffer + stack_size */
+    char* mapped_;  /*> mmap 得到的起始地址，[mapped_, buffer_) 为保护页(可能为空) */
+    FiberContext* occupy_; /*> 共享栈模式下，当前占用该栈的上下文 */
 
     StackMemory(int size = 128 * 1024);
 
     ~StackMemory();
+
+    StackMemory(const StackMemory&) = delete;
+
+    StackMemory& operator=(const StackMemory&) = delete;
+
+    /**
+     * @brief 归还 [buffer_, bp_ - keep) 范围内的物理页，虚拟地址保持映射.
+     *
+     * @param keep 栈基址一侧需要保留的字节数
+     */
+    void Purge(size_t keep = 0);
   };
 
-  FiberContext();
+  /**
+   * @brief Constructor
+   *
+   * @param shareStack 是否使用共享栈，共享栈模式下切出时会把栈上已使用的部分
+   * 拷贝到堆上，以一次 memcpy 换取更小的内存占用
+   */
+  FiberContext(bool shareStack = false);
 
   FiberContext(const FiberContext& rhs);
 
@@ -50,10 +71,81 @@ struct FiberContext {
    */
   int Make(void* (*pfn)(void*, void*), const void* s1, const void* s2);
 
-  void* regs_[13];     /*>
-                          存储13个通用寄存器，这里不需要r10，r11以及rax，r10、r11和rax会被调用者保存
+  /**
+   * @brief 从上下文 @p curr 切换到上下文 @p pending ，负责共享栈的保存与恢复.
+   *
+   * @param curr 当前上下文
+   * @param pending 待切换的上下文
+   */
+  static void Swap(FiberContext* curr, FiberContext* pending);
+
+  bool IsShared() const { return isShared_; }
+
+  void* regs_[14];     /*>
+                          存储13个通用寄存器和返回地址，这里不需要r10，r11以及rax，r10、r11和rax会被调用者保存
                         */
   StackMemory* stack_; /*> 栈内存 */
+
+  bool isShared_;      /*> 是否运行在共享栈上 */
+  char* stackSp_;      /*> 切出时的栈顶，[stackSp_, stack_->bp_) 为已使用的栈 */
+  char* saveBuffer_;   /*> 共享栈模式下，切出时保存栈内容的缓冲区 */
+  size_t saveSize_;    /*> 缓冲区中有效数据的长度 */
+  size_t saveCapacity_;/*> 缓冲区的容量 */
+
+ private:
+  /**
+   * @brief 将 [stackSp_, stack_->bp_) 保存到堆上的缓冲区中.
+   */
+  void SaveStack();
+};
+
+// 线程级协程栈分配器，空闲栈通过空闲链表复用
+class StackAllocator {
+ public:
+  using StackMemory = FiberContext::StackMemory;
+
+  static const int kDefaultStackSize = 128 * 1024; /*> 默认栈大小 */
+  static const size_t kMaxCachedStacks = 64;       /*> 空闲链表的最大长度 */
+  static const int kShareStackSize = 256 * 1024;   /*> 共享栈的大小 */
+  static const int kShareStackCount = 8;           /*> 每个线程的共享栈数量 */
+
+  /**
+   * @brief 获取当前线程的栈分配器.
+   */
+  static StackAllocator& GetInstance();
+
+  /**
+   * @brief 分配一个协程栈，优先从空闲链表中获取.
+   *
+   * @param size 栈大小
+   * @return StackMemory*
+   */
+  StackMemory* Allocate(int size = kDefaultStackSize);
+
+  /**
+   * @brief 归还一个协程栈，空闲链表未满时缓存它（物理页会被归还），否则 munmap.
+   *
+   * @param stack 待归还的栈
+   */
+  void Deallocate(StackMemory* stack);
+
+  /**
+   * @brief 以轮转的方式从本线程的共享栈中取一个.
+   *
+   * @return StackMemory* 共享栈，由分配器持有
+   */
+  StackMemory* GetShareStack();
+
+ private:
+  StackAllocator() = default;
+  StackAllocator(const StackAllocator&) = delete;
+  StackAllocator& operator=(const StackAllocator&) = delete;
+ ~StackAllocator();
+
+ private:
+  std::vector<StackMemory*> freeList_; /*> 空闲栈链表 */
+  StackMemory* shareStacks_[kShareStackCount] = {}; /*> 共享栈 */
+  unsigned shareStackIdx_ = 0; /*> 下一次分配的共享栈的下标 */
 };
 
 }  // namespace pio::fiber
@@ -12,15 +12,31 @@
 #define PIORUN_FIBER_FIBER_H_
 
 #include "coctx.h"
+#include "core/clock.h"
 #include "core/mutex.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+
 #include <deque>
+#include <exception>
+#include <optional>
+#include <memory>
+#include <vector>
 #include <mutex>
 #include <atomic>
 #include <thread>
+#include <cstddef>
 #include <cstdio>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <system_error>
 #include <type_traits>
 
 namespace pio::fiber {
@@ -35,10 +51,148 @@ class MultiThreadFiberScheduler;
 
 class Fiber;
 
+struct StTimeoutItem;
+struct StFdEvent;
+struct StUringSocket;
+
+/**
+ * @brief 把相对时间换算成运行时单调时钟上的截止时间，向上取整到微秒.
+ */
+template <typename Rep, typename Period>
+inline MonotonicClock::time_point DeadlineAfter(
+    const std::chrono::duration<Rep, Period>& d) {
+  return MonotonicClock::Refresh() +
+         std::chrono::ceil<MonotonicClock::duration>(d);
+}
+
+/**
+ * @brief 把其他时钟上的时间点换算成运行时单调时钟上的截止时间.
+ */
+template <typename Clock, typename Duration>
+inline MonotonicClock::time_point DeadlineAt(
+    const std::chrono::time_point<Clock, Duration>& tp) {
+  return DeadlineAfter(tp - Clock::now());
+}
+
+inline MonotonicClock::time_point DeadlineAt(
+    const MonotonicClock::time_point& tp) {
+  return tp;
+}
+
+/**
+ * @brief 协程的取消令牌，可以在任意线程中取消对应的协程.
+ * 取消后，该协程正在进行的以及之后进行的可超时等待(try_lock_for、wait_for、
+ * read_for 等)，以及被 hook 的套接字 IO 上的等待(read/recv/accept/connect 等，
+ * 有没有设置超时都一样)在需要阻塞时立即失败，errno 为 ECANCELED；
+ * 同步原语上不带超时的等待(lock、wait、channel 的 read/write)不受影响.
+ * 令牌只对获取它时协程上运行的任务有效，任务结束后 cancel 不再有任何作用.
+ */
+class cancel_token {
+
+friend class Fiber;
+
+ public:
+  cancel_token() = default;
+
+  void cancel() const;
+  bool cancelled() const;
+
+ private:
+  struct State {
+    SpinLock   lock; /*> 保护以下成员，以及被取消时对协程等待状态的访问 */
+    Fiber*    fiber; /*> 令牌对应的协程，任务结束后置空 */
+    bool  cancelled; /*> 是否已经被取消 */
+    bool    blocked; /*> 协程是否阻塞在可以被取消的等待上 */
+  };
+
+  explicit cancel_token(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+  std::shared_ptr<State> state_;
+
+};
+
+/**
+ * @brief 同步原语等待队列中的结点. 普通的等待使用协程对象中内嵌的结点，select 的
+ * 每个分支一个结点；结点由等待者提供，阻塞和唤醒都不需要分配内存.
+ */
+struct WaitNode {
+  Fiber*   fiber; /*> 等待的协程 */
+  WaitNode* prev; /*> 队列中的前一个结点 */
+  WaitNode* next; /*> 队列中的后一个结点 */
+  int      index; /*> 协程在 select 中时为分支下标，否则为 -1 */
+  bool    linked; /*> 是否在某个等待队列中 */
+  bool   granted; /*> 互斥锁是否已经直接转交给了等待的协程 */
+};
+
+/**
+ * @brief 侵入式的先进先出等待队列，由所属同步原语的锁保护.
+ */
+class WaitQueue {
+
+ public:
+  WaitQueue() : head_(nullptr), tail_(nullptr), size_(0) {}
+  WaitQueue(const WaitQueue&) = delete;
+  WaitQueue& operator=(const WaitQueue&) = delete;
+
+  bool empty() const { return head_ == nullptr; }
+  size_t size() const { return size_; }
+
+  void push_back(WaitNode* node);
+  void push_front(WaitNode* node);
+
+  /**
+   * @brief 取出队首的结点.
+   * 
+   * @return WaitNode* 队列为空时返回空
+   */
+  WaitNode* pop_front();
+
+  /**
+   * @brief 把结点从队列中移除.
+   * 
+   * @return bool 结点是否还在队列中
+   */
+  bool remove(WaitNode* node);
+
+  /**
+   * @brief 取出所有结点，返回按入队顺序以 next 串起来的链表.
+   * 在锁外遍历时要先读出 next 再唤醒结点的协程，协程被唤醒后可能马上重新使用它的结点.
+   */
+  WaitNode* pop_all();
+
+  /**
+   * @brief 唤醒 pop_all 取出的链表中所有的协程，在锁外调用.
+   */
+  static void WakeAll(WaitNode* list);
+
+ private:
+  WaitNode* head_; /*> 队首 */
+  WaitNode* tail_; /*> 队尾 */
+  size_t    size_; /*> 结点数量 */
+
+};
+
+/**
+ * @brief 协程互斥锁. 锁被其他线程上的协程持有时先短暂自旋，否则挂起等待.
+ * 正常模式下释放锁只唤醒一个等待者，由它和新来的协程竞争；有等待者超过 1ms
+ * 没有拿到锁时切换到饥饿模式，释放锁时把所有权直接转交给队首的等待者，新来的
+ * 协程不再抢锁而是排队，等待队列清空后回到正常模式.
+ */
 class mutex {
 
  public:
-  mutex() : locked(false) {}
+  // 竞争情况的统计
+  struct Stats {
+    uint64_t   contended; /*> 没有在快速路径上拿到锁的次数 */
+    uint64_t     spinned; /*> 通过自旋拿到锁的次数 */
+    uint64_t      parked; /*> 挂起等待的次数 */
+    uint64_t    handoffs; /*> 饥饿模式下直接转交所有权的次数 */
+    uint64_t starvations; /*> 进入饥饿模式的次数 */
+  };
+
+  mutex()
+      : state(0), waiting(0), owner(nullptr), woken(false), contended(0),
+        spinned(0), parked(0), handoffs(0), starvations(0) {}
  ~mutex() {}
   mutex(const mutex&) = delete;
   mutex& operator=(const mutex&) = delete;
@@ -47,17 +201,55 @@ class mutex {
   bool try_lock();
   void unlock();
 
+  Stats GetStats() const;
+
+  /**
+   * @brief 在截止时间之前获取锁.
+   * 
+   * @return bool 是否获取成功，失败时 errno 为 ETIMEDOUT 或 ECANCELED
+   */
+  bool try_lock_until(const MonotonicClock::time_point& deadline);
+
+  template <typename Clock, typename Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock, Duration>& tp)
+  { return try_lock_until(DeadlineAt(tp)); }
+
+  template <typename Rep, typename Period>
+  bool try_lock_for(const std::chrono::duration<Rep, Period>& d)
+  { return try_lock_until(DeadlineAfter(d)); }
+
  private:
-  std::deque<Fiber*> waiters;
-  SpinLock               mtx;
-  bool                locked;
+  static const int kLocked   = 1; /*> 锁已经被持有 */
+  static const int kStarving = 2; /*> 饥饿模式 */
+
+  bool TryAcquire();
+  bool Spin();
+  bool LockSlow(const MonotonicClock::time_point& deadline);
+  static bool RemoveWaiter(void* self, Fiber* fiber);
+
+  std::atomic<int>              state; /*> kLocked 和 kStarving 的组合，kStarving 只在 mtx 内修改 */
+  std::atomic<int>            waiting; /*> 等待队列中的协程数量，不加锁也可以读 */
+  std::atomic<FiberEnvironment*> owner; /*> 持有锁的协程所在的线程，用来判断是否值得自旋 */
+  WaitQueue                   waiters; /*> 等待队列，由 mtx 保护 */
+  SpinLock                        mtx;
+  bool                          woken; /*> 是否有被唤醒、还没有重新抢锁的等待者，由 mtx 保护 */
+  std::atomic<uint64_t>     contended; /*> 见 Stats */
+  std::atomic<uint64_t>       spinned;
+  std::atomic<uint64_t>        parked;
+  std::atomic<uint64_t>      handoffs;
+  std::atomic<uint64_t>   starvations;
 
 };
 
+/**
+ * @brief 协程读写锁，偏向读者. 读者只修改自己所在调度线程的计数，各线程的计数
+ * 分别占一条缓存行，读多写少时读者之间没有共享的写操作. 写者先撤销读者的快速
+ * 路径，再等待所有计数之和归零；有写者持有或等待时新来的读者排队，写者优先.
+ */
 class shared_mutex {
 
  public:
-  shared_mutex() : state() {}
+  shared_mutex() : slots(), writing(false), owned(false), drainer(nullptr) {}
  ~shared_mutex() {}
   shared_mutex(const shared_mutex&) = delete;
   shared_mutex& operator=(const shared_mutex&) = delete;
@@ -70,10 +262,26 @@ class shared_mutex {
   void unlock_shared();
 
  private:
-  std::deque<Fiber*> rwaiters;
-  std::deque<Fiber*> wwaiters;
-  SpinLock                mtx;
-  int                   state;
+  static const int kReaderSlots = 16; /*> 读者计数的个数，调度线程按编号取模使用 */
+
+  // 读者计数. 协程可能在持有读锁期间被迁移到其他线程，加锁和解锁不一定是同一个
+  // 计数，单个计数可以为负，只有所有计数之和有意义
+  struct alignas(64) ReaderSlot {
+    std::atomic<int> count;
+  };
+
+  ReaderSlot* Slot();
+  int ReaderCount() const;
+  void LeaveSlot(ReaderSlot* slot);
+  void WaitReaders();
+
+  ReaderSlot         slots[kReaderSlots];
+  alignas(64) std::atomic<bool> writing; /*> 是否有写者持有或者等待锁，由 mtx 保护修改 */
+  WaitQueue                     rwaiters;
+  WaitQueue                     wwaiters;
+  SpinLock                           mtx;
+  bool                             owned; /*> 是否有写者持有锁，由 mtx 保护 */
+  Fiber*                         drainer; /*> 等待读者离开的写者，由 mtx 保护 */
 
 };
 
@@ -88,12 +296,48 @@ class condition_variable {
 	    wait(lock);
   }
 
+  /**
+   * @brief 等待通知直到截止时间，返回前重新获取 @p lock.
+   * 
+   * @return std::cv_status 超时或被取消时为 timeout，errno 为 ETIMEDOUT 或 ECANCELED
+   */
+  std::cv_status wait_until(std::unique_lock<fiber::mutex>& lock,
+                            const MonotonicClock::time_point& deadline);
+
+  template <typename Clock, typename Duration>
+  std::cv_status wait_until(std::unique_lock<fiber::mutex>& lock,
+                            const std::chrono::time_point<Clock, Duration>& tp)
+  { return wait_until(lock, DeadlineAt(tp)); }
+
+  template <typename Clock, typename Duration, typename _Predicate>
+  bool wait_until(std::unique_lock<fiber::mutex>& lock,
+                  const std::chrono::time_point<Clock, Duration>& tp,
+                  _Predicate pred) {
+    auto deadline = DeadlineAt(tp);
+    while (!pred())
+      if (wait_until(lock, deadline) == std::cv_status::timeout)
+        return pred();
+    return true;
+  }
+
+  template <typename Rep, typename Period>
+  std::cv_status wait_for(std::unique_lock<fiber::mutex>& lock,
+                          const std::chrono::duration<Rep, Period>& d)
+  { return wait_until(lock, DeadlineAfter(d)); }
+
+  template <typename Rep, typename Period, typename _Predicate>
+  bool wait_for(std::unique_lock<fiber::mutex>& lock,
+                const std::chrono::duration<Rep, Period>& d, _Predicate pred)
+  { return wait_until(lock, DeadlineAfter(d), std::move(pred)); }
+
   void notify_one();
   void notify_all();
 
  private:
-  std::deque<Fiber*> waiters;
-  SpinLock               mtx;
+  static bool RemoveWaiter(void* self, Fiber* fiber);
+
+  WaitQueue waiters;
+  SpinLock      mtx;
 
 };
 
@@ -109,19 +353,187 @@ class semaphore {
   bool try_wait();
   void signal();
 
+  /**
+   * @brief 在截止时间之前获取信号量.
+   * 
+   * @return bool 是否获取成功，失败时 errno 为 ETIMEDOUT 或 ECANCELED
+   */
+  bool wait_until(const MonotonicClock::time_point& deadline);
+
+  template <typename Clock, typename Duration>
+  bool wait_until(const std::chrono::time_point<Clock, Duration>& tp)
+  { return wait_until(DeadlineAt(tp)); }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& d)
+  { return wait_until(DeadlineAfter(d)); }
+
+ private:
+  static bool RemoveWaiter(void* self, Fiber* fiber);
+
+ public:
+  WaitQueue waiters;
+  SpinLock      mtx;
+  size_t      count;
+
+};
+
+class channel_base;
+
+/**
+ * @brief select 的一个分支，由 on_read/on_write 构造.
+ */
+struct select_case {
+  channel_base*     ch; /*> 分支对应的管道 */
+  bool           write; /*> 是写分支还是读分支 */
+  void*          value; /*> 读分支读出到的位置，写分支待写入的值 */
+  bool*             ok; /*> 分支执行后，管道已经关闭时置为 false，否则为 true，可以为空 */
+  bool (*pfnTry)(const select_case&); /*> 非阻塞地执行本分支，执行成功或者管道已经关闭时返回 true */
+};
+
+/**
+ * @brief 同时等待多个管道的读写，执行第一个就绪的分支.
+ * 多个分支同时就绪时随机选择一个，避免总是偏向排在前面的分支.
+ * 阻塞期间每个分支在对应管道上登记一次，被第一个就绪的管道唤醒.
+ * 
+ * @param cases 分支
+ * @param deadline 截止时间，为 time_point::max() 时一直等待(也不会被取消)
+ * @return int 被执行的分支的下标，超时或者被取消时返回 -1，errno 为 ETIMEDOUT 或 ECANCELED
+ */
+int select(std::initializer_list<select_case> cases,
+           const MonotonicClock::time_point& deadline = MonotonicClock::time_point::max());
+
+template <typename Rep, typename Period>
+inline int select(std::initializer_list<select_case> cases,
+                  const std::chrono::duration<Rep, Period>& timeout)
+{ return select(cases, DeadlineAfter(timeout)); }
+
+/**
+ * @brief 管道中与元素类型无关的部分：阻塞在管道上的读写协程的等待队列.
+ * 只有管道为空(满)时读(写)协程才会进入等待队列，其余情况下读写都不加锁.
+ */
+class channel_base {
+
  public:
-  std::deque<Fiber*> waiters;
-  SpinLock               mtx;
-  size_t               count;
+  channel_base(const channel_base&) = delete;
+  channel_base& operator=(const channel_base&) = delete;
+
+  /**
+   * @brief 关闭管道并唤醒所有等待的读写协程.
+   * 关闭后写入失败；读出在取完剩余的元素后失败，errno 均为 EPIPE.
+   */
+  void close();
+
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+ protected:
+  channel_base()
+      : closed_(false), readWaiterCount_(0), writeWaiterCount_(0) {}
+  virtual ~channel_base() {}
+
+  /**
+   * @brief 管道中是否有已经写入完成的元素.
+   */
+  virtual bool Readable() const = 0;
+
+  /**
+   * @brief 管道中是否有空闲的位置.
+   */
+  virtual bool Writable() const = 0;
+
+  /**
+   * @brief 管道为空时阻塞当前协程，直到有元素写入、管道被关闭或者超过截止时间.
+   * 被唤醒不代表一定能读到元素(可能被其他协程抢先读走)，调用者需要重试.
+   * 
+   * @param deadline 截止时间，为 time_point::max() 时不会超时也不会被取消
+   * @return int 0、ETIMEDOUT 或 ECANCELED
+   */
+  int WaitReadable(const MonotonicClock::time_point& deadline)
+  { return Wait(true, deadline); }
+
+  /**
+   * @brief 管道已满时阻塞当前协程，语义同 WaitReadable.
+   */
+  int WaitWritable(const MonotonicClock::time_point& deadline)
+  { return Wait(false, deadline); }
+
+  /**
+   * @brief 写入 @p n 个元素后调用，唤醒至多 @p n 个等待读的协程.
+   */
+  void NotifyReaders(size_t n) {
+    // 与 Wait 中的 fetch_add 构成 Dekker 式的握手：要么这里看到等待者，要么等待者看到新元素
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (readWaiterCount_.load(std::memory_order_relaxed) > 0) Notify(true, n);
+  }
+
+  /**
+   * @brief 读出 @p n 个元素后调用，唤醒至多 @p n 个等待写的协程.
+   */
+  void NotifyWriters(size_t n) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writeWaiterCount_.load(std::memory_order_relaxed) > 0) Notify(false, n);
+  }
+
+ private:
+  friend int select(std::initializer_list<select_case> cases,
+                    const MonotonicClock::time_point& deadline);
+
+  int  Wait(bool reader, const MonotonicClock::time_point& deadline);
+  void Notify(bool reader, size_t n);
+  void AddWaiter(bool reader, WaitNode* node);
+  bool RemoveWaiter(bool reader, WaitNode* node);
+  static bool RemoveReader(void* self, Fiber* fiber);
+  static bool RemoveWriter(void* self, Fiber* fiber);
+  static bool ClaimSelect(void* self, Fiber* fiber);
+
+  std::atomic<bool>            closed_; /*> 管道是否已经关闭 */
+  std::atomic<int>    readWaiterCount_; /*> 等待读的协程数量，不加锁也可以读 */
+  std::atomic<int>   writeWaiterCount_; /*> 等待写的协程数量，不加锁也可以读 */
+  WaitQueue                readWaiters_; /*> 等待读的协程 */
+  WaitQueue               writeWaiters_; /*> 等待写的协程 */
+  SpinLock                         mtx_; /*> 保护等待队列 */
 
 };
 
+/**
+ * @brief 有界的多生产者多消费者管道.
+ * 元素存放在与容量等长的环形缓冲区中，每个槽位带有一个序号，读写通过 CAS
+ * 抢占位置，不需要加锁，也不需要分配内存.
+ * 参见 Dmitry Vyukov, Bounded MPMC queue.
+ * 
+ * @tparam T 元素类型
+ */
 template <typename T>
-class channel {
+class channel : public channel_base {
 
  public:
-  channel(int sz = 1) : full(0), space(sz) {}
- ~channel() {}
+  class iterator;
+
+  /**
+   * @brief Constructor.
+   * 
+   * @param sz 容量，小于 1 时按 1 处理
+   */
+  channel(int sz = 1) : enqueuePos_(0), dequeuePos_(0) {
+    cap_ = (size_t)(sz > 0 ? sz : 1);
+    mask_ = (cap_ & (cap_ - 1)) == 0 ? cap_ - 1 : 0;
+    cells_ = static_cast<Cell*>(::operator new(cap_ * sizeof(Cell)));
+    for (size_t i = 0; i < cap_; i++) {
+      new (&cells_[i]) Cell();
+      cells_[i].seq.store(i * 2, std::memory_order_relaxed);
+    }
+  }
+
+ ~channel() {
+    // 销毁还留在管道中的元素
+    size_t end = enqueuePos_.load(std::memory_order_relaxed);
+    for (size_t pos = dequeuePos_.load(std::memory_order_relaxed); pos != end; pos++) {
+      Cell& cell = At(pos);
+      if (cell.seq.load(std::memory_order_acquire) == pos * 2 + 1) cell.value()->~T();
+    }
+    for (size_t i = 0; i < cap_; i++) cells_[i].~Cell();
+    ::operator delete(cells_);
+  }
 
   friend void operator>>(const T& x, channel& c)
   { c.write(x); }
@@ -141,41 +553,415 @@ class channel {
   void operator<<(T&& x)
   { this->write(std::move(x)); }
 
-  void write(const T& x) {
-    space.wait();
-    mtx.lock();
-    items.push_back(x);
-    mtx.unlock();
-    full.signal();
+  size_t capacity() const { return cap_; }
+
+  /**
+   * @brief 写入一个元素，管道已满时阻塞.
+   * 
+   * @return bool 管道已经关闭时返回 false
+   */
+  bool write(const T& x) { return Write(x, MonotonicClock::time_point::max()); }
+  bool write(T&& x) { return Write(std::move(x), MonotonicClock::time_point::max()); }
+
+  /**
+   * @brief 读出一个元素，管道为空时阻塞. 元素直接从槽位移动构造，T 只需要可以移动构造.
+   * 
+   * @return T 管道已经关闭且为空时返回 T()；T 不能默认构造时抛出 std::system_error(EPIPE)，
+   * 需要区分关闭的情况请使用 read(T&)
+   */
+  T read() {
+    std::optional<T> x;
+    if (!Read([&x](T&& v) { x.emplace(std::move(v)); },
+              MonotonicClock::time_point::max())) {
+      if constexpr (std::is_default_constructible_v<T>) {
+        return T();
+      } else {
+        throw std::system_error(EPIPE, std::generic_category(), "channel closed");
+      }
+    }
+    return std::move(*x);
   }
 
-  void write(T&& x) {
-    space.wait();
-    mtx.lock();
-    items.push_back(std::move(x));
-    mtx.unlock();
-    full.signal();
+  /**
+   * @brief 读出一个元素，管道为空时阻塞.
+   * 
+   * @return bool 管道已经关闭且为空时返回 false
+   */
+  bool read(T& x) { return Read(AssignTo(x), MonotonicClock::time_point::max()); }
+
+  /**
+   * @brief 非阻塞地写入一个元素.
+   * 
+   * @return bool 管道已满或者已经关闭时返回 false
+   */
+  bool try_write(const T& x) {
+    if (closed() || !TryPush(x)) return false;
+    NotifyReaders(1);
+    return true;
   }
 
-  T read() {
-    full.wait();
-    mtx.lock();
-    T x = std::move(items.front());
-    items.pop_front();
-    mtx.unlock();
-    space.signal();
-    return x;
+  /**
+   * @brief 非阻塞地读出一个元素.
+   * 
+   * @return bool 管道为空时返回 false
+   */
+  bool try_read(T& x) {
+    if (!TryPop(x)) return false;
+    NotifyWriters(1);
+    return true;
+  }
+
+  /**
+   * @brief 在截止时间之前写入.
+   * 
+   * @return bool 是否写入成功，失败时 errno 为 ETIMEDOUT、ECANCELED 或 EPIPE
+   */
+  template <typename U, typename Clock, typename Duration>
+  bool write_until(U&& x, const std::chrono::time_point<Clock, Duration>& tp)
+  { return Write(std::forward<U>(x), DeadlineAt(tp)); }
+
+  template <typename U, typename Rep, typename Period>
+  bool write_for(U&& x, const std::chrono::duration<Rep, Period>& d)
+  { return Write(std::forward<U>(x), DeadlineAfter(d)); }
+
+  /**
+   * @brief 在截止时间之前读出.
+   * 
+   * @return bool 是否读出成功，失败时 errno 为 ETIMEDOUT、ECANCELED 或 EPIPE
+   */
+  template <typename Clock, typename Duration>
+  bool read_until(T& x, const std::chrono::time_point<Clock, Duration>& tp)
+  { return Read(AssignTo(x), DeadlineAt(tp)); }
+
+  template <typename Rep, typename Period>
+  bool read_for(T& x, const std::chrono::duration<Rep, Period>& d)
+  { return Read(AssignTo(x), DeadlineAfter(d)); }
+
+  /**
+   * @brief 依次写入 [first, last) 中的元素，管道已满时阻塞.
+   * 每次抢占尽可能多的连续位置，一批元素只需要一次 CAS 和一次唤醒检查.
+   * 
+   * @return size_t 写入的元素数量，管道被关闭时可能少于 last - first
+   */
+  template <typename ForwardIt>
+  size_t write_batch(ForwardIt first, ForwardIt last) {
+    size_t total = 0;
+    while (first != last) {
+      size_t n = TryPushBatch(first, last);
+      if (n > 0) {
+        total += n;
+        NotifyReaders(n);
+        continue;
+      }
+      if (closed()) {
+        errno = EPIPE;
+        break;
+      }
+      WaitWritable(MonotonicClock::time_point::max());
+    }
+    return total;
+  }
+
+  /**
+   * @brief 读出至多 @p n 个元素写到 @p out，管道为空时阻塞直到至少读出一个元素.
+   * 
+   * @return size_t 读出的元素数量，管道已经关闭且为空时返回 0
+   */
+  template <typename OutputIt>
+  size_t read_batch(OutputIt out, size_t n) {
+    if (n == 0) return 0;
+    for (;;) {
+      size_t got = TryPopBatch(out, n);
+      if (got > 0) {
+        NotifyWriters(got);
+        return got;
+      }
+      if (closed()) {
+        // 关闭前写入的元素可能刚刚完成
+        got = TryPopBatch(out, n);
+        if (got > 0) return got;
+        errno = EPIPE;
+        return 0;
+      }
+      WaitReadable(MonotonicClock::time_point::max());
+    }
   }
 
+  /**
+   * @brief 依次读出管道中的元素，直到管道被关闭且为空. 迭代器持有当前元素，T 需要可以默认构造.
+   */
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(); }
+
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+
+    iterator() : ch_(nullptr), value_() {}
+    explicit iterator(channel* ch) : ch_(ch), value_() { ++*this; }
+
+    T& operator*() { return value_; }
+    T* operator->() { return &value_; }
+
+    iterator& operator++() {
+      if (ch_ != nullptr && !ch_->read(value_)) ch_ = nullptr;
+      return *this;
+    }
+
+    bool operator==(const iterator& rhs) const { return ch_ == rhs.ch_; }
+    bool operator!=(const iterator& rhs) const { return ch_ != rhs.ch_; }
+
+   private:
+    channel* ch_;
+    T     value_;
+  };
+
  private:
-  mutex mtx;
-  semaphore full;
-  semaphore space;
-  std::deque<T> items;
+  struct Cell {
+    // 槽位序号：等于 2 * 位置时可写，等于 2 * 位置 + 1 时可读.
+    // 乘 2 是为了让容量为 1 时"可写"和"可读"两种状态也能区分开
+    std::atomic<size_t> seq;
+    alignas(T) unsigned char storage[sizeof(T)];
+
+    T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+  };
+
+  /**
+   * @brief 位置 @p pos 对应的槽位. 容量是 2 的幂时用掩码代替取模.
+   */
+  Cell& At(size_t pos) const {
+    return cells_[mask_ != 0 ? pos & mask_ : pos % cap_];
+  }
+
+  bool Readable() const override {
+    size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    size_t seq = At(pos).seq.load(std::memory_order_acquire);
+    return (intptr_t)seq - (intptr_t)(pos * 2 + 1) >= 0 || closed();
+  }
+
+  bool Writable() const override {
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    size_t seq = At(pos).seq.load(std::memory_order_acquire);
+    return (intptr_t)seq - (intptr_t)(pos * 2) >= 0 || closed();
+  }
+
+  template <typename U>
+  bool TryPush(U&& x) {
+    Cell* cell;
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &At(pos);
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos * 2);
+      if (diff == 0) {
+        if (enqueuePos_.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos_.load(std::memory_order_relaxed);
+      }
+    }
+    new (cell->storage) T(std::forward<U>(x));
+    cell->seq.store(pos * 2 + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief 把读出的元素移动赋值给 @p x 的接收函数.
+   */
+  static auto AssignTo(T& x) {
+    return [&x](T&& v) { x = std::move(v); };
+  }
+
+  bool TryPop(T& x) { return TryPop(AssignTo(x)); }
+
+  /**
+   * @brief 非阻塞地取出一个元素，以右值交给 @p sink.
+   */
+  template <typename Sink, typename = std::enable_if_t<std::is_invocable_v<Sink&, T&&>>>
+  bool TryPop(Sink&& sink) {
+    Cell* cell;
+    size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &At(pos);
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos * 2 + 1);
+      if (diff == 0) {
+        if (dequeuePos_.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeuePos_.load(std::memory_order_relaxed);
+      }
+    }
+    sink(std::move(*cell->value()));
+    cell->value()->~T();
+    cell->seq.store((pos + cap_) * 2, std::memory_order_release);
+    return true;
+  }
+
+  template <typename ForwardIt>
+  size_t TryPushBatch(ForwardIt& first, ForwardIt last) {
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    size_t n;
+    for (;;) {
+      // 统计从 pos 开始连续可写的位置数
+      n = 0;
+      for (ForwardIt it = first; it != last && n < cap_; ++it, ++n) {
+        size_t seq = At(pos + n).seq.load(std::memory_order_acquire);
+        if (seq != (pos + n) * 2) break;
+      }
+      if (n == 0) {
+        size_t seq = At(pos).seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos * 2) < 0) return 0;
+        pos = enqueuePos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (enqueuePos_.compare_exchange_weak(pos, pos + n,
+                                            std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < n; i++, ++first) {
+      Cell* cell = &At(pos + i);
+      new (cell->storage) T(*first);
+      cell->seq.store((pos + i) * 2 + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+  template <typename OutputIt>
+  size_t TryPopBatch(OutputIt& out, size_t max) {
+    size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    size_t n;
+    for (;;) {
+      // 统计从 pos 开始连续可读的元素数
+      n = 0;
+      while (n < max && n < cap_) {
+        size_t seq = At(pos + n).seq.load(std::memory_order_acquire);
+        if (seq != (pos + n) * 2 + 1) break;
+        n++;
+      }
+      if (n == 0) {
+        size_t seq = At(pos).seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos * 2 + 1) < 0) return 0;
+        pos = dequeuePos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (dequeuePos_.compare_exchange_weak(pos, pos + n,
+                                            std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < n; i++) {
+      Cell* cell = &At(pos + i);
+      *out = std::move(*cell->value());
+      ++out;
+      cell->value()->~T();
+      cell->seq.store((pos + i + cap_) * 2, std::memory_order_release);
+    }
+    return n;
+  }
+
+  template <typename U>
+  bool Write(U&& x, const MonotonicClock::time_point& deadline) {
+    for (;;) {
+      if (closed()) {
+        errno = EPIPE;
+        return false;
+      }
+      if (TryPush(std::forward<U>(x))) {
+        NotifyReaders(1);
+        return true;
+      }
+      int ret = WaitWritable(deadline);
+      if (ret != 0) {
+        errno = ret;
+        return false;
+      }
+    }
+  }
+
+  template <typename Sink>
+  bool Read(Sink&& sink, const MonotonicClock::time_point& deadline) {
+    for (;;) {
+      if (TryPop(sink)) {
+        NotifyWriters(1);
+        return true;
+      }
+      if (closed()) {
+        // 关闭前写入的元素可能刚刚完成
+        if (TryPop(sink)) return true;
+        errno = EPIPE;
+        return false;
+      }
+      int ret = WaitReadable(deadline);
+      if (ret != 0) {
+        errno = ret;
+        return false;
+      }
+    }
+  }
+
+  alignas(64) std::atomic<size_t> enqueuePos_; /*> 写位置 */
+  alignas(64) std::atomic<size_t> dequeuePos_; /*> 读位置 */
+  alignas(64) Cell*                    cells_; /*> 环形缓冲区 */
+  size_t                                 cap_; /*> 容量 */
+  size_t                                mask_; /*> 容量是 2 的幂时为容量 - 1，否则为 0 */
 
 };
 
 
+/**
+ * @brief 构造 select 的读分支.
+ * 
+ * @param ch 管道
+ * @param x 读出的元素
+ * @param ok 管道已经关闭且为空时置为 false，可以为空
+ */
+template <typename T>
+inline select_case on_read(channel<T>& ch, T& x, bool* ok = nullptr) {
+  return {&ch, false, &x, ok, [](const select_case& c) {
+    auto ch = static_cast<channel<T>*>(c.ch);
+    bool done = ch->try_read(*static_cast<T*>(c.value));
+    if (!done && ch->closed()) {
+      // 关闭前写入的元素可能刚刚完成
+      done = ch->try_read(*static_cast<T*>(c.value));
+      if (c.ok != nullptr) *c.ok = done;
+      return true;
+    }
+    if (done && c.ok != nullptr) *c.ok = true;
+    return done;
+  }};
+}
+
+/**
+ * @brief 构造 select 的写分支.
+ * 
+ * @param ch 管道
+ * @param x 待写入的元素，分支执行时被复制到管道中
+ * @param ok 管道已经关闭时置为 false，可以为空
+ */
+template <typename T>
+inline select_case on_write(channel<T>& ch, const T& x, bool* ok = nullptr) {
+  return {&ch, true, const_cast<T*>(&x), ok, [](const select_case& c) {
+    auto ch = static_cast<channel<T>*>(c.ch);
+    if (ch->closed()) {
+      if (c.ok != nullptr) *c.ok = false;
+      return true;
+    }
+    bool done = ch->try_write(*static_cast<const T*>(c.value));
+    if (done && c.ok != nullptr) *c.ok = true;
+    return done;
+  }};
+}
+
 using Mutex = mutex;
 using RWmutex = shared_mutex;
 using Semaphore = semaphore;
@@ -185,51 +971,384 @@ template <class T>
 using Channel = channel<T>;
 
 
+/**
+ * @brief 协程本地存储，以 pthread_key_t 作为下标直接寻址.
+ * 键值较小的槽位内联在协程对象中，其余槽位在第一次写入时按需分配.
+ * 复制协程对象时不复制其中的值.
+ * 和 glibc 一样，每个槽位记录写入时键的代数，键被删除后代数加一，
+ * 旧的值即使还留在槽位中也视为空，不会被复用同一个键值的新键读到.
+ */
+class FiberSpecific {
+
+ public:
+  FiberSpecific() : inline_(), ext_(nullptr), used_(0) {}
+  FiberSpecific(const FiberSpecific&) : FiberSpecific() {}
+  FiberSpecific(FiberSpecific&& rhs) noexcept;
+ ~FiberSpecific();
+
+  FiberSpecific& operator=(const FiberSpecific& rhs);
+  FiberSpecific& operator=(FiberSpecific&& rhs) noexcept;
+
+  void* Get(pthread_key_t key) const {
+    const Slot* slot;
+    if (key < kInlineSlots) {
+      slot = &inline_[key];
+    } else {
+      if (ext_ == nullptr || key >= kMaxKeys) return nullptr;
+      slot = &ext_[key - kInlineSlots];
+    }
+    if (slot->value == nullptr ||
+        slot->generation != generations_[key].load(std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return slot->value;
+  }
+
+  int Set(pthread_key_t key, const void* value);
+
+  /**
+   * @brief 按 pthread 的语义调用各个键的析构函数并清空所有槽位.
+   */
+  void Release();
+
+  /**
+   * @brief 键被删除后调用，所有协程中这个键下的值都不再可见.
+   */
+  static void Invalidate(pthread_key_t key) {
+    if (key < kMaxKeys) generations_[key].fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  static const pthread_key_t kInlineSlots = 16;
+  static const pthread_key_t kMaxKeys = PTHREAD_KEYS_MAX;
+
+  struct Slot {
+    void*           value; /*> 槽位中的值 */
+    uint32_t   generation; /*> 写入时键的代数 */
+  };
+
+  static std::atomic<uint32_t> generations_[kMaxKeys]; /*> 各个键的代数，键被删除时加一 */
+
+  Slot   inline_[kInlineSlots]; /*> 内联的槽位 */
+  Slot*                   ext_; /*> 扩展槽位，按需分配 */
+  pthread_key_t          used_; /*> 被写入过的最大键值 + 1，清理时只需扫描这个范围 */
+
+};
+
+/**
+ * @brief 记录键的析构函数，协程结束时用它来释放协程本地存储中的值.
+ * 由 hook 后的 pthread_key_create/pthread_key_delete 调用.
+ *
+ * @param key 键
+ * @param destructor 析构函数，可以为空
+ */
+void SetSpecificDestructor(pthread_key_t key, void (*destructor)(void*));
+
+/**
+ * @brief 删除键：清除它的析构函数，并让各个协程中这个键下的值失效.
+ * 由 hook 后的 pthread_key_delete 调用.
+ *
+ * @param key 键
+ */
+void DeleteSpecificKey(pthread_key_t key);
+
+/**
+ * @brief 获取当前正在运行的协程，本线程还没有(或已经销毁了)协程环境时返回空.
+ * 不会创建协程环境，可以在线程退出等阶段安全调用.
+ *
+ * @return Fiber*
+ */
+Fiber* CurrentFiber();
+
+/**
+ * @brief 被 hook 的套接字 IO 的后端.
+ */
+enum class IoBackend {
+  kEpoll, /*> 非阻塞系统调用，EAGAIN 时通过 epoll 等待就绪(默认) */
+  kUring, /*> accept/connect/recv/send 直接提交到线程级的 io_uring */
+};
+
+/**
+ * @brief 选择被 hook 的套接字 IO 的后端，应当在提交第一个协程之前调用.
+ * 没有调用时读取环境变量 PIORUN_IO_BACKEND(epoll 或 uring). 内核不支持
+ * 多发 recv 和 provided buffer ring (6.0 之前)时退回 epoll.
+ *
+ * @return IoBackend 实际使用的后端
+ */
+IoBackend SetIoBackend(IoBackend backend);
+
+/**
+ * @brief 当前使用的套接字 IO 后端.
+ */
+IoBackend GetIoBackend();
+
+/**
+ * @brief 协程函数的包装，只能移动不能拷贝.
+ * 捕获不超过 kInlineSize 字节且可以无异常移动的可调用对象直接存放在对象内部，
+ * 构造、移动和调用都不会分配堆内存；更大的可调用对象退化为堆上分配.
+ */
+class FiberFunc {
+
+ public:
+  static constexpr size_t kInlineSize = 64;
+
+  FiberFunc() noexcept : ops_(nullptr) {}
+  FiberFunc(std::nullptr_t) noexcept : ops_(nullptr) {}
+
+  template <typename F, typename Fn = std::decay_t<F>,
+            typename = std::enable_if_t<!std::is_same_v<Fn, FiberFunc> &&
+                                        std::is_invocable_v<Fn&>>>
+  FiberFunc(F&& fn) : ops_(nullptr) {
+    // 只有可能为空的类型才检查；函数名退化成的指针永远非空，对它判空会触发 -Waddress
+    if constexpr ((std::is_pointer_v<Fn> &&
+                   !std::is_function_v<std::remove_reference_t<F>>) ||
+                  std::is_same_v<Fn, std::function<void()>>) {
+      if (fn == nullptr) return;
+    }
+    if constexpr (IsInline<Fn>()) {
+      ::new (buf_) Fn(std::forward<F>(fn));
+    } else {
+      *reinterpret_cast<Fn**>(buf_) = new Fn(std::forward<F>(fn));
+    }
+    ops_ = &kOps<Fn>;
+  }
+
+  FiberFunc(FiberFunc&& rhs) noexcept : ops_(rhs.ops_) {
+    if (ops_ != nullptr) {
+      ops_->move(buf_, rhs.buf_);
+      rhs.ops_ = nullptr;
+    }
+  }
+
+  FiberFunc& operator=(FiberFunc&& rhs) noexcept {
+    if (this != &rhs) {
+      Clear();
+      if (rhs.ops_ != nullptr) {
+        rhs.ops_->move(buf_, rhs.buf_);
+        ops_ = rhs.ops_;
+        rhs.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  FiberFunc& operator=(std::nullptr_t) noexcept {
+    Clear();
+    return *this;
+  }
+
+  FiberFunc(const FiberFunc&) = delete;
+  FiberFunc& operator=(const FiberFunc&) = delete;
+
+ ~FiberFunc() { Clear(); }
+
+  void operator()() { ops_->invoke(buf_); }
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+  bool operator==(std::nullptr_t) const noexcept { return ops_ == nullptr; }
+  bool operator!=(std::nullptr_t) const noexcept { return ops_ != nullptr; }
+
+ private:
+  struct Ops {
+    void (*invoke)(void*);
+    void (*move)(void* dst, void* src); /*> 移动到 dst 并析构 src */
+    void (*destroy)(void*);
+  };
+
+  template <typename Fn>
+  static constexpr bool IsInline() {
+    return sizeof(Fn) <= kInlineSize &&
+           alignof(Fn) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<Fn>;
+  }
+
+  template <typename Fn>
+  static void Invoke(void* p) {
+    if constexpr (IsInline<Fn>()) {
+      (*static_cast<Fn*>(p))();
+    } else {
+      (**static_cast<Fn**>(p))();
+    }
+  }
+
+  template <typename Fn>
+  static void Move(void* dst, void* src) {
+    if constexpr (IsInline<Fn>()) {
+      ::new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+      static_cast<Fn*>(src)->~Fn();
+    } else {
+      *static_cast<Fn**>(dst) = *static_cast<Fn**>(src);
+    }
+  }
+
+  template <typename Fn>
+  static void Destroy(void* p) {
+    if constexpr (IsInline<Fn>()) {
+      static_cast<Fn*>(p)->~Fn();
+    } else {
+      delete *static_cast<Fn**>(p);
+    }
+  }
+
+  template <typename Fn>
+  static constexpr Ops kOps = {&Invoke<Fn>, &Move<Fn>, &Destroy<Fn>};
+
+  void Clear() noexcept {
+    if (ops_ != nullptr) {
+      ops_->destroy(buf_);
+      ops_ = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char buf_[kInlineSize]; /*> 可调用对象或指向它的指针 */
+  const Ops* ops_; /*> 类型相关的操作，为空表示没有函数 */
+};
+
 class Fiber {
 
 friend class FiberEnvironment;
+friend void threadRoutine(int, MultiThreadFiberScheduler*);
 friend class mutex;
 friend class shared_mutex;
 friend class semaphore;
 friend class condition_variable;
+friend class cancel_token;
+friend class channel_base;
+friend class CompletionEvent;
+friend class WaitQueue;
+friend struct ReadyList;
+friend int select(std::initializer_list<select_case> cases,
+                  const MonotonicClock::time_point& deadline);
 friend int GoRoutine(Fiber* co, void*);
+friend void OnWaitTimeout(StTimeoutItem* ap);
+friend struct StFdEvent;
+friend struct StUringSocket;
 
  public:
-  Fiber(const std::function<void()>& pfn = nullptr);
-  Fiber(const Fiber& rhs) = default;
-  Fiber(Fiber&& rhs) noexcept = default;
+  Fiber(FiberFunc pfn = nullptr, bool shareStack = false);
+  Fiber(const Fiber& rhs) = delete;
  ~Fiber();
 
-  Fiber& operator=(const Fiber& rhs) = default;
-  Fiber& operator=(Fiber&& rhs) noexcept = default;
+  Fiber& operator=(const Fiber& rhs) = delete;
 
   void Yield ();
   void Resume();
-  void Reset (const std::function<void()>& pfn = nullptr);
-  void Reset (std::function<void()>&& pfn);
+  void Reset (FiberFunc&& pfn = nullptr);
   bool Done() const { return cEnd_ != 0; }
   bool IsMain() const { return cIsMain_ == 1; }
   bool IsHooked() const { return cEnableSysHook_ == 1; }
+  bool IsShareStack() const { return ctx_.IsShared(); }
   void EnableHook() { cEnableSysHook_ = 1; }
   void DisableHook() { cEnableSysHook_ = 0; }
+  bool IsPinned() const { return cPinned_ == 1; }
+  void SetPinned(bool pinned) { cPinned_ = pinned; }
+  void* GetSpecific(pthread_key_t key) const { return spec_.Get(key); }
+  int SetSpecific(pthread_key_t key, const void* value) { return spec_.Set(key, value); }
+  cancel_token GetCancelToken();
+  bool IsCancelled() const;
 
  private:
   FiberEnvironment*     env_; /*> 协程所在的协程环境 */
-  std::function<void()> pfn_; /*> 协程对应的函数 */
+  FiberFunc             pfn_; /*> 协程对应的函数 */
   FiberContext          ctx_; /*> 协程上下文，包括寄存器和栈 */
+  FiberSpecific        spec_; /*> 协程本地存储，协程结束时清空 */
+  std::shared_ptr<cancel_token::State> cancel_; /*> 取消令牌的状态，第一次获取令牌时创建 */
+  void*           waitOwner_; /*> 协程正在可超时地等待的同步原语 */
+  bool (*pfnWaitRemove_)(void*, Fiber*); /*> 把协程从同步原语的等待队列中移除 */
+  int            waitResult_; /*> 可超时等待的结果：0、ETIMEDOUT 或 ECANCELED */
+  std::atomic<int> selectFired_; /*> select 中第一个就绪的分支下标，尚未就绪时为 -1 */
+  StTimeoutItem*    pWaitItem_; /*> 可超时等待期间挂在所在线程时间轮上的结点 */
+  WaitNode          waitNode_; /*> 在同步原语上等待时放入等待队列的结点 */
+  Fiber*          pNextReady_; /*> 在就绪队列中时，指向下一个就绪的协程 */
 
   bool               cStart_; /*> 该协程是否已经开始运行 */
   bool                 cEnd_; /*> 该协程是否已经执行完毕 */
   bool              cIsMain_; /*> 该协程是否是主协程 */
   bool       cEnableSysHook_; /*> 是否打开钩子标识，默认打开 */
   bool          cCreateByEnv; /*> 该协程是否是有协程池创建的，默认为否 */
+  bool              cPinned_; /*> 是否固定在所在的线程上，不会被迁移到其他线程 */
 
  private:
   Fiber(bool);
   void SwapContext(Fiber* pendingCo);
 
+  /**
+   * @brief 就绪(被唤醒但还没有运行)时能否迁移到其他线程. 只有协程池中的、
+   * 独立栈上的、没有固定线程的协程可以迁移.
+   */
+  bool IsMigratable() const {
+    return cCreateByEnv && !cPinned_ && !IsShareStack() && cStart_ && !cEnd_;
+  }
+
+  /**
+   * @brief 记录协程即将等待的同步原语，需要在把协程加入其等待队列之前调用.
+   * 
+   * @param owner 同步原语
+   * @param pfnRemove 在同步原语的锁保护下把协程从等待队列中移除，返回是否移除成功
+   */
+  void PrepareWait(void* owner, bool (*pfnRemove)(void*, Fiber*)) {
+    waitOwner_ = owner;
+    pfnWaitRemove_ = pfnRemove;
+    waitResult_ = 0;
+  }
+
+  /**
+   * @brief 阻塞当前协程，直到被唤醒、超过截止时间或者被取消.
+   * 超时和取消都要先把协程从等待队列中移除，移除失败说明唤醒已经发生，
+   * 因此协程恰好被唤醒一次.
+   * 
+   * @param deadline 截止时间，为 time_point::max() 时一直等待
+   * @param cancelUntimed 截止时间为 time_point::max() 时是否仍然可以被取消，IO 等待为 true
+   * @return int 0 表示被唤醒，否则为 ETIMEDOUT 或 ECANCELED
+   */
+  int WaitUntil(const MonotonicClock::time_point& deadline, bool cancelUntimed = false);
+
+};
+
+
+// 提交给调度器的任务
+// 对象通过线程本地的缓存复用，提交任务不需要分配内存
+struct FiberTask {
+  FiberFunc fn;    /*> 任务函数 */
+  bool shareStack; /*> 是否运行在共享栈上 */
+  FiberTask* next; /*> 在 FiberTaskList 中的后继 */
+};
+
+// 以 FiberTask::next 串联的先进先出任务链表，入队出队都不分配内存
+class FiberTaskList {
+
+ public:
+  FiberTaskList() : head_(nullptr), tail_(nullptr), size_(0) {}
+
+  bool empty() const { return head_ == nullptr; }
+  size_t size() const { return size_; }
+  FiberTask* front() const { return head_; }
+
+  void push_back(FiberTask* task) {
+    task->next = nullptr;
+    if (tail_ == nullptr) {
+      head_ = task;
+    } else {
+      tail_->next = task;
+    }
+    tail_ = task;
+    size_++;
+  }
+
+  void pop_front() {
+    head_ = head_->next;
+    if (head_ == nullptr) tail_ = nullptr;
+    size_--;
+  }
+
+ private:
+  FiberTask* head_;
+  FiberTask* tail_;
+  size_t     size_;
 };
 
+// 线程本地的无锁任务队列（Chase-Lev），只有所属线程可以 push/pop，其他线程可以 steal
+template <typename T>
+class WorkStealingQueue;
 
 class MultiThreadFiberScheduler {
 
@@ -247,33 +1366,401 @@ friend void threadRoutine(int, MultiThreadFiberScheduler*);
 
  public:
   static MultiThreadFiberScheduler& GetInstance();
-  void Schedule(const std::function<void()>& fn);
-  void Schedule(std::function<void()>&& fn);
+  void Schedule(FiberFunc&& fn, bool shareStack = false);
+
+  /**
+   * @brief 提交一个只能在指定调度线程上运行的任务，不会被其他线程窃取.
+   * 在该线程上提交时直接放入本线程的队列，不加锁也不唤醒其他线程.
+   * 主线程(0 号)在 main 返回之后才开始调度.
+   *
+   * @param thread 调度线程的编号，[0, ThreadCount())
+   * @param fn 任务函数
+   * @param shareStack 是否运行在共享栈上
+   */
+  void ScheduleOn(int thread, FiberFunc&& fn, bool shareStack = false);
+
+  /**
+   * @brief 调度线程的数量.
+   */
+  int ThreadCount() const { return threadNum; }
+
+  /**
+   * @brief 开启或关闭就绪协程在调度线程之间的迁移，默认关闭.
+   * 开启时，空闲的调度线程会请求积压最多的线程把一部分就绪的协程交给自己，
+   * 被迁移的协程之后一直在新的线程上运行. 开启前要确认跨过阻塞调用的代码没有
+   * 持有 errno、thread_local 变量等线程局部状态的地址(编译器可能在函数内缓存它们)，
+   * 依赖线程亲和性的协程通过 this_fiber::pin_to_thread 固定在所在的线程上.
+   */
+  void SetMigration(bool enable) { migration.store(enable, std::memory_order_relaxed); }
+
+  /**
+   * @brief 设置每个调度线程的协程池最多保留多少个空闲协程，默认 256.
+   * 超出的协程连同它们的栈在调度循环中释放；留在池中的协程除了最近回收的少数几个，
+   * 栈的物理页也会归还给操作系统，只占虚拟地址空间.
+   */
+  void SetFiberPoolWatermark(size_t count) {
+    fiberPoolWatermark.store(count, std::memory_order_relaxed);
+  }
+
+ private:
+  /**
+   * @brief 提交一个任务：调度线程上产生的任务放入本线程的队列，否则放入全局队列.
+   *
+   * @param task 待提交的任务
+   */
+  void Schedule(FiberTask* task);
+
+  /**
+   * @brief 唤醒一个阻塞在 epoll_wait 上的空闲调度线程，让它来获取新任务.
+   */
+  void WakeupIdleThread();
+
+  /**
+   * @brief 唤醒所有阻塞在 epoll_wait 上的调度线程，调用者需持有 mutex.
+   */
+  void WakeupAllThreads();
 
  private:
   
-  std::deque<std::function<void()>> commTasks;
+  FiberTaskList commTasks; /*> 全局任务队列，存放非调度线程提交的任务及本地队列溢出的任务 */
   SpinLock mutex;
   std::deque<std::thread> threads;
   int wannaQuitThreadCount;
   const int threadNum;
+  std::vector<std::unique_ptr<WorkStealingQueue<FiberTask*>>> runQueues; /*> 每个调度线程的本地任务队列 */
+  std::vector<FiberEnvironment*> envs; /*> 每个调度线程的协程环境，线程退出后置空，由 mutex 保护 */
+  std::vector<FiberTaskList> pinnedTasks; /*> 其他线程通过 ScheduleOn 提交给每个调度线程的任务，由 mutex 保护 */
+  std::atomic<int> idleThreadCount;   /*> 阻塞在 epoll_wait 上等待任务的线程数量 */
+  std::atomic<bool> migration;        /*> 是否允许就绪协程在线程之间迁移 */
+  std::atomic<size_t> fiberPoolWatermark; /*> 每个调度线程的协程池保留的最大空闲协程数 */
   // int turn = 0;
 };
 
 struct __go {
 
-  __go() {}
+  __go(bool shareStack = false) : shareStack(shareStack) {}
 
  ~__go() {}
 
-  inline void operator-(const std::function<void()>& fn) {
-    MultiThreadFiberScheduler::GetInstance().Schedule(fn);
+  template <typename F>
+  inline void operator-(F&& fn) {
+    MultiThreadFiberScheduler::GetInstance().Schedule(
+        FiberFunc(std::forward<F>(fn)), shareStack);
+  }
+
+  bool shareStack; /*> 是否使用共享栈 */
+
+};
+
+/**
+ * @brief 一次性的完成事件，最多一个协程等待它，是 future 和 task_group 的基础.
+ * Set 可以在任意线程中调用.
+ */
+class CompletionEvent {
+
+ public:
+  CompletionEvent() : set_(false), waiter_(nullptr) {}
+  CompletionEvent(const CompletionEvent&) = delete;
+  CompletionEvent& operator=(const CompletionEvent&) = delete;
+
+  /**
+   * @brief 标记为已完成，唤醒正在等待的协程.
+   */
+  void Set();
+
+  /**
+   * @brief 恢复为未完成，调用时不能有协程在等待.
+   */
+  void Reset();
+
+  bool IsSet() const;
+
+  /**
+   * @brief 等待事件完成. 在主协程中调用时让出线程轮询.
+   * 
+   * @param deadline 截止时间，为 time_point::max() 时一直等待(也不会被取消)
+   * @return int 0、ETIMEDOUT 或 ECANCELED
+   */
+  int Wait(const MonotonicClock::time_point& deadline = MonotonicClock::time_point::max());
+
+ private:
+  static bool RemoveWaiter(void* self, Fiber* fiber);
+
+  mutable SpinLock mtx_; /*> 保护以下成员 */
+  bool             set_; /*> 是否已经完成 */
+  Fiber*        waiter_; /*> 等待的协程 */
+
+};
+
+/**
+ * @brief future 的共享状态：结果(或异常)和完成事件.
+ */
+template <typename T>
+struct FutureState : CompletionEvent {
+  template <typename F>
+  void Run(F& fn) {
+    try {
+      value.emplace(fn());
+    } catch (...) {
+      error = std::current_exception();
+    }
+    Set();
   }
 
-  inline void operator-(std::function<void()>&& fn) {
-    MultiThreadFiberScheduler::GetInstance().Schedule(std::move(fn));
+  T Take() {
+    if (error) std::rethrow_exception(error);
+    return std::move(*value);
   }
 
+  std::optional<T>      value; /*> 任务的返回值 */
+  std::exception_ptr    error; /*> 任务抛出的异常 */
+};
+
+template <>
+struct FutureState<void> : CompletionEvent {
+  template <typename F>
+  void Run(F& fn) {
+    try {
+      fn();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    Set();
+  }
+
+  void Take() {
+    if (error) std::rethrow_exception(error);
+  }
+
+  std::exception_ptr    error; /*> 任务抛出的异常 */
+};
+
+/**
+ * @brief 协程任务的结果，由 fiber::async 返回.
+ * 
+ * @tparam T 任务的返回值类型
+ */
+template <typename T>
+class future {
+
+ public:
+  future() = default;
+  explicit future(std::shared_ptr<FutureState<T>> state) : state_(std::move(state)) {}
+  future(future&&) noexcept = default;
+  future& operator=(future&&) noexcept = default;
+  future(const future&) = delete;
+  future& operator=(const future&) = delete;
+
+  bool valid() const { return state_ != nullptr; }
+
+  bool ready() const { return state_ != nullptr && state_->IsSet(); }
+
+  /**
+   * @brief 等待任务完成并取出结果，任务抛出的异常在这里重新抛出. 只能调用一次.
+   */
+  T get() {
+    state_->Wait();
+    auto state = std::move(state_);
+    return state->Take();
+  }
+
+  void wait() const { state_->Wait(); }
+
+  /**
+   * @brief 在截止时间之前等待任务完成.
+   * 
+   * @return bool 任务是否已经完成，否则 errno 为 ETIMEDOUT 或 ECANCELED
+   */
+  template <typename Clock, typename Duration>
+  bool wait_until(const std::chrono::time_point<Clock, Duration>& tp) const {
+    int ret = state_->Wait(DeadlineAt(tp));
+    if (ret != 0) errno = ret;
+    return ret == 0;
+  }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& d) const
+  { return wait_until(DeadlineAfter(d)); }
+
+ private:
+  std::shared_ptr<FutureState<T>> state_; /*> 与任务共享的状态 */
+
+};
+
+/**
+ * @brief 在新的协程中运行 @p fn，通过返回的 future 获取它的结果.
+ * 
+ * @param fn 任务函数
+ * @param shareStack 是否运行在共享栈上
+ */
+template <typename F>
+auto async(F&& fn, bool shareStack = false)
+    -> future<std::invoke_result_t<std::decay_t<F>&>> {
+  using T = std::invoke_result_t<std::decay_t<F>&>;
+  auto state = std::make_shared<FutureState<T>>();
+  MultiThreadFiberScheduler::GetInstance().Schedule(
+      [state, fn = std::forward<F>(fn)]() mutable { state->Run(fn); },
+      shareStack);
+  return future<T>(std::move(state));
+}
+
+/**
+ * @brief 一组协程任务，可以一起等待它们全部完成.
+ * 同一个 task_group 只能由一个协程提交任务和等待；析构时等待所有任务完成.
+ */
+class task_group {
+
+ public:
+  task_group() : pending_(0) {}
+ ~task_group() { WaitDone(MonotonicClock::time_point::max()); }
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+  /**
+   * @brief 在新的协程中运行 @p fn.
+   * 
+   * @param fn 任务函数
+   * @param shareStack 是否运行在共享栈上
+   */
+  template <typename F>
+  void spawn(F&& fn, bool shareStack = false) {
+    mtx_.Lock();
+    if (pending_++ == 0) done_.Reset();
+    mtx_.Unlock();
+    MultiThreadFiberScheduler::GetInstance().Schedule(
+        [this, fn = std::forward<F>(fn)]() mutable {
+          try {
+            fn();
+          } catch (...) {
+            OnError(std::current_exception());
+          }
+          Finish();
+        },
+        shareStack);
+  }
+
+  /**
+   * @brief 等待目前提交的所有任务完成，重新抛出其中第一个任务抛出的异常.
+   */
+  void wait() {
+    WaitDone(MonotonicClock::time_point::max());
+    Rethrow();
+  }
+
+  /**
+   * @brief 在截止时间之前等待目前提交的所有任务完成.
+   * 
+   * @return bool 是否全部完成，否则 errno 为 ETIMEDOUT 或 ECANCELED
+   */
+  template <typename Clock, typename Duration>
+  bool wait_until(const std::chrono::time_point<Clock, Duration>& tp) {
+    int ret = WaitDone(DeadlineAt(tp));
+    if (ret != 0) {
+      errno = ret;
+      return false;
+    }
+    Rethrow();
+    return true;
+  }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& d)
+  { return wait_until(DeadlineAfter(d)); }
+
+ private:
+  void Finish() {
+    mtx_.Lock();
+    if (--pending_ == 0) done_.Set();
+    mtx_.Unlock();
+  }
+
+  int WaitDone(const MonotonicClock::time_point& deadline) {
+    mtx_.Lock();
+    bool busy = pending_ > 0;
+    mtx_.Unlock();
+    if (!busy) return 0;
+    int ret = done_.Wait(deadline);
+    // done_ 触发时最后一个任务可能还没有释放 mtx_，等它离开之后 task_group 才能被销毁
+    mtx_.Lock();
+    mtx_.Unlock();
+    return ret;
+  }
+
+  void OnError(std::exception_ptr error) {
+    mtx_.Lock();
+    if (!error_) error_ = std::move(error);
+    mtx_.Unlock();
+  }
+
+  void Rethrow() {
+    mtx_.Lock();
+    auto error = std::move(error_);
+    error_ = nullptr;
+    mtx_.Unlock();
+    if (error) std::rethrow_exception(error);
+  }
+
+  int                 pending_; /*> 尚未完成的任务数量，由 mtx_ 保护 */
+  CompletionEvent        done_; /*> 所有任务完成时触发 */
+  SpinLock                mtx_; /*> 保护 pending_ 和 error_ */
+  std::exception_ptr    error_; /*> 第一个任务抛出的异常 */
+
+};
+
+/**
+ * @brief 执行阻塞任务(磁盘 IO、第三方阻塞库、耗时的计算)的线程池，由 this_fiber::run_blocking 使用.
+ * 线程在没有空闲线程时按需创建，总数不超过上限，空闲一段时间后退出；
+ * 线程数达到上限时新任务在队列中排队.
+ */
+class BlockingPool {
+
+ public:
+  struct Stats {
+    size_t     threads; /*> 当前的线程数 */
+    size_t        idle; /*> 空闲的线程数 */
+    size_t     running; /*> 正在执行的任务数 */
+    size_t      queued; /*> 正在排队的任务数 */
+    size_t   maxQueued; /*> 排队任务数的历史最大值 */
+    uint64_t completed; /*> 已经完成的任务数 */
+  };
+
+  static BlockingPool& GetInstance();
+
+  /**
+   * @brief 提交一个任务，在池中的某个线程上执行.
+   */
+  void Submit(FiberFunc&& fn);
+
+  /**
+   * @brief 设置线程数上限，即同时执行的任务数上限，默认为 64.
+   * 调小时多出的线程执行完手头的任务后退出.
+   */
+  void SetMaxThreads(size_t n);
+
+  /**
+   * @brief 设置线程空闲多久之后退出，默认为 60 秒.
+   */
+  void SetIdleTimeout(std::chrono::milliseconds timeout);
+
+  Stats GetStats() const;
+
+ private:
+  BlockingPool();
+  BlockingPool(const BlockingPool&) = delete;
+  BlockingPool& operator=(const BlockingPool&) = delete;
+
+  void WorkerLoop();
+
+  mutable std::mutex          mtx_; /*> 保护以下成员 */
+  std::condition_variable      cv_; /*> 有新任务时通知空闲线程 */
+  std::deque<FiberFunc>     queue_; /*> 排队的任务 */
+  size_t               maxThreads_; /*> 线程数上限 */
+  std::chrono::milliseconds idleTimeout_; /*> 线程空闲多久之后退出 */
+  size_t                  threads_; /*> 当前的线程数 */
+  size_t                     idle_; /*> 空闲的线程数 */
+  size_t                maxQueued_; /*> 排队任务数的历史最大值 */
+  uint64_t              completed_; /*> 已经完成的任务数 */
+
 };
 
 }
@@ -295,6 +1782,18 @@ unsigned long long get_id();
  */
 int get_thread_id();
 
+/**
+ * @brief pin current coroutine to the thread it is running on, or allow it to
+ * migrate again. When migration is enabled by
+ * MultiThreadFiberScheduler::SetMigration(true), a woken coroutine may be
+ * handed over to an idle scheduler thread and resume there; pin coroutines that keep thread-local state or
+ * thread-affine resources across blocking calls. Coroutines started by
+ * MultiThreadFiberScheduler::ScheduleOn are pinned from the start.
+ * 
+ * @param pinned whether to pin current coroutine
+ */
+void pin_to_thread(bool pinned = true);
+
 /**
  * @brief get pointer of current coroutine.
  * 
@@ -307,6 +1806,66 @@ pio::fiber::Fiber* co_self();
  */
 void yield();
 
+/**
+ * @brief get cancel token of the task running on current coroutine.
+ * 
+ * @return pio::fiber::cancel_token 
+ */
+pio::fiber::cancel_token get_cancel_token();
+
+/**
+ * @brief whether the task running on current coroutine has been cancelled.
+ */
+bool is_cancelled();
+
+/**
+ * @brief fiber local variable.
+ * 每个协程各自持有一份 T，第一次访问时默认构造，协程结束时析构；
+ * 在主协程中访问时等价于线程本地变量.
+ * 
+ * @tparam T 变量类型
+ */
+template <typename T>
+class local {
+
+ public:
+  local() {
+    // 经过 hook 的 pthread_key_create 会记录析构函数
+    int ret = pthread_key_create(&key_, &local::Destroy);
+    if (ret != 0) {
+      throw std::system_error(ret, std::generic_category(), "pthread_key_create");
+    }
+  }
+ ~local() { pthread_key_delete(key_); }
+  local(const local&) = delete;
+  local& operator=(const local&) = delete;
+
+  T* get() const { return static_cast<T*>(co_self()->GetSpecific(key_)); }
+
+  T& operator*() {
+    T* value = get();
+    if (value == nullptr) {
+      value = new T();
+      co_self()->SetSpecific(key_, value);
+    }
+    return *value;
+  }
+
+  T* operator->() { return &**this; }
+
+  void reset(T* value = nullptr) {
+    T* old = get();
+    co_self()->SetSpecific(key_, value);
+    delete old;
+  }
+
+ private:
+  static void Destroy(void* value) { delete static_cast<T*>(value); }
+
+  pthread_key_t key_;
+
+};
+
 /**
  * @brief enable system hook for current coroutine.
  */
@@ -320,9 +1879,9 @@ void disable_system_hook();
 /**
  * @brief sleep current coroutine.
  * 
- * @param ms sleep time
+ * @param us sleep time, accurate to microseconds
  */
-void sleep_for(const std::chrono::milliseconds& ms);
+void sleep_for(const std::chrono::microseconds& us);
 
 /**
  * @brief sleep current coroutine.
@@ -331,8 +1890,43 @@ void sleep_for(const std::chrono::milliseconds& ms);
  */
 void sleep_until(const std::chrono::high_resolution_clock::time_point& time_point);
 
+/**
+ * @brief sleep current coroutine.
+ * 
+ * @param time_point time point of the runtime's monotonic clock
+ */
+void sleep_until(const MonotonicClock::time_point& time_point);
+
+/**
+ * @brief run a blocking callable on the blocking pool, parking current coroutine
+ * until it returns. Other coroutines on this thread keep running in the meantime.
+ * In the main coroutine (or a thread without coroutines) fn is called directly.
+ * 
+ * @param fn callable to run, moved into the pool
+ * @return the result of fn; an exception thrown by fn is rethrown here
+ */
+template <typename F>
+auto run_blocking(F&& fn) -> std::invoke_result_t<std::decay_t<F>&> {
+  using T = std::invoke_result_t<std::decay_t<F>&>;
+  pio::fiber::Fiber* self = pio::fiber::CurrentFiber();
+  if (self == nullptr || self->IsMain()) {
+    return fn();
+  }
+  // 协程挂起期间共享栈可能被其他协程占用，结果和任务函数都放在堆上
+  auto state = std::make_shared<pio::fiber::FutureState<T>>();
+  pio::fiber::BlockingPool::GetInstance().Submit(
+      [state, fn = std::forward<F>(fn)]() mutable { state->Run(fn); });
+  state->Wait();
+  return state->Take();
+}
+
 }
 
 #define go pio::fiber::__go()-
 
+/**
+ * 在共享栈上运行的协程，适合大量空闲连接的场景，每次切换需要额外拷贝一次已使用的栈.
+ */
+#define go_shared pio::fiber::__go(true)-
+
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+/**
+ * @file file.h
+ * @author horse-dog (horsedog@whu.edu.cn)
+ * @brief 协程中的普通文件 IO
+ * @version 0.1
+ * @date 2023-06-14
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef PIORUN_FIBER_FILE_H_
+#define PIORUN_FIBER_FILE_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// 普通文件总是"可读可写"的，epoll 无法让协程在磁盘 IO 期间让出线程.
+// 这里的操作在协程中提交到本线程的 io_uring 并挂起当前协程，完成后由调度循环唤醒；
+// 内核不支持 io_uring(或不支持某个操作)时交给阻塞任务线程池 BlockingPool 执行.
+// 主协程和共享栈上的协程中直接同步执行.
+// 返回值和 errno 与同名的系统调用相同. 开启了 hook 的协程中，open/openat 打开的
+// 普通文件上的 read/write/pread/pwrite/fsync/fdatasync 会自动转到这里.
+namespace pio::fiber::file {
+
+int open(const char* path, int flags, mode_t mode = 0);
+
+int openat(int dirfd, const char* path, int flags, mode_t mode = 0);
+
+ssize_t read(int fd, void* buf, size_t count);
+
+ssize_t write(int fd, const void* buf, size_t count);
+
+ssize_t pread(int fd, void* buf, size_t count, off_t offset);
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset);
+
+int fsync(int fd);
+
+int fdatasync(int fd);
+
+int statx(int dirfd, const char* path, int flags, unsigned int mask,
+          struct statx* buf);
+
+/**
+ * @brief 通过 statx 获取文件信息，填写 struct stat 中常用的字段.
+ */
+int stat(const char* path, struct stat* buf);
+
+}  // namespace pio::fiber::file
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file resolver.h
+ * @author horse-dog (horsedog@whu.edu.cn)
+ * @brief 协程中的 DNS 解析
+ * @version 0.1
+ * @date 2023-06-12
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef PIORUN_FIBER_RESOLVER_H_
+#define PIORUN_FIBER_RESOLVER_H_
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core/mutex.h"
+
+namespace pio::fiber {
+
+// 解析得到的一个地址
+struct IpAddress {
+  int family;       /*> AF_INET 或 AF_INET6 */
+  union {
+    in_addr v4;
+    in6_addr v6;
+  };
+};
+
+// 协程中使用的 DNS 解析器.
+// 查询通过 hook 之后的 UDP 套接字发出，等待应答时只挂起当前协程；结果按记录的 TTL
+// 缓存(名字不存在或没有该类型记录的否定应答按 SOA 中的 TTL 缓存)，同一个名字的并发
+// 查询只发出一次，其余协程等待这一次的结果. /etc/hosts 中的名字不经过名字服务器.
+// getaddrinfo/gethostbyname/gethostbyname_r 在开启了 hook 的协程中会转到这里.
+class Resolver {
+ public:
+  static Resolver& GetInstance();
+
+  /**
+   * @brief 解析主机名的 A 或 AAAA 记录. 只能在协程(非主协程)中调用.
+   *
+   * @param name 主机名，不支持 resolv.conf 中的 search 后缀
+   * @param family AF_INET 或 AF_INET6
+   * @param addrs 解析得到的地址
+   * @return int 0 成功；EAI_NONAME 名字不存在或没有该类型的记录；
+   *         EAI_AGAIN 名字服务器超时或出错
+   */
+  int Lookup(const std::string& name, int family, std::vector<IpAddress>& addrs);
+
+  /**
+   * @brief 替换名字服务器，默认读取 /etc/resolv.conf，都没有时使用 127.0.0.1.
+   *
+   * @param servers 形如 "127.0.0.1"、"127.0.0.1:5353"、"::1"、"[::1]:53"
+   * @return bool 有无法解析的地址时返回 false，此时不做修改
+   */
+  bool SetNameservers(const std::vector<std::string>& servers);
+
+  /**
+   * @brief 设置每次向一个名字服务器查询的超时时间和轮询所有名字服务器的次数.
+   * 默认取 /etc/resolv.conf 中的 options timeout/attempts，即 5 秒、2 次.
+   */
+  void SetTimeout(std::chrono::milliseconds timeout, int attempts);
+
+  /**
+   * @brief 清空缓存，正在进行的查询不受影响.
+   */
+  void ClearCache();
+
+ private:
+  struct Entry;
+  struct Config;
+
+  Resolver();
+
+  Resolver(const Resolver&) = delete;
+
+  Resolver& operator=(const Resolver&) = delete;
+
+  std::shared_ptr<const Config> GetConfig();
+
+  /**
+   * @brief 依次询问各个名字服务器.
+   *
+   * @param ttl 应答的有效期(秒)，否定应答时为否定缓存的有效期，出错时为 0
+   * @return int 同 Lookup
+   */
+  int Query(const Config& config, const std::string& name, int family,
+            std::vector<IpAddress>& addrs, uint32_t& ttl);
+
+  SpinLock                                          mtx_; /*> 保护以下成员 */
+  std::shared_ptr<const Config>                  config_; /*> 名字服务器和超时设置 */
+  std::unordered_map<std::string, std::shared_ptr<Entry>> cache_; /*> (类型, 名字) -> 缓存项 */
+  std::unordered_multimap<std::string, IpAddress>         hosts_; /*> /etc/hosts，构造时读取 */
+};
+
+}  // namespace pio::fiber
+
+#endif
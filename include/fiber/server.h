@@ -0,0 +1,78 @@
+/**
+ * @file server.h
+ * @author horse-dog (horsedog@whu.edu.cn)
+ * @brief 每个调度线程一个 SO_REUSEPORT 监听套接字的协程服务器
+ * @version 0.1
+ * @date 2023-06-18
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef PIORUN_FIBER_SERVER_H_
+#define PIORUN_FIBER_SERVER_H_
+
+#include <netinet/in.h>
+
+#include <functional>
+#include <memory>
+
+namespace pio::fiber {
+
+// 每个调度线程一个 SO_REUSEPORT 监听套接字的 TCP 服务器(thread-per-core).
+// 内核按四元组把新连接分散到各个监听套接字上；每个调度线程上固定运行一个接受协程，
+// 每次被唤醒时用 accept4 取空本线程监听套接字的积压连接，处理连接的协程也固定在同一个
+// 线程上运行，不会被其他线程窃取，连接从接受到关闭都不会跨线程.
+// 主线程(0 号调度线程)在 main 返回之后才开始调度，在此之前分给它的连接会在积压队列中等待.
+class ReusePortServer {
+ public:
+  /**
+   * @brief 处理一个连接，运行在接受该连接的调度线程上. 连接在内核中是非阻塞的，
+   * 对用户表现为阻塞的套接字；处理函数负责关闭连接.
+   */
+  using Handler = std::function<void(int fd, const sockaddr_in& peer)>;
+
+  explicit ReusePortServer(Handler handler);
+
+  ReusePortServer(const ReusePortServer&) = delete;
+  ReusePortServer& operator=(const ReusePortServer&) = delete;
+
+  /**
+   * @brief 调用 Stop.
+   */
+  ~ReusePortServer();
+
+  /**
+   * @brief 为每个调度线程创建一个监听套接字，并在各个线程上启动接受协程.
+   *
+   * @param ip 监听的地址，为空、"0"、"0.0.0.0" 或 "*" 时监听所有地址
+   * @param port 监听的端口，为 0 时由内核选择，通过 Port 获取
+   * @param backlog 每个监听套接字的积压队列长度
+   * @return int 0 成功；否则为出错的 errno，已经创建的监听套接字会被关闭；
+   *         重复调用时返回 EALREADY
+   */
+  int Listen(const char* ip, unsigned short port, int backlog = 1024);
+
+  /**
+   * @brief 停止接受新连接，不等待接受协程退出. 监听套接字在服务器对象和所有接受协程
+   * 都结束之后关闭，已经接受的连接不受影响.
+   */
+  void Stop();
+
+  /**
+   * @brief 监听的端口，Listen 成功之前为 0.
+   */
+  unsigned short Port() const { return port_; }
+
+ private:
+  struct State;
+
+  static void Acceptor(std::shared_ptr<State> state, int thread);
+
+  std::shared_ptr<State> state_; /*> 和接受协程共享的状态 */
+  unsigned short          port_; /*> 监听的端口 */
+
+};
+
+}  // namespace pio::fiber
+
+#endif
@@ -7,6 +7,7 @@
 #define HTTP_RESPONSE_H
 
 #include <fcntl.h>     // open
+#include <stdlib.h>    // malloc, free
 #include <sys/mman.h>  // mmap, munmap
 #include <sys/stat.h>  // stat
 #include <unistd.h>    // close
@@ -45,8 +46,11 @@ class HttpResponse {
   std::string srcDir_;
 
   char* mmFile_;
+  bool isMapped_;             /* mmFile_ 是 mmap 得到的还是 malloc 得到的 */
   struct stat mmFileStat_;
 
+  static const size_t MAX_READ_SIZE = 4 * 1024 * 1024; /* 不超过该大小的文件直接读入内存 */
+
   static const std::unordered_map<std::string, std::string> SUFFIX_TYPE;
   static const std::unordered_map<int, std::string> CODE_STATUS;
   static const std::unordered_map<int, std::string> CODE_PATH;
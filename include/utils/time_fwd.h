@@ -3,9 +3,11 @@
 
 #include <chrono>
 
+#include "core/clock.h"
+
 namespace pio {
 
-using Clock = std::chrono::steady_clock;
+using Clock = MonotonicClock;
 using TimePoint = std::chrono::time_point<Clock>;
 using Duration = std::chrono::duration<int64_t, std::micro>;
 inline constexpr const auto NO_DEADLINE = TimePoint::max();
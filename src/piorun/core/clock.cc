@@ -0,0 +1,114 @@
+#include "core/clock.h"
+
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace pio {
+
+namespace {
+
+thread_local int64_t cachedNow = 0; /*> 当前线程缓存的时间(us) */
+thread_local bool cacheOwned = false; /*> 当前线程是否有调度循环负责刷新缓存 */
+
+const int kTscShift = 48;        /*> tscMult 的小数位数 */
+
+std::atomic<bool> useTsc{false}; /*> 是否从 TSC 读取时间 */
+uint64_t tscBase = 0;            /*> 校准时的 TSC 读数 */
+int64_t monoBase = 0;            /*> 校准时的单调时钟(ns) */
+uint64_t tscMult = 0;            /*> 每个 TSC 周期对应的纳秒数，kTscShift 位小数的定点数 */
+
+int64_t ReadMonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000'000'000 + ts.tv_nsec;
+}
+
+int64_t ReadMonotonic() { return ReadMonotonicNs() / 1000; }
+
+#if defined(__x86_64__)
+/**
+ * @brief 同时读取 TSC 和单调时钟，TSC 取单调时钟前后两次读数的中点.
+ * 读取多次，取前后两次 TSC 读数相距最近的一组，排除缺页、中断等带来的延迟.
+ */
+void ReadPair(uint64_t& tsc, int64_t& mono) {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 16; i++) {
+    uint64_t before = __rdtsc();
+    int64_t now = ReadMonotonicNs();
+    uint64_t span = __rdtsc() - before;
+    if (span < best) {
+      best = span;
+      tsc = before + span / 2;
+      mono = now;
+    }
+  }
+}
+#endif
+
+int64_t ReadSource() {
+#if defined(__x86_64__)
+  if (useTsc.load(std::memory_order_acquire)) {
+    unsigned __int128 delta = __rdtsc() - tscBase;
+    return (monoBase + (int64_t)((delta * tscMult) >> kTscShift)) / 1000;
+  }
+#endif
+  return ReadMonotonic();
+}
+
+}  // namespace
+
+MonotonicClock::time_point MonotonicClock::now() noexcept {
+  // 没有调度循环刷新缓存的线程上，缓存只会停在上一次读取的时间
+  if (!cacheOwned || cachedNow == 0) return Refresh();
+  return time_point(duration(cachedNow));
+}
+
+MonotonicClock::time_point MonotonicClock::Refresh() noexcept {
+  // 不同线程刷新的时间可能有先后，保证单个线程看到的时间不会倒退
+  int64_t now = ReadSource();
+  if (now > cachedNow) cachedNow = now;
+  return time_point(duration(cachedNow));
+}
+
+void MonotonicClock::OwnThreadCache(bool owned) noexcept {
+  cacheOwned = owned;
+  if (owned) Refresh();
+}
+
+bool MonotonicClock::EnableTsc() {
+#if defined(__x86_64__)
+  if (useTsc.load(std::memory_order_acquire)) return true;
+
+  // CPUID.80000007H:EDX[8]，恒定速率且不会在深度睡眠时停止的 TSC
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+    return false;
+  }
+
+  // 用纳秒读数校准：微秒读数在 10ms 的窗口上有 1e-4 的误差，一小时会漂移 0.36s
+  uint64_t tsc0, tsc1;
+  int64_t mono0, mono1;
+  ReadPair(tsc0, mono0);
+  struct timespec wait = {0, 10'000'000};
+  nanosleep(&wait, nullptr);
+  ReadPair(tsc1, mono1);
+  if (tsc1 <= tsc0 || mono1 <= mono0) return false;
+
+  tscBase = tsc1;
+  monoBase = mono1;
+  tscMult = (uint64_t)(((unsigned __int128)(mono1 - mono0) << kTscShift) / (tsc1 - tsc0));
+  useTsc.store(true, std::memory_order_release);
+  return true;
+#else
+  return false;
+#endif
+}
+
+}  // namespace pio
@@ -22,6 +22,9 @@ Scheduler MainScheduleIml() {
       promise.scheduled_.pop_front();
     }
 
+    // 每轮刷新一次缓存的时间，超时检查都基于它
+    Clock::Refresh();
+
     bool all_done = true;
     for (auto &em : promise.emitters_) {
       if (!em->IsEmpty()) {
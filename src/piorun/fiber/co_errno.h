@@ -0,0 +1,24 @@
+/**
+ * @file co_errno.h
+ * @author horse-dog (horsedog@whu.edu.cn)
+ * @brief 库内部使用的 errno，只在 src/piorun/fiber 下的源文件中包含
+ * @version 0.1
+ * @date 2023-06-14
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef PIORUN_FIBER_CO_ERRNO_H_
+#define PIORUN_FIBER_CO_ERRNO_H_
+
+#include <errno.h>
+
+// 协程可能在等待之后换到其他线程上继续运行(见 FiberEnvironment::MigrateReadyFibers).
+// __errno_location 被声明为 const，编译器会把 errno 的地址缓存下来跨过等待继续使用，
+// 因此库中的 errno 都改为每次通过 co_errno_location 重新获取. 需要放在所有系统头文件之后包含.
+extern int* co_errno_location();
+
+#undef errno
+#define errno (*co_errno_location())
+
+#endif
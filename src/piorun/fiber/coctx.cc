@@ -1,11 +1,20 @@
 #include "fiber/coctx.h"
 
-#include <new>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
 
 namespace pio::fiber {
 
+extern "C" {
+extern void coctx_swap(FiberContext*, FiberContext*, const char* src,
+                       size_t len, char* dst) asm("coctx_swap");
+}
+
 // low | regs[0] : r15 |
 //     | regs[1] : r14 |
 //     | regs[2] : r13 |
@@ -18,41 +27,182 @@ namespace pio::fiber {
 //     | regs[9] : rdx |
 //     | regs[10]: rcx |
 //     | regs[11]: rbx |
-// hig | regs[12]: rsp |
+//     | regs[12]: rsp |
+// hig | regs[13]: ret |
 enum {
   kRDI = 7,
   kRSI = 8,
   kRSP = 12,
+  kRETAddr = 13,
 };
 
-// stack size = 128 * 1024
-FiberContext::StackMemory::StackMemory(int size) : stackSize_(size) {
-  this->buffer_ = new char[stackSize_];
+static size_t PageSize() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+/**
+ * @brief 允许带保护页的栈的最大数量.
+ * 每个保护页都会让内核多出一个 VMA，数量超过 vm.max_map_count 后 mmap 会直接
+ * 失败，因此只让保护页占用其中的四分之一，超出的栈不再设置保护页.
+ */
+static long MaxGuardedStacks() {
+  static const long limit = [] {
+    long count = 65530;
+    FILE* fp = fopen("/proc/sys/vm/max_map_count", "r");
+    if (fp != nullptr) {
+      if (fscanf(fp, "%ld", &count) != 1) count = 65530;
+      fclose(fp);
+    }
+    return count / 4;
+  }();
+  return limit;
+}
+
+static std::atomic<long> guardedStacks{0}; /*> 当前带保护页的栈的数量 */
+
+// stack size = 128 * 1024, 向上取整到页大小，栈底额外映射一个 PROT_NONE 保护页，
+// 栈溢出时将直接触发 SIGSEGV，而不是悄悄改写相邻的内存
+FiberContext::StackMemory::StackMemory(int size) {
+  const size_t page = PageSize();
+  const size_t usable = (size + page - 1) & ~(page - 1);
+  bool guard = guardedStacks.fetch_add(1, std::memory_order_relaxed) <
+               MaxGuardedStacks();
+  if (!guard) guardedStacks.fetch_sub(1, std::memory_order_relaxed);
+
+  const size_t length = usable + (guard ? page : 0);
+  void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (p == MAP_FAILED) {
+    if (guard) guardedStacks.fetch_sub(1, std::memory_order_relaxed);
+    throw std::bad_alloc();
+  }
+  if (guard && mprotect(p, page, PROT_NONE) != 0) {
+    munmap(p, length);
+    guardedStacks.fetch_sub(1, std::memory_order_relaxed);
+    throw std::bad_alloc();
+  }
+  this->occupy_ = nullptr;
+  this->mapped_ = (char*)p;
+  this->buffer_ = mapped_ + (guard ? page : 0);
+  this->stackSize_ = usable;
   this->bp_ = buffer_ + stackSize_;
 }
 
 FiberContext::StackMemory::~StackMemory() {
-  delete[] buffer_;
+  if (buffer_ != mapped_) {
+    guardedStacks.fetch_sub(1, std::memory_order_relaxed);
+  }
+  munmap(mapped_, (buffer_ - mapped_) + stackSize_);
+  mapped_ = nullptr;
   buffer_ = nullptr;
   bp_ = nullptr;
 }
 
-FiberContext::FiberContext() 
-: regs_{}, stack_(new StackMemory()) {}
+void FiberContext::StackMemory::Purge(size_t keep) {
+  const size_t page = PageSize();
+  keep = (keep + page - 1) & ~(page - 1);
+  if (keep >= (size_t)stackSize_) return;
+  // 不用 MADV_FREE：它要等内存紧张时才回收，这期间这些页仍然计入进程的常驻内存
+  madvise(buffer_, stackSize_ - keep, MADV_DONTNEED);
+}
 
-FiberContext::FiberContext(const FiberContext& rhs) {
+StackAllocator& StackAllocator::GetInstance() {
+  thread_local StackAllocator allocator;
+  return allocator;
+}
+
+StackAllocator::~StackAllocator() {
+  for (auto stack : freeList_) {
+    delete stack;
+  }
+  freeList_.clear();
+  for (auto& stack : shareStacks_) {
+    delete stack;
+    stack = nullptr;
+  }
+}
+
+FiberContext::StackMemory* StackAllocator::Allocate(int size) {
+  for (size_t i = freeList_.size(); i > 0; i--) {
+    StackMemory* stack = freeList_[i - 1];
+    if (stack->stackSize_ >= size) {
+      freeList_[i - 1] = freeList_.back();
+      freeList_.pop_back();
+      return stack;
+    }
+  }
+  return new StackMemory(size);
+}
+
+void StackAllocator::Deallocate(StackMemory* stack) {
+  if (stack == nullptr) return;
+  if (freeList_.size() >= kMaxCachedStacks) {
+    delete stack;
+    return;
+  }
+  stack->Purge();
+  freeList_.push_back(stack);
+}
+
+FiberContext::StackMemory* StackAllocator::GetShareStack() {
+  StackMemory*& stack = shareStacks_[shareStackIdx_++ % kShareStackCount];
+  if (stack == nullptr) {
+    stack = new StackMemory(kShareStackSize);
+  }
+  return stack;
+}
+
+FiberContext::FiberContext(bool shareStack)
+    : regs_{},
+      stack_(shareStack ? StackAllocator::GetInstance().GetShareStack()
+                        : StackAllocator::GetInstance().Allocate()),
+      isShared_(shareStack),
+      stackSp_(),
+      saveBuffer_(),
+      saveSize_(),
+      saveCapacity_() {}
+
+FiberContext::FiberContext(const FiberContext& rhs)
+    : isShared_(rhs.isShared_),
+      stackSp_(),
+      saveBuffer_(),
+      saveSize_(),
+      saveCapacity_() {
   memcpy(regs_, rhs.regs_, sizeof(regs_));
-  this->stack_ = new StackMemory(*rhs.stack_);
+  this->stack_ =
+      isShared_ ? StackAllocator::GetInstance().GetShareStack()
+                : StackAllocator::GetInstance().Allocate(rhs.stack_->stackSize_);
 }
 
-FiberContext::FiberContext(FiberContext&& rhs) noexcept {
+FiberContext::FiberContext(FiberContext&& rhs) noexcept
+    : isShared_(rhs.isShared_),
+      stackSp_(rhs.stackSp_),
+      saveBuffer_(rhs.saveBuffer_),
+      saveSize_(rhs.saveSize_),
+      saveCapacity_(rhs.saveCapacity_) {
   memcpy(regs_, rhs.regs_, sizeof(regs_));
   this->stack_ = rhs.stack_;
+  if (isShared_ && stack_ != nullptr && stack_->occupy_ == &rhs) {
+    stack_->occupy_ = this;
+  }
   rhs.stack_ = nullptr;
+  rhs.saveBuffer_ = nullptr;
+  rhs.saveSize_ = rhs.saveCapacity_ = 0;
 }
 
 FiberContext::~FiberContext() {
-  delete stack_;
+  if (isShared_) {
+    // 共享栈由分配器持有，这里只需要解除占用关系
+    if (stack_ != nullptr && stack_->occupy_ == this) {
+      stack_->occupy_ = nullptr;
+    }
+    free(saveBuffer_);
+    saveBuffer_ = nullptr;
+    saveSize_ = saveCapacity_ = 0;
+  } else {
+    StackAllocator::GetInstance().Deallocate(stack_);
+  }
   stack_ = nullptr;
 }
 
@@ -79,15 +229,57 @@ int FiberContext::Make(void*(*pfn)(void*, void*), const void *s1, const void *s2
   sp = (char*)((unsigned long)sp & -16LL);
   memset(regs_, 0, sizeof(regs_));
 
-  // 设置返回地址
-  void** ret_addr = (void**)(sp);
-  *ret_addr = (void*)pfn;
+  // 设置返回地址，coctx_swap 会在切换时把它写到栈上。
+  // 这里不能直接写栈，共享栈此时可能正被其他协程使用
+  this->regs_[kRETAddr] = (void*)pfn;
 
   // 协程运行开始前，最重要的信息只有rdi，rsi，rsp和返回地址
   this->regs_[kRSP] = sp;
   this->regs_[kRDI] = (char*)s1;
   this->regs_[kRSI] = (char*)s2;
+
+  // 重新开始运行的上下文不再需要之前保存的栈
+  this->saveSize_ = 0;
   return 0;
 }
 
+void FiberContext::SaveStack() {
+  size_t len = stack_->bp_ - stackSp_;
+  if (saveCapacity_ < len) {
+    free(saveBuffer_);
+    saveBuffer_ = (char*)malloc(len);
+    if (saveBuffer_ == nullptr) {
+      saveCapacity_ = 0;
+      throw std::bad_alloc();
+    }
+    saveCapacity_ = len;
+  }
+  saveSize_ = len;
+  memcpy(saveBuffer_, stackSp_, len);
 }
+
+void FiberContext::Swap(FiberContext* curr, FiberContext* pending) {
+  // 以当前的 %rsp 作为栈顶，本函数的整个栈帧都会被保存下来
+  char* sp;
+  asm volatile("movq %%rsp, %0" : "=r"(sp));
+  curr->stackSp_ = sp;
+
+  const char* src = nullptr;
+  size_t len = 0;
+  if (pending->isShared_) {
+    FiberContext* occupy = pending->stack_->occupy_;
+    if (occupy != pending) {
+      // 共享栈被其他协程占用，先把它的栈内容保存起来
+      if (occupy != nullptr) occupy->SaveStack();
+      pending->stack_->occupy_ = pending;
+      src = pending->saveBuffer_;
+      len = pending->saveSize_;
+    }
+  }
+
+  // 栈内容的恢复由 coctx_swap 在切换栈之前完成：切换回来之后，本函数的栈帧
+  // (例如被保存的寄存器)在恢复之前就可能被访问
+  coctx_swap(curr, pending, src, len, pending->stackSp_);
+}
+
+}  // namespace pio::fiber
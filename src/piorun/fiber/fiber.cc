@@ -1,36 +1,50 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <core/clock.h>
+#include <core/thread.h>
 #include <fiber/fiber.h>
+#include <linux/io_uring.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <new>
 #include <thread>
 
+#include "co_errno.h"
+
 thread_local bool isaccept = false;
 
-namespace pio::fiber {
+// 不能内联，否则调用者中的地址又会被当作常量缓存
+__attribute__((noinline, noipa)) int* co_errno_location() { return __errno_location(); }
 
-extern "C" {
+namespace pio::fiber {
 
-extern void coctx_swap(FiberContext*, FiberContext*) asm("coctx_swap");
+/**
+ * @brief 获取当前线程缓存的单调时钟时间（微秒级），由调度循环每轮刷新
+ *
+ * @return unsigned long long
+ */
+static unsigned long long GetTickUS() {
+  return MonotonicClock::now().time_since_epoch().count();
 }
 
 /**
- * @brief 获取当前系统时间（毫秒级）
+ * @brief 读取时钟源并刷新缓存，获取精确的当前时间（微秒级）
  *
  * @return unsigned long long
  */
-static unsigned long long GetTickMS() {
-  // 1秒 = 1000毫秒 = 1000'000微秒 = 1000'000'000纳秒
-  // timeval结构体由秒 + 微秒组成
-  struct timeval now = {0};
-  gettimeofday(&now, NULL);
-  unsigned long long u = now.tv_sec;
-  u *= 1000;
-  u += now.tv_usec / 1000;
-  return u;
+static unsigned long long RefreshTickUS() {
+  return MonotonicClock::Refresh().time_since_epoch().count();
 }
 
 // 超时事件结点组成的链表
@@ -46,8 +60,7 @@ struct StTimeoutItem {
   StTimeoutItem* pNext;     /*> 指向下一个结点 */
   StTimeoutItemLink* pLink; /*> 指向本结点所属的链表 */
 
-  uint64_t ullExpireTime; /*> 超时时间 */
-  uint64_t isDelayActive; /*> 是否是在之后的轮子才超时 */
+  uint64_t ullExpireTime; /*> 超时时间(us) */
 
   OnPreparePfn_t pfnPrepare; /*> 预处理函数，在eventloop中会被调用 */
   OnProcessPfn_t pfnProcess; /*> 处理函数，在eventloop中会被调用 */
@@ -60,7 +73,6 @@ struct StTimeoutItem {
         pNext(),
         pLink(),
         ullExpireTime(),
-        isDelayActive(),
         pfnPrepare(),
         pfnProcess(),
         pArg(),
@@ -160,105 +172,170 @@ struct StTimeoutItemLink {
   }
 };
 
-// 时间轮定时器容器
+// 分层时间轮定时器容器
+// 最底层的一个时间槽对应 1us，每一层有 256 个时间槽，上一层的一个时间槽覆盖下一层的一整圈。
+// 时间槽按到期时间的绝对值索引，定时器在上层的时间槽到期时被重新分配到下层(cascade)。
+// 插入和取消(StTimeoutItem::RemoveFromLink)都是 O(1) 的，每层用位图记录非空的时间槽，
+// 推进时间和查询最近的到期时间时可以直接跳过空的时间槽。
 struct StTimeout {
-  StTimeoutItemLink* pItems_; /*> 时间轮，是一个由多个超时事件链表组成的数组 */
-  int iItemSize_; /*> 时间轮的大小，默认为60*1000 */
+  static const int kLevelBits = 8;
+  static const int kLevelSize = 1 << kLevelBits; /*> 每层时间槽的数量 */
+  static const int kLevelMask = kLevelSize - 1;
+  static const int kLevels = 5; /*> 层数，总共覆盖 2^40us，约 12.7 天 */
 
-  uint64_t ullStart_;  /*> 上一次取超时事件的绝对时间 */
-  int64_t llStartIdx_; /*> 上一次取超时事件的槽号范围的最大值 +
-                          1，即下次取超时事件的开始槽号 */
+  StTimeoutItemLink pItems_[kLevels][kLevelSize]; /*> 各层的时间槽 */
+  uint64_t bitmap_[kLevels][kLevelSize / 64]; /*> 可能非空的时间槽，取消定时器时不会清除 */
+  uint64_t ullCurrent_; /*> 下一个待处理的时间(us)，早于它开始的时间槽都已经处理过了 */
 
-  StTimeout(int iSize)
-      : pItems_(), iItemSize_(iSize), ullStart_(GetTickMS()), llStartIdx_() {
-    pItems_ = new StTimeoutItemLink[iSize];
-  }
+  StTimeout() : pItems_(), bitmap_(), ullCurrent_(GetTickUS()) {}
 
-  ~StTimeout() {
-    delete[] pItems_;
-    pItems_ = nullptr;
-    iItemSize_ = 0;
-    ullStart_ = 0;
-    llStartIdx_ = 0;
-  }
+  ~StTimeout() { ullCurrent_ = 0; }
 
   /**
    * @brief 新注册一个超时事件结点
    *
    * @param apItem 新的超时事件结点
-   * @param allNow 当前时间(ms)
+   * @param allNow 当前时间(us)
    * @return int 插入成功时返回0, 插入失败时返回-1
    */
   int AddTimeout(StTimeoutItem* apItem, uint64_t allNow) {
-    if (this->ullStart_ == 0) {
-      this->ullStart_ = allNow;
-      this->llStartIdx_ = 0;
-    }
-
-    // 计算时间差，单位为ms
-    auto diff = apItem->ullExpireTime - this->ullStart_;
-
-    // 比上一次取超时事件的时间还要长超过了一分钟（60*1000ms)，（溢出了。。。）报错
-    // 不过这里又改为了将超时时间设置为最长支持的时间，然后添加。。。
-    // 增加 isDelayActive 实现长时间定时器
-    apItem->isDelayActive = diff >= iItemSize_ ? 1 : 0;
-
-    // if (diff >= (uint64_t)this->iItemSize_) {
-    //   diff = this->iItemSize_ - 1;
-    // }
-
-    /**
-     * 返回-1的情况：
-     * 1. 时间轮定时器容器已经步过了 allNow 时刻.
-     * 2. 想要添加一个超时结点，然而该结点在添加前就超时了.
-     */
-    if (allNow < this->ullStart_ || apItem->ullExpireTime < allNow) {
+    // 想要添加一个超时结点，然而该结点在添加前就超时了
+    if (apItem->ullExpireTime < allNow) {
       return -1;
     }
-
-    // 好的，把这个新结点添加到时间轮中对应的槽指向的链表的尾部
-    this->pItems_[(llStartIdx_ + diff) % iItemSize_].AddTail(apItem);
+    Insert(apItem);
     return 0;
   }
 
   /**
    * @brief 取出所有截至目前为止超时的事件，将它们append到 @p apResult 中.
    *
-   * @param allNow 当前时间(ms)
+   * @param allNow 当前时间(us)
    * @param apResult 存储超时事件的链表
    */
   void TakeAllTimeout(uint64_t allNow, StTimeoutItemLink* apResult) {
-    if (this->ullStart_ == 0) {
-      this->ullStart_ = allNow;
-      this->llStartIdx_ = 0;
-    }
+    while (this->ullCurrent_ <= allNow) {
+      uint64_t next = NextEvent();
+      if (next > allNow) {
+        // 直到 allNow 都没有可能非空的时间槽
+        this->ullCurrent_ = allNow + 1;
+        break;
+      }
+      this->ullCurrent_ = next;
 
-    if (allNow < this->ullStart_) {
-      return;
+      // 从上往下，把在 next 时刻开始的上层时间槽重新分配到下层
+      for (int level = kLevels - 1; level > 0; level--) {
+        if ((next & ((1ULL << (level * kLevelBits)) - 1)) == 0) {
+          Cascade(level, (next >> (level * kLevelBits)) & kLevelMask);
+        }
+      }
+
+      int idx = next & kLevelMask;
+      apResult->Join(&this->pItems_[0][idx]);
+      ClearBit(0, idx);
+      this->ullCurrent_ = next + 1;
     }
+  }
 
-    // 超时的时间槽的数量可以通过时间差除以粒度得到
-    int cnt = allNow - this->ullStart_ + 1;
+  /**
+   * @brief 距离最近一个可能到期的超时事件还有多久.
+   * 被取消的定时器可能让结果偏早，但不会偏晚.
+   *
+   * @param allNow 当前时间(us)
+   * @param maxUs 最长等待时间(us)
+   * @return uint64_t 等待时间(us)，没有定时器时返回 @p maxUs
+   */
+  uint64_t NextTimeout(uint64_t allNow, uint64_t maxUs) {
+    uint64_t next = NextEvent();
+    if (next == UINT64_MAX) return maxUs;
+    if (next <= allNow) return 0;
+    return next - allNow < maxUs ? next - allNow : maxUs;
+  }
 
-    // 如果超时的时间槽的数量超过了时间轮的最大容量，把它限制为这个最大容量
-    if (cnt > this->iItemSize_) {
-      cnt = this->iItemSize_;
+ private:
+  void Insert(StTimeoutItem* apItem) {
+    uint64_t expire = apItem->ullExpireTime;
+    if (expire < this->ullCurrent_) {
+      expire = this->ullCurrent_;
     }
+    uint64_t delta = expire - this->ullCurrent_;
+    int level = 0;
+    while (level < kLevels - 1 &&
+           delta >= (1ULL << ((level + 1) * kLevelBits))) {
+      level++;
+    }
+    if (level == kLevels - 1 &&
+        delta >= (1ULL << (kLevels * kLevelBits - kLevelBits)) * kLevelMask) {
+      // 超出了时间轮的范围，先挂在最顶层的最后一个时间槽上，到时再重新分配
+      expire = this->ullCurrent_ +
+               (1ULL << (kLevels * kLevelBits - kLevelBits)) * kLevelMask;
+    }
+    int idx = (expire >> (level * kLevelBits)) & kLevelMask;
+    this->pItems_[level][idx].AddTail(apItem);
+    this->bitmap_[level][idx >> 6] |= 1ULL << (idx & 63);
+  }
 
-    // 如果cnt小于0，肯定有问题（但是这里感觉已经肯定不会小于0了。。。）
-    if (cnt < 0) {
-      return;
+  void ClearBit(int level, int idx) {
+    this->bitmap_[level][idx >> 6] &= ~(1ULL << (idx & 63));
+  }
+
+  /**
+   * @brief 把第 @p level 层的第 @p idx 个时间槽中的定时器重新分配到下层.
+   */
+  void Cascade(int level, int idx) {
+    StTimeoutItemLink items;
+    items.Join(&this->pItems_[level][idx]);
+    ClearBit(level, idx);
+    while (items.head_ != nullptr) {
+      StTimeoutItem* lp = items.head_;
+      items.PopHead();
+      Insert(lp);
     }
+  }
 
-    // 好的，现在开始遍历这些时间槽各自指向的链表吧，把这些链表全部splice到apResult
-    for (int i = 0; i < cnt; i++) {
-      int idx = (this->llStartIdx_ + i) % this->iItemSize_;
-      apResult->Join(&this->pItems_[idx]);
+  /**
+   * @brief 在第 @p level 层中，从下标 @p from 开始查找第一个可能非空的时间槽.
+   *
+   * @return int 时间槽的下标，没有时返回-1
+   */
+  int FindSlot(int level, int from) const {
+    for (int w = from >> 6; w < kLevelSize / 64; w++) {
+      uint64_t bits = this->bitmap_[level][w];
+      if (w == (from >> 6)) bits &= ~0ULL << (from & 63);
+      if (bits != 0) return (w << 6) + __builtin_ctzll(bits);
     }
+    return -1;
+  }
 
-    // 现在更新上一次取超时事件的绝对时间和槽号
-    this->ullStart_ = allNow;
-    this->llStartIdx_ += cnt - 1;
+  /**
+   * @brief 下一个需要处理的时刻：最底层可能非空的时间槽的到期时间，或者上层可能非空的
+   * 时间槽开始的时间(届时需要 cascade)，取最小值.
+   *
+   * @return uint64_t 时刻(us)，时间轮为空时返回 UINT64_MAX
+   */
+  uint64_t NextEvent() const {
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < kLevels; level++) {
+      int shift = level * kLevelBits;
+      uint64_t span = 1ULL << (shift + kLevelBits); /*> 本层转一圈的时间 */
+      uint64_t base = this->ullCurrent_ & ~(span - 1);
+      int cur = (this->ullCurrent_ >> shift) & kLevelMask;
+      // 早于 ullCurrent_ 开始的时间槽都已经 cascade 过了，其中的定时器属于下一圈；
+      // ullCurrent_ 恰好是本层时间槽的开始时，当前时间槽还没有处理
+      bool started = (this->ullCurrent_ & ((1ULL << shift) - 1)) == 0;
+      int from = started ? cur : cur + 1;
+      int idx = from < kLevelSize ? FindSlot(level, from) : -1;
+      uint64_t when;
+      if (idx >= 0) {
+        when = base + ((uint64_t)idx << shift);
+      } else {
+        idx = FindSlot(level, 0);
+        if (idx < 0) continue;
+        when = base + span + ((uint64_t)idx << shift);
+      }
+      if (when < best) best = when;
+    }
+    return best;
   }
 };
 
@@ -343,10 +420,75 @@ struct StCoPollItem : public StTimeoutItem {
   pollfd* pSelf;       /*> 指向该Poll结点对应的pollfd */
   StCoPoller* pPoll;   /*> 指向管理该Poll结点的Poll结构体 */
   epoll_event stEvent; /*> 用于存放关心的epoll事件 */
+  int iDupFd;          /*> 描述符已经常驻在本线程的 epoll 中时，临时注册它的副本 */
+
+  StCoPollItem() : pSelf(), pPoll(), stEvent(), iDupFd(-1) {}
+
+  // 注册到 epoll 中的描述符号
+  int RegisteredFd() const { return iDupFd >= 0 ? iDupFd : pSelf->fd; }
+};
+
+// 常驻在 epoll 中的描述符注册.
+// 第一次有协程等待该描述符时，以边沿触发的方式注册到该协程所在线程的 epoll 中，直到描述符关闭；
+// 之后的等待只需要挂起协程(必要时再挂一个定时器)，不再有 epoll_ctl 和内存分配.
+// 读写各有一个等待队列，事件到来时由注册所在的线程把等待者交还给它们自己的线程.
+// 对象随描述符号一起复用，关闭后也不释放，epoll_wait 已经返回但尚未处理的事件不会访问到野指针.
+struct StFdEvent : public StTimeoutItem {
+  int fd;           /*> 描述符 */
+  int iEpollFd;     /*> 注册所在的 epoll */
+  SpinLock lock;    /*> 保护以下成员 */
+  bool bRegistered; /*> 是否已经注册到 epoll 中 */
+  bool bReadable;   /*> 上次等待之后出现过可读(或出错)的边沿 */
+  bool bWritable;   /*> 上次等待之后出现过可写(或出错)的边沿 */
+  bool bClosing;    /*> 描述符正在被关闭，不能再注册 */
+  WaitQueue readers; /*> 等待可读的协程 */
+  WaitQueue writers; /*> 等待可写的协程 */
+
+  explicit StFdEvent(int fd)
+      : fd(fd),
+        iEpollFd(-1),
+        bRegistered(false),
+        bReadable(false),
+        bWritable(false),
+        bClosing(false) {}
+
+  /**
+   * @brief 挂起当前协程，直到描述符出现 @p events 方向的就绪边沿、超时或者被取消.
+   * 就绪边沿可能早于调用发生，因此返回 1 只表示应该重试系统调用.
+   *
+   * @param events POLLIN 或 POLLOUT
+   * @param deadline 截止时间
+   * @return int 1 表示就绪，0 表示超时，-1 表示出错(errno 为 ECANCELED 等)
+   */
+  int Wait(short events, const MonotonicClock::time_point& deadline);
+
+  /**
+   * @brief 描述符即将关闭：在描述符号还属于它时从 epoll 中注销，唤醒所有等待者.
+   * 直到 Closed 之前等待者只会让出后重试，不会把描述符重新注册回去.
+   */
+  void Close();
+
+  /**
+   * @brief 描述符已经真正关闭，复用这个描述符号的新描述符可以重新注册.
+   */
+  void Closed();
+
+  /**
+   * @brief epoll 事件到来时调用，记录就绪边沿并唤醒对应方向的等待者.
+   */
+  void OnEvent(uint32_t events);
 
-  StCoPollItem() : pSelf(), pPoll(), stEvent() {}
+  static bool RemoveWaiter(void* self, Fiber* fiber);
 };
 
+/**
+ * @brief 常驻注册的 prepare function，事件在这里就处理完毕，不进入到达事件队列.
+ */
+static void OnFdEventPrepare(StTimeoutItem* ap, epoll_event& e,
+                             StTimeoutItemLink* active) {
+  ((StFdEvent*)ap)->OnEvent(e.events);
+}
+
 /**
  * @brief poll process function, 唤醒超时事件结点 @p ap 所在的协程.
  *
@@ -357,6 +499,20 @@ static void OnPollProcess(StTimeoutItem* ap) {
   co->Resume();
 }
 
+/**
+ * @brief 可超时等待的超时处理函数，把协程从等待队列中移除并唤醒它.
+ * 移除失败说明协程已经被唤醒(或取消)，只是还没有被调度，这里什么也不做.
+ *
+ * @param ap 超时事件结点
+ */
+void OnWaitTimeout(StTimeoutItem* ap) {
+  Fiber* co = (Fiber*)ap->pArg;
+  if (co->pfnWaitRemove_(co->waitOwner_, co)) {
+    co->waitResult_ = ETIMEDOUT;
+    co->Resume();
+  }
+}
+
 /**
  * @brief poll prepare function,
  *
@@ -379,353 +535,2194 @@ static void OnPollPrepare(StTimeoutItem* ap, epoll_event& e,
   }
 }
 
-class FiberEnvironment {
-  friend class Fiber;
-  friend class FiberScheduler;
-
- public:
-  Fiber* pCallStack_[128];         /*> 协程调用栈 */
-  int callStackSize_;              /*> 当前调用栈长度 */
-  int EpollFd_;                    /*> epfd */
-  int threadId_;                   /*> 线程ID, 用于识别调度器 */
-  StTimeout* pTimeWheel_;          /*> time wheel */
-  StTimeoutItemLink pActiveList_;  /*> 到达事件缓存 */
-  StTimeoutItemLink pTimeoutList_; /*> 超时事件缓存 */
-  epoll_event* epollEvents_;       /*> epoll_event数组 */
-  size_t eventsLength_;            /*> epoll_event数组的大小 */
-  size_t currentFiberCount_; /*> 本线程目前正在运行的协程数量(不包含主协程) */
-  std::deque<std::function<void()>>
-      raisedTasks_; /*> 本轮loop新产生的任务组成的队列 */
-  std::deque<Fiber*> userYieldFiberQ_; /*> 用户手动yield的协程的队列 */
-  SpinLock
-      lockForSyncSignalFiberQ_; /*>
-                                   用于线程间互斥地访问被同步类唤醒的协程组成的队列
-                                 */
-  std::deque<Fiber*> syncSignalFiberQ_; /*> 被同步类唤醒的协程组成的队列 */
-  std::deque<Fiber*> fiberPool_; /*> 协程池 */
+/**
+ * @brief 在 io_uring 上等待完成的一个请求，完成后由调度循环唤醒发起请求的协程.
+ */
+struct StUringRequest : public StTimeoutItem {
+  using OnCompletePfn_t = void (*)(StUringRequest*);
 
-  static const int EPOLL_SIZE_ = 1024 * 10; /*> epoll_wait最大支持的事件数 */
+  int res;        /*> 完成事件的返回值，失败时为 -errno */
+  unsigned flags; /*> 完成事件的标志位 */
+  OnCompletePfn_t pfnComplete; /*> 多发请求的完成处理函数，为空时唤醒 pArg 所指的协程 */
 
- private:
-  FiberEnvironment()
-      : pCallStack_(),
-        callStackSize_(),
-        pActiveList_(),
-        pTimeoutList_(),
-        currentFiberCount_(0) {
-    Fiber* self = new Fiber(true);
-    // 入栈主协程
-    pCallStack_[callStackSize_++] = self;
-    EpollFd_ = epoll_create(1);
-    pTimeWheel_ = new StTimeout((2 << 15)); /* one wheel is 60 seconds */
-    epollEvents_ = new epoll_event[EPOLL_SIZE_];
-    eventsLength_ = EPOLL_SIZE_;
-  }
+  StUringRequest() : res(0), flags(0), pfnComplete() {}
+};
 
-  ~FiberEnvironment() {
-    if (threadId_ == -1) {
-      threadRoutine(0, &MultiThreadFiberScheduler::GetInstance());
-    }
-    // close(EpollFd_); could recycle by system.
-    Fiber* mainCo = pCallStack_[0];
-    delete mainCo;
-    delete pTimeWheel_;
-    delete[] epollEvents_;
-    for (auto x : fiberPool_) {
-      delete x;
+/**
+ * @brief 线程级的 io_uring，第一次使用时创建.
+ * 提交队列只由所属线程填写，请求放入提交队列后协程随即挂起，调度循环在每轮
+ * epoll_wait 之前把积攒的请求一次性交给内核. ring fd 注册在本线程的 epoll 中，
+ * 完成队列非空时 epoll 返回，由 OnUringPrepare 收割完成事件并唤醒对应的协程.
+ * 没有使用 liburing，直接通过系统调用和 mmap 操作共享的环形队列.
+ */
+struct StUring : public StTimeoutItem {
+  int ringFd;                /*> io_uring_setup 返回的描述符 */
+  unsigned features;         /*> 内核支持的特性 IORING_FEAT_* */
+  unsigned sqEntries;        /*> 提交队列的容量 */
+  unsigned* sqHead;          /*> 提交队列头，内核消费 */
+  unsigned* sqTail;          /*> 提交队列尾，本线程生产 */
+  unsigned* sqFlags;         /*> 内核设置的状态 IORING_SQ_*，例如完成队列溢出 */
+  unsigned sqMask;           /*> 提交队列下标掩码 */
+  unsigned* sqArray;         /*> 提交队列中保存 sqe 下标的数组 */
+  io_uring_sqe* sqes;        /*> sqe 数组 */
+  unsigned* cqHead;          /*> 完成队列头，本线程消费 */
+  unsigned* cqTail;          /*> 完成队列尾，内核生产 */
+  unsigned cqMask;           /*> 完成队列下标掩码 */
+  io_uring_cqe* cqes;        /*> cqe 数组 */
+  void* sqRing;              /*> 提交队列的映射 */
+  size_t sqRingSize;         /*> 提交队列映射的大小 */
+  void* cqRing;              /*> 完成队列的映射，内核支持 SINGLE_MMAP 时与 sqRing 相同 */
+  size_t cqRingSize;         /*> 完成队列映射的大小 */
+  size_t sqesSize;           /*> sqe 数组映射的大小 */
+  unsigned toSubmit;         /*> 已经放入提交队列、还没有交给内核的请求数 */
+  bool ops[IORING_OP_LAST];  /*> 内核支持的操作 */
+  io_uring_buf_ring* bufRing; /*> 多发 recv 使用的 provided buffer ring */
+  char* bufBase;             /*> provided buffer 的内存，BUF_COUNT_ 个 BUF_SIZE_ 字节的缓冲区 */
+  unsigned short bufTail;    /*> bufRing 的尾，本线程生产 */
+  bool bufProbed;            /*> 是否已经尝试过注册 bufRing */
+  bool bufLegacy;            /*> bufRing 不可用，缓冲区通过 IORING_OP_PROVIDE_BUFFERS 提供 */
+
+  static const unsigned ENTRIES_ = 256;        /*> 提交队列的容量 */
+  static const unsigned BUF_COUNT_ = 256;      /*> provided buffer 的数量，2 的幂 */
+  static const unsigned BUF_SIZE_ = 16 * 1024; /*> 每个 provided buffer 的大小 */
+  static const unsigned short BUF_GROUP_ = 0;  /*> provided buffer 的组号 */
+
+  StUring()
+      : ringFd(-1),
+        sqes((io_uring_sqe*)MAP_FAILED),
+        sqRing(MAP_FAILED),
+        cqRing(MAP_FAILED),
+        toSubmit(0),
+        ops(),
+        bufRing((io_uring_buf_ring*)MAP_FAILED),
+        bufBase((char*)MAP_FAILED),
+        bufTail(0),
+        bufProbed(false),
+        bufLegacy(false) {}
+
+  ~StUring() {
+    if (bufBase != MAP_FAILED) munmap(bufBase, BUF_COUNT_ * BUF_SIZE_);
+    if (bufRing != MAP_FAILED) {
+      munmap(bufRing, BUF_COUNT_ * sizeof(io_uring_buf));
     }
-    pTimeWheel_ = nullptr;
-    epollEvents_ = nullptr;
-    eventsLength_ = 0;
-    callStackSize_ = 0;
-    currentFiberCount_ = 0;
+    if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (ringFd >= 0) close(ringFd);
   }
 
- public:
-  static FiberEnvironment* GetInstance() {
-    thread_local FiberEnvironment env;
-    return &env;
-  }
+  /**
+   * @brief 创建 io_uring 并注册到 epoll 中.
+   *
+   * @param epfd 所属线程的 epoll，小于 0 时不注册(只用于探测)
+   * @return StUring* 内核不支持(或被 seccomp 禁用)时返回空
+   */
+  static StUring* Create(int epfd);
 
-  int EpollWait(int timeout) {
-    return epoll_wait(EpollFd_, epollEvents_, eventsLength_, timeout);
-  }
+  /**
+   * @brief provided buffer ring 是否真的可用，整个进程只探测一次.
+   * 有的内核注册 bufRing 成功，但从中选择缓冲区的请求总是返回 ENOBUFS.
+   */
+  static bool BufRingWorks();
 
-  Fiber* GetFiberFromPool() {
-    if (fiberPool_.empty()) {
-      fiberPool_.resize(64);
-      for (auto&& x : fiberPool_) {
-        x = new Fiber();
-        x->cCreateByEnv = 1;
-      }
-    }
+  /**
+   * @brief 保证提交队列中至少有 @p n 个空闲的 sqe，不够时先把已有的请求交给内核.
+   * 链接在一起的请求必须在同一次提交中，取 sqe 之前先预留.
+   *
+   * @return bool 内核来不及消费时返回 false
+   */
+  bool Reserve(unsigned n);
 
-    Fiber* x = fiberPool_.front();
-    fiberPool_.pop_front();
-    return x;
-  }
+  /**
+   * @brief 取一个空闲的 sqe，提交队列满时先把已有的请求交给内核.
+   *
+   * @return io_uring_sqe* 已清零的 sqe，内核来不及消费时返回空
+   */
+  io_uring_sqe* GetSqe();
 
-  void RecycleFiberToPool(Fiber* fiber) { fiberPool_.push_back(fiber); }
-};
+  /**
+   * @brief 映射并注册 provided buffer ring，ring 中还没有缓冲区.
+   */
+  bool RegisterBufRing();
 
-int GoRoutine(Fiber* co, void*) {
-  co->env_->currentFiberCount_ += 1;
-  if (co->pfn_ != nullptr) {
-    co->pfn_();
-  }
-  co->cEnd_ = 1;
-  if (co->cCreateByEnv) {
-    co->env_->RecycleFiberToPool(co);
+  /**
+   * @brief 准备多发 recv 使用的 provided buffer，只尝试一次.
+   * 优先使用 bufRing，不可用时退回到 IORING_OP_PROVIDE_BUFFERS.
+   *
+   * @return bool 内核不支持时返回 false
+   */
+  bool SetupBuffers();
+
+  /**
+   * @brief 把编号为 @p bid 的 provided buffer 还给内核.
+   */
+  void RecycleBuffer(unsigned bid);
+
+  /**
+   * @brief 取消 user_data 为 @p req 的请求，取消本身的完成事件被忽略.
+   */
+  void Cancel(StUringRequest* req);
+
+  /**
+   * @brief 把积攒的请求交给内核，不等待完成.
+   */
+  void Submit();
+
+  /**
+   * @brief 收割完成队列，把完成的请求放入到达事件队列.
+   * 完成队列溢出时，溢出的完成事件要通过 io_uring_enter 才能回到队列中，
+   * 否则 ring fd 一直可读，调度循环空转.
+   */
+  void Reap(StTimeoutItemLink* active);
+
+  /**
+   * @brief 不关心成功结果的请求(归还缓冲区、取消)加上 IOSQE_CQE_SKIP_SUCCESS，
+   * 减少完成事件.
+   */
+  void SkipSuccess(io_uring_sqe* sqe) const {
+    if (features & IORING_FEAT_CQE_SKIP) sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
   }
-  co->env_->currentFiberCount_ -= 1;
-  co->Yield();
-  return 0;
+};
+
+/**
+ * @brief io_uring 的 epoll 预处理函数，收割完成事件.
+ *
+ * @param ap io_uring 结点
+ * @param e  epoll_event
+ * @param active 到达事件队列
+ */
+static void OnUringPrepare(StTimeoutItem* ap, epoll_event& e,
+                           StTimeoutItemLink* active) {
+  ((StUring*)ap)->Reap(active);
 }
 
-Fiber::Fiber(bool)
-    : env_(nullptr),
-      pfn_(nullptr),
-      cStart_(0),
-      cEnd_(0),
-      cIsMain_(1),
-      cEnableSysHook_(0),
-      cCreateByEnv(0) {}
+StUring* StUring::Create(int epfd) {
+  io_uring_params p = {};
+  int fd = syscall(__NR_io_uring_setup, ENTRIES_, &p);
+  if (fd < 0) return nullptr;
+
+  StUring* ring = new StUring();
+  ring->ringFd = fd;
+  ring->features = p.features;
+  ring->sqEntries = p.sq_entries;
+  // 没有 NODROP 的内核在完成队列溢出时会丢弃完成事件，协程将永远不会被唤醒
+  if (!(p.features & IORING_FEAT_NODROP)) {
+    delete ring;
+    return nullptr;
+  }
 
-Fiber::Fiber(const std::function<void()>& pfn)
-    : env_(FiberEnvironment::GetInstance()),
-      pfn_(pfn),
-      cStart_(0),
-      cEnd_(0),
-      cIsMain_(0),
-      cEnableSysHook_(1),
-      cCreateByEnv() {}
+  ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    ring->sqRingSize = ring->cqRingSize =
+        std::max(ring->sqRingSize, ring->cqRingSize);
+  }
+  ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    delete ring;
+    return nullptr;
+  }
+  ring->cqRing = single ? ring->sqRing
+                        : mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+  ring->sqes = (io_uring_sqe*)mmap(nullptr, ring->sqesSize,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, fd,
+                                   IORING_OFF_SQES);
+  if (ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    delete ring;
+    return nullptr;
+  }
 
-Fiber::~Fiber() {
-  pfn_ = nullptr;
-  cStart_ = cEnd_ = 0;
+  char* sq = (char*)ring->sqRing;
+  char* cq = (char*)ring->cqRing;
+  ring->sqHead = (unsigned*)(sq + p.sq_off.head);
+  ring->sqTail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sqFlags = (unsigned*)(sq + p.sq_off.flags);
+  ring->sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)(sq + p.sq_off.array);
+  ring->cqHead = (unsigned*)(cq + p.cq_off.head);
+  ring->cqTail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  // 探测内核支持哪些操作，不支持探测的老内核只用最早的几个操作
+  size_t probeSize = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+  io_uring_probe* probe = (io_uring_probe*)calloc(1, probeSize);
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              IORING_OP_LAST) == 0) {
+    for (int op = 0; op < probe->ops_len && op < IORING_OP_LAST; op++) {
+      ring->ops[op] = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+    }
+  } else {
+    ring->ops[IORING_OP_NOP] = ring->ops[IORING_OP_READV] =
+        ring->ops[IORING_OP_WRITEV] = ring->ops[IORING_OP_FSYNC] = true;
+  }
+  free(probe);
+
+  ring->pfnPrepare = OnUringPrepare;
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = ring;
+  if (epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    delete ring;
+    return nullptr;
+  }
+  return ring;
 }
 
-void Fiber::Yield() {
-  Fiber* last = env_->pCallStack_[env_->callStackSize_ - 2];
-  env_->callStackSize_--;
-  SwapContext(last);
+bool StUring::BufRingWorks() {
+  static const bool works = [] {
+    // 在临时的 io_uring 上从 bufRing 中选一个缓冲区读管道
+    StUring* ring = Create(-1);
+    int fds[2] = {-1, -1};
+    bool ok = false;
+    if (ring != nullptr && ring->ops[IORING_OP_READ] && ring->RegisterBufRing() &&
+        pipe(fds) == 0 && write(fds[1], "x", 1) == 1) {
+      char buf[8];
+      io_uring_buf* entry = &ring->bufRing->bufs[0];
+      entry->addr = (uint64_t)buf;
+      entry->len = sizeof(buf);
+      entry->bid = 0;
+      __atomic_store_n(&ring->bufRing->tail, 1, __ATOMIC_RELEASE);
+      io_uring_sqe* sqe = ring->GetSqe();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fds[0];
+      sqe->off = (uint64_t)-1;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUF_GROUP_;
+      if (syscall(__NR_io_uring_enter, ring->ringFd, 1, 1,
+                  IORING_ENTER_GETEVENTS, nullptr, 0) == 1) {
+        ok = ring->cqes[*ring->cqHead & ring->cqMask].res == 1;
+      }
+    }
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    delete ring;
+    return ok;
+  }();
+  return works;
 }
 
-void Fiber::Resume() {
-  Fiber* curr = env_->pCallStack_[env_->callStackSize_ - 1];
-  if (!this->cStart_) {
-    this->cStart_ = 1;
-    this->ctx_.Make((void* (*)(void*, void*))GoRoutine, this, nullptr);
+bool StUring::Reserve(unsigned n) {
+  if (*sqTail + n - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqEntries) {
+    Submit();
   }
-  env_->pCallStack_[env_->callStackSize_++] = this;
-  curr->SwapContext(this);
+  return *sqTail + n - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) <= sqEntries;
 }
 
-void Fiber::Reset(const std::function<void()>& pfn) {
-  if (cIsMain_) return;
-  if (cStart_ && !cEnd_) return;
-  cStart_ = 0;
-  cEnd_ = 0;
-  this->pfn_ = pfn;
+io_uring_sqe* StUring::GetSqe() {
+  if (!Reserve(1)) return nullptr;
+  unsigned tail = *sqTail;
+  unsigned index = tail & sqMask;
+  io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  toSubmit++;
+  return sqe;
 }
 
-void Fiber::Reset(std::function<void()>&& pfn) {
-  if (cIsMain_) return;
-  if (cStart_ && !cEnd_) return;
-  cStart_ = 0;
-  cEnd_ = 0;
-  this->pfn_ = std::move(pfn);
+void StUring::Submit() {
+  while (toSubmit > 0) {
+    int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, 0, nullptr, 0);
+    if (ret > 0) {
+      toSubmit -= std::min<unsigned>(ret, toSubmit);
+    } else if (ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      // EAGAIN/EBUSY: 内核暂时无法接收，留到下一轮再提交
+      break;
+    }
+  }
 }
 
-void Fiber::SwapContext(Fiber* pendingCo) {
-  coctx_swap(&(this->ctx_), &(pendingCo->ctx_));
+bool StUring::RegisterBufRing() {
+  bufRing = (io_uring_buf_ring*)mmap(nullptr, BUF_COUNT_ * sizeof(io_uring_buf),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufRing == MAP_FAILED) return false;
+  io_uring_buf_reg reg = {};
+  reg.ring_addr = (uint64_t)bufRing;
+  reg.ring_entries = BUF_COUNT_;
+  reg.bgid = BUF_GROUP_;
+  return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg,
+                 1) == 0;
 }
 
-void condition_variable::wait(std::unique_lock<fiber::mutex>& lock) {
-  this->mtx.Lock();
-  waiters.push_back(this_fiber::co_self());
-  this->mtx.Unlock();
-  lock.unlock();
-  this_fiber::co_self()->Yield();
-  lock.lock();
+bool StUring::SetupBuffers() {
+  if (bufProbed) return bufBase != MAP_FAILED;
+  bufProbed = true;
+  bool ring = BufRingWorks() && RegisterBufRing();
+  if (!ring && !ops[IORING_OP_PROVIDE_BUFFERS]) return false;
+  // 缓冲区的物理页在第一次收到数据时才分配
+  void* base = mmap(nullptr, BUF_COUNT_ * BUF_SIZE_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) return false;
+  bufBase = (char*)base;
+  if (ring) {
+    for (unsigned bid = 0; bid < BUF_COUNT_; bid++) {
+      RecycleBuffer(bid);
+    }
+    return true;
+  }
+  // 一次提供全部缓冲区，立即提交，保证在随后的 recv 之前生效
+  io_uring_sqe* sqe = GetSqe();
+  if (sqe == nullptr) return false;
+  bufLegacy = true;
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = BUF_COUNT_;
+  sqe->addr = (uint64_t)bufBase;
+  sqe->len = BUF_SIZE_;
+  sqe->off = 0;
+  sqe->buf_group = BUF_GROUP_;
+  sqe->user_data = 0;
+  Submit();
+  return true;
 }
 
-void condition_variable::notify_one() {
-  Fiber* fb = nullptr;
-  mtx.Lock();
-  if (!waiters.empty()) {
-    fb = waiters.front();
-    waiters.pop_front();
-    // printf("signal..., waiters size = %lu\n", waiters.size());
-  }
-  mtx.Unlock();
-  if (fb != nullptr) {
-    fb->env_->lockForSyncSignalFiberQ_.Lock();
-    fb->env_->syncSignalFiberQ_.push_back(fb);
-    fb->env_->lockForSyncSignalFiberQ_.Unlock();
+void StUring::RecycleBuffer(unsigned bid) {
+  if (bufLegacy) {
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t)(bufBase + (size_t)bid * BUF_SIZE_);
+    sqe->len = BUF_SIZE_;
+    sqe->off = bid;
+    sqe->buf_group = BUF_GROUP_;
+    sqe->user_data = 0;
+    SkipSuccess(sqe);
+    return;
   }
+  io_uring_buf* buf = &bufRing->bufs[bufTail & (BUF_COUNT_ - 1)];
+  buf->addr = (uint64_t)(bufBase + (size_t)bid * BUF_SIZE_);
+  buf->len = BUF_SIZE_;
+  buf->bid = bid;
+  bufTail++;
+  __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
 }
 
-void condition_variable::notify_all() {
-  std::deque<Fiber*> dq;
-  mtx.Lock();
-  if (!waiters.empty()) {
-    dq.swap(waiters);
-    // printf("signal..., waiters size = %lu\n", waiters.size());
-  }
-  mtx.Unlock();
-  for (auto fiber : dq) {
-    fiber->env_->lockForSyncSignalFiberQ_.Lock();
-    fiber->env_->syncSignalFiberQ_.push_back(fiber);
-    fiber->env_->lockForSyncSignalFiberQ_.Unlock();
-  }
+void StUring::Cancel(StUringRequest* req) {
+  io_uring_sqe* sqe = GetSqe();
+  if (sqe == nullptr) return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uint64_t)req;
+  sqe->user_data = 0;
+  SkipSuccess(sqe);
 }
 
-void mutex::lock() {
-  mtx.Lock();
-  if (locked == false) {
-    locked = true;
-    mtx.Unlock();
-    return;
+void StUring::Reap(StTimeoutItemLink* active) {
+  for (;;) {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      io_uring_cqe* cqe = &cqes[head & cqMask];
+      StUringRequest* req = (StUringRequest*)cqe->user_data;
+      if (req == nullptr) continue;
+      req->res = cqe->res;
+      req->flags = cqe->flags;
+      if (req->pfnComplete) {
+        req->pfnComplete(req);
+      } else {
+        active->AddTail(req);
+      }
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    if (!(__atomic_load_n(sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+      break;
+    }
+    syscall(__NR_io_uring_enter, ringFd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+  }
+}
+
+/**
+ * @brief io_uring 后端下一个流式套接字的接收状态.
+ * 第一次 accept/recv 时在当前线程的 io_uring 上提交一个多发(multishot)请求，之后内核
+ * 每接受一个连接或收到一段数据就产生一个完成事件，不需要再次提交. 收割时数据从
+ * provided buffer 拷贝到 data 中并立即归还缓冲区，因此任何线程上的协程都可以读取.
+ * 积压的数据或连接超过上限时取消多发请求，读走之后再重新提交.
+ * 与 StFdEvent 一样随描述符号复用，不释放；描述符关闭时 iGen 加一，
+ * 之前提交的请求剩下的完成事件都会被丢弃.
+ */
+struct StUringSocket : public StUringRequest {
+  int fd;                   /*> 描述符 */
+  SpinLock lock;            /*> 保护以下成员 */
+  bool bListen;             /*> 是否是监听套接字，多发的是 accept */
+  bool bArmed;              /*> 多发请求是否还在内核中 */
+  bool bArmAccept;          /*> 在内核中的多发请求是否是 accept */
+  bool bStopping;           /*> 是否已经请求取消多发请求 */
+  bool bEof;                /*> 对端是否关闭了连接 */
+  int iError;               /*> 多发请求因错误结束时的 errno，读取一次后清零 */
+  uint32_t iGen;            /*> 描述符关闭一次加一 */
+  uint32_t iArmGen;         /*> 多发请求提交时的 iGen */
+  StUring* pRing;           /*> 多发请求所在的 io_uring */
+  std::vector<char> data;   /*> 收到但还没有被读走的数据，从 iHead 开始 */
+  size_t iHead;             /*> data 中第一个没有被读走的字节 */
+  std::deque<int> accepted; /*> 已经接受但还没有被取走的连接 */
+  WaitQueue readers;        /*> 等待数据或连接的协程 */
+
+  static const size_t MAX_BUFFERED_ = 256 * 1024; /*> 积压的数据上限 */
+  static const size_t MAX_ACCEPTED_ = 1024;       /*> 积压的连接上限 */
+
+  explicit StUringSocket(int fd)
+      : fd(fd),
+        bListen(false),
+        bArmed(false),
+        bArmAccept(false),
+        bStopping(false),
+        bEof(false),
+        iError(0),
+        iGen(0),
+        iArmGen(0),
+        pRing(nullptr),
+        iHead(0) {
+    pfnComplete = OnComplete;
+  }
+
+  /**
+   * @brief 读取数据，语义同 recv. 支持 MSG_PEEK、MSG_DONTWAIT、MSG_WAITALL 和
+   * MSG_TRUNC(丢弃数据，此时 iov 只用来给出长度)，其他标志被忽略.
+   *
+   * @param iov 接收缓冲区
+   * @param count iov 的个数
+   * @param flags recv 的标志位
+   * @param deadline 截止时间
+   * @return ssize_t 读到的字节数，0 表示对端关闭；出错返回 -1，errno 为 ENOSYS
+   *         表示本线程不能使用 io_uring，调用者应当改用 epoll
+   */
+  ssize_t Recv(const iovec* iov, int count, int flags,
+               const MonotonicClock::time_point& deadline);
+
+  /**
+   * @brief 取走一个已经接受的连接.
+   *
+   * @param nonblock 没有连接时是否立即返回 EAGAIN
+   * @param deadline 截止时间
+   * @return int 新连接的描述符，出错时同 Recv
+   */
+  int Accept(bool nonblock, const MonotonicClock::time_point& deadline);
+
+  /**
+   * @brief 等待可读(有数据、连接、对端关闭或出错)，用于 poll.
+   * 截止时间已过时只检查已经收到的结果，不会提交多发请求.
+   *
+   * @return int 1 表示可读，0 表示超时，-1 表示出错(errno 为 ENOSYS 时同 Recv)
+   */
+  int WaitReadable(const MonotonicClock::time_point& deadline);
+
+  /**
+   * @brief 是否已经接管了这个描述符的接收，接管之后读取都必须经过这里.
+   */
+  bool Active();
+
+  /**
+   * @brief 描述符即将关闭：停止多发请求，丢弃积压的数据和连接，唤醒等待者.
+   *
+   * @param fdOpen 描述符是否还没有关闭. 描述符号已经被新的描述符复用时，
+   *        不能再通过 shutdown 停止其他线程上的多发请求，只能等它自己结束
+   */
+  void Close(bool fdOpen);
+
+ private:
+  /**
+   * @brief 是否有可以立即返回给读取者的结果，调用时持有 lock.
+   */
+  bool Ready() const {
+    return data.size() > iHead || !accepted.empty() || bEof || iError != 0;
+  }
+
+  /**
+   * @brief 确保多发请求在内核中，调用时持有 lock.
+   *
+   * @return bool 本线程不能使用 io_uring 时返回 false
+   */
+  bool Arm();
+
+  /**
+   * @brief 挂起当前协程直到有结果、描述符关闭、超时或者被取消，调用时持有 lock，返回时已释放.
+   *
+   * @return int 0 表示应该重试，否则为 errno
+   */
+  int Wait(const MonotonicClock::time_point& deadline);
+
+  static void OnComplete(StUringRequest* req);
+
+  static bool RemoveWaiter(void* self, Fiber* fiber);
+};
+
+/**
+ * @brief 有界的 Chase-Lev 工作窃取队列.
+ * 所属线程在 bottom 端 Push/Pop，其他线程在 top 端 Steal，均不需要加锁.
+ * 参见 Lê et al., Correct and Efficient Work-Stealing for Weak Memory Models.
+ *
+ * @tparam T 元素类型，必须是指针
+ */
+template <typename T>
+class WorkStealingQueue {
+  static_assert(std::is_pointer_v<T>);
+
+ public:
+  WorkStealingQueue(size_t capacity = 4096)
+      : top_(0), bottom_(0), mask_(capacity - 1) {
+    assert((capacity & mask_) == 0);
+    buffer_ = new std::atomic<T>[capacity];
+  }
+
+ ~WorkStealingQueue() { delete[] buffer_; }
+
+  WorkStealingQueue(const WorkStealingQueue&) = delete;
+  WorkStealingQueue& operator=(const WorkStealingQueue&) = delete;
+
+  /**
+   * @brief 在 bottom 端追加一个元素，只能由所属线程调用.
+   *
+   * @param x 待追加的元素
+   * @return bool 队列已满时返回false
+   */
+  bool Push(T x) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    if (b - t > (int64_t)mask_) return false;
+    buffer_[b & mask_].store(x, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * @brief 从 bottom 端取出一个元素，只能由所属线程调用.
+   *
+   * @return T 队列为空时返回nullptr
+   */
+  T Pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    T x = nullptr;
+    if (t <= b) {
+      x = buffer_[b & mask_].load(std::memory_order_relaxed);
+      if (t == b) {
+        // 只剩最后一个元素，和窃取者竞争
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+          x = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  /**
+   * @brief 从 top 端窃取一个元素，可以由任意线程调用.
+   *
+   * @return T 队列为空或竞争失败时返回nullptr
+   */
+  T Steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t < b) {
+      T x = buffer_[t & mask_].load(std::memory_order_relaxed);
+      if (top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        return x;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief 队列中元素数量的近似值.
+   */
+  size_t Size() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+  }
+
+  bool Empty() const { return Size() == 0; }
+
+ private:
+  alignas(64) std::atomic<int64_t> top_;    /*> 窃取端 */
+  alignas(64) std::atomic<int64_t> bottom_; /*> 所属线程端 */
+  alignas(64) std::atomic<T>* buffer_;      /*> 环形缓冲区 */
+  size_t mask_;                             /*> 容量 - 1，容量为2的幂 */
+};
+
+/*> 当前线程作为调度线程时的本地任务队列 */
+static thread_local WorkStealingQueue<FiberTask*>* localRunQueue = nullptr;
+
+/*> 当前线程作为调度线程时只能在本线程运行的任务，只有本线程访问 */
+static thread_local FiberTaskList* localPinnedTasks = nullptr;
+
+/*> 当前线程作为调度线程时的编号，否则为 -1 */
+static thread_local int localThreadIndex = -1;
+
+/*> 当前线程的协程环境，创建前和销毁后为空 */
+static thread_local FiberEnvironment* currentEnv = nullptr;
+
+/**
+ * @brief 以 Fiber::pNextReady_ 串起来的先进先出的就绪协程链表，只在一个线程中使用.
+ */
+struct ReadyList {
+  Fiber* head = nullptr; /*> 队首 */
+  Fiber* tail = nullptr; /*> 队尾 */
+
+  bool Empty() const { return head == nullptr; }
+
+  void PushBack(Fiber* fiber) {
+    fiber->pNextReady_ = nullptr;
+    if (tail != nullptr) {
+      tail->pNextReady_ = fiber;
+    } else {
+      head = fiber;
+    }
+    tail = fiber;
+  }
+
+  // 恢复运行之前先取下，协程运行后可能马上又被放入某个就绪队列
+  Fiber* PopFront() {
+    Fiber* fiber = head;
+    head = fiber->pNextReady_;
+    if (head == nullptr) tail = nullptr;
+    fiber->pNextReady_ = nullptr;
+    return fiber;
+  }
+};
+
+class FiberEnvironment {
+  friend class Fiber;
+  friend class FiberScheduler;
+
+ public:
+  Fiber* pCallStack_[128];         /*> 协程调用栈 */
+  int callStackSize_;              /*> 当前调用栈长度 */
+  int EpollFd_;                    /*> epfd */
+  int threadId_;                   /*> 线程ID, 用于识别调度器 */
+  StTimeout* pTimeWheel_;          /*> time wheel */
+  StTimeoutItemLink pActiveList_;  /*> 到达事件缓存 */
+  StTimeoutItemLink pTimeoutList_; /*> 超时事件缓存 */
+  epoll_event* epollEvents_;       /*> epoll_event数组 */
+  size_t eventsLength_;            /*> epoll_event数组的大小 */
+  std::atomic<size_t> currentFiberCount_; /*> 本线程目前正在运行的协程数量(不包含主协程)，迁移时由原线程修改 */
+  std::deque<Fiber*> userYieldFiberQ_; /*> 用户手动yield的协程的队列 */
+  std::atomic<Fiber*> readyHead_;  /*> 被同步类唤醒的协程组成的无锁栈，任意线程压入，主协程一次取空 */
+  int eventFd_;                    /*> 注册在 epoll 中的 eventfd，用于唤醒阻塞在 epoll_wait 上的线程 */
+  std::atomic<bool> sleeping_;     /*> 线程是否(即将)阻塞在 epoll_wait 上 */
+  std::atomic<bool> idle_;         /*> 线程是否阻塞在 epoll_wait 上等待新任务 */
+  std::atomic<FiberEnvironment*> stealRequest_; /*> 请求本线程迁走一部分就绪协程的空闲线程 */
+  std::atomic<size_t> readyHint_;  /*> 上一轮被唤醒的协程中可以迁移的数量，供空闲线程选择请求对象 */
+  Fiber* pNextFiber_;              /*> 接力位：本线程的协程唤醒的同线程协程，唤醒者切出时直接切换到它 */
+  int handoffCount_;               /*> 不经过主协程连续接力的次数 */
+  std::vector<Fiber*> fiberPool_; /*> 协程池，后进先出，优先复用栈还在缓存中的协程 */
+  std::vector<Fiber*> sharedFiberPool_; /*> 共享栈协程池 */
+  size_t fiberPoolPurged_;         /*> fiberPool_ 底部已经归还了栈物理页的协程数 */
+  StUring* pUring_;                /*> 本线程的 io_uring，第一次使用时创建 */
+  bool uringProbed_;               /*> 是否已经尝试过创建 io_uring */
+
+  static const int EPOLL_SIZE_ = 1024 * 10; /*> epoll_wait最大支持的事件数 */
+  static const size_t FIBER_POOL_WATERMARK_ = 256; /*> 协程池默认保留的最大空闲协程数 */
+  static const size_t FIBER_POOL_HOT_ = 16; /*> 协程池顶部保留栈物理页的协程数，更深处的协程会归还栈的物理页 */
+  static const uint64_t MAX_EPOLL_TIMEOUT_ = 1000'000; /*> epoll_wait 的最长阻塞时间(us) */
+  static const size_t MIGRATE_MIN_READY_ = 16; /*> 一轮中可以迁移的就绪协程达到这个数量时才迁移 */
+  static const int MAX_HANDOFF_ = 64; /*> 连续接力达到这个次数后回到主协程一次，让定时器、IO 事件和其他就绪协程得以处理 */
+
+ private:
+  FiberEnvironment()
+      : pCallStack_(),
+        callStackSize_(),
+        pActiveList_(),
+        pTimeoutList_(),
+        currentFiberCount_(0),
+        readyHead_(nullptr),
+        sleeping_(false),
+        idle_(false),
+        stealRequest_(nullptr),
+        readyHint_(0),
+        pNextFiber_(nullptr),
+        handoffCount_(0),
+        fiberPoolPurged_(0),
+        pUring_(nullptr),
+        uringProbed_(false) {
+    Fiber* self = new Fiber(true);
+    // 入栈主协程
+    pCallStack_[callStackSize_++] = self;
+    currentEnv = this;
+    EpollFd_ = epoll_create(1);
+    // eventfd 的 data.ptr 为空，以便和超时事件结点区分开
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(EpollFd_, EPOLL_CTL_ADD, eventFd_, &ev);
+    pTimeWheel_ = new StTimeout();
+    epollEvents_ = new epoll_event[EPOLL_SIZE_];
+    eventsLength_ = EPOLL_SIZE_;
+  }
+
+  ~FiberEnvironment() {
+    if (threadId_ == -1) {
+      threadRoutine(0, &MultiThreadFiberScheduler::GetInstance());
+    }
+    currentEnv = nullptr;
+    Fiber* mainCo = pCallStack_[0];
+    delete mainCo;
+    delete pTimeWheel_;
+    delete[] epollEvents_;
+    for (auto x : fiberPool_) {
+      delete x;
+    }
+    for (auto x : sharedFiberPool_) {
+      delete x;
+    }
+    delete pUring_;
+    pUring_ = nullptr;
+    // 阻塞任务池等线程会反复创建和退出，描述符不能留给进程退出时回收
+    syscall(SYS_close, eventFd_);
+    syscall(SYS_close, EpollFd_);
+    eventFd_ = -1;
+    EpollFd_ = -1;
+    pTimeWheel_ = nullptr;
+    epollEvents_ = nullptr;
+    eventsLength_ = 0;
+    callStackSize_ = 0;
+    currentFiberCount_ = 0;
+  }
+
+ public:
+  static FiberEnvironment* GetInstance() {
+    thread_local FiberEnvironment env;
+    return &env;
+  }
+
+  /**
+   * @brief 获取本线程的 io_uring，第一次调用时创建.
+   *
+   * @return StUring* 内核不支持 io_uring 时返回空
+   */
+  StUring* GetUring() {
+    if (!uringProbed_) {
+      uringProbed_ = true;
+      pUring_ = StUring::Create(EpollFd_);
+    }
+    return pUring_;
+  }
+
+  /**
+   * @brief 等待 epoll 事件.
+   *
+   * @param timeout 最长等待时间(us)，内核支持 epoll_pwait2 时精确到微秒，否则向上取整到毫秒
+   * @return int 到达的事件数量
+   */
+  int EpollWait(uint64_t timeout) {
+#ifdef SYS_epoll_pwait2
+    static std::atomic<bool> noPwait2{false};
+    if (timeout % 1000 != 0 && !noPwait2.load(std::memory_order_relaxed)) {
+      struct timespec ts = {(time_t)(timeout / 1000'000),
+                            (long)(timeout % 1000'000) * 1000};
+      int ret = syscall(SYS_epoll_pwait2, EpollFd_, epollEvents_,
+                        eventsLength_, &ts, nullptr, 0);
+      if (ret >= 0 || errno != ENOSYS) return ret;
+      noPwait2.store(true, std::memory_order_relaxed);
+    }
+#endif
+    return epoll_wait(EpollFd_, epollEvents_, eventsLength_,
+                      (timeout + 999) / 1000);
+  }
+
+  /**
+   * @brief 如果本线程阻塞在 epoll_wait 上，通过 eventfd 唤醒它.
+   *
+   * @return bool 是否真的发出了唤醒
+   */
+  bool Wakeup() {
+    if (!sleeping_.exchange(false)) return false;
+    // 直接走系统调用，绕过 write 的 hook
+    uint64_t one = 1;
+    syscall(SYS_write, eventFd_, &one, sizeof(one));
+    return true;
+  }
+
+  /**
+   * @brief 读空 eventfd 的计数.
+   */
+  void DrainWakeup() {
+    uint64_t count;
+    syscall(SYS_read, eventFd_, &count, sizeof(count));
+  }
+
+  /**
+   * @brief 把被同步类唤醒的协程放入本线程的就绪队列，必要时唤醒本线程.
+   * 唤醒者是本线程上的协程时，被唤醒的协程放入接力位，唤醒者切出时直接切换过去，
+   * 不经过主协程和 epoll_wait.
+   *
+   * @param fiber 被唤醒的协程
+   */
+  void AddSignaledFiber(Fiber* fiber) {
+    if (currentEnv == this && callStackSize_ > 1 && pNextFiber_ == nullptr) {
+      Fiber* self = pCallStack_[callStackSize_ - 1];
+      if (self != fiber && !self->IsShareStack() && !fiber->IsShareStack()) {
+        pNextFiber_ = fiber;
+        return;
+      }
+    }
+    EnqueueSignaledFiber(fiber);
+  }
+
+  /**
+   * @brief 把协程放入本线程的就绪队列，由主协程在下一轮调度中恢复.
+   *
+   * @param fiber 就绪的协程
+   */
+  void EnqueueSignaledFiber(Fiber* fiber) {
+    PushReadyFiber(fiber);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Wakeup();
+  }
+
+  /**
+   * @brief 把协程压入就绪栈，不唤醒本线程. 任意线程都可以调用，不加锁也不分配内存.
+   *
+   * @param fiber 就绪的协程
+   */
+  void PushReadyFiber(Fiber* fiber) {
+    Fiber* head = readyHead_.load(std::memory_order_relaxed);
+    do {
+      fiber->pNextReady_ = head;
+    } while (!readyHead_.compare_exchange_weak(head, fiber,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+  }
+
+  /**
+   * @brief 是否有被唤醒、等待主协程恢复的协程.
+   */
+  bool HasReadyFibers() const {
+    return readyHead_.load(std::memory_order_acquire) != nullptr;
+  }
+
+  /**
+   * @brief 取空就绪栈，按被唤醒的顺序接到 @p ready 的末尾. 只能在本线程的主协程中调用.
+   *
+   * @param ready 本线程还没有运行的就绪协程
+   */
+  void TakeReadyFibers(ReadyList& ready) {
+    Fiber* fiber = readyHead_.exchange(nullptr, std::memory_order_acquire);
+    // 栈中是后进先出的，翻转成先进先出
+    ReadyList batch;
+    while (fiber != nullptr) {
+      Fiber* next = fiber->pNextReady_;
+      fiber->pNextReady_ = batch.head;
+      batch.head = fiber;
+      if (batch.tail == nullptr) batch.tail = fiber;
+      fiber = next;
+    }
+    if (batch.Empty()) return;
+    if (ready.Empty()) {
+      ready = batch;
+    } else {
+      ready.tail->pNextReady_ = batch.head;
+      ready.tail = batch.tail;
+    }
+  }
+
+  /**
+   * @brief 响应空闲线程的迁移请求：可以迁移的就绪协程足够多时，把其中一半交给它.
+   * 只能在本线程的主协程中调用. 此时本线程的协程都已经切出，被唤醒的协程挂在本线程
+   * 时间轮上的超时结点也只有在这里才能安全地摘除；描述符的常驻注册不需要移动，事件
+   * 到来时会交给等待者当前所在的线程.
+   *
+   * @param ready 本线程还没有运行的就绪协程，迁走的协程从中移除
+   */
+  void AnswerStealRequest(ReadyList& ready) {
+    FiberEnvironment* to = stealRequest_.load();
+    if (to == nullptr) return;
+    size_t migratable = 0;
+    for (Fiber* fiber = ready.head; fiber != nullptr; fiber = fiber->pNextReady_) {
+      migratable += fiber->IsMigratable();
+    }
+    if (migratable >= MIGRATE_MIN_READY_) MigrateReadyFibers(ready, to, migratable / 2);
+    // 迁移完成之后才撤销请求，请求方据此判断协程是否已经到达
+    stealRequest_.store(nullptr);
+    to->Wakeup();
+  }
+
+  /**
+   * @brief 把就绪的协程交给另一个线程，之后它们一直在那个线程上运行.
+   *
+   * @param ready 本线程还没有运行的就绪协程，迁走的协程从中移除
+   * @param to 接收协程的线程
+   * @param quota 最多迁移的数量
+   */
+  void MigrateReadyFibers(ReadyList& ready, FiberEnvironment* to,
+                          size_t quota) {
+    size_t migratable = 0;
+    for (Fiber* fiber = ready.head; fiber != nullptr; fiber = fiber->pNextReady_) {
+      migratable += fiber->IsMigratable();
+    }
+    // 迁走靠近队尾的，先被唤醒的协程仍然在本线程上先运行
+    size_t keep = migratable > quota ? migratable - quota : 0;
+    size_t count = 0;
+    ReadyList rest, moved;
+    while (!ready.Empty()) {
+      Fiber* fiber = ready.PopFront();
+      if (!fiber->IsMigratable() || keep > 0) {
+        keep -= fiber->IsMigratable();
+        rest.PushBack(fiber);
+        continue;
+      }
+      if (fiber->pWaitItem_ != nullptr) fiber->pWaitItem_->RemoveFromLink();
+      fiber->env_ = to;
+      moved.PushBack(fiber);
+      count++;
+    }
+    ready = rest;
+    if (count == 0) return;
+    currentFiberCount_.fetch_sub(count);
+    to->currentFiberCount_.fetch_add(count);
+    while (!moved.Empty()) {
+      to->PushReadyFiber(moved.PopFront());
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    to->Wakeup();
+  }
+
+  Fiber* GetFiberFromPool(bool shareStack = false) {
+    auto&& pool = shareStack ? sharedFiberPool_ : fiberPool_;
+    if (pool.empty()) {
+      pool.resize(64);
+      for (auto&& x : pool) {
+        x = new Fiber(nullptr, shareStack);
+        x->cCreateByEnv = 1;
+      }
+    }
+
+    Fiber* x = pool.back();
+    pool.pop_back();
+    if (!shareStack && fiberPoolPurged_ > fiberPool_.size()) {
+      fiberPoolPurged_ = fiberPool_.size();
+    }
+    return x;
+  }
+
+  void RecycleFiberToPool(Fiber* fiber) {
+    if (fiber->IsShareStack()) {
+      sharedFiberPool_.push_back(fiber);
+    } else {
+      fiberPool_.push_back(fiber);
+    }
+  }
+
+  /**
+   * @brief 释放协程池中超出水位线的空闲协程，它们的栈交还给栈分配器；
+   * 留在池中的协程除了顶部的 FIBER_POOL_HOT_ 个，栈的物理页都归还给操作系统.
+   * 只能在主协程中调用，此时池中的协程都已经让出了各自的栈.
+   *
+   * @param watermark 协程池保留的最大空闲协程数
+   */
+  void TrimFiberPool(size_t watermark) {
+    while (fiberPool_.size() > watermark) {
+      delete fiberPool_.back();
+      fiberPool_.pop_back();
+    }
+    while (sharedFiberPool_.size() > watermark) {
+      delete sharedFiberPool_.back();
+      sharedFiberPool_.pop_back();
+    }
+    // 后进先出，池底部的协程很久才会被复用，不必让它们的栈一直占着物理内存；
+    // 共享栈由分配器持有，不在这里处理
+    fiberPoolPurged_ = std::min(fiberPoolPurged_, fiberPool_.size());
+    for (; fiberPoolPurged_ + FIBER_POOL_HOT_ < fiberPool_.size(); fiberPoolPurged_++) {
+      fiberPool_[fiberPoolPurged_]->ctx_.stack_->Purge();
+    }
+  }
+};
+
+int GoRoutine(Fiber* co, void*) {
+  co->env_->currentFiberCount_ += 1;
+  if (co->pfn_ != nullptr) {
+    co->pfn_();
+    co->pfn_ = nullptr; // 尽早析构捕获的对象，不让它们留在协程池里
+  }
+  // 协程本地存储和取消令牌都不能带给复用这个协程对象的下一个任务
+  co->spec_.Release();
+  if (co->cancel_ != nullptr) {
+    co->cancel_->lock.Lock();
+    co->cancel_->fiber = nullptr;
+    co->cancel_->lock.Unlock();
+    co->cancel_.reset();
+  }
+  co->cEnd_ = 1;
+  if (co->cCreateByEnv) {
+    co->env_->RecycleFiberToPool(co);
+  }
+  co->env_->currentFiberCount_ -= 1;
+  co->Yield();
+  return 0;
+}
+
+Fiber::Fiber(bool)
+    : env_(nullptr),
+      pfn_(nullptr),
+      waitOwner_(),
+      pfnWaitRemove_(),
+      waitResult_(0),
+      selectFired_(-1),
+      pWaitItem_(nullptr),
+      waitNode_{this, nullptr, nullptr, -1, false, false},
+      pNextReady_(nullptr),
+      cStart_(0),
+      cEnd_(0),
+      cIsMain_(1),
+      cEnableSysHook_(0),
+      cCreateByEnv(0),
+      cPinned_(1) {}
+
+Fiber::Fiber(FiberFunc pfn, bool shareStack)
+    : env_(FiberEnvironment::GetInstance()),
+      pfn_(std::move(pfn)),
+      ctx_(shareStack),
+      waitOwner_(),
+      pfnWaitRemove_(),
+      waitResult_(0),
+      selectFired_(-1),
+      pWaitItem_(nullptr),
+      waitNode_{this, nullptr, nullptr, -1, false, false},
+      pNextReady_(nullptr),
+      cStart_(0),
+      cEnd_(0),
+      cIsMain_(0),
+      cEnableSysHook_(1),
+      cCreateByEnv(),
+      cPinned_(0) {}
+
+Fiber::~Fiber() {
+  pfn_ = nullptr;
+  cStart_ = cEnd_ = 0;
+}
+
+void Fiber::Yield() {
+  FiberEnvironment* env = env_;
+  if (env->callStackSize_ == 2) {
+    // 即将回到主协程：接力位上有协程时直接切换过去，调用栈上由它替换自己
+    Fiber* next = env->pNextFiber_;
+    if (next != nullptr) {
+      env->pNextFiber_ = nullptr;
+      if (!IsShareStack() &&
+          env->handoffCount_ < FiberEnvironment::MAX_HANDOFF_) {
+        env->handoffCount_++;
+        env->pCallStack_[1] = next;
+        SwapContext(next);
+        return;
+      }
+      env->EnqueueSignaledFiber(next);
+    }
+    env->handoffCount_ = 0;
+  }
+  Fiber* last = env->pCallStack_[env->callStackSize_ - 2];
+  env->callStackSize_--;
+  SwapContext(last);
+}
+
+void Fiber::Resume() {
+  Fiber* curr = env_->pCallStack_[env_->callStackSize_ - 1];
+  if (!this->cStart_) {
+    this->cStart_ = 1;
+    this->ctx_.Make((void* (*)(void*, void*))GoRoutine, this, nullptr);
+  }
+  env_->pCallStack_[env_->callStackSize_++] = this;
+  curr->SwapContext(this);
+}
+
+void Fiber::Reset(FiberFunc&& pfn) {
+  if (cIsMain_) return;
+  if (cStart_ && !cEnd_) return;
+  cStart_ = 0;
+  cEnd_ = 0;
+  this->pfn_ = std::move(pfn);
+}
+
+void Fiber::SwapContext(Fiber* pendingCo) {
+  FiberContext::Swap(&(this->ctx_), &(pendingCo->ctx_));
+}
+
+int Fiber::WaitUntil(const MonotonicClock::time_point& deadline, bool cancelUntimed) {
+  // 同步原语上不带超时的等待没有失败的出口(例如 lock)，不能被取消
+  auto state = deadline != MonotonicClock::time_point::max() || cancelUntimed
+                   ? cancel_.get()
+                   : nullptr;
+  if (state != nullptr) {
+    state->lock.Lock();
+    if (state->cancelled) {
+      state->lock.Unlock();
+      if (pfnWaitRemove_(waitOwner_, this)) return ECANCELED;
+      // 已经被唤醒，等待调度即可
+      Yield();
+      return waitResult_;
+    }
+    state->blocked = true;
+    state->lock.Unlock();
+  }
+
+  if (deadline == MonotonicClock::time_point::max()) {
+    // 不会超时，不需要挂到时间轮上
+    Yield();
+    if (state != nullptr) {
+      state->lock.Lock();
+      state->blocked = false;
+      state->lock.Unlock();
+    }
+    return waitResult_;
+  }
+
+  // 共享栈上的协程切出后栈内容会被覆盖，超时结点只能放在堆上
+  StTimeoutItem stackItem;
+  StTimeoutItem* pItem = nullptr;
+  auto now = RefreshTickUS();
+  auto expire = deadline.time_since_epoch().count();
+  if (expire > (int64_t)now) {
+    pItem = IsShareStack() ? new StTimeoutItem() : &stackItem;
+    pItem->pfnProcess = OnWaitTimeout;
+    pItem->pArg = this;
+    pItem->ullExpireTime = expire;
+    env_->pTimeWheel_->AddTimeout(pItem, now);
+    pWaitItem_ = pItem;
+    Yield();
+    // 被迁移过的话结点已经在原线程上摘除，这里什么也不做
+    pWaitItem_ = nullptr;
+    pItem->RemoveFromLink();
+    if (pItem != &stackItem) delete pItem;
+  } else if (pfnWaitRemove_(waitOwner_, this)) {
+    waitResult_ = ETIMEDOUT;
+  } else {
+    Yield();
+  }
+
+  if (state != nullptr) {
+    state->lock.Lock();
+    state->blocked = false;
+    state->lock.Unlock();
+  }
+  return waitResult_;
+}
+
+int StFdEvent::Wait(short events, const MonotonicClock::time_point& deadline) {
+  Fiber* self = this_fiber::co_self();
+  bool isRead = (events & POLLIN) != 0;
+  lock.Lock();
+  if (bClosing) {
+    // 重试的系统调用在描述符关闭后得到 EBADF，或者作用到复用描述符号的新描述符上
+    lock.Unlock();
+    this_fiber::yield();
+    return 1;
+  }
+  if (!bRegistered) {
+    // 注册时已经就绪的话 epoll 会立即报告一次，不会丢失注册之前的边沿
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = this;
+    iEpollFd = self->env_->EpollFd_;
+    if (epoll_ctl(iEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST) {
+      lock.Unlock();
+      // 普通文件等不支持 epoll 的描述符总是就绪的
+      return errno == EPERM ? 1 : -1;
+    }
+    this->pfnPrepare = OnFdEventPrepare;
+    bRegistered = true;
+  }
+  bool& ready = isRead ? bReadable : bWritable;
+  if (ready) {
+    ready = false;
+    lock.Unlock();
+    return 1;
+  }
+  self->PrepareWait(this, &StFdEvent::RemoveWaiter);
+  (isRead ? readers : writers).push_back(&self->waitNode_);
+  lock.Unlock();
+
+  int ret = self->WaitUntil(deadline, true);
+  if (ret == 0) return 1;
+  if (ret == ETIMEDOUT) return 0;
+  errno = ret;
+  return -1;
+}
+
+void StFdEvent::Close() {
+  lock.Lock();
+  bool registered = bRegistered;
+  bRegistered = bReadable = bWritable = false;
+  bClosing = true;
+  WaitNode* readable = readers.pop_all();
+  WaitNode* writable = writers.pop_all();
+  // 描述符还没有关闭，注销的一定是它自己的注册
+  if (registered) {
+    epoll_ctl(iEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+  lock.Unlock();
+  WaitQueue::WakeAll(readable);
+  WaitQueue::WakeAll(writable);
+}
+
+void StFdEvent::Closed() {
+  lock.Lock();
+  bClosing = false;
+  lock.Unlock();
+}
+
+void StFdEvent::OnEvent(uint32_t events) {
+  WaitNode* readable = nullptr;
+  WaitNode* writable = nullptr;
+  lock.Lock();
+  // 有等待者时边沿交给它们，否则记下来留给下一次等待.
+  // 边沿触发只报告一次，同一方向的等待者全部唤醒重试，没有读完的数据不会没人处理
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+    bReadable = readers.empty();
+    readable = readers.pop_all();
+  }
+  if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+    bWritable = writers.empty();
+    writable = writers.pop_all();
+  }
+  lock.Unlock();
+  // 被唤醒的协程可能属于其他线程，统一交给它所在线程的就绪队列
+  WaitQueue::WakeAll(readable);
+  WaitQueue::WakeAll(writable);
+}
+
+bool StFdEvent::RemoveWaiter(void* self, Fiber* fiber) {
+  auto ev = (StFdEvent*)self;
+  ev->lock.Lock();
+  bool found = ev->readers.remove(&fiber->waitNode_) ||
+               ev->writers.remove(&fiber->waitNode_);
+  ev->lock.Unlock();
+  return found;
+}
+
+bool StUringSocket::Active() {
+  lock.Lock();
+  bool active = bArmed || Ready();
+  lock.Unlock();
+  return active;
+}
+
+bool StUringSocket::Arm() {
+  if (bArmed) return true;
+  Fiber* self = CurrentFiber();
+  if (self == nullptr || self->IsMain()) return false;
+  StUring* ring = FiberEnvironment::GetInstance()->GetUring();
+  if (ring == nullptr || (!bListen && !ring->SetupBuffers())) return false;
+  io_uring_sqe* sqe = ring->GetSqe();
+  if (sqe == nullptr) return false;
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t)this;
+  if (bListen) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = StUring::BUF_GROUP_;
+  }
+  bArmed = true;
+  bArmAccept = bListen;
+  bStopping = false;
+  iArmGen = iGen;
+  pRing = ring;
+  return true;
+}
+
+int StUringSocket::Wait(const MonotonicClock::time_point& deadline) {
+  Fiber* self = this_fiber::co_self();
+  self->PrepareWait(this, &StUringSocket::RemoveWaiter);
+  readers.push_back(&self->waitNode_);
+  lock.Unlock();
+  int ret = self->WaitUntil(deadline, true);
+  return ret == ETIMEDOUT ? EAGAIN : ret;
+}
+
+ssize_t StUringSocket::Recv(const iovec* iov, int count, int flags,
+                            const MonotonicClock::time_point& deadline) {
+  size_t want = 0;
+  for (int i = 0; i < count; i++) {
+    want += iov[i].iov_len;
+  }
+  size_t got = 0;
+  int err = 0;
+  lock.Lock();
+  uint32_t gen = iGen;
+  while (got < want) {
+    if (gen != iGen) {
+      err = EBADF;
+      break;
+    }
+    size_t avail = data.size() - iHead;
+    if (avail > 0) {
+      // 从 iov 中第 got 个字节的位置开始拷贝
+      size_t skip = got;
+      const char* src = data.data() + iHead;
+      size_t n = std::min(avail, want - got);
+      size_t left = (flags & MSG_TRUNC) ? 0 : n;
+      for (int i = 0; i < count && left > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+          skip -= iov[i].iov_len;
+          continue;
+        }
+        size_t len = std::min<size_t>(iov[i].iov_len - skip, left);
+        memcpy((char*)iov[i].iov_base + skip, src, len);
+        src += len;
+        left -= len;
+        skip = 0;
+      }
+      got += n;
+      if (flags & MSG_PEEK) break;
+      iHead += n;
+      if (iHead == data.size()) {
+        data.clear();
+        iHead = 0;
+      } else if (iHead >= MAX_BUFFERED_ / 4) {
+        data.erase(data.begin(), data.begin() + iHead);
+        iHead = 0;
+      }
+      if (!(flags & MSG_WAITALL)) break;
+      continue;
+    }
+    if (bEof) break;
+    if (iError != 0) {
+      if (got == 0) std::swap(err, iError);
+      break;
+    }
+    if (!Arm()) {
+      err = ENOSYS;
+      break;
+    }
+    if (flags & MSG_DONTWAIT) {
+      err = EAGAIN;
+      break;
+    }
+    err = Wait(deadline);
+    if (err != 0) {
+      lock.Lock();
+      break;
+    }
+    lock.Lock();
+  }
+  // 因为积压过多而停止的多发请求，读走一部分之后重新提交
+  if (gen == iGen && !bArmed && !bEof && iError == 0 &&
+      data.size() - iHead < MAX_BUFFERED_ / 2) {
+    Arm();
+  }
+  lock.Unlock();
+  if (got > 0 || err == 0) return got;
+  errno = err;
+  return -1;
+}
+
+int StUringSocket::Accept(bool nonblock,
+                          const MonotonicClock::time_point& deadline) {
+  lock.Lock();
+  if (!bArmed && accepted.empty()) bListen = true;
+  uint32_t gen = iGen;
+  for (;;) {
+    int err = 0;
+    if (gen != iGen) {
+      err = EBADF;
+    } else if (!accepted.empty()) {
+      int cli = accepted.front();
+      accepted.pop_front();
+      if (accepted.size() < MAX_ACCEPTED_ / 2) Arm();
+      lock.Unlock();
+      return cli;
+    } else if (iError != 0) {
+      std::swap(err, iError);
+    } else if (!Arm()) {
+      err = ENOSYS;
+    } else if (nonblock) {
+      err = EAGAIN;
+    } else {
+      err = Wait(deadline);
+      lock.Lock();
+    }
+    if (err != 0) {
+      lock.Unlock();
+      errno = err;
+      return -1;
+    }
+  }
+}
+
+int StUringSocket::WaitReadable(const MonotonicClock::time_point& deadline) {
+  lock.Lock();
+  uint32_t gen = iGen;
+  for (;;) {
+    int err = 0;
+    if (gen != iGen || Ready()) {
+      lock.Unlock();
+      return 1;
+    } else if (deadline <= MonotonicClock::now()) {
+      // 只是检查一下，没有接管的描述符留给调用者直接 poll
+      lock.Unlock();
+      return 0;
+    } else if (!Arm()) {
+      err = ENOSYS;
+    } else {
+      err = Wait(deadline);
+      lock.Lock();
+    }
+    if (err != 0) {
+      lock.Unlock();
+      if (err == EAGAIN) return 0;
+      errno = err;
+      return -1;
+    }
+  }
+}
+
+void StUringSocket::Close(bool fdOpen) {
+  std::vector<char> dropped;
+  std::deque<int> orphans;
+  lock.Lock();
+  iGen++;
+  // 多发请求持有文件的引用，不停止的话关闭描述符并不会关闭连接.
+  // 只有提交请求的线程能取消它，其他线程通过 shutdown 让它结束；都做不到时
+  // 留给 OnComplete 在下一个完成事件到来时取消
+  StUring* ring = pRing;
+  bool sameRing = currentEnv != nullptr && currentEnv->pUring_ == ring;
+  bool stop = bArmed && !bStopping && (sameRing || fdOpen);
+  bStopping = bStopping || stop;
+  dropped.swap(data);
+  orphans.swap(accepted);
+  iHead = 0;
+  bListen = bEof = false;
+  iError = 0;
+  WaitNode* pending = readers.pop_all();
+  lock.Unlock();
+  if (stop && sameRing) {
+    ring->Cancel(this);
+  } else if (stop) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  for (int cli : orphans) {
+    close(cli);
+  }
+  WaitQueue::WakeAll(pending);
+}
+
+void StUringSocket::OnComplete(StUringRequest* req) {
+  auto sock = (StUringSocket*)req;
+  int res = sock->res;
+  unsigned flags = sock->flags;
+  bool more = flags & IORING_CQE_F_MORE;
+  bool stop = false;
+  int orphan = -1;
+  WaitNode* pending = nullptr;
+  sock->lock.Lock();
+  StUring* ring = sock->pRing;
+  bool stale = sock->iArmGen != sock->iGen;
+  if (sock->bArmAccept) {
+    if (res >= 0 && stale) {
+      orphan = res;
+    } else if (res >= 0) {
+      sock->accepted.push_back(res);
+    }
+  } else if (flags & IORING_CQE_F_BUFFER) {
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0 && !stale) {
+      const char* buf = ring->bufBase + (size_t)bid * StUring::BUF_SIZE_;
+      sock->data.insert(sock->data.end(), buf, buf + res);
+    }
+    ring->RecycleBuffer(bid);
+  }
+  if (!more) {
+    sock->bArmed = sock->bStopping = false;
+    if (!stale && res == 0 && !sock->bArmAccept) {
+      sock->bEof = true;
+    } else if (!stale && res < 0 && res != -ECANCELED && res != -ENOBUFS) {
+      sock->iError = -res;
+    }
+  } else if (!sock->bStopping &&
+             (stale || sock->data.size() - sock->iHead > MAX_BUFFERED_ ||
+              sock->accepted.size() > MAX_ACCEPTED_)) {
+    sock->bStopping = stop = true;
+  }
+  // 等待者全部唤醒重试，没有取到数据或连接的重新等待
+  if (!stale || !more) {
+    pending = sock->readers.pop_all();
+  }
+  sock->lock.Unlock();
+  if (stop) ring->Cancel(sock);
+  if (orphan >= 0) close(orphan);
+  // 被唤醒的协程可能属于其他线程，统一交给它所在线程的就绪队列
+  WaitQueue::WakeAll(pending);
+}
+
+bool StUringSocket::RemoveWaiter(void* self, Fiber* fiber) {
+  auto sock = (StUringSocket*)self;
+  sock->lock.Lock();
+  bool found = sock->readers.remove(&fiber->waitNode_);
+  sock->lock.Unlock();
+  return found;
+}
+
+cancel_token Fiber::GetCancelToken() {
+  if (cancel_ == nullptr) {
+    cancel_ = std::make_shared<cancel_token::State>();
+    cancel_->fiber = this;
+    cancel_->cancelled = false;
+    cancel_->blocked = false;
+  }
+  return cancel_token(cancel_);
+}
+
+bool Fiber::IsCancelled() const {
+  if (cancel_ == nullptr) return false;
+  cancel_->lock.Lock();
+  bool cancelled = cancel_->cancelled;
+  cancel_->lock.Unlock();
+  return cancelled;
+}
+
+void cancel_token::cancel() const {
+  if (state_ == nullptr) return;
+  state_->lock.Lock();
+  state_->cancelled = true;
+  Fiber* fb = state_->fiber;
+  // 持有令牌的锁时协程不会离开等待，等待状态可以安全访问
+  if (fb != nullptr && state_->blocked &&
+      fb->pfnWaitRemove_(fb->waitOwner_, fb)) {
+    fb->waitResult_ = ECANCELED;
+    fb->env_->AddSignaledFiber(fb);
+  }
+  state_->lock.Unlock();
+}
+
+bool cancel_token::cancelled() const {
+  if (state_ == nullptr) return false;
+  state_->lock.Lock();
+  bool cancelled = state_->cancelled;
+  state_->lock.Unlock();
+  return cancelled;
+}
+
+void WaitQueue::push_back(WaitNode* node) {
+  node->prev = tail_;
+  node->next = nullptr;
+  node->linked = true;
+  if (tail_ != nullptr) {
+    tail_->next = node;
+  } else {
+    head_ = node;
+  }
+  tail_ = node;
+  size_++;
+}
+
+void WaitQueue::push_front(WaitNode* node) {
+  node->prev = nullptr;
+  node->next = head_;
+  node->linked = true;
+  if (head_ != nullptr) {
+    head_->prev = node;
+  } else {
+    tail_ = node;
+  }
+  head_ = node;
+  size_++;
+}
+
+WaitNode* WaitQueue::pop_front() {
+  WaitNode* node = head_;
+  if (node == nullptr) return nullptr;
+  head_ = node->next;
+  if (head_ != nullptr) {
+    head_->prev = nullptr;
+  } else {
+    tail_ = nullptr;
+  }
+  node->linked = false;
+  size_--;
+  return node;
+}
+
+bool WaitQueue::remove(WaitNode* node) {
+  if (!node->linked) return false;
+  if (node->prev != nullptr) {
+    node->prev->next = node->next;
+  } else {
+    head_ = node->next;
+  }
+  if (node->next != nullptr) {
+    node->next->prev = node->prev;
+  } else {
+    tail_ = node->prev;
+  }
+  node->linked = false;
+  size_--;
+  return true;
+}
+
+WaitNode* WaitQueue::pop_all() {
+  WaitNode* list = head_;
+  // 取出的结点不再属于队列，超时和取消不能再从队列中移除它们
+  for (WaitNode* node = list; node != nullptr; node = node->next) {
+    node->linked = false;
+  }
+  head_ = tail_ = nullptr;
+  size_ = 0;
+  return list;
+}
+
+void WaitQueue::WakeAll(WaitNode* list) {
+  while (list != nullptr) {
+    WaitNode* next = list->next;
+    list->fiber->env_->AddSignaledFiber(list->fiber);
+    list = next;
   }
-  waiters.push_back(this_fiber::co_self());
+}
+
+/**
+ * @brief 在 @p mtx 的保护下把 @p node 从等待队列中移除.
+ *
+ * @return bool 结点是否还在等待队列中
+ */
+static bool RemoveFromWaiters(SpinLock& mtx, WaitQueue& waiters, WaitNode* node) {
+  mtx.Lock();
+  bool found = waiters.remove(node);
   mtx.Unlock();
-  this_fiber::co_self()->Yield();
+  return found;
 }
 
-bool mutex::try_lock() {
+/*> 各个键的析构函数，下标为 pthread_key_t */
+static std::atomic<void (*)(void*)> specificDestructors[PTHREAD_KEYS_MAX];
+
+void SetSpecificDestructor(pthread_key_t key, void (*destructor)(void*)) {
+  if (key < PTHREAD_KEYS_MAX) {
+    specificDestructors[key].store(destructor, std::memory_order_release);
+  }
+}
+
+void DeleteSpecificKey(pthread_key_t key) {
+  SetSpecificDestructor(key, nullptr);
+  FiberSpecific::Invalidate(key);
+}
+
+Fiber* CurrentFiber() {
+  auto env = currentEnv;
+  if (env == nullptr) return nullptr;
+  return env->pCallStack_[env->callStackSize_ - 1];
+}
+
+/**
+ * @brief 内核是否支持 io_uring 后端需要的多发 recv(6.0) 和 provided buffer ring(5.19).
+ * 两者都无法直接探测，以同在 6.0 加入的 IORING_OP_SEND_ZC 作为依据.
+ */
+static bool ProbeUringSocket() {
+  io_uring_params p = {};
+  int fd = syscall(__NR_io_uring_setup, 2, &p);
+  if (fd < 0) return false;
+  size_t size = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+  io_uring_probe* probe = (io_uring_probe*)calloc(1, size);
+  bool ok = (p.features & IORING_FEAT_NODROP) &&
+            syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                    IORING_OP_LAST) == 0 &&
+            probe->ops_len > IORING_OP_SEND_ZC &&
+            (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  close(fd);
+  return ok;
+}
+
+/*> 套接字 IO 的后端，-1 表示还没有选择 */
+static std::atomic<int> ioBackend{-1};
+
+IoBackend SetIoBackend(IoBackend backend) {
+  if (backend == IoBackend::kUring && !ProbeUringSocket()) {
+    backend = IoBackend::kEpoll;
+  }
+  ioBackend.store((int)backend, std::memory_order_relaxed);
+  return backend;
+}
+
+IoBackend GetIoBackend() {
+  int backend = ioBackend.load(std::memory_order_relaxed);
+  if (backend < 0) {
+    const char* name = getenv("PIORUN_IO_BACKEND");
+    bool uring = name != nullptr && strcmp(name, "uring") == 0;
+    return SetIoBackend(uring ? IoBackend::kUring : IoBackend::kEpoll);
+  }
+  return (IoBackend)backend;
+}
+
+FiberSpecific::FiberSpecific(FiberSpecific&& rhs) noexcept
+    : ext_(rhs.ext_), used_(rhs.used_) {
+  memcpy(inline_, rhs.inline_, sizeof(inline_));
+  memset(rhs.inline_, 0, sizeof(rhs.inline_));
+  rhs.ext_ = nullptr;
+  rhs.used_ = 0;
+}
+
+FiberSpecific::~FiberSpecific() {
+  Release();
+  free(ext_);
+  ext_ = nullptr;
+}
+
+FiberSpecific& FiberSpecific::operator=(const FiberSpecific& rhs) {
+  if (&rhs != this) Release();
+  return *this;
+}
+
+FiberSpecific& FiberSpecific::operator=(FiberSpecific&& rhs) noexcept {
+  if (&rhs == this) return *this;
+  this->~FiberSpecific();
+  new (this) FiberSpecific(std::move(rhs));
+  return *this;
+}
+
+std::atomic<uint32_t> FiberSpecific::generations_[FiberSpecific::kMaxKeys];
+
+int FiberSpecific::Set(pthread_key_t key, const void* value) {
+  if (key >= kMaxKeys) return EINVAL;
+  Slot* slot;
+  if (key < kInlineSlots) {
+    slot = &inline_[key];
+  } else {
+    if (ext_ == nullptr) {
+      if (value == nullptr) return 0;
+      ext_ = (Slot*)calloc(kMaxKeys - kInlineSlots, sizeof(Slot));
+      if (ext_ == nullptr) return ENOMEM;
+    }
+    slot = &ext_[key - kInlineSlots];
+  }
+  slot->value = const_cast<void*>(value);
+  slot->generation = generations_[key].load(std::memory_order_relaxed);
+  if (value != nullptr && key >= used_) used_ = key + 1;
+  return 0;
+}
+
+void FiberSpecific::Release() {
+  // 析构函数可能再次写入协程本地存储，和 pthread 一样最多重复
+  // PTHREAD_DESTRUCTOR_ITERATIONS 轮
+  for (int round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS && used_ > 0;
+       round++) {
+    pthread_key_t used = used_;
+    used_ = 0;
+    for (pthread_key_t key = 0; key < used; key++) {
+      // 已经删除的键下的值不调用析构函数，与 pthread 一致
+      void* value = Get(key);
+      Set(key, nullptr);
+      if (value == nullptr) continue;
+      auto destructor =
+          specificDestructors[key].load(std::memory_order_acquire);
+      if (destructor != nullptr) destructor(value);
+    }
+  }
+  // 仍然残留的值直接丢弃
+  if (used_ > 0) {
+    memset(inline_, 0, sizeof(inline_));
+    if (ext_ != nullptr) {
+      memset(ext_, 0, (kMaxKeys - kInlineSlots) * sizeof(Slot));
+    }
+    used_ = 0;
+  }
+}
+
+void condition_variable::wait(std::unique_lock<fiber::mutex>& lock) {
+  Fiber* self = this_fiber::co_self();
+  this->mtx.Lock();
+  waiters.push_back(&self->waitNode_);
+  this->mtx.Unlock();
+  lock.unlock();
+  self->Yield();
+  lock.lock();
+}
+
+std::cv_status condition_variable::wait_until(
+    std::unique_lock<fiber::mutex>& lock,
+    const MonotonicClock::time_point& deadline) {
+  Fiber* self = this_fiber::co_self();
+  this->mtx.Lock();
+  self->PrepareWait(this, &condition_variable::RemoveWaiter);
+  waiters.push_back(&self->waitNode_);
+  this->mtx.Unlock();
+  lock.unlock();
+  int ret = self->WaitUntil(deadline);
+  lock.lock();
+  if (ret != 0) {
+    errno = ret;
+    return std::cv_status::timeout;
+  }
+  return std::cv_status::no_timeout;
+}
+
+bool condition_variable::RemoveWaiter(void* self, Fiber* fiber) {
+  auto cv = (condition_variable*)self;
+  return RemoveFromWaiters(cv->mtx, cv->waiters, &fiber->waitNode_);
+}
+
+void condition_variable::notify_one() {
+  Fiber* fb = nullptr;
   mtx.Lock();
-  if (locked == false) {
-    locked = true;
-    mtx.Unlock();
-    return true;
+  WaitNode* node = waiters.pop_front();
+  if (node != nullptr) fb = node->fiber;
+  mtx.Unlock();
+  if (fb != nullptr) {
+    fb->env_->AddSignaledFiber(fb);
   }
+}
+
+void condition_variable::notify_all() {
+  mtx.Lock();
+  WaitNode* list = waiters.pop_all();
   mtx.Unlock();
+  WaitQueue::WakeAll(list);
+}
+
+/*> 等待者等待超过这个时间(us)仍然没有拿到锁时，互斥锁切换到饥饿模式 */
+static const int64_t kMutexStarvationUs = 1000;
+
+/*> 自旋等待锁被释放的最大轮数 */
+static const int kMutexSpinRounds = 128;
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+bool mutex::TryAcquire() {
+  int expected = 0;
+  if (state.compare_exchange_strong(expected, kLocked,
+                                    std::memory_order_acquire,
+                                    std::memory_order_relaxed)) {
+    owner.store(currentEnv, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief 持有者是其他线程上的协程时，锁很可能马上被释放，短暂自旋比挂起再唤醒便宜.
+ * 持有者在本线程上时它不可能在自旋期间运行，单核机器上自旋也没有意义.
+ *
+ * @return bool 是否在自旋期间拿到了锁
+ */
+bool mutex::Spin() {
+  static const bool multiCore = std::thread::hardware_concurrency() > 1;
+  if (!multiCore) return false;
+  for (int i = 0; i < kMutexSpinRounds; i++) {
+    int s = state.load(std::memory_order_relaxed);
+    if (s & kStarving) return false;
+    if (s == 0) {
+      if (TryAcquire()) {
+        spinned.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      continue;
+    }
+    if (owner.load(std::memory_order_relaxed) == currentEnv) return false;
+    CpuRelax();
+  }
   return false;
 }
 
+void mutex::lock() {
+  if (TryAcquire()) return;
+  LockSlow(MonotonicClock::time_point::max());
+}
+
+bool mutex::try_lock() {
+  // 饥饿模式下不抢在等待者前面
+  return TryAcquire();
+}
+
+bool mutex::try_lock_until(const MonotonicClock::time_point& deadline) {
+  if (TryAcquire()) return true;
+  return LockSlow(deadline);
+}
+
+bool mutex::LockSlow(const MonotonicClock::time_point& deadline) {
+  contended.fetch_add(1, std::memory_order_relaxed);
+  if (Spin()) return true;
+
+  Fiber* self = this_fiber::co_self();
+  WaitNode* node = &self->waitNode_;
+  auto since = MonotonicClock::Refresh();
+  bool wasWoken = false; /*> 是否是被 unlock 唤醒后重新抢锁 */
+  mtx.Lock();
+  for (;;) {
+    if (wasWoken) woken = false;
+    // 饥饿模式下只有被唤醒的等待者可以拿锁，队列已经清空时除外
+    int s = state.load(std::memory_order_relaxed);
+    if (!(s & kLocked) && (!(s & kStarving) || wasWoken || waiters.empty())) {
+      int desired = kLocked | (waiters.empty() ? 0 : (s & kStarving));
+      if (state.compare_exchange_strong(s, desired, std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+        owner.store(currentEnv, std::memory_order_relaxed);
+        mtx.Unlock();
+        return true;
+      }
+      continue;
+    }
+
+    auto now = MonotonicClock::Refresh();
+    if (deadline != MonotonicClock::time_point::max() && deadline <= now) {
+      mtx.Unlock();
+      errno = ETIMEDOUT;
+      return false;
+    }
+    if (wasWoken && !(s & kStarving) &&
+        (now - since).count() > kMutexStarvationUs) {
+      state.fetch_or(kStarving, std::memory_order_relaxed);
+      starvations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 被唤醒后没有抢到锁的等待者排回队首，不会因为被唤醒而失去位置
+    if (wasWoken) {
+      waiters.push_front(node);
+    } else {
+      waiters.push_back(node);
+    }
+    waiting.fetch_add(1, std::memory_order_seq_cst);
+    // 先登记再检查，和 unlock 中先释放再检查等待者相对应
+    if (!(state.load(std::memory_order_seq_cst) & kLocked)) {
+      waiters.remove(node);
+      waiting.fetch_sub(1, std::memory_order_relaxed);
+      continue;
+    }
+    parked.fetch_add(1, std::memory_order_relaxed);
+
+    if (deadline == MonotonicClock::time_point::max()) {
+      mtx.Unlock();
+      self->Yield();
+    } else {
+      self->PrepareWait(this, &mutex::RemoveWaiter);
+      mtx.Unlock();
+      int ret = self->WaitUntil(deadline);
+      if (ret != 0) {
+        errno = ret;
+        return false;
+      }
+    }
+    if (node->granted) {
+      // 饥饿模式下 unlock 已经把锁转交给了本协程
+      node->granted = false;
+      // 等待时间已经不长了，说明排队不再严重，回到正常模式
+      if ((MonotonicClock::Refresh() - since).count() <= kMutexStarvationUs) {
+        mtx.Lock();
+        state.fetch_and(~kStarving, std::memory_order_relaxed);
+        mtx.Unlock();
+      }
+      return true;
+    }
+    wasWoken = true;
+    mtx.Lock();
+  }
+}
+
+bool mutex::RemoveWaiter(void* self, Fiber* fiber) {
+  auto mu = (mutex*)self;
+  mu->mtx.Lock();
+  bool found = mu->waiters.remove(&fiber->waitNode_);
+  if (found) {
+    mu->waiting.fetch_sub(1, std::memory_order_relaxed);
+    if (mu->waiters.empty()) {
+      mu->state.fetch_and(~kStarving, std::memory_order_relaxed);
+    }
+  }
+  mu->mtx.Unlock();
+  return found;
+}
+
 void mutex::unlock() {
   Fiber* fb = nullptr;
-  mtx.Lock();
-  if (!waiters.empty()) {
-    fb = waiters.front();
-    waiters.pop_front();
+  int expected = kLocked;
+  if (state.compare_exchange_strong(expected, 0, std::memory_order_release,
+                                    std::memory_order_relaxed)) {
+    // 正常模式：释放锁，唤醒一个等待者和新来的协程竞争
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) == 0) return;
+    mtx.Lock();
+    if (!woken && !waiters.empty()) {
+      fb = waiters.pop_front()->fiber;
+      waiting.fetch_sub(1, std::memory_order_relaxed);
+      woken = true;
+    }
+    mtx.Unlock();
   } else {
-    locked = false;
+    // 饥饿模式：锁保持持有状态，所有权直接转交给队首的等待者
+    mtx.Lock();
+    WaitNode* node = waiters.pop_front();
+    if (node != nullptr) {
+      waiting.fetch_sub(1, std::memory_order_relaxed);
+      node->granted = true;
+      fb = node->fiber;
+      owner.store(fb->env_, std::memory_order_relaxed);
+      handoffs.fetch_add(1, std::memory_order_relaxed);
+      if (waiters.empty()) state.store(kLocked, std::memory_order_relaxed);
+    } else {
+      state.store(0, std::memory_order_release);
+    }
+    mtx.Unlock();
+  }
+  if (fb != nullptr) {
+    fb->env_->AddSignaledFiber(fb);
+  }
+}
+
+mutex::Stats mutex::GetStats() const {
+  Stats stats;
+  stats.contended = contended.load(std::memory_order_relaxed);
+  stats.spinned = spinned.load(std::memory_order_relaxed);
+  stats.parked = parked.load(std::memory_order_relaxed);
+  stats.handoffs = handoffs.load(std::memory_order_relaxed);
+  stats.starvations = starvations.load(std::memory_order_relaxed);
+  return stats;
+}
+
+shared_mutex::ReaderSlot* shared_mutex::Slot() {
+  // 没有协程环境的线程(普通线程、阻塞线程池)按线程 ID 散列到某个计数上
+  if (currentEnv == nullptr) {
+    static thread_local size_t hashed =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    return &slots[hashed & (kReaderSlots - 1)];
+  }
+  return &slots[currentEnv->threadId_ & (kReaderSlots - 1)];
+}
+
+int shared_mutex::ReaderCount() const {
+  int n = 0;
+  for (int i = 0; i < kReaderSlots; i++) {
+    n += slots[i].count.load(std::memory_order_seq_cst);
+  }
+  return n;
+}
+
+void shared_mutex::LeaveSlot(ReaderSlot* slot) {
+  slot->count.fetch_sub(1, std::memory_order_seq_cst);
+  // 快速路径：没有写者时读者只修改自己的计数
+  if (!writing.load(std::memory_order_seq_cst)) return;
+  Fiber* fb = nullptr;
+  mtx.Lock();
+  if (drainer != nullptr && ReaderCount() == 0) {
+    fb = drainer;
+    drainer = nullptr;
   }
   mtx.Unlock();
   if (fb != nullptr) {
-    fb->env_->lockForSyncSignalFiberQ_.Lock();
-    fb->env_->syncSignalFiberQ_.push_back(fb);
-    fb->env_->lockForSyncSignalFiberQ_.Unlock();
+    fb->env_->AddSignaledFiber(fb);
+  }
+}
+
+/**
+ * @brief 写者拿到锁之后等待已经进入的读者全部离开.
+ * 读者在 writing 置位之前完成的计数一定能被看到，之后进入的读者会发现 writing
+ * 并退回，最后离开的读者负责唤醒写者.
+ */
+void shared_mutex::WaitReaders() {
+  while (ReaderCount() != 0) {
+    Fiber* self = this_fiber::co_self();
+    mtx.Lock();
+    if (ReaderCount() == 0) {
+      mtx.Unlock();
+      return;
+    }
+    drainer = self;
+    mtx.Unlock();
+    self->Yield();
   }
 }
 
 void shared_mutex::lock() {
   mtx.Lock();
-  if (state == 0) {
-    // printf("state is 0, lock succeed\n");
-    state = -1;
+  writing.store(true, std::memory_order_seq_cst);
+  if (!owned) {
+    owned = true;
     mtx.Unlock();
+    WaitReaders();
     return;
   }
-  // printf("lock failed..., add to wqueue\n");
-  wwaiters.push_back(this_fiber::co_self());
+  Fiber* self = this_fiber::co_self();
+  wwaiters.push_back(&self->waitNode_);
   mtx.Unlock();
-  this_fiber::co_self()->Yield();
+  // 被 unlock 唤醒时锁已经转交给了本协程，读者在此期间无法进入
+  self->Yield();
 }
 
 bool shared_mutex::try_lock() {
   mtx.Lock();
-  if (state == 0) {
-    state = -1;
+  if (owned || ReaderCount() != 0) {
     mtx.Unlock();
-    return true;
+    return false;
   }
+  owned = true;
+  writing.store(true, std::memory_order_seq_cst);
   mtx.Unlock();
-  return false;
+  if (ReaderCount() != 0) {
+    // 置位 writing 之前有读者进入了，放弃并唤醒因此排队的读者
+    unlock();
+    return false;
+  }
+  return true;
 }
 
 void shared_mutex::unlock() {
   Fiber* fb = nullptr;
-  std::deque<Fiber*> pendingReadersQ;
+  WaitNode* pendingReaders = nullptr;
   mtx.Lock();
   if (!wwaiters.empty()) {
-    // printf("unlock and call another writer\n");
-    fb = wwaiters.front();
-    wwaiters.pop_front();
-  } else if (!rwaiters.empty()) {
-    // printf("unlock and call all reader\n");
-    state = rwaiters.size();
-    pendingReadersQ.swap(rwaiters);
+    fb = wwaiters.pop_front()->fiber;
   } else {
-    // printf("unlock, set state to 0\n");
-    state = 0;
+    owned = false;
+    writing.store(false, std::memory_order_seq_cst);
+    pendingReaders = rwaiters.pop_all();
   }
   mtx.Unlock();
 
   if (fb != nullptr) {
-    fb->env_->lockForSyncSignalFiberQ_.Lock();
-    fb->env_->syncSignalFiberQ_.push_back(fb);
-    fb->env_->lockForSyncSignalFiberQ_.Unlock();
-  } else if (!pendingReadersQ.empty()) {
-    for (auto fiber : pendingReadersQ) {
-      fiber->env_->lockForSyncSignalFiberQ_.Lock();
-      fiber->env_->syncSignalFiberQ_.push_back(fiber);
-      fiber->env_->lockForSyncSignalFiberQ_.Unlock();
-    }
+    fb->env_->AddSignaledFiber(fb);
+  } else {
+    WaitQueue::WakeAll(pendingReaders);
   }
 }
 
 void shared_mutex::lock_shared() {
-  mtx.Lock();
-  if (state >= 0 && wwaiters.empty()) {
-    // printf("state = %d, and no wwaiters, lock succeed\n", state);
-    state++;
-    mtx.Unlock();
-    return;
-  }
-  // if (state < 0)
-  // printf("lock_shared failed..., state is -1, add to rqueue\n");
-  // else
-  // printf("lock_shared failed..., has wwaiters, add to rqueue\n");
-
-  rwaiters.push_back(this_fiber::co_self());
-  mtx.Unlock();
-  this_fiber::co_self()->Yield();
-}
-
-bool shared_mutex::try_lock_shared() {
-  mtx.Lock();
-  if (state >= 0 && wwaiters.empty()) {
-    state++;
+  for (;;) {
+    if (try_lock_shared()) return;
+    Fiber* self = this_fiber::co_self();
+    mtx.Lock();
+    if (!writing.load(std::memory_order_relaxed)) {
+      mtx.Unlock();
+      continue;
+    }
+    rwaiters.push_back(&self->waitNode_);
     mtx.Unlock();
-    return true;
-  }
-  mtx.Unlock();
-  return false;
+    // 被唤醒后重新走快速路径，期间可能又有写者到来
+    self->Yield();
+  }
 }
 
-void shared_mutex::unlock_shared() {
-  Fiber* fb = nullptr;
-  mtx.Lock();
-  if (state == 1 && !wwaiters.empty()) {
-    // printf("last reader, unlock_shared and call a writer\n");
-    fb = wwaiters.front();
-    wwaiters.pop_front();
-    state = -1;
-  } else {
-    state--;
-    // printf("unlock_shared, state--, reader left: %d\n", state);
-  }
-  mtx.Unlock();
-  if (fb != nullptr) {
-    fb->env_->lockForSyncSignalFiberQ_.Lock();
-    fb->env_->syncSignalFiberQ_.push_back(fb);
-    fb->env_->lockForSyncSignalFiberQ_.Unlock();
-  }
+bool shared_mutex::try_lock_shared() {
+  ReaderSlot* slot = Slot();
+  slot->count.fetch_add(1, std::memory_order_seq_cst);
+  if (!writing.load(std::memory_order_seq_cst)) return true;
+  LeaveSlot(slot);
+  return false;
 }
 
+void shared_mutex::unlock_shared() { LeaveSlot(Slot()); }
+
 void semaphore::wait() {
   mtx.Lock();
   if (count > 0) {
@@ -733,9 +2730,10 @@ void semaphore::wait() {
     mtx.Unlock();
     return;
   }
-  waiters.push_back(this_fiber::co_self());
+  Fiber* self = this_fiber::co_self();
+  waiters.push_back(&self->waitNode_);
   mtx.Unlock();
-  this_fiber::co_self()->Yield();
+  self->Yield();
 }
 
 bool semaphore::try_wait() {
@@ -749,21 +2747,399 @@ bool semaphore::try_wait() {
   return false;
 }
 
+bool semaphore::wait_until(const MonotonicClock::time_point& deadline) {
+  Fiber* self = this_fiber::co_self();
+  mtx.Lock();
+  if (count > 0) {
+    --count;
+    mtx.Unlock();
+    return true;
+  }
+  self->PrepareWait(this, &semaphore::RemoveWaiter);
+  waiters.push_back(&self->waitNode_);
+  mtx.Unlock();
+  int ret = self->WaitUntil(deadline);
+  if (ret != 0) {
+    errno = ret;
+    return false;
+  }
+  return true;
+}
+
+bool semaphore::RemoveWaiter(void* self, Fiber* fiber) {
+  auto sem = (semaphore*)self;
+  return RemoveFromWaiters(sem->mtx, sem->waiters, &fiber->waitNode_);
+}
+
 void semaphore::signal() {
   Fiber* fb = nullptr;
   mtx.Lock();
-  if (!waiters.empty()) {
-    fb = waiters.front();
-    waiters.pop_front();
+  WaitNode* node = waiters.pop_front();
+  if (node != nullptr) {
+    fb = node->fiber;
   } else {
     ++count;
   }
   mtx.Unlock();
   if (fb != nullptr) {
-    fb->env_->lockForSyncSignalFiberQ_.Lock();
-    fb->env_->syncSignalFiberQ_.push_back(fb);
-    fb->env_->lockForSyncSignalFiberQ_.Unlock();
+    fb->env_->AddSignaledFiber(fb);
+  }
+}
+
+void channel_base::close() {
+  closed_.store(true, std::memory_order_seq_cst);
+  mtx_.Lock();
+  readWaiterCount_.store(0, std::memory_order_relaxed);
+  writeWaiterCount_.store(0, std::memory_order_relaxed);
+  // select 中的协程可能已经被其他管道唤醒了，必须在锁内认领；没有认领到的结点
+  // 在锁外随时可能随着它所在的栈帧一起失效，不能留在待唤醒的链表中
+  WaitNode* list = nullptr;
+  WaitNode** tail = &list;
+  auto claim = [&tail](WaitQueue& waiters) {
+    for (WaitNode* node = waiters.pop_all(); node != nullptr; node = node->next) {
+      int expected = -1;
+      if (node->index < 0 ||
+          node->fiber->selectFired_.compare_exchange_strong(expected, node->index)) {
+        *tail = node;
+        tail = &node->next;
+      }
+    }
+  };
+  claim(readWaiters_);
+  claim(writeWaiters_);
+  *tail = nullptr;
+  mtx_.Unlock();
+  WaitQueue::WakeAll(list);
+}
+
+int channel_base::Wait(bool reader, const MonotonicClock::time_point& deadline) {
+  Fiber* self = this_fiber::co_self();
+  mtx_.Lock();
+  // 先登记再检查，和 NotifyReaders/NotifyWriters 中先写入再检查等待者相对应
+  AddWaiter(reader, &self->waitNode_);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if ((reader ? Readable() : Writable()) || closed()) {
+    RemoveWaiter(reader, &self->waitNode_);
+    mtx_.Unlock();
+    return 0;
+  }
+  self->PrepareWait(this, reader ? &channel_base::RemoveReader
+                                 : &channel_base::RemoveWriter);
+  mtx_.Unlock();
+  if (deadline == MonotonicClock::time_point::max()) {
+    self->Yield();
+    return 0;
+  }
+  return self->WaitUntil(deadline);
+}
+
+void channel_base::Notify(bool reader, size_t n) {
+  Fiber* fibers[16];
+  auto& waiters = reader ? readWaiters_ : writeWaiters_;
+  auto& count = reader ? readWaiterCount_ : writeWaiterCount_;
+  while (n > 0) {
+    size_t got = 0, popped = 0;
+    mtx_.Lock();
+    while (got < n && got < 16 && !waiters.empty()) {
+      WaitNode* node = waiters.pop_front();
+      popped++;
+      // select 中的协程只由第一个就绪的分支唤醒，已经被认领的直接跳过
+      int expected = -1;
+      if (node->index >= 0 &&
+          !node->fiber->selectFired_.compare_exchange_strong(expected, node->index)) {
+        continue;
+      }
+      fibers[got++] = node->fiber;
+    }
+    count.fetch_sub(popped, std::memory_order_relaxed);
+    bool more = !waiters.empty();
+    mtx_.Unlock();
+    for (size_t i = 0; i < got; i++) {
+      fibers[i]->env_->AddSignaledFiber(fibers[i]);
+    }
+    if (!more || got == 0) break;
+    n -= got;
+  }
+}
+
+void channel_base::AddWaiter(bool reader, WaitNode* node) {
+  auto& waiters = reader ? readWaiters_ : writeWaiters_;
+  auto& count = reader ? readWaiterCount_ : writeWaiterCount_;
+  waiters.push_back(node);
+  count.fetch_add(1, std::memory_order_seq_cst);
+}
+
+bool channel_base::RemoveWaiter(bool reader, WaitNode* node) {
+  auto& waiters = reader ? readWaiters_ : writeWaiters_;
+  auto& count = reader ? readWaiterCount_ : writeWaiterCount_;
+  if (!waiters.remove(node)) return false;
+  count.fetch_sub(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool channel_base::RemoveReader(void* self, Fiber* fiber) {
+  auto ch = (channel_base*)self;
+  ch->mtx_.Lock();
+  bool found = ch->RemoveWaiter(true, &fiber->waitNode_);
+  ch->mtx_.Unlock();
+  return found;
+}
+
+bool channel_base::RemoveWriter(void* self, Fiber* fiber) {
+  auto ch = (channel_base*)self;
+  ch->mtx_.Lock();
+  bool found = ch->RemoveWaiter(false, &fiber->waitNode_);
+  ch->mtx_.Unlock();
+  return found;
+}
+
+/**
+ * @brief select 的超时和取消：抢在所有管道之前认领协程.
+ */
+bool channel_base::ClaimSelect(void*, Fiber* fiber) {
+  int expected = -1;
+  return fiber->selectFired_.compare_exchange_strong(expected, INT_MAX);
+}
+
+/*> select 的分支不超过这个数量时，等待结点放在栈上 */
+static const int kSelectStackNodes = 8;
+
+int select(std::initializer_list<select_case> cases,
+           const MonotonicClock::time_point& deadline) {
+  thread_local uint32_t seed = 2463534242u;
+  const select_case* cs = cases.begin();
+  const int n = (int)cases.size();
+  Fiber* self = this_fiber::co_self();
+
+  // 随机选择第一个尝试的分支
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  const int start = n > 0 ? (int)(seed % n) : 0;
+
+  // 每个分支一个等待结点，通常放在栈上；共享栈的协程切出后栈内容会被覆盖，
+  // 唤醒者还要访问这些结点，只能放在堆上
+  WaitNode stackNodes[kSelectStackNodes];
+  std::unique_ptr<WaitNode[]> heapNodes;
+  WaitNode* nodes = stackNodes;
+  if (self->IsShareStack() || n > kSelectStackNodes) {
+    heapNodes.reset(new WaitNode[n]);
+    nodes = heapNodes.get();
+  }
+
+  for (;;) {
+    for (int k = 0; k < n; k++) {
+      int i = (start + k) % n;
+      if (cs[i].pfnTry(cs[i])) return i;
+    }
+    if (deadline != MonotonicClock::time_point::max() &&
+        deadline <= MonotonicClock::Refresh()) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    // 在每个管道上登记，再检查一遍是否有分支已经就绪
+    self->selectFired_.store(-1, std::memory_order_relaxed);
+    for (int i = 0; i < n; i++) {
+      nodes[i].fiber = self;
+      nodes[i].index = i;
+      nodes[i].granted = false;
+      cs[i].ch->mtx_.Lock();
+      cs[i].ch->AddWaiter(!cs[i].write, &nodes[i]);
+      cs[i].ch->mtx_.Unlock();
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    int ready = -1;
+    for (int i = 0; i < n && ready < 0; i++) {
+      auto ch = cs[i].ch;
+      if (ch->closed() || (cs[i].write ? ch->Writable() : ch->Readable())) {
+        ready = i;
+      }
+    }
+
+    int ret = 0;
+    int expected = -1;
+    if (ready >= 0 && self->selectFired_.compare_exchange_strong(expected, ready)) {
+      // 自己认领成功，不需要阻塞
+    } else if (ready >= 0) {
+      // 已经被某个管道唤醒，等待调度
+      self->Yield();
+    } else {
+      self->PrepareWait(nullptr, &channel_base::ClaimSelect);
+      if (deadline == MonotonicClock::time_point::max()) {
+        self->Yield();
+      } else {
+        ret = self->WaitUntil(deadline);
+      }
+    }
+
+    for (int i = 0; i < n; i++) {
+      cs[i].ch->mtx_.Lock();
+      cs[i].ch->RemoveWaiter(!cs[i].write, &nodes[i]);
+      cs[i].ch->mtx_.Unlock();
+    }
+    if (ret != 0) {
+      errno = ret;
+      return -1;
+    }
+
+    // 先尝试唤醒本协程的分支，没有成功(元素被其他协程抢先取走)就重新来过
+    int fired = self->selectFired_.load(std::memory_order_relaxed);
+    if (cs[fired].pfnTry(cs[fired])) return fired;
+  }
+}
+
+void CompletionEvent::Set() {
+  mtx_.Lock();
+  set_ = true;
+  Fiber* fb = waiter_;
+  waiter_ = nullptr;
+  mtx_.Unlock();
+  if (fb != nullptr) {
+    fb->env_->AddSignaledFiber(fb);
+  }
+}
+
+void CompletionEvent::Reset() {
+  mtx_.Lock();
+  set_ = false;
+  mtx_.Unlock();
+}
+
+bool CompletionEvent::IsSet() const {
+  mtx_.Lock();
+  bool set = set_;
+  mtx_.Unlock();
+  return set;
+}
+
+int CompletionEvent::Wait(const MonotonicClock::time_point& deadline) {
+  Fiber* self = this_fiber::co_self();
+  if (self->IsMain()) {
+    // 主协程不能让出，只能轮询
+    while (!IsSet()) {
+      if (deadline != MonotonicClock::time_point::max() &&
+          deadline <= MonotonicClock::Refresh()) {
+        return ETIMEDOUT;
+      }
+      std::this_thread::yield();
+    }
+    return 0;
+  }
+  mtx_.Lock();
+  if (set_) {
+    mtx_.Unlock();
+    return 0;
+  }
+  self->PrepareWait(this, &CompletionEvent::RemoveWaiter);
+  waiter_ = self;
+  mtx_.Unlock();
+  if (deadline == MonotonicClock::time_point::max()) {
+    self->Yield();
+    return 0;
+  }
+  return self->WaitUntil(deadline);
+}
+
+bool CompletionEvent::RemoveWaiter(void* self, Fiber* fiber) {
+  auto event = (CompletionEvent*)self;
+  event->mtx_.Lock();
+  bool found = event->waiter_ == fiber;
+  if (found) event->waiter_ = nullptr;
+  event->mtx_.Unlock();
+  return found;
+}
+
+BlockingPool& BlockingPool::GetInstance() {
+  // 进程退出时线程可能还阻塞在 cv_ 上，对象交给系统回收
+  static BlockingPool* x = new BlockingPool();
+  return *x;
+}
+
+BlockingPool::BlockingPool()
+    : maxThreads_(64),
+      idleTimeout_(std::chrono::seconds(60)),
+      threads_(0),
+      idle_(0),
+      maxQueued_(0),
+      completed_(0) {}
+
+void BlockingPool::Submit(FiberFunc&& fn) {
+  std::unique_lock<std::mutex> lock(mtx_);
+  queue_.push_back(std::move(fn));
+  maxQueued_ = std::max(maxQueued_, queue_.size());
+  // 已经被唤醒但还没有取走任务的空闲线程也计在 idle_ 中，排队的任务比它们多时才新建线程
+  bool spawn = queue_.size() > idle_ && threads_ < maxThreads_;
+  if (spawn) {
+    threads_++;
+  }
+  lock.unlock();
+
+  if (!spawn) {
+    cv_.notify_one();
+    return;
+  }
+  try {
+    // 线程退出时自己释放 Thread 对象
+    new Thread([this] { WorkerLoop(); }, "blocking");
+  } catch (...) {
+    lock.lock();
+    threads_--;
+    lock.unlock();
+    cv_.notify_one();
+  }
+}
+
+void BlockingPool::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mtx_);
+  for (;;) {
+    idle_++;
+    while (queue_.empty() && threads_ <= maxThreads_) {
+      if (cv_.wait_for(lock, idleTimeout_) == std::cv_status::timeout &&
+          queue_.empty()) {
+        break;
+      }
+    }
+    idle_--;
+    if (queue_.empty() || threads_ > maxThreads_) {
+      break;
+    }
+    FiberFunc fn = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    fn();
+    fn = nullptr;
+    lock.lock();
+    completed_++;
   }
+  threads_--;
+  lock.unlock();
+  delete Thread::GetCurrentThread();
+}
+
+void BlockingPool::SetMaxThreads(size_t n) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  maxThreads_ = std::max<size_t>(1, n);
+  cv_.notify_all();
+}
+
+void BlockingPool::SetIdleTimeout(std::chrono::milliseconds timeout) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  idleTimeout_ = timeout;
+  cv_.notify_all();
+}
+
+BlockingPool::Stats BlockingPool::GetStats() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  Stats stats;
+  stats.threads = threads_;
+  stats.idle = idle_;
+  stats.running = threads_ - idle_;
+  stats.queued = queue_.size();
+  stats.maxQueued = maxQueued_;
+  stats.completed = completed_;
+  return stats;
 }
 
 // void FiberScheduler::Start(std::function<int(void)> pfn) {
@@ -826,39 +3202,231 @@ void semaphore::signal() {
 //   }
 // }
 
+// 空闲 FiberTask 的缓存。任务常常在提交它的线程之外运行，因此本地缓存超过水位线时
+// 整批交给全局缓存，本地缓存为空时再从全局缓存整批取回，稳态下提交任务不分配内存
+static const size_t TASK_CACHE_BATCH_ = 64;     /*> 本地缓存与全局缓存之间一次转移的数量 */
+static const size_t TASK_CACHE_WATERMARK_ = 4096; /*> 全局缓存保留的最大空闲任务数 */
+
+struct TaskCache {
+  std::vector<FiberTask*> tasks;
+ ~TaskCache();
+};
+
+// 线程退出时，thread_local 对象析构之后仍可能有清理路径提交或释放任务(例如主线程 main
+// 返回后的调度循环)，此时直接分配和释放，不再经过本地缓存. 标记本身可以平凡析构，
+// 在本线程的整个生命周期内都可以访问
+static thread_local TaskCache localTaskCache;
+static thread_local bool localTaskCacheDestroyed = false;
+
+TaskCache::~TaskCache() {
+  localTaskCacheDestroyed = true;
+  for (auto task : tasks) {
+    delete task;
+  }
+  tasks.clear();
+}
+
+// 全局缓存在首次使用时创建且从不析构，进程退出时仍在运行的调度线程可以继续访问它
+struct GlobalTaskCache {
+  SpinLock lock;
+  std::vector<FiberTask*> tasks;
+};
+
+static GlobalTaskCache& GetGlobalTaskCache() {
+  static GlobalTaskCache* cache = new GlobalTaskCache();
+  return *cache;
+}
+
+static FiberTask* AllocTask(FiberFunc&& fn, bool shareStack) {
+  FiberTask* task = nullptr;
+  if (!localTaskCacheDestroyed) {
+    auto&& tasks = localTaskCache.tasks;
+    if (tasks.empty()) {
+      auto&& global = GetGlobalTaskCache();
+      global.lock.Lock();
+      size_t n = std::min(global.tasks.size(), TASK_CACHE_BATCH_);
+      tasks.insert(tasks.end(), global.tasks.end() - n, global.tasks.end());
+      global.tasks.resize(global.tasks.size() - n);
+      global.lock.Unlock();
+    }
+    if (!tasks.empty()) {
+      task = tasks.back();
+      tasks.pop_back();
+    }
+  }
+  if (task == nullptr) {
+    task = new FiberTask();
+  }
+  task->fn = std::move(fn);
+  task->shareStack = shareStack;
+  return task;
+}
+
+static void FreeTask(FiberTask* task) {
+  if (localTaskCacheDestroyed) {
+    delete task;
+    return;
+  }
+  auto&& tasks = localTaskCache.tasks;
+  tasks.push_back(task);
+  if (tasks.size() < TASK_CACHE_BATCH_ * 2) return;
+  auto&& global = GetGlobalTaskCache();
+  global.lock.Lock();
+  size_t n = std::min(TASK_CACHE_BATCH_, TASK_CACHE_WATERMARK_ - std::min(global.tasks.size(), TASK_CACHE_WATERMARK_));
+  global.tasks.insert(global.tasks.end(), tasks.end() - n, tasks.end());
+  global.lock.Unlock();
+  tasks.resize(tasks.size() - n);
+  while (tasks.size() > TASK_CACHE_BATCH_) {
+    delete tasks.back();
+    tasks.pop_back();
+  }
+}
+
+/**
+ * @brief 运行一个任务：从协程池中取出一个协程执行它.
+ *
+ * @param env 当前线程的协程环境
+ * @param task 待运行的任务，运行后被释放
+ */
+static void RunTask(FiberEnvironment* env, FiberTask* task,
+                    bool pinned = false) {
+  Fiber* fiber = env->GetFiberFromPool(task->shareStack);
+  fiber->Reset(std::move(task->fn));
+  fiber->SetPinned(pinned);
+  FreeTask(task);
+  fiber->Resume();
+}
+
 void threadRoutine(int i, MultiThreadFiberScheduler* sc) {
   auto env = FiberEnvironment::GetInstance();
   auto tmWheel = env->pTimeWheel_;
   auto events = env->epollEvents_;
-  auto&& pendingTasks = env->raisedTasks_;
-  std::deque<std::function<void()>> stealedTasks;
-  std::deque<Fiber*> signaledFibers;
+  auto&& runQueue = *sc->runQueues[i];
+  FiberTaskList pinnedTasks;
+  std::deque<Fiber*> yieldFibers;
+  ReadyList signaledFibers;
   env->threadId_ = i;
+  localRunQueue = &runQueue;
+  localPinnedTasks = &pinnedTasks;
+  localThreadIndex = i;
+  MonotonicClock::OwnThreadCache(true);
   const auto thread_num = sc->threadNum;
   bool wannaQuit = false;
+  bool retry = false;    /*> 上一轮没有拿到全局队列的锁，需要尽快重试 */
+  FiberEnvironment* stealFrom = nullptr; /*> 请求过迁移就绪协程的线程 */
+  unsigned seed = i + 1; /*> 选择窃取对象的随机数种子 */
+
+  sc->mutex.Lock();
+  sc->envs[i] = env;
+  sc->mutex.Unlock();
 
   while (true) {
-    int eventNum = env->EpollWait(1);  // wait for 1 ms
+    // 没有可运行的任务时，阻塞到下一个超时事件到期，新任务和同步类的唤醒通过 eventfd 打断阻塞
+    // 刚变为空闲但还没有登记退出意愿的线程也不能阻塞，否则会拖慢进程退出
+    uint64_t waitUs = 0;
+    bool unregisteredIdle = !wannaQuit && env->currentFiberCount_ == 0 &&
+                            stealFrom == nullptr;
+    if (!retry && !unregisteredIdle && runQueue.Empty() &&
+        pinnedTasks.empty() && env->userYieldFiberQ_.empty()) {
+      waitUs = tmWheel->NextTimeout(RefreshTickUS(),
+                                    FiberEnvironment::MAX_EPOLL_TIMEOUT_);
+    }
+    if (waitUs != 0) {
+      // 先声明即将阻塞再检查一遍是否有新工作，与生产者的唤醒配对，避免丢失唤醒
+      env->sleeping_.store(true);
+      if (isaccept == false) {
+        env->idle_.store(true);
+        sc->idleThreadCount.fetch_add(1);
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      bool hasWork = env->HasReadyFibers();
+      if (isaccept == false) {
+        for (int k = 0; k < thread_num && !hasWork; k++) {
+          hasWork = !sc->runQueues[k]->Empty();
+        }
+      }
+      sc->mutex.Lock();
+      hasWork = hasWork || !sc->pinnedTasks[i].empty() ||
+                (isaccept == false && !sc->commTasks.empty());
+      sc->mutex.Unlock();
+      if (hasWork) waitUs = 0;
+    }
+
+    // 本轮积攒的 io_uring 请求一次性交给内核
+    if (env->pUring_) env->pUring_->Submit();
+
+    int eventNum = env->EpollWait(waitUs);
+
+    if (env->idle_.exchange(false)) {
+      sc->idleThreadCount.fetch_sub(1);
+    }
+    env->sleeping_.store(false);
 
-    if (sc->mutex.TryLock()) {
+    retry = !sc->mutex.TryLock();
+    if (!retry) {
+      // 从全局队列中只取走均摊到每个线程的那一份，剩下的留给其他线程
       if (isaccept == false && !sc->commTasks.empty()) {
-        stealedTasks.swap(sc->commTasks);
-        if (wannaQuit == true) {
-          wannaQuit = false;
-          --sc->wannaQuitThreadCount;
+        size_t share = (sc->commTasks.size() + thread_num - 1) / thread_num;
+        while (share-- > 0 && runQueue.Push(sc->commTasks.front())) {
+          sc->commTasks.pop_front();
+        }
+      }
+
+      // 其他线程指定给本线程的任务
+      auto&& pinned = sc->pinnedTasks[i];
+      while (!pinned.empty()) {
+        FiberTask* task = pinned.front();
+        pinned.pop_front();
+        pinnedTasks.push_back(task);
+      }
+
+      // 本线程无事可做时，请求可以迁移的就绪协程最多的线程交一部分给自己.
+      // 请求被处理之前不登记退出意愿，以免协程迁移过来之前其他线程误判所有线程都已空闲
+      if (stealFrom != nullptr && stealFrom->stealRequest_.load() != env) {
+        stealFrom = nullptr;
+      }
+      if (stealFrom == nullptr && isaccept == false &&
+          sc->migration.load(std::memory_order_relaxed) && runQueue.Empty() &&
+          pinnedTasks.empty() && env->userYieldFiberQ_.empty()) {
+        bool hasReady = env->HasReadyFibers();
+        FiberEnvironment* victim = nullptr;
+        size_t most = FiberEnvironment::MIGRATE_MIN_READY_ - 1;
+        for (int k = 0; k < thread_num && !hasReady; k++) {
+          FiberEnvironment* other = sc->envs[k];
+          if (k == i || other == nullptr) continue;
+          size_t n = other->readyHint_.load(std::memory_order_relaxed);
+          if (n > most) {
+            most = n;
+            victim = other;
+          }
+        }
+        FiberEnvironment* expected = nullptr;
+        if (victim != nullptr &&
+            victim->stealRequest_.compare_exchange_strong(expected, env)) {
+          stealFrom = victim;
+          victim->Wakeup();
         }
       }
 
-      // if is false, check could to true or not.
-      if (wannaQuit == false && stealedTasks.empty() &&
-          env->currentFiberCount_ == 0) {
-        wannaQuit = true;
-        ++sc->wannaQuitThreadCount;
+      // 本地没有任务也没有协程时，线程才愿意退出
+      bool idle = runQueue.Empty() && pinnedTasks.empty() &&
+                  env->currentFiberCount_ == 0 && stealFrom == nullptr;
+      if (wannaQuit != idle) {
+        wannaQuit = idle;
+        sc->wannaQuitThreadCount += idle ? 1 : -1;
       }
 
       // check break.
-      if (sc->wannaQuitThreadCount == thread_num && stealedTasks.empty() &&
-          env->currentFiberCount_ == 0) {
+      bool noPinned = true;
+      for (int k = 0; k < thread_num && noPinned; k++) {
+        noPinned = sc->pinnedTasks[k].empty();
+      }
+      if (sc->wannaQuitThreadCount == thread_num && idle &&
+          sc->commTasks.empty() && noPinned) {
+        // 其他线程可能正阻塞在 epoll_wait 上，唤醒它们一起退出
+        sc->envs[i] = nullptr;
+        sc->WakeupAllThreads();
         sc->mutex.Unlock();
         // printf("%d exit\n", i);
         break;
@@ -866,6 +3434,30 @@ void threadRoutine(int i, MultiThreadFiberScheduler* sc) {
       sc->mutex.Unlock();
     }
 
+    // 本地队列为空时，从随机选择的其他线程的队列中窃取一半的任务
+    if (isaccept == false && runQueue.Empty()) {
+      int start = rand_r(&seed) % thread_num;
+      for (int k = 0; k < thread_num; k++) {
+        int victim = (start + k) % thread_num;
+        auto&& victimQueue = *sc->runQueues[victim];
+        size_t count = victimQueue.Size();
+        if (victim == i || count == 0) continue;
+        if (wannaQuit) {
+          // 先撤销退出意愿，避免其他线程在窃取期间误判所有线程都已空闲
+          sc->mutex.Lock();
+          wannaQuit = false;
+          --sc->wannaQuitThreadCount;
+          sc->mutex.Unlock();
+        }
+        for (count = (count + 1) / 2; count > 0; count--) {
+          FiberTask* task = victimQueue.Steal();
+          if (task == nullptr) break;
+          runQueue.Push(task);
+        }
+        break;
+      }
+    }
+
     auto active = env->pActiveList_;
     auto timeout = env->pTimeoutList_;
 
@@ -874,6 +3466,10 @@ void threadRoutine(int i, MultiThreadFiberScheduler* sc) {
     // get all the arrivedNode.
     for (int i = 0; i < eventNum; i++) {
       auto arrivedNode = (StTimeoutItem*)events[i].data.ptr;
+      if (arrivedNode == nullptr) {
+        env->DrainWakeup();
+        continue;
+      }
       if (arrivedNode->pfnPrepare) {
         arrivedNode->pfnPrepare(arrivedNode, events[i], &active);
       } else {
@@ -882,7 +3478,7 @@ void threadRoutine(int i, MultiThreadFiberScheduler* sc) {
     }
 
     // get all the timeoutNode.
-    auto now = GetTickMS();
+    auto now = RefreshTickUS();
     tmWheel->TakeAllTimeout(now, &timeout);
 
     auto lp = timeout.head_;
@@ -911,48 +3507,68 @@ void threadRoutine(int i, MultiThreadFiberScheduler* sc) {
       lp = active.head_;
     }
 
-    for (auto&& task : stealedTasks) {
-      Fiber* fiber = env->GetFiberFromPool();
-      fiber->Reset(task);
-      fiber->Resume();
+    // 只运行本轮开始时已有的任务，新产生的任务留到下一轮，避免饿死 epoll 事件
+    for (size_t n = runQueue.Size(); n > 0; n--) {
+      FiberTask* task = runQueue.Pop();
+      if (task == nullptr) break;
+      RunTask(env, task);
+    }
+    for (size_t n = pinnedTasks.size(); n > 0; n--) {
+      FiberTask* task = pinnedTasks.front();
+      pinnedTasks.pop_front();
+      RunTask(env, task, true);
     }
 
-    stealedTasks.clear();
-
-    for (auto usrYieldFiber : env->userYieldFiberQ_) {
+    // 恢复运行的协程可能再次 yield，先取出本轮的队列，再次 yield 的留到下一轮
+    yieldFibers.swap(env->userYieldFiberQ_);
+    for (auto usrYieldFiber : yieldFibers) {
       usrYieldFiber->Resume();
     }
 
-    env->userYieldFiberQ_.clear();
+    yieldFibers.clear();
 
-    env->lockForSyncSignalFiberQ_.Lock();
-    if (!env->syncSignalFiberQ_.empty()) {
-      // printf("//////////。。。。。\n");
-    }
-    signaledFibers.swap(env->syncSignalFiberQ_);
-    env->lockForSyncSignalFiberQ_.Unlock();
+    env->TakeReadyFibers(signaledFibers);
 
-    for (auto fb : signaledFibers) {
-      fb->Resume();
+    // 积压较多时叫醒一个空闲线程，让它来请求迁移；处理过程中随时响应迁移请求，
+    // 交出去的是还没有运行的协程
+    size_t migratable = 0;
+    for (Fiber* fb = signaledFibers.head; fb != nullptr; fb = fb->pNextReady_) {
+      migratable += fb->IsMigratable();
+    }
+    env->readyHint_.store(migratable, std::memory_order_relaxed);
+    env->AnswerStealRequest(signaledFibers);
+    if (migratable >= FiberEnvironment::MIGRATE_MIN_READY_ &&
+        sc->migration.load(std::memory_order_relaxed)) {
+      sc->WakeupIdleThread();
     }
 
-    signaledFibers.clear();
+    while (!signaledFibers.Empty()) {
+      if (env->stealRequest_.load(std::memory_order_relaxed) != nullptr) {
+        env->AnswerStealRequest(signaledFibers);
+        if (signaledFibers.Empty()) break;
+      }
+      signaledFibers.PopFront()->Resume();
+    }
+    env->readyHint_.store(0, std::memory_order_relaxed);
 
-    // sc->mutex.Lock();
-    // if (sc->commTasks.empty()) {
-    //   sc->commTasks.swap(pendingTasks);
-    // } else {
-    //   for (auto&& task : pendingTasks) {
-    //     sc->commTasks.emplace_back(std::move(task));
-    //   }
-    // }
-    // sc->mutex.Unlock();
-    // pendingTasks.clear();
+    env->TrimFiberPool(sc->fiberPoolWatermark.load(std::memory_order_relaxed));
   }
+
+  localRunQueue = nullptr;
+  localPinnedTasks = nullptr;
+  localThreadIndex = -1;
+  MonotonicClock::OwnThreadCache(false);
 }
 
 MultiThreadFiberScheduler::MultiThreadFiberScheduler(int threadNum)
     : threadNum(threadNum) {
+  for (int i = 0; i < threadNum; i++) {
+    this->runQueues.emplace_back(new WorkStealingQueue<FiberTask*>());
+  }
+  this->envs.resize(threadNum, nullptr);
+  this->pinnedTasks.resize(threadNum);
+  this->migration = false;
+  this->fiberPoolWatermark = FiberEnvironment::FIBER_POOL_WATERMARK_;
   FiberEnvironment::GetInstance()->threadId_ = -1;
   for (int i = 1; i < threadNum; i++) {
     this->threads.emplace_back(std::bind(threadRoutine, i, this));
@@ -963,6 +3579,18 @@ MultiThreadFiberScheduler::~MultiThreadFiberScheduler() {
   for (auto&& thread : threads) {
     thread.join();
   }
+  while (!commTasks.empty()) {
+    FiberTask* task = commTasks.front();
+    commTasks.pop_front();
+    delete task;
+  }
+  for (auto&& tasks : pinnedTasks) {
+    while (!tasks.empty()) {
+      FiberTask* task = tasks.front();
+      tasks.pop_front();
+      delete task;
+    }
+  }
 }
 
 MultiThreadFiberScheduler& MultiThreadFiberScheduler::GetInstance() {
@@ -970,18 +3598,60 @@ MultiThreadFiberScheduler& MultiThreadFiberScheduler::GetInstance() {
   return x;
 }
 
-void MultiThreadFiberScheduler::Schedule(const std::function<void()>& fn) {
+void MultiThreadFiberScheduler::Schedule(FiberFunc&& fn, bool shareStack) {
+  Schedule(AllocTask(std::move(fn), shareStack));
+}
+
+void MultiThreadFiberScheduler::Schedule(FiberTask* task) {
+  // accept 所在的线程把新任务交给全局队列，让新连接尽量分散到其他线程
+  if (localRunQueue != nullptr && isaccept == false &&
+      localRunQueue->Push(task)) {
+    WakeupIdleThread();
+    return;
+  }
+  mutex.Lock();
+  commTasks.push_back(task);
+  mutex.Unlock();
+  WakeupIdleThread();
+}
+
+void MultiThreadFiberScheduler::ScheduleOn(int thread, FiberFunc&& fn,
+                                           bool shareStack) {
+  FiberTask* task = AllocTask(std::move(fn), shareStack);
+  if (thread == localThreadIndex) {
+    localPinnedTasks->push_back(task);
+    return;
+  }
   mutex.Lock();
-  commTasks.push_back(fn);
+  pinnedTasks[thread].push_back(task);
+  FiberEnvironment* env = envs[thread];
+  if (env != nullptr) {
+    if (env->idle_.exchange(false)) idleThreadCount.fetch_sub(1);
+    env->Wakeup();
+  }
   mutex.Unlock();
 }
 
-void MultiThreadFiberScheduler::Schedule(std::function<void()>&& fn) {
+void MultiThreadFiberScheduler::WakeupIdleThread() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (idleThreadCount.load(std::memory_order_relaxed) == 0) return;
   mutex.Lock();
-  commTasks.push_back(fn);
+  for (auto env : envs) {
+    if (env != nullptr && env->idle_.exchange(false)) {
+      idleThreadCount.fetch_sub(1);
+      env->Wakeup();
+      break;
+    }
+  }
   mutex.Unlock();
 }
 
+void MultiThreadFiberScheduler::WakeupAllThreads() {
+  for (auto env : envs) {
+    if (env != nullptr) env->Wakeup();
+  }
+}
+
 }  // namespace pio::fiber
 
 namespace pio::this_fiber {
@@ -997,20 +3667,26 @@ pio::fiber::Fiber* co_self() {
   return env->pCallStack_[env->callStackSize_ - 1];
 }
 
-void sleep_for(const std::chrono::milliseconds& ms) {
+void sleep_for(const std::chrono::microseconds& us) {
   if (co_self()->IsMain()) {
-    std::this_thread::sleep_for(ms);
+    std::this_thread::sleep_for(us);
     return;
   }
 
-  auto timeout = fiber::StTimeoutItem();
+  // 共享栈上的协程切出后栈内容会被覆盖，超时结点只能放在堆上
+  fiber::StTimeoutItem stackItem;
+  auto self = co_self();
+  auto pItem = self->IsShareStack() ? new fiber::StTimeoutItem() : &stackItem;
+  auto&& timeout = *pItem;
   timeout.pfnProcess = fiber::OnPollProcess;
-  timeout.pArg = co_self();
-  auto now = fiber::GetTickMS();
-  timeout.ullExpireTime = now + ms.count();
+  timeout.pArg = self;
+  // 刷新一次时钟，避免缓存的时间偏旧导致提前唤醒
+  auto now = fiber::RefreshTickUS();
+  timeout.ullExpireTime = now + us.count();
   fiber::FiberEnvironment::GetInstance()->pTimeWheel_->AddTimeout(&timeout,
                                                                   now);
-  co_self()->Yield();
+  self->Yield();
+  if (pItem != &stackItem) delete pItem;
 }
 
 void sleep_until(
@@ -1021,16 +3697,26 @@ void sleep_until(
     return;
   }
 
-  auto timeout = fiber::StTimeoutItem();
+  fiber::StTimeoutItem stackItem;
+  auto self = co_self();
+  auto pItem = self->IsShareStack() ? new fiber::StTimeoutItem() : &stackItem;
+  auto&& timeout = *pItem;
   timeout.pfnProcess = fiber::OnPollProcess;
-  timeout.pArg = co_self();
-  auto now = fiber::GetTickMS();
-  timeout.ullExpireTime =
-      duration_cast<milliseconds>(time_point.time_since_epoch()).count();
-  if (fiber::FiberEnvironment::GetInstance()->pTimeWheel_->AddTimeout(
+  timeout.pArg = self;
+  // time_point 来自系统时钟，换算成相对时间后再加到单调时钟上
+  auto left = ceil<microseconds>(time_point - high_resolution_clock::now());
+  auto now = fiber::RefreshTickUS();
+  timeout.ullExpireTime = now + (left.count() > 0 ? left.count() : 0);
+  if (left.count() > 0 && fiber::FiberEnvironment::GetInstance()->pTimeWheel_->AddTimeout(
           &timeout, now) == 0) {
-    co_self()->Yield();
+    self->Yield();
   }
+  if (pItem != &stackItem) delete pItem;
+}
+
+void sleep_until(const MonotonicClock::time_point& time_point) {
+  auto left = time_point - MonotonicClock::Refresh();
+  if (left.count() > 0) sleep_for(left);
 }
 
 void yield() {
@@ -1043,14 +3729,36 @@ void yield() {
   self->Yield();
 }
 
+pio::fiber::cancel_token get_cancel_token() {
+  return co_self()->GetCancelToken();
+}
+
+bool is_cancelled() { return co_self()->IsCancelled(); }
+
 void enable_system_hook() { co_self()->EnableHook(); }
 
+void pin_to_thread(bool pinned) {
+  auto self = co_self();
+  if (!self->IsMain()) self->SetPinned(pinned);
+}
+
 void disable_system_hook() { co_self()->DisableHook(); }
 
 }  // namespace pio::this_fiber
 
 typedef int (*poll_pfn_t)(struct pollfd fds[], nfds_t nfds, int timeout);
 
+/**
+ * @brief 从 epoll 中注销 poll 的临时注册，关闭为此复制的描述符.
+ */
+static void co_poll_unregister(int epfd, pio::fiber::StCoPollItem* item) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, item->RegisteredFd(), &item->stEvent);
+  if (item->iDupFd >= 0) {
+    syscall(SYS_close, item->iDupFd);
+    item->iDupFd = -1;
+  }
+}
+
 int co_poll_inner(pollfd fds[], nfds_t nfds, int timeout, poll_pfn_t pollfunc) {
   if (timeout == 0) {
     return pollfunc(fds, nfds, timeout);
@@ -1065,8 +3773,9 @@ int co_poll_inner(pollfd fds[], nfds_t nfds, int timeout, poll_pfn_t pollfunc) {
   // 1.struct change
   pio::fiber::StCoPoller* arg = new pio::fiber::StCoPoller(epfd, nfds);
 
+  // 共享栈上的协程切出后栈内容会被其他协程覆盖，挂到 epoll 和时间轮上的结点不能放在栈上
   pio::fiber::StCoPollItem arr[2];
-  if (nfds < 2) {
+  if (nfds < 2 && !self->IsShareStack()) {
     arg->pPollItems = arr;
   } else {  // 如果监听的描述符在2个及以上
     arg->pPollItems = new pio::fiber::StCoPollItem[nfds];
@@ -1092,13 +3801,40 @@ int co_poll_inner(pollfd fds[], nfds_t nfds, int timeout, poll_pfn_t pollfunc) {
       ev.events = pio::fiber::StCoPoller::PollEvent2Epoll(fds[i].events);
 
       int ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i].fd, &ev);
+      if (ret < 0 && errno == EEXIST) {
+        // 描述符已经常驻在本线程的 epoll 中(见 StFdEvent)，同一个描述符号不能重复注册，
+        // 改为注册它的一个副本：epoll 按(描述符号, 打开的文件)区分注册，事件是同一个文件的
+        int dupFd = syscall(SYS_fcntl, fds[i].fd, F_DUPFD_CLOEXEC, 0);
+        if (dupFd >= 0) {
+          arg->pPollItems[i].iDupFd = dupFd;
+          ret = epoll_ctl(epfd, EPOLL_CTL_ADD, dupFd, &ev);
+          if (ret < 0) {
+            int err = errno;
+            syscall(SYS_close, dupFd);
+            arg->pPollItems[i].iDupFd = -1;
+            errno = err;
+          }
+        }
+      }
 
-      if (ret < 0 && errno == EPERM && nfds == 1 && pollfunc != NULL) {
+      if (ret < 0 && ((errno == EPERM && nfds == 1 && pollfunc != NULL) ||
+                      errno == EMFILE || errno == ENFILE)) {
+        int err = errno;
+        for (nfds_t j = 0; j < i; j++) {
+          if (fds[j].fd > -1) {
+            co_poll_unregister(epfd, &arg->pPollItems[j]);
+          }
+        }
         if (arg->pPollItems != arr) {
           delete[] arg->pPollItems;
           arg->pPollItems = NULL;
         }
         delete arg;
+        if (err != EPERM) {
+          // 没有描述符号可以用来复制常驻的描述符
+          errno = err;
+          return -1;
+        }
         return pollfunc(fds, nfds, timeout);
       }
     }
@@ -1106,9 +3842,13 @@ int co_poll_inner(pollfd fds[], nfds_t nfds, int timeout, poll_pfn_t pollfunc) {
   }
 
   // 3.add timeout
-  unsigned long long now = pio::fiber::GetTickMS();
-  arg->ullExpireTime = timeout > 0 ? (now + timeout) : UINT64_MAX;
-  int ret = env->pTimeWheel_->AddTimeout(arg, now);
+  // 没有超时限制时不需要挂到时间轮上
+  int ret = 0;
+  if (timeout > 0) {
+    unsigned long long now = pio::fiber::GetTickUS();
+    arg->ullExpireTime = now + timeout * 1000ULL;
+    ret = env->pTimeWheel_->AddTimeout(arg, now);
+  }
   int iRaiseCnt = 0;
   if (ret != 0) {
     errno = EINVAL;
@@ -1122,9 +3862,8 @@ int co_poll_inner(pollfd fds[], nfds_t nfds, int timeout, poll_pfn_t pollfunc) {
   // clear epoll status and memory
   arg->RemoveFromLink();
   for (nfds_t i = 0; i < nfds; i++) {
-    int fd = fds[i].fd;
-    if (fd > -1) {
-      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &arg->pPollItems[i].stEvent);
+    if (fds[i].fd > -1) {
+      co_poll_unregister(epfd, &arg->pPollItems[i]);
     }
     fds[i].revents = arg->fds[i].revents;
   }
@@ -1139,6 +3878,100 @@ int co_poll_inner(pollfd fds[], nfds_t nfds, int timeout, poll_pfn_t pollfunc) {
   return iRaiseCnt;
 }
 
+pio::fiber::StFdEvent* co_fd_event_new(int fd) {
+  return new pio::fiber::StFdEvent(fd);
+}
+
+void co_fd_event_delete(pio::fiber::StFdEvent* ev) { delete ev; }
+
+int co_fd_event_wait(pio::fiber::StFdEvent* ev, short events,
+                     const pio::MonotonicClock::time_point& deadline) {
+  return ev->Wait(events, deadline);
+}
+
+void co_fd_event_close(pio::fiber::StFdEvent* ev) { ev->Close(); }
+
+void co_fd_event_closed(pio::fiber::StFdEvent* ev) { ev->Closed(); }
+
+unsigned co_uring_features() {
+  if (pio::fiber::CurrentFiber() == nullptr) return 0;
+  auto ring = pio::fiber::FiberEnvironment::GetInstance()->GetUring();
+  return ring ? ring->features : 0;
+}
+
+bool co_uring_supported(int op) {
+  if (pio::fiber::CurrentFiber() == nullptr) return false;
+  auto ring = pio::fiber::FiberEnvironment::GetInstance()->GetUring();
+  return ring && op >= 0 && op < IORING_OP_LAST && ring->ops[op];
+}
+
+int co_uring_submit_wait(const io_uring_sqe& sqe,
+                         const pio::MonotonicClock::time_point& deadline) {
+  using namespace pio::fiber;
+  Fiber* self = CurrentFiber();
+  // 共享栈上的请求结点和缓冲区在协程切出后会被其他协程覆盖
+  if (self == nullptr || self->IsMain() || self->IsShareStack()) return -ENOSYS;
+  StUring* ring = FiberEnvironment::GetInstance()->GetUring();
+  if (ring == nullptr) return -ENOSYS;
+  bool timed = deadline != pio::MonotonicClock::time_point::max();
+  if (!ring->Reserve(timed ? 2 : 1)) return -EAGAIN;
+
+  StUringRequest req;
+  io_uring_sqe* slot = ring->GetSqe();
+  *slot = sqe;
+  slot->user_data = (uint64_t)&req;
+  req.pArg = self;
+  req.pfnProcess = OnPollProcess;
+
+  // 超时通过链接在后面的 LINK_TIMEOUT 实现，超时的请求以 -ECANCELED 完成
+  __kernel_timespec ts;
+  if (timed) {
+    auto left = std::max(deadline - pio::MonotonicClock::Refresh(),
+                         pio::MonotonicClock::duration::zero());
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+    ts.tv_sec = ns / 1000'000'000;
+    ts.tv_nsec = ns % 1000'000'000;
+    slot->flags |= IOSQE_IO_LINK;
+    io_uring_sqe* timeout = ring->GetSqe();
+    timeout->opcode = IORING_OP_LINK_TIMEOUT;
+    timeout->addr = (uint64_t)&ts;
+    timeout->len = 1;
+    timeout->user_data = 0;
+  }
+  self->Yield();
+  return req.res;
+}
+
+pio::fiber::StUringSocket* co_uring_socket_new(int fd) {
+  return new pio::fiber::StUringSocket(fd);
+}
+
+ssize_t co_uring_socket_recv(pio::fiber::StUringSocket* sock, const iovec* iov,
+                             int count, int flags,
+                             const pio::MonotonicClock::time_point& deadline) {
+  return sock->Recv(iov, count, flags, deadline);
+}
+
+int co_uring_socket_accept(pio::fiber::StUringSocket* sock, bool nonblock,
+                           const pio::MonotonicClock::time_point& deadline) {
+  return sock->Accept(nonblock, deadline);
+}
+
+int co_uring_socket_wait(pio::fiber::StUringSocket* sock,
+                         const pio::MonotonicClock::time_point& deadline) {
+  return sock->WaitReadable(deadline);
+}
+
+bool co_uring_socket_active(pio::fiber::StUringSocket* sock) {
+  return sock->Active();
+}
+
+void co_uring_socket_delete(pio::fiber::StUringSocket* sock) { delete sock; }
+
+void co_uring_socket_close(pio::fiber::StUringSocket* sock, bool fdOpen) {
+  sock->Close(fdOpen);
+}
+
 int co_poll(pollfd fds[], nfds_t nfds, int timeout_ms) {
   return co_poll_inner(fds, nfds, timeout_ms, NULL);
 }
\ No newline at end of file
@@ -0,0 +1,177 @@
+#include "fiber/file.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "fiber/fiber.h"
+#include "co_errno.h"
+
+extern unsigned co_uring_features();
+extern bool co_uring_supported(int op);
+extern int co_uring_submit_wait(const io_uring_sqe& sqe,
+                                const pio::MonotonicClock::time_point& deadline);
+
+namespace pio::fiber::file {
+
+namespace {
+
+const size_t kMaxRw = 0x7ffff000; /*> 一次读写的上限，与内核的 MAX_RW_COUNT 相同 */
+
+// 系统调用风格的返回值(-1 和 errno)换成 -errno，以便从线程池的线程中带回来
+long ToNegErrno(long ret) { return ret < 0 ? -errno : ret; }
+
+// -errno 换回系统调用风格的返回值
+long FromNegErrno(long ret) {
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+/**
+ * @brief 执行一个文件操作.
+ *
+ * @param op 对应的 IORING_OP_*，为负时表示不能使用 io_uring
+ * @param sqe 填好的请求(user_data 除外)
+ * @param fn 同步执行的版本，返回值同系统调用，不能调用被 hook 的函数
+ * @return long 同系统调用
+ */
+template <typename F>
+long Execute(int op, const io_uring_sqe& sqe, F&& fn) {
+  Fiber* self = CurrentFiber();
+  if (self == nullptr || self->IsMain() || self->IsShareStack()) {
+    return fn();
+  }
+  if (op >= 0 && co_uring_supported(op)) {
+    int res = co_uring_submit_wait(sqe, MonotonicClock::time_point::max());
+    // -EAGAIN 表示提交队列已满，改用线程池
+    if (res != -EAGAIN) return FromNegErrno(res);
+  }
+  return FromNegErrno(
+      this_fiber::run_blocking([&fn] { return ToNegErrno(fn()); }));
+}
+
+io_uring_sqe MakeRw(int op, int fd, const void* buf, size_t count, off_t off) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = op;
+  sqe.fd = fd;
+  sqe.addr = (uint64_t)buf;
+  sqe.len = (uint32_t)std::min(count, kMaxRw);
+  sqe.off = (uint64_t)off;
+  return sqe;
+}
+
+// 在当前文件位置上读写(offset 为 -1)需要内核支持 IORING_FEAT_RW_CUR_POS
+int CurPosOp(int op) {
+  return (co_uring_features() & IORING_FEAT_RW_CUR_POS) ? op : -1;
+}
+
+}  // namespace
+
+int open(const char* path, int flags, mode_t mode) {
+  return openat(AT_FDCWD, path, flags, mode);
+}
+
+int openat(int dirfd, const char* path, int flags, mode_t mode) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_OPENAT;
+  sqe.fd = dirfd;
+  sqe.addr = (uint64_t)path;
+  sqe.len = mode;
+  sqe.open_flags = flags;
+  return Execute(IORING_OP_OPENAT, sqe, [=] {
+    return syscall(SYS_openat, dirfd, path, flags, mode);
+  });
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+  auto sqe = MakeRw(IORING_OP_READ, fd, buf, count, -1);
+  return Execute(CurPosOp(IORING_OP_READ), sqe, [=] {
+    return syscall(SYS_read, fd, buf, count);
+  });
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  auto sqe = MakeRw(IORING_OP_WRITE, fd, buf, count, -1);
+  return Execute(CurPosOp(IORING_OP_WRITE), sqe, [=] {
+    return syscall(SYS_write, fd, buf, count);
+  });
+}
+
+ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+  auto sqe = MakeRw(IORING_OP_READ, fd, buf, count, offset);
+  return Execute(IORING_OP_READ, sqe, [=] {
+    return syscall(SYS_pread64, fd, buf, count, offset);
+  });
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
+  auto sqe = MakeRw(IORING_OP_WRITE, fd, buf, count, offset);
+  return Execute(IORING_OP_WRITE, sqe, [=] {
+    return syscall(SYS_pwrite64, fd, buf, count, offset);
+  });
+}
+
+int fsync(int fd) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_FSYNC;
+  sqe.fd = fd;
+  return Execute(IORING_OP_FSYNC, sqe, [=] { return syscall(SYS_fsync, fd); });
+}
+
+int fdatasync(int fd) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_FSYNC;
+  sqe.fd = fd;
+  sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+  return Execute(IORING_OP_FSYNC, sqe,
+                 [=] { return syscall(SYS_fdatasync, fd); });
+}
+
+int statx(int dirfd, const char* path, int flags, unsigned int mask,
+          struct statx* buf) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_STATX;
+  sqe.fd = dirfd;
+  sqe.addr = (uint64_t)path;
+  sqe.len = mask;
+  sqe.off = (uint64_t)buf;
+  sqe.statx_flags = flags;
+  return Execute(IORING_OP_STATX, sqe, [=] {
+    return syscall(SYS_statx, dirfd, path, flags, mask, buf);
+  });
+}
+
+int stat(const char* path, struct stat* buf) {
+  struct statx stx;
+  if (file::statx(AT_FDCWD, path, 0, STATX_BASIC_STATS, &stx) < 0) return -1;
+  memset(buf, 0, sizeof(*buf));
+  buf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  buf->st_ino = stx.stx_ino;
+  buf->st_mode = stx.stx_mode;
+  buf->st_nlink = stx.stx_nlink;
+  buf->st_uid = stx.stx_uid;
+  buf->st_gid = stx.stx_gid;
+  buf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  buf->st_size = stx.stx_size;
+  buf->st_blksize = stx.stx_blksize;
+  buf->st_blocks = stx.stx_blocks;
+  buf->st_atim = {stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec};
+  buf->st_mtim = {stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec};
+  buf->st_ctim = {stx.stx_ctime.tv_sec, stx.stx_ctime.tv_nsec};
+  return 0;
+}
+
+}  // namespace pio::fiber::file
@@ -0,0 +1,479 @@
+#include "fiber/resolver.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <random>
+
+#include "fiber/fiber.h"
+
+namespace pio::fiber {
+
+namespace {
+
+const size_t kMaxEntries = 4096;      /*> 缓存项的上限，超过时先淘汰过期的项 */
+const uint32_t kMaxTtl = 86400;       /*> 肯定应答最长缓存一天 */
+const uint32_t kMaxNegativeTtl = 3600;  /*> 否定应答最长缓存一小时 */
+const uint32_t kDefaultNegativeTtl = 30; /*> 否定应答中没有 SOA 时的缓存时间 */
+const size_t kMaxPacket = 4096;       /*> 接收应答的缓冲区大小 */
+
+const uint16_t kTypeA = 1;
+const uint16_t kTypeCname = 5;
+const uint16_t kTypeSoa = 6;
+const uint16_t kTypeAaaa = 28;
+const uint16_t kClassIn = 1;
+
+// 应答的分类
+enum ParseResult {
+  kIgnore,      /*> 不是本次查询的应答，继续等待 */
+  kAnswer,      /*> 得到了地址 */
+  kNoName,      /*> 名字不存在或没有该类型的记录 */
+  kServerFail,  /*> 名字服务器出错，换下一个 */
+};
+
+uint16_t Get16(const unsigned char* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+uint32_t Get32(const unsigned char* p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief 跳过报文中的一个名字(可能是压缩指针).
+ *
+ * @return bool 名字越界时返回 false
+ */
+bool SkipName(const unsigned char* msg, size_t len, size_t& pos) {
+  while (pos < len) {
+    unsigned char c = msg[pos];
+    if ((c & 0xC0) == 0xC0) {
+      pos += 2;
+      return pos <= len;
+    }
+    if (c == 0) {
+      pos += 1;
+      return true;
+    }
+    pos += 1 + c;
+  }
+  return false;
+}
+
+/**
+ * @brief 构造查询报文，打开递归查询.
+ *
+ * @return bool 名字不合法时返回 false
+ */
+bool BuildQuery(const std::string& name, uint16_t id, uint16_t qtype,
+                std::vector<unsigned char>& pkt) {
+  pkt.assign({(unsigned char)(id >> 8), (unsigned char)id, 0x01, 0x00,
+              0, 1, 0, 0, 0, 0, 0, 0});
+  size_t start = 0;
+  while (start < name.size()) {
+    size_t dot = name.find('.', start);
+    if (dot == std::string::npos) dot = name.size();
+    size_t n = dot - start;
+    if (n == 0 || n > 63) return false;
+    pkt.push_back((unsigned char)n);
+    pkt.insert(pkt.end(), name.begin() + start, name.begin() + dot);
+    start = dot + 1;
+  }
+  pkt.push_back(0);
+  pkt.insert(pkt.end(), {(unsigned char)(qtype >> 8), (unsigned char)qtype,
+                         0, (unsigned char)kClassIn});
+  return pkt.size() <= 512;
+}
+
+/**
+ * @brief 解析应答报文.
+ *
+ * @param ttl 肯定应答时为地址和 CNAME 记录中最小的 TTL，否定应答时为否定缓存的有效期
+ */
+ParseResult ParseReply(const unsigned char* msg, size_t len, uint16_t id,
+                       uint16_t qtype, std::vector<IpAddress>& addrs,
+                       uint32_t& ttl) {
+  if (len < 12 || Get16(msg) != id || !(msg[2] & 0x80)) {
+    return kIgnore;
+  }
+  bool truncated = msg[2] & 0x02;
+  int rcode = msg[3] & 0x0F;
+  uint16_t qdcount = Get16(msg + 4);
+  uint16_t ancount = Get16(msg + 6);
+  uint16_t nscount = Get16(msg + 8);
+
+  size_t pos = 12;
+  for (int i = 0; i < qdcount; i++) {
+    if (!SkipName(msg, len, pos) || pos + 4 > len) return kIgnore;
+    if (Get16(msg + pos) != qtype) return kIgnore;
+    pos += 4;
+  }
+  if (rcode == 3) {
+    // NXDOMAIN，下面按 NODATA 一样从权威部分取 SOA
+    ancount = 0;
+  } else if (rcode != 0) {
+    return kServerFail;
+  }
+
+  const int addrlen = qtype == kTypeA ? 4 : 16;
+  uint32_t minTtl = kMaxTtl;
+  addrs.clear();
+  for (int i = 0; i < ancount + nscount; i++) {
+    if (!SkipName(msg, len, pos) || pos + 10 > len) break;
+    uint16_t type = Get16(msg + pos);
+    uint16_t klass = Get16(msg + pos + 2);
+    uint32_t rrttl = Get32(msg + pos + 4);
+    uint16_t rdlen = Get16(msg + pos + 8);
+    pos += 10;
+    if (pos + rdlen > len) break;
+    const unsigned char* rdata = msg + pos;
+    pos += rdlen;
+    if (klass != kClassIn) continue;
+
+    if (i < ancount) {
+      if (type == qtype && rdlen == addrlen) {
+        IpAddress addr;
+        addr.family = qtype == kTypeA ? AF_INET : AF_INET6;
+        memcpy(qtype == kTypeA ? (void*)&addr.v4 : (void*)&addr.v6, rdata, addrlen);
+        addrs.push_back(addr);
+        minTtl = std::min(minTtl, rrttl);
+      } else if (type == kTypeCname) {
+        minTtl = std::min(minTtl, rrttl);
+      }
+    } else if (type == kTypeSoa && addrs.empty() && rdlen >= 20) {
+      // RFC 2308: 否定应答的有效期取 SOA 记录的 TTL 和 MINIMUM 中较小的一个
+      ttl = std::min({rrttl, Get32(rdata + rdlen - 4), kMaxNegativeTtl});
+      return kNoName;
+    }
+  }
+
+  if (!addrs.empty()) {
+    ttl = minTtl;
+    return kAnswer;
+  }
+  // 被截断的应答里可能本来有地址，交给下一个名字服务器
+  if (truncated) {
+    return kServerFail;
+  }
+  ttl = kDefaultNegativeTtl;
+  return kNoName;
+}
+
+/**
+ * @brief 解析名字服务器的地址.
+ */
+bool ParseServer(const std::string& text, sockaddr_storage& ss, socklen_t& len) {
+  std::string host = text;
+  int port = 53;
+  if (!text.empty() && text[0] == '[') {
+    size_t end = text.find(']');
+    if (end == std::string::npos) return false;
+    host = text.substr(1, end - 1);
+    if (end + 1 < text.size()) {
+      if (text[end + 1] != ':') return false;
+      port = atoi(text.c_str() + end + 2);
+    }
+  } else if (std::count(text.begin(), text.end(), ':') == 1) {
+    size_t colon = text.find(':');
+    host = text.substr(0, colon);
+    port = atoi(text.c_str() + colon + 1);
+  }
+  if (port <= 0 || port > 65535) return false;
+
+  memset(&ss, 0, sizeof(ss));
+  auto v4 = (sockaddr_in*)&ss;
+  auto v6 = (sockaddr_in6*)&ss;
+  if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+    v4->sin_family = AF_INET;
+    v4->sin_port = htons(port);
+    len = sizeof(sockaddr_in);
+    return true;
+  }
+  if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+    v6->sin6_family = AF_INET6;
+    v6->sin6_port = htons(port);
+    len = sizeof(sockaddr_in6);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief 去掉末尾的点并转成小写，作为缓存的键.
+ */
+std::string Normalize(const std::string& name) {
+  std::string s = name;
+  if (!s.empty() && s.back() == '.') s.pop_back();
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+/**
+ * @brief 生成一个随机的查询 ID. 每次调用都重新取当前线程的随机数发生器：
+ * 查询期间协程可能被迁移到其他线程，不能跨过等待持有线程局部对象的地址.
+ */
+__attribute__((noinline)) uint16_t RandomQueryId() {
+  static thread_local std::mt19937 rng(std::random_device{}());
+  return (uint16_t)rng();
+}
+
+}  // namespace
+
+// 名字服务器和超时设置，修改时整体替换
+struct Resolver::Config {
+  struct Server {
+    sockaddr_storage addr;
+    socklen_t         len;
+  };
+
+  std::vector<Server>         servers; /*> 名字服务器 */
+  std::chrono::milliseconds   timeout; /*> 每次查询的超时时间 */
+  int                        attempts; /*> 轮询所有名字服务器的次数 */
+};
+
+// 一个 (类型, 名字) 的缓存项. 第一个查询的协程负责发出请求，
+// 同时到来的查询在 cv 上等待 ready.
+struct Resolver::Entry {
+  fiber::mutex                      mtx;
+  condition_variable                 cv;
+  std::atomic<bool>      ready{false}; /*> 查询是否已经完成，完成后以下成员不再修改 */
+  int                          err = 0; /*> Lookup 的返回值 */
+  std::vector<IpAddress>         addrs; /*> 解析得到的地址 */
+  MonotonicClock::time_point    expire; /*> 过期时间 */
+};
+
+Resolver& Resolver::GetInstance() {
+  static Resolver x;
+  return x;
+}
+
+Resolver::Resolver() {
+  auto config = std::make_shared<Config>();
+  config->timeout = std::chrono::seconds(5);
+  config->attempts = 2;
+
+  char line[512];
+  if (FILE* fp = fopen("/etc/resolv.conf", "r")) {
+    while (fgets(line, sizeof(line), fp)) {
+      char key[32], value[256];
+      if (sscanf(line, "%31s %255s", key, value) != 2) continue;
+      if (strcmp(key, "nameserver") == 0) {
+        Config::Server server;
+        // resolv.conf 中的 IPv6 地址不带方括号，也不带端口
+        std::string text = strchr(value, ':') ? "[" + std::string(value) + "]" : value;
+        if (ParseServer(text, server.addr, server.len)) {
+          config->servers.push_back(server);
+        }
+      } else if (strcmp(key, "options") == 0) {
+        char* save = nullptr;
+        strtok_r(line, " \t\n", &save);
+        for (char* opt = strtok_r(nullptr, " \t\n", &save); opt;
+             opt = strtok_r(nullptr, " \t\n", &save)) {
+          if (strncmp(opt, "timeout:", 8) == 0) {
+            config->timeout = std::chrono::seconds(std::max(1, atoi(opt + 8)));
+          } else if (strncmp(opt, "attempts:", 9) == 0) {
+            config->attempts = std::max(1, atoi(opt + 9));
+          }
+        }
+      }
+    }
+    fclose(fp);
+  }
+  if (config->servers.empty()) {
+    Config::Server server;
+    ParseServer("127.0.0.1", server.addr, server.len);
+    config->servers.push_back(server);
+  }
+  config_ = std::move(config);
+
+  if (FILE* fp = fopen("/etc/hosts", "r")) {
+    while (fgets(line, sizeof(line), fp)) {
+      if (char* comment = strchr(line, '#')) *comment = '\0';
+      char* save = nullptr;
+      char* tok = strtok_r(line, " \t\n", &save);
+      if (tok == nullptr) continue;
+      IpAddress addr;
+      if (inet_pton(AF_INET, tok, &addr.v4) == 1) {
+        addr.family = AF_INET;
+      } else if (inet_pton(AF_INET6, tok, &addr.v6) == 1) {
+        addr.family = AF_INET6;
+      } else {
+        continue;
+      }
+      while ((tok = strtok_r(nullptr, " \t\n", &save)) != nullptr) {
+        hosts_.emplace(Normalize(tok), addr);
+      }
+    }
+    fclose(fp);
+  }
+}
+
+std::shared_ptr<const Resolver::Config> Resolver::GetConfig() {
+  mtx_.Lock();
+  auto config = config_;
+  mtx_.Unlock();
+  return config;
+}
+
+bool Resolver::SetNameservers(const std::vector<std::string>& servers) {
+  std::vector<Config::Server> parsed(servers.size());
+  for (size_t i = 0; i < servers.size(); i++) {
+    if (!ParseServer(servers[i], parsed[i].addr, parsed[i].len)) {
+      return false;
+    }
+  }
+  if (parsed.empty()) {
+    return false;
+  }
+  mtx_.Lock();
+  auto config = std::make_shared<Config>(*config_);
+  config->servers = std::move(parsed);
+  config_ = std::move(config);
+  mtx_.Unlock();
+  return true;
+}
+
+void Resolver::SetTimeout(std::chrono::milliseconds timeout, int attempts) {
+  mtx_.Lock();
+  auto config = std::make_shared<Config>(*config_);
+  config->timeout = timeout;
+  config->attempts = std::max(1, attempts);
+  config_ = std::move(config);
+  mtx_.Unlock();
+}
+
+void Resolver::ClearCache() {
+  mtx_.Lock();
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    if (it->second->ready.load(std::memory_order_acquire)) {
+      it = cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  mtx_.Unlock();
+}
+
+int Resolver::Lookup(const std::string& name, int family,
+                     std::vector<IpAddress>& addrs) {
+  addrs.clear();
+  std::string key = Normalize(name);
+  if (key.empty() || key.size() > 253 || (family != AF_INET && family != AF_INET6)) {
+    return EAI_NONAME;
+  }
+
+  auto range = hosts_.equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.family == family) addrs.push_back(it->second);
+  }
+  if (!addrs.empty()) {
+    return 0;
+  }
+
+  std::string cacheKey = (family == AF_INET ? "4:" : "6:") + key;
+  auto now = MonotonicClock::Refresh();
+  std::shared_ptr<Entry> entry;
+  bool leader = false;
+
+  mtx_.Lock();
+  auto it = cache_.find(cacheKey);
+  if (it != cache_.end() && (!it->second->ready.load(std::memory_order_acquire) ||
+                             it->second->expire > now)) {
+    entry = it->second;
+  } else {
+    if (it == cache_.end() && cache_.size() >= kMaxEntries) {
+      // 先淘汰过期的项，仍然太多时随意淘汰已完成的项
+      for (auto jt = cache_.begin(); jt != cache_.end();) {
+        bool ready = jt->second->ready.load(std::memory_order_acquire);
+        jt = ready && jt->second->expire <= now ? cache_.erase(jt) : std::next(jt);
+      }
+      for (auto jt = cache_.begin(); jt != cache_.end() && cache_.size() >= kMaxEntries;) {
+        jt = jt->second->ready.load(std::memory_order_acquire) ? cache_.erase(jt) : std::next(jt);
+      }
+    }
+    entry = std::make_shared<Entry>();
+    cache_[cacheKey] = entry;
+    leader = true;
+  }
+  mtx_.Unlock();
+
+  if (leader) {
+    uint32_t ttl = 0;
+    entry->err = Query(*GetConfig(), key, family, entry->addrs, ttl);
+    entry->expire = MonotonicClock::Refresh() + std::chrono::seconds(ttl);
+    std::lock_guard<fiber::mutex> lock(entry->mtx);
+    entry->ready.store(true, std::memory_order_release);
+    entry->cv.notify_all();
+  } else if (!entry->ready.load(std::memory_order_acquire)) {
+    std::unique_lock<fiber::mutex> lock(entry->mtx);
+    entry->cv.wait(lock, [&] { return entry->ready.load(std::memory_order_acquire); });
+  }
+  addrs = entry->addrs;
+  return entry->err;
+}
+
+int Resolver::Query(const Config& config, const std::string& name, int family,
+                    std::vector<IpAddress>& addrs, uint32_t& ttl) {
+  const uint16_t qtype = family == AF_INET ? kTypeA : kTypeAaaa;
+
+  std::vector<unsigned char> pkt;
+  std::vector<unsigned char> reply(kMaxPacket);
+  ttl = 0;
+  if (!BuildQuery(name, 0, qtype, pkt)) {
+    return EAI_NONAME;
+  }
+
+  for (int attempt = 0; attempt < config.attempts; attempt++) {
+    for (auto&& server : config.servers) {
+      int fd = socket(server.addr.ss_family, SOCK_DGRAM, 0);
+      if (fd < 0) {
+        continue;
+      }
+      // 连接之后内核只会交上来这个名字服务器的应答
+      if (connect(fd, (const sockaddr*)&server.addr, server.len) != 0) {
+        close(fd);
+        continue;
+      }
+      uint16_t id = RandomQueryId();
+      pkt[0] = id >> 8;
+      pkt[1] = id & 0xFF;
+      if (send(fd, pkt.data(), pkt.size(), 0) != (ssize_t)pkt.size()) {
+        close(fd);
+        continue;
+      }
+
+      auto deadline = DeadlineAfter(config.timeout);
+      ParseResult result = kIgnore;
+      while (result == kIgnore) {
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - MonotonicClock::Refresh());
+        if (left.count() <= 0) break;
+        timeval tv = {(time_t)(left.count() / 1000000),
+                      (suseconds_t)(left.count() % 1000000)};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ssize_t n = recv(fd, reply.data(), reply.size(), 0);
+        if (n < 0) break;
+        result = ParseReply(reply.data(), n, id, qtype, addrs, ttl);
+      }
+      close(fd);
+
+      if (result == kAnswer) {
+        return 0;
+      }
+      if (result == kNoName) {
+        addrs.clear();
+        return EAI_NONAME;
+      }
+    }
+  }
+  addrs.clear();
+  ttl = 0;
+  return EAI_AGAIN;
+}
+
+}  // namespace pio::fiber
@@ -0,0 +1,149 @@
+#include "fiber/server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "fiber/fiber.h"
+#include "co_errno.h"
+
+namespace pio::fiber {
+
+namespace {
+
+const int kMaxAcceptBatch = 64; /*> 连续接受这么多连接后让出一次，让处理连接的协程运行 */
+
+}  // namespace
+
+struct ReusePortServer::State {
+  Handler           handler; /*> 处理连接的函数 */
+  std::vector<int>      fds; /*> 每个调度线程的监听套接字 */
+  std::atomic<bool> stopping; /*> 是否已经调用了 Stop */
+
+  // 服务器和所有接受协程都结束之后才关闭监听套接字，Stop 不会作用到被复用的描述符上
+  ~State() {
+    for (int fd : fds) close(fd);
+  }
+};
+
+ReusePortServer::ReusePortServer(Handler handler)
+    : state_(std::make_shared<State>()), port_(0) {
+  state_->handler = std::move(handler);
+  state_->stopping = false;
+}
+
+ReusePortServer::~ReusePortServer() { Stop(); }
+
+int ReusePortServer::Listen(const char* ip, unsigned short port, int backlog) {
+  if (!state_->fds.empty()) return EALREADY;
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (!ip || '\0' == *ip || 0 == strcmp(ip, "0") ||
+      0 == strcmp(ip, "0.0.0.0") || 0 == strcmp(ip, "*")) {
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  } else if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+    return EINVAL;
+  }
+
+  // 在 hook 之下创建套接字，让监听套接字和协程中创建的一样记录状态(例如可以走 io_uring)
+  Fiber* self = this_fiber::co_self();
+  bool hooked = self->IsHooked();
+  self->EnableHook();
+
+  auto&& sc = MultiThreadFiberScheduler::GetInstance();
+  std::vector<int> fds;
+  int err = 0;
+  for (int i = 0; i < sc.ThreadCount() && err == 0; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      err = errno;
+      break;
+    }
+    fds.push_back(fd);
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, backlog) != 0) {
+      err = errno;
+      break;
+    }
+    // 端口由内核选择时，其余的套接字绑定到第一个套接字得到的端口上
+    if (addr.sin_port == 0) {
+      sockaddr_in bound;
+      socklen_t len = sizeof(bound);
+      if (getsockname(fd, (sockaddr*)&bound, &len) != 0) {
+        err = errno;
+        break;
+      }
+      addr.sin_port = bound.sin_port;
+    }
+    // 接受协程在积压队列为空时通过 poll 等待，而不是阻塞在 accept 中
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  if (!hooked) self->DisableHook();
+
+  if (err != 0) {
+    for (int fd : fds) close(fd);
+    return err;
+  }
+  state_->fds = std::move(fds);
+  port_ = ntohs(addr.sin_port);
+  for (int i = 0; i < (int)state_->fds.size(); i++) {
+    sc.ScheduleOn(i, [state = state_, i] { Acceptor(state, i); });
+  }
+  return 0;
+}
+
+void ReusePortServer::Stop() {
+  if (state_->stopping.exchange(true)) return;
+  // 唤醒等待中的接受协程
+  for (int fd : state_->fds) shutdown(fd, SHUT_RDWR);
+}
+
+void ReusePortServer::Acceptor(std::shared_ptr<State> state, int thread) {
+  auto&& sc = MultiThreadFiberScheduler::GetInstance();
+  int fd = state->fds[thread];
+  while (!state->stopping.load(std::memory_order_acquire)) {
+    // 取空积压队列，新连接在本线程上处理
+    int n = 0;
+    for (; n < kMaxAcceptBatch; n++) {
+      sockaddr_in peer;
+      socklen_t len = sizeof(peer);
+      int cli = accept4(fd, (sockaddr*)&peer, &len, SOCK_CLOEXEC);
+      if (cli < 0) break;
+      sc.ScheduleOn(thread, [state, cli, peer] { state->handler(cli, peer); });
+    }
+    if (n == kMaxAcceptBatch) {
+      this_fiber::yield();
+      continue;
+    }
+
+    int err = errno;
+    if (err == EAGAIN || err == EWOULDBLOCK) {
+      pollfd pf = {fd, POLLIN, 0};
+      poll(&pf, 1, -1);
+    } else if (err == EMFILE || err == ENFILE || err == ENOBUFS ||
+               err == ENOMEM) {
+      // 资源暂时不足，稍后重试，连接留在积压队列中
+      this_fiber::sleep_for(std::chrono::milliseconds(10));
+    } else if (err != ECONNABORTED && err != EINTR && err != EPROTO &&
+               err != EPERM) {
+      // 监听套接字被关闭(shutdown 之后为 EINVAL)
+      break;
+    }
+  }
+}
+
+}  // namespace pio::fiber
@@ -1,3 +1,4 @@
+#include <arpa/inet.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -11,16 +12,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <linux/io_uring.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
+#include <vector>
 
 #include "fiber/fiber.h"
+#include "fiber/file.h"
+#include "fiber/resolver.h"
+
+#include "co_errno.h"
 
 struct rpchook_t {
   int user_flag;            // user flag in fcntl
@@ -29,22 +40,104 @@ struct rpchook_t {
 
   struct timeval read_timeout;
   struct timeval write_timeout;
+
+  int regular_file;         // 协程中 open 得到的普通文件，读写转到 fiber::file
+  int stream;               // 流式套接字，io_uring 后端下收发都提交到 io_uring
 };
 
+extern pio::fiber::StFdEvent *co_fd_event_new(int fd);
+extern void co_fd_event_delete(pio::fiber::StFdEvent *ev);
+extern int co_fd_event_wait(pio::fiber::StFdEvent *ev, short events,
+                            const pio::MonotonicClock::time_point &deadline);
+extern void co_fd_event_close(pio::fiber::StFdEvent *ev);
+extern void co_fd_event_closed(pio::fiber::StFdEvent *ev);
+
+extern int co_uring_submit_wait(const io_uring_sqe &sqe,
+                                const pio::MonotonicClock::time_point &deadline);
+extern pio::fiber::StUringSocket *co_uring_socket_new(int fd);
+extern ssize_t co_uring_socket_recv(
+    pio::fiber::StUringSocket *sock, const iovec *iov, int count, int flags,
+    const pio::MonotonicClock::time_point &deadline);
+extern int co_uring_socket_accept(pio::fiber::StUringSocket *sock,
+                                  bool nonblock,
+                                  const pio::MonotonicClock::time_point &deadline);
+extern int co_uring_socket_wait(pio::fiber::StUringSocket *sock,
+                                const pio::MonotonicClock::time_point &deadline);
+extern bool co_uring_socket_active(pio::fiber::StUringSocket *sock);
+extern void co_uring_socket_delete(pio::fiber::StUringSocket *sock);
+extern void co_uring_socket_close(pio::fiber::StUringSocket *sock, bool fdOpen);
+
+// 描述符表，按页表的方式分两级组织：目录中的每一项指向一页 kPageSize 个描述符的上下文.
+// 页在第一次访问时分配，之后不再释放，因此读取路径只需要两次 acquire load，不需要加锁；
+// 内存占用随实际用到的最大描述符增长，目录本身位于 bss 段，未访问的部分不占物理内存.
 class FdContextManager {
  private:
-  FdContextManager(size_t sz = 102400) {
-    for (int i = 0; i < sz; i++) {
-      fdContexts_[i].domain = -1;
+  static const int kPageBits = 10;
+  static const int kPageSize = 1 << kPageBits;   /*> 每页的描述符数量 */
+  static const int kDirSize = 1 << 16;           /*> 目录项数量，总共支持 2^26 个描述符 */
+
+  struct FdContext {
+    rpchook_t hook;                                /*> hook 相关的状态，domain 为 -1 表示未使用 */
+    std::atomic<pio::fiber::StFdEvent *> event;    /*> 在 epoll 中的常驻注册 */
+    std::atomic<pio::fiber::StUringSocket *> uring; /*> io_uring 后端下的接收状态 */
+  };
+
+  struct Page {
+    FdContext contexts[kPageSize];
+
+    Page() {
+      for (auto &&x : contexts) {
+        memset(&x.hook, 0, sizeof(x.hook));
+        x.hook.domain = -1;
+        x.event.store(nullptr, std::memory_order_relaxed);
+        x.uring.store(nullptr, std::memory_order_relaxed);
+      }
     }
-  }
+  };
+
+  FdContextManager() = default;
 
   FdContextManager(const FdContextManager &) = delete;
 
   FdContextManager(FdContextManager &&) = delete;
 
+  // 进程退出时其他线程可能还在访问描述符表，页交给系统回收
   ~FdContextManager() {}
 
+  /**
+   * @brief 获取描述符所在的页，不存在时分配.
+   *
+   * @return FdContext* 描述符的上下文，描述符超出范围时返回空
+   */
+  FdContext *GetFdContext(int fd) {
+    if (fd < 0 || fd >= kDirSize * kPageSize) {
+      return nullptr;
+    }
+    auto &&slot = dir_[fd >> kPageBits];
+    Page *page = slot.load(std::memory_order_acquire);
+    if (page == nullptr) {
+      Page *created = new Page();
+      if (slot.compare_exchange_strong(page, created,
+                                       std::memory_order_acq_rel)) {
+        page = created;
+      } else {
+        delete created;
+      }
+    }
+    return page->contexts + (fd & (kPageSize - 1));
+  }
+
+  /**
+   * @brief 获取描述符的上下文，所在的页还没有分配时返回空.
+   */
+  FdContext *FindFdContext(int fd) const {
+    if (fd < 0 || fd >= kDirSize * kPageSize) {
+      return nullptr;
+    }
+    Page *page = dir_[fd >> kPageBits].load(std::memory_order_acquire);
+    return page == nullptr ? nullptr : page->contexts + (fd & (kPageSize - 1));
+  }
+
  public:
   static FdContextManager &GetInstance() {
     static FdContextManager x;
@@ -52,68 +145,125 @@ class FdContextManager {
   }
 
   rpchook_t *GetContextByFd(int fd) {
-    if (fd > -1 && fd < (int)sizeof(fdContexts_) / (int)sizeof(fdContexts_[0])) {
-      // if (fdContexts_[fd] == nullptr) {
-      //   rpchook_t* lp = (rpchook_t*)calloc(1, sizeof(rpchook_t));
-      //   lp->read_timeout.tv_sec = -1;
-      //   lp->write_timeout.tv_sec = -1;
-      //   fdContexts_[fd] = lp;
-      //   return lp;
-      // }
-      // return fdContexts_[fd];
-      if (fdContexts_[fd].domain == -1) {
-        memset(fdContexts_ + fd, 0, sizeof(fdContexts_[0]));
-        fdContexts_[fd].read_timeout.tv_sec = -1;
-        fdContexts_[fd].write_timeout.tv_sec = -1;
+    FdContext *ctx = GetFdContext(fd);
+    if (ctx == nullptr) {
+      return nullptr;
+    }
+    rpchook_t *lp = &ctx->hook;
+    if (lp->domain == -1) {
+      memset(lp, 0, sizeof(*lp));
+      lp->read_timeout.tv_sec = -1;
+      lp->write_timeout.tv_sec = -1;
+    }
+    return lp;
+  }
+
+  /**
+   * @brief 获取描述符在 epoll 中的常驻注册，第一次获取时创建.
+   * 注册对象随描述符号复用，直到进程退出都不释放.
+   *
+   * @return pio::fiber::StFdEvent* 描述符超出范围时返回空
+   */
+  pio::fiber::StFdEvent *GetEventByFd(int fd) {
+    FdContext *ctx = GetFdContext(fd);
+    if (ctx == nullptr) {
+      return nullptr;
+    }
+    pio::fiber::StFdEvent *ev = ctx->event.load(std::memory_order_acquire);
+    if (ev == nullptr) {
+      pio::fiber::StFdEvent *created = co_fd_event_new(fd);
+      if (ctx->event.compare_exchange_strong(ev, created,
+                                             std::memory_order_acq_rel)) {
+        ev = created;
+      } else {
+        co_fd_event_delete(created);
       }
-      return fdContexts_ + fd;
-    }
-    return nullptr;
-    // rwMutex_.lock_shared();
-    // if (fd < fdContexts_.size() && fdContexts_[fd] != nullptr) {
-    //   rpchook_t *result = fdContexts_[fd];
-    //   rwMutex_.unlock_shared();
-    //   return result;
-    // }
-    // rwMutex_.unlock_shared();
-
-    // rwMutex_.lock();
-    // if (fdContexts_.size() <= fd) [[unlikely]] {
-    //   fdContexts_.resize(static_cast<size_t>(fd) * 3 / 2, nullptr);
-    // }
-
-    // rpchook_t *result = new rpchook_t{0};
-    // fdContexts_[fd] = result;
-    // fdContexts_[fd]->read_timeout.tv_sec = -1;
-    // fdContexts_[fd]->write_timeout.tv_sec = -1;
-    // rwMutex_.unlock();
-    // return result;
+    }
+    return ev;
   }
 
-  void DelContextByFd(int fd) {
-    if (fd > -1 && fd < (int)sizeof(fdContexts_) / (int)sizeof(fdContexts_[0])) {
-      // rpchook_t* lp = fdContexts_[fd];
-      // if (lp != nullptr) {
-      //   fdContexts_[fd] = nullptr;
-      //   free(lp);
-      // }
-      fdContexts_[fd].domain = -1;
+  /**
+   * @brief 注销描述符在 epoll 中的常驻注册，唤醒正在等待它的协程.
+   *
+   * @param fdOpen 描述符是否还没有关闭；为 true 时真正关闭之后要调用 ClosedEventByFd，
+   * 在此之前等待者不会把描述符重新注册回去
+   */
+  void CloseEventByFd(int fd, bool fdOpen) {
+    FdContext *ctx = FindFdContext(fd);
+    if (ctx == nullptr) {
+      return;
+    }
+    pio::fiber::StFdEvent *ev = ctx->event.load(std::memory_order_acquire);
+    if (ev != nullptr) {
+      co_fd_event_close(ev);
+      if (!fdOpen) co_fd_event_closed(ev);
     }
+  }
 
-    // rwMutex_.lock();
-    // if (fdContexts_.size() <= fd) {
-    //   rwMutex_.unlock();
-    //   return;
-    // }
-    // delete fdContexts_[fd];
-    // fdContexts_[fd] = nullptr;
-    // rwMutex_.unlock();
+  void ClosedEventByFd(int fd) {
+    FdContext *ctx = FindFdContext(fd);
+    if (ctx == nullptr) {
+      return;
+    }
+    pio::fiber::StFdEvent *ev = ctx->event.load(std::memory_order_acquire);
+    if (ev != nullptr) {
+      co_fd_event_closed(ev);
+    }
+  }
+
+  /**
+   * @brief 获取描述符在 io_uring 后端下的接收状态，第一次获取时创建.
+   * 与 epoll 中的常驻注册一样随描述符号复用，直到进程退出都不释放.
+   *
+   * @return pio::fiber::StUringSocket* 描述符超出范围时返回空
+   */
+  pio::fiber::StUringSocket *GetUringByFd(int fd) {
+    FdContext *ctx = GetFdContext(fd);
+    if (ctx == nullptr) {
+      return nullptr;
+    }
+    pio::fiber::StUringSocket *sock = ctx->uring.load(std::memory_order_acquire);
+    if (sock == nullptr) {
+      pio::fiber::StUringSocket *created = co_uring_socket_new(fd);
+      if (ctx->uring.compare_exchange_strong(sock, created,
+                                             std::memory_order_acq_rel)) {
+        sock = created;
+      } else {
+        co_uring_socket_delete(created);
+      }
+    }
+    return sock;
+  }
+
+  /**
+   * @brief 获取已经存在的接收状态，不创建.
+   */
+  pio::fiber::StUringSocket *FindUringByFd(int fd) const {
+    FdContext *ctx = FindFdContext(fd);
+    return ctx == nullptr ? nullptr : ctx->uring.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief 停止描述符上的多发请求，丢弃积压的数据，唤醒正在等待的协程.
+   *
+   * @param fdOpen 描述符是否还没有关闭；为 false 时表示描述符号刚被新的描述符复用
+   */
+  void CloseUringByFd(int fd, bool fdOpen) {
+    pio::fiber::StUringSocket *sock = FindUringByFd(fd);
+    if (sock != nullptr) {
+      co_uring_socket_close(sock, fdOpen);
+    }
+  }
+
+  void DelContextByFd(int fd) {
+    FdContext *ctx = FindFdContext(fd);
+    if (ctx != nullptr) {
+      ctx->hook.domain = -1;
+    }
   }
 
  private:
-  // std::deque<rpchook_t *> fdContexts_;
-  rpchook_t fdContexts_[102400];
-  // std::shared_mutex rwMutex_;
+  std::atomic<Page *> dir_[kDirSize]; /*> 页目录 */
 };
 
 typedef int (*socket_pfn_t)(int domain, int type, int protocol);
@@ -139,6 +289,29 @@ typedef ssize_t (*send_pfn_t)(int socket, const void *buffer, size_t length,
                               int flags);
 typedef ssize_t (*recv_pfn_t)(int socket, void *buffer, size_t length,
                               int flags);
+typedef ssize_t (*sendmsg_pfn_t)(int socket, const struct msghdr *message,
+                                 int flags);
+typedef ssize_t (*recvmsg_pfn_t)(int socket, struct msghdr *message, int flags);
+typedef int (*accept4_pfn_t)(int fd, sockaddr *addr, socklen_t *len, int flags);
+
+typedef ssize_t (*sendfile_pfn_t)(int out_fd, int in_fd, off_t *offset,
+                                  size_t count);
+typedef ssize_t (*splice_pfn_t)(int fd_in, loff_t *off_in, int fd_out,
+                                loff_t *off_out, size_t len,
+                                unsigned int flags);
+
+typedef int (*open_pfn_t)(const char *path, int flags, ...);
+typedef int (*openat_pfn_t)(int dirfd, const char *path, int flags, ...);
+typedef ssize_t (*pread_pfn_t)(int fd, void *buf, size_t count, off_t offset);
+typedef ssize_t (*pwrite_pfn_t)(int fd, const void *buf, size_t count,
+                                off_t offset);
+typedef int (*fsync_pfn_t)(int fd);
+typedef int (*fdatasync_pfn_t)(int fd);
+
+typedef int (*nanosleep_pfn_t)(const struct timespec *req,
+                               struct timespec *rem);
+typedef int (*usleep_pfn_t)(useconds_t usec);
+typedef unsigned int (*sleep_pfn_t)(unsigned int seconds);
 
 typedef int (*poll_pfn_t)(struct pollfd fds[], nfds_t nfds, int timeout);
 typedef int (*setsockopt_pfn_t)(int socket, int level, int option_name,
@@ -149,6 +322,9 @@ typedef struct tm *(*localtime_r_pfn_t)(const time_t *timep, struct tm *result);
 
 typedef void *(*pthread_getspecific_pfn_t)(pthread_key_t key);
 typedef int (*pthread_setspecific_pfn_t)(pthread_key_t key, const void *value);
+typedef int (*pthread_key_create_pfn_t)(pthread_key_t *key,
+                                        void (*destructor)(void *));
+typedef int (*pthread_key_delete_pfn_t)(pthread_key_t key);
 
 typedef int (*setenv_pfn_t)(const char *name, const char *value, int overwrite);
 typedef int (*unsetenv_pfn_t)(const char *name);
@@ -161,6 +337,9 @@ typedef int (*gethostbyname_r_pfn_t)(const char *__restrict name,
                                      char *__restrict __buf, size_t __buflen,
                                      struct hostent **__restrict __result,
                                      int *__restrict __h_errnop);
+typedef int (*getaddrinfo_pfn_t)(const char *node, const char *service,
+                                 const struct addrinfo *hints,
+                                 struct addrinfo **res);
 
 static socket_pfn_t g_sys_socket_func =
     (socket_pfn_t)dlsym(RTLD_NEXT, "socket");
@@ -182,6 +361,33 @@ static recvfrom_pfn_t g_sys_recvfrom_func =
 
 static send_pfn_t g_sys_send_func = (send_pfn_t)dlsym(RTLD_NEXT, "send");
 static recv_pfn_t g_sys_recv_func = (recv_pfn_t)dlsym(RTLD_NEXT, "recv");
+static sendmsg_pfn_t g_sys_sendmsg_func =
+    (sendmsg_pfn_t)dlsym(RTLD_NEXT, "sendmsg");
+static recvmsg_pfn_t g_sys_recvmsg_func =
+    (recvmsg_pfn_t)dlsym(RTLD_NEXT, "recvmsg");
+static accept4_pfn_t g_sys_accept4_func =
+    (accept4_pfn_t)dlsym(RTLD_NEXT, "accept4");
+
+static sendfile_pfn_t g_sys_sendfile_func =
+    (sendfile_pfn_t)dlsym(RTLD_NEXT, "sendfile");
+static splice_pfn_t g_sys_splice_func =
+    (splice_pfn_t)dlsym(RTLD_NEXT, "splice");
+
+static open_pfn_t g_sys_open_func = (open_pfn_t)dlsym(RTLD_NEXT, "open");
+static openat_pfn_t g_sys_openat_func =
+    (openat_pfn_t)dlsym(RTLD_NEXT, "openat");
+static pread_pfn_t g_sys_pread_func = (pread_pfn_t)dlsym(RTLD_NEXT, "pread");
+static pwrite_pfn_t g_sys_pwrite_func =
+    (pwrite_pfn_t)dlsym(RTLD_NEXT, "pwrite");
+static fsync_pfn_t g_sys_fsync_func = (fsync_pfn_t)dlsym(RTLD_NEXT, "fsync");
+static fdatasync_pfn_t g_sys_fdatasync_func =
+    (fdatasync_pfn_t)dlsym(RTLD_NEXT, "fdatasync");
+
+static nanosleep_pfn_t g_sys_nanosleep_func =
+    (nanosleep_pfn_t)dlsym(RTLD_NEXT, "nanosleep");
+static usleep_pfn_t g_sys_usleep_func =
+    (usleep_pfn_t)dlsym(RTLD_NEXT, "usleep");
+static sleep_pfn_t g_sys_sleep_func = (sleep_pfn_t)dlsym(RTLD_NEXT, "sleep");
 
 static poll_pfn_t g_sys_poll_func = (poll_pfn_t)dlsym(RTLD_NEXT, "poll");
 
@@ -189,6 +395,15 @@ static setsockopt_pfn_t g_sys_setsockopt_func =
     (setsockopt_pfn_t)dlsym(RTLD_NEXT, "setsockopt");
 static fcntl_pfn_t g_sys_fcntl_func = (fcntl_pfn_t)dlsym(RTLD_NEXT, "fcntl");
 
+static pthread_getspecific_pfn_t g_sys_pthread_getspecific_func =
+    (pthread_getspecific_pfn_t)dlsym(RTLD_NEXT, "pthread_getspecific");
+static pthread_setspecific_pfn_t g_sys_pthread_setspecific_func =
+    (pthread_setspecific_pfn_t)dlsym(RTLD_NEXT, "pthread_setspecific");
+static pthread_key_create_pfn_t g_sys_pthread_key_create_func =
+    (pthread_key_create_pfn_t)dlsym(RTLD_NEXT, "pthread_key_create");
+static pthread_key_delete_pfn_t g_sys_pthread_key_delete_func =
+    (pthread_key_delete_pfn_t)dlsym(RTLD_NEXT, "pthread_key_delete");
+
 static setenv_pfn_t g_sys_setenv_func =
     (setenv_pfn_t)dlsym(RTLD_NEXT, "setenv");
 static unsetenv_pfn_t g_sys_unsetenv_func =
@@ -202,6 +417,8 @@ static gethostbyname_pfn_t g_sys_gethostbyname_func =
     (gethostbyname_pfn_t)dlsym(RTLD_NEXT, "gethostbyname");
 static gethostbyname_r_pfn_t g_sys_gethostbyname_r_func =
     (gethostbyname_r_pfn_t)dlsym(RTLD_NEXT, "gethostbyname_r");
+static getaddrinfo_pfn_t g_sys_getaddrinfo_func =
+    (getaddrinfo_pfn_t)dlsym(RTLD_NEXT, "getaddrinfo");
 
 static __poll_pfn_t g_sys___poll_func =
     (__poll_pfn_t)dlsym(RTLD_NEXT, "__poll");
@@ -211,9 +428,120 @@ static __poll_pfn_t g_sys___poll_func =
     g_sys_##name##_func = (name##_pfn_t)dlsym(RTLD_NEXT, #name); \
   }
 
+/**
+ * @brief 当前协程是否开启了 hook. 不能用 co_self()：它会为没有协程环境的线程
+ * 创建一个(连同 epoll 描述符和 eventfd)，普通线程上的调用直接走系统实现.
+ */
+static bool HookEnabled() {
+  pio::fiber::Fiber *self = pio::fiber::CurrentFiber();
+  return self && self->IsHooked();
+}
+
+/**
+ * @brief 把 SO_RCVTIMEO/SO_SNDTIMEO 设置的超时时间换算成截止时间.
+ */
+static pio::MonotonicClock::time_point TimeoutDeadline(const struct timeval &tv) {
+  if (tv.tv_sec == -1) return pio::MonotonicClock::time_point::max();
+  return pio::fiber::DeadlineAfter(std::chrono::seconds(tv.tv_sec) +
+                                   std::chrono::microseconds(tv.tv_usec));
+}
+
+/**
+ * @brief 系统调用返回 EAGAIN 之后，挂起当前协程直到 @p fd 在 @p events 方向上就绪.
+ * 借助描述符在 epoll 中的常驻注册，等待时不需要 epoll_ctl.
+ *
+ * @param fd 描述符
+ * @param events POLLIN 或 POLLOUT
+ * @param deadline 截止时间，同一次调用中的多次等待共用
+ * @return bool 是否应该重试系统调用；超时时 errno 为 EAGAIN，被取消时为 ECANCELED
+ */
+static bool WaitFd(int fd, short events,
+                   const pio::MonotonicClock::time_point &deadline) {
+  pio::fiber::StFdEvent *ev = FdContextManager::GetInstance().GetEventByFd(fd);
+  if (ev == nullptr) {
+    struct pollfd pf = {0};
+    pf.fd = fd;
+    pf.events = (events | POLLERR | POLLHUP);
+    int timeout = -1;
+    if (deadline != pio::MonotonicClock::time_point::max()) {
+      auto left = deadline - pio::MonotonicClock::Refresh();
+      timeout = std::max<int64_t>(
+          0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    }
+    if (poll(&pf, 1, timeout) > 0) return true;
+    errno = EAGAIN;
+    return false;
+  }
+  int ret = co_fd_event_wait(ev, events, deadline);
+  if (ret == 0) errno = EAGAIN;
+  return ret > 0;
+}
+
+/**
+ * @brief 被 hook 的套接字 IO 是否提交到 io_uring：io_uring 后端下的流式套接字.
+ */
+static bool UseUring(const rpchook_t *lp) {
+  return lp && lp->stream &&
+         pio::fiber::GetIoBackend() == pio::fiber::IoBackend::kUring;
+}
+
+/**
+ * @brief 接受的新连接丢弃描述符号上一个使用者留下的状态，继承监听套接字的类型.
+ * 新连接在内核中已经是非阻塞的(accept4 带 SOCK_NONBLOCK)，这里只记录用户看到的
+ * 文件状态标志，不再需要额外的 fcntl.
+ *
+ * @param cli 新连接
+ * @param listen 监听套接字的状态，可以为空
+ * @param nonblock 用户是否要求非阻塞(SOCK_NONBLOCK)
+ */
+static void SetupAccepted(int cli, const rpchook_t *listen, bool nonblock) {
+  FdContextManager::GetInstance().DelContextByFd(cli);
+  FdContextManager::GetInstance().CloseEventByFd(cli, false);
+  FdContextManager::GetInstance().CloseUringByFd(cli, false);
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(cli);
+  if (lp == nullptr) {
+    // 没有状态可以记录，内核中的标志就是用户看到的标志
+    if (!nonblock) g_sys_fcntl_func(cli, F_SETFL, O_RDWR);
+    return;
+  }
+  lp->user_flag = O_RDWR | (nonblock ? O_NONBLOCK : 0);
+  if (listen) {
+    lp->stream = listen->stream;
+  }
+}
+
+/**
+ * @brief io_uring 后端的 accept，从监听套接字上的多发 accept 积压的连接中取一个.
+ * 多发 accept 不返回对端地址，需要时通过 getpeername 获取.
+ *
+ * @return int 同 accept4；本线程不能使用 io_uring 时返回 -1 且 errno 为 ENOSYS
+ */
+static int UringAccept(int fd, const rpchook_t *lp, struct sockaddr *addr,
+                       socklen_t *len, int flags) {
+  pio::fiber::StUringSocket *sock =
+      FdContextManager::GetInstance().GetUringByFd(fd);
+  if (sock == nullptr) {
+    errno = ENOSYS;
+    return -1;
+  }
+  int cli = co_uring_socket_accept(sock, O_NONBLOCK & lp->user_flag,
+                                   TimeoutDeadline(lp->read_timeout));
+  if (cli < 0) {
+    return cli;
+  }
+  if (addr && len) {
+    getpeername(cli, addr, len);
+  }
+  if (flags & SOCK_CLOEXEC) {
+    g_sys_fcntl_func(cli, F_SETFD, FD_CLOEXEC);
+  }
+  SetupAccepted(cli, lp, flags & SOCK_NONBLOCK);
+  return cli;
+}
+
 int socket(int domain, int type, int protocol) {
   HOOK_SYS_FUNC(socket);
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_socket_func(domain, type, protocol);
   }
   int fd = g_sys_socket_func(domain, type, protocol);
@@ -221,14 +549,47 @@ int socket(int domain, int type, int protocol) {
     return fd;
   }
 
+  // 描述符可能没有经过 close 的 hook 就被关闭了，丢弃上一个使用者留下的状态
+  FdContextManager::GetInstance().DelContextByFd(fd);
+  FdContextManager::GetInstance().CloseEventByFd(fd, false);
+  FdContextManager::GetInstance().CloseUringByFd(fd, false);
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
   lp->domain = domain;
+  lp->stream = (type & 0xf) == SOCK_STREAM;
 
   fcntl(fd, F_SETFL, g_sys_fcntl_func(fd, F_GETFL));
 
   return fd;
 }
 
+/**
+ * @brief hook 之后的 accept/accept4. 总是以 SOCK_NONBLOCK 接受连接，新连接不需要
+ * 再通过 fcntl 设置非阻塞.
+ */
+static int HookedAccept(int fd, struct sockaddr *addr, socklen_t *len,
+                        int flags) {
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
+  int cli;
+  if (UseUring(lp)) {
+    cli = UringAccept(fd, lp, addr, len, flags);
+    if (!(cli < 0 && errno == ENOSYS)) {
+      return cli;
+    }
+  }
+  if (!lp || (O_NONBLOCK & lp->user_flag)) {
+    cli = g_sys_accept4_func(fd, addr, len, flags | SOCK_NONBLOCK);
+  } else {
+    auto deadline = TimeoutDeadline(lp->read_timeout);
+    do {
+      cli = g_sys_accept4_func(fd, addr, len, flags | SOCK_NONBLOCK);
+    } while (cli < 0 && errno == EAGAIN && WaitFd(fd, POLLIN, deadline));
+  }
+  if (cli >= 0) {
+    SetupAccepted(cli, lp, flags & SOCK_NONBLOCK);
+  }
+  return cli;
+}
+
 extern thread_local bool isaccept;
 
 int accept(int fd, struct sockaddr *addr, socklen_t *len) {
@@ -236,43 +597,68 @@ int accept(int fd, struct sockaddr *addr, socklen_t *len) {
     g_sys_accept_func = (accept_pfn_t)dlsym(((void *) -1l), "accept");
     isaccept = true;
   }
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_accept_func(fd, addr, len);
   }
-  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
-  if (!lp || (O_NONBLOCK & lp->user_flag)) {
-    int cli = g_sys_accept_func(fd, addr, len);
-    if (cli >= 0) {
-      fcntl(cli, F_SETFL, g_sys_fcntl_func(cli, F_GETFL));
-    }
-    return cli;
+  HOOK_SYS_FUNC(accept4);
+  return HookedAccept(fd, addr, len, 0);
+}
+
+int accept4(int fd, struct sockaddr *addr, socklen_t *len, int flags) {
+  HOOK_SYS_FUNC(accept4);
+  if (!HookEnabled()) {
+    return g_sys_accept4_func(fd, addr, len, flags);
   }
+  return HookedAccept(fd, addr, len, flags);
+}
 
-  int timeout = lp->read_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->read_timeout.tv_sec * 1000) +
-                          (lp->read_timeout.tv_usec / 1000);
-  struct pollfd pf = {0};
-  pf.fd = fd;
-  pf.events = (POLLIN | POLLERR | POLLHUP);
-  int pollret = poll(&pf, 1, timeout);
-  int cli = g_sys_accept_func(fd, addr, len);
-  if (cli >= 0) {
-    fcntl(cli, F_SETFL, g_sys_fcntl_func(cli, F_GETFL));
+/**
+ * @brief io_uring 后端的 connect，最长等待 75 秒.
+ *
+ * @return int 同 connect；本线程不能使用 io_uring 时返回 -1 且 errno 为 ENOSYS
+ */
+static int UringConnect(int fd, const struct sockaddr *address,
+                        socklen_t address_len) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_CONNECT;
+  sqe.fd = fd;
+  sqe.addr = (uint64_t)address;
+  sqe.off = address_len;
+  int res = co_uring_submit_wait(
+      sqe, pio::fiber::DeadlineAfter(std::chrono::seconds(75)));
+  if (res == -EAGAIN) {
+    res = -ENOSYS;
+  } else if (res == -ECANCELED) {
+    res = -ETIMEDOUT;
   }
-  return cli;
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return 0;
 }
 
 int connect(int fd, const struct sockaddr *address, socklen_t address_len) {
   HOOK_SYS_FUNC(connect);
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_connect_func(fd, address, address_len);
   }
 
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
+  if (UseUring(lp) && !(O_NONBLOCK & lp->user_flag)) {
+    int ret = UringConnect(fd, address, address_len);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      if (sizeof(lp->dest) >= address_len) {
+        memcpy(&(lp->dest), address, (int)address_len);
+      }
+      return ret;
+    }
+  }
+
   // 1.sys call
   int ret = g_sys_connect_func(fd, address, address_len);
 
-  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
   if (!lp) return ret;
 
   if (sizeof(lp->dest) >= address_len) {
@@ -287,162 +673,253 @@ int connect(int fd, const struct sockaddr *address, socklen_t address_len) {
     return ret;
   }
 
-  // 2.wait
-  int pollret = 0;
-  struct pollfd pf = {0};
-
-  for (int i = 0; i < 3; i++)  // 25s * 3 = 75s
-  {
-    memset(&pf, 0, sizeof(pf));
-    pf.fd = fd;
-    pf.events = (POLLOUT | POLLERR | POLLHUP);
-
-    pollret = poll(&pf, 1, 25000);
-
-    if (1 == pollret) {
-      break;
-    }
+  // 2.wait, 75s
+  if (!WaitFd(fd, POLLOUT,
+              pio::fiber::DeadlineAfter(std::chrono::seconds(75)))) {
+    if (errno == EAGAIN) errno = ETIMEDOUT;
+    return -1;
   }
 
-  if (pf.revents & POLLOUT)  // connect succ
-  {
-    // 3.check getsockopt ret
-    int err = 0;
-    socklen_t errlen = sizeof(err);
-    ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
-    if (ret < 0) {
-      return ret;
-    } else if (err != 0) {
-      errno = err;
-      return -1;
-    }
-    errno = 0;
-    return 0;
+  // 3.check getsockopt ret
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+  ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+  if (ret < 0) {
+    return ret;
+  } else if (err != 0) {
+    errno = err;
+    return -1;
   }
-
-  errno = ETIMEDOUT;
-  return ret;
+  errno = 0;
+  return 0;
 }
 
 int close(int fd) {
   HOOK_SYS_FUNC(close);
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
-    return g_sys_close_func(fd);
-  }
-
+  // 常驻的 epoll 注册在真正关闭之前注销并唤醒等待者：关闭之后描述符号可能立刻被其他线程复用，
+  // 那时再注销会删掉新描述符的注册。不论是否开启 hook 都要注销，否则复用这个描述符号的新描述符收不到事件
   FdContextManager::GetInstance().DelContextByFd(fd);
+  FdContextManager::GetInstance().CloseUringByFd(fd, true);
+  FdContextManager::GetInstance().CloseEventByFd(fd, true);
   int ret = g_sys_close_func(fd);
-
+  FdContextManager::GetInstance().ClosedEventByFd(fd);
   return ret;
 }
 
-// ssize_t readv(int __fd, const iovec *__iovec, int __count) {}
-// ssize_t writev(int __fd, const iovec *__iovec, int __count)
+/**
+ * @brief 跳过 iovec 数组中已经传输完的 @p n 个字节.
+ */
+static void AdvanceIovec(iovec *&iov, int &count, size_t n) {
+  while (count > 0 && n >= iov->iov_len) {
+    n -= iov->iov_len;
+    ++iov;
+    --count;
+  }
+  if (n > 0) {
+    iov->iov_base = (char *)iov->iov_base + n;
+    iov->iov_len -= n;
+  }
+}
+
+/*> 带外数据和错误队列不经过普通的数据流，即使描述符被多发 recv 接管也直接交给系统调用 */
+static const int kUringBypassFlags = MSG_OOB | MSG_ERRQUEUE;
+
+/**
+ * @brief 描述符上的数据是否已经由多发 recv 接管(在内核中或者有积压的数据).
+ * 接管之后普通数据只能从积压中读取，直接调用系统调用会跳过或者打乱已经收到的数据.
+ */
+static bool UringOwnsRecv(int fd) {
+  pio::fiber::StUringSocket *sock =
+      FdContextManager::GetInstance().FindUringByFd(fd);
+  return sock != nullptr && co_uring_socket_active(sock);
+}
+
+/**
+ * @brief io_uring 后端的接收，数据来自套接字上的多发 recv.
+ * 第一次接收之后，这个描述符上的数据都由多发 recv 取走，之后的接收都必须经过这里.
+ *
+ * @return ssize_t 同 recv；本线程不能使用 io_uring 时返回 -1 且 errno 为 ENOSYS
+ */
+static ssize_t UringRecv(int fd, const rpchook_t *lp, const iovec *iov,
+                         int count, int flags) {
+  pio::fiber::StUringSocket *sock =
+      FdContextManager::GetInstance().GetUringByFd(fd);
+  if (sock == nullptr) {
+    errno = ENOSYS;
+    return -1;
+  }
+  if (O_NONBLOCK & lp->user_flag) {
+    flags |= MSG_DONTWAIT;
+  }
+  return co_uring_socket_recv(sock, iov, count, flags,
+                              TimeoutDeadline(lp->read_timeout));
+}
 
-ssize_t readv1(int fd, const iovec *iovec, int count) {
+/**
+ * @brief io_uring 后端的发送，与 write 一样写完全部数据才返回.
+ *
+ * @return ssize_t 同 write；还没有发出任何数据时本线程不能使用 io_uring，
+ *         返回 -1 且 errno 为 ENOSYS
+ */
+static ssize_t UringSend(int fd, const rpchook_t *lp, const iovec *iov,
+                         int count, int flags) {
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += iov[i].iov_len;
+  }
+  std::vector<iovec> rest(iov, iov + count);
+  iovec *cur = rest.data();
+  int left = count;
+  auto deadline = TimeoutDeadline(lp->write_timeout);
+
+  size_t sent = 0;
+  while (sent < total) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    sqe.fd = fd;
+    sqe.msg_flags = flags;
+    if (left == 1) {
+      sqe.opcode = IORING_OP_SEND;
+      sqe.addr = (uint64_t)cur->iov_base;
+      sqe.len = (uint32_t)std::min<size_t>(cur->iov_len, 0x7ffff000);
+    } else {
+      msg.msg_iov = cur;
+      msg.msg_iovlen = left;
+      sqe.opcode = IORING_OP_SENDMSG;
+      sqe.addr = (uint64_t)&msg;
+      sqe.len = 1;
+    }
+    int res = co_uring_submit_wait(sqe, deadline);
+    if (res > 0) {
+      sent += res;
+      AdvanceIovec(cur, left, res);
+      continue;
+    }
+    if (res == -ENOSYS || res == -EAGAIN) {
+      res = sent == 0 ? -ENOSYS : -EAGAIN;
+    } else if (res == -ECANCELED) {
+      // 超过 SO_SNDTIMEO，与 epoll 后端一样返回 EAGAIN
+      res = -EAGAIN;
+    }
+    errno = -res;
+    break;
+  }
+  if (sent == 0 && total > 0) {
+    return -1;
+  }
+  return sent;
+}
+
+ssize_t readv(int fd, const iovec *iov, int count) {
   HOOK_SYS_FUNC(readv);
-  // printf("hooking readv\n");
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
-    return g_sys_readv_func(fd, iovec, count);
+  if (!HookEnabled()) {
+    return g_sys_readv_func(fd, iov, count);
   }
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
 
+  if (UseUring(lp)) {
+    ssize_t ret = UringRecv(fd, lp, iov, count, 0);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
-    ssize_t ret = g_sys_readv_func(fd, iovec, count);
-    return ret;
+    return g_sys_readv_func(fd, iov, count);
   }
-  int timeout = lp->read_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->read_timeout.tv_sec * 1000) +
-                          (lp->read_timeout.tv_usec / 1000);
-
-  struct pollfd pf = {0};
-  pf.fd = fd;
-  pf.events = (POLLIN | POLLERR | POLLHUP);
+  auto deadline = TimeoutDeadline(lp->read_timeout);
 
-  int pollret = poll(&pf, 1, timeout);
-
-  ssize_t readret = g_sys_readv_func(fd, iovec, count);
+  ssize_t readret;
+  do {
+    readret = g_sys_readv_func(fd, iov, count);
+  } while (readret < 0 && errno == EAGAIN && WaitFd(fd, POLLIN, deadline));
 
   return readret;
 }
 
-ssize_t writev1(int fd, const iovec *iovec, int count) {
+ssize_t writev(int fd, const iovec *iov, int count) {
   HOOK_SYS_FUNC(writev);
-  // printf("hooking writev\n");
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
-    return g_sys_writev_func(fd, iovec, count);
+  if (!HookEnabled()) {
+    return g_sys_writev_func(fd, iov, count);
   }
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
 
+  if (UseUring(lp) && !(O_NONBLOCK & lp->user_flag)) {
+    ssize_t ret = UringSend(fd, lp, iov, count, 0);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
-    ssize_t ret = g_sys_writev_func(fd, iovec, count);
-    return ret;
+    return g_sys_writev_func(fd, iov, count);
   }
-  size_t wrotelen = 0;
-  int timeout = lp->write_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->write_timeout.tv_sec * 1000) +
-                          (lp->write_timeout.tv_usec / 1000);
-
-  ssize_t writeret =
-      g_sys_writev_func(fd, iovec, count);
-
-  // if (writeret == 0) {
-  //   return writeret;
-  // }
-
-  // if (writeret > 0) {
-  //   wrotelen += writeret;
-  // }
-  // while (wrotelen < nbyte) {
-  //   struct pollfd pf = {0};
-  //   pf.fd = fd;
-  //   pf.events = (POLLOUT | POLLERR | POLLHUP);
-  //   poll(&pf, 1, timeout);
-
-  //   writeret =
-  //       g_sys_write_func(fd, (const char *)buf + wrotelen, nbyte - wrotelen);
-
-  //   if (writeret <= 0) {
-  //     break;
-  //   }
-  //   wrotelen += writeret;
-  // }
-  // if (writeret <= 0 && wrotelen == 0) {
-  //   return writeret;
-  // }
-  return writeret;
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += iov[i].iov_len;
+  }
+  auto deadline = TimeoutDeadline(lp->write_timeout);
+
+  ssize_t writeret;
+  do {
+    writeret = g_sys_writev_func(fd, iov, count);
+  } while (writeret < 0 && errno == EAGAIN && WaitFd(fd, POLLOUT, deadline));
+
+  if (writeret <= 0 || (size_t)writeret == total) {
+    return writeret;
+  }
+
+  // 只写出了一部分：复制一份 iovec 数组，跳过已经写出的部分后继续
+  std::vector<iovec> rest(iov, iov + count);
+  iovec *cur = rest.data();
+  int left = count;
+  size_t wrotelen = writeret;
+  AdvanceIovec(cur, left, writeret);
+  while (wrotelen < total) {
+    writeret = g_sys_writev_func(fd, cur, left);
+    if (writeret > 0) {
+      wrotelen += writeret;
+      AdvanceIovec(cur, left, writeret);
+    } else if (!(writeret < 0 && errno == EAGAIN &&
+                 WaitFd(fd, POLLOUT, deadline))) {
+      break;
+    }
+  }
+  return wrotelen;
 }
 
 ssize_t read(int fd, void *buf, size_t nbyte) {
   HOOK_SYS_FUNC(read);
   // printf("hooking read\n");
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_read_func(fd, buf, nbyte);
   }
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
 
+  if (lp && lp->regular_file) {
+    return pio::fiber::file::read(fd, buf, nbyte);
+  }
+  if (UseUring(lp)) {
+    iovec iov = {buf, nbyte};
+    ssize_t ret = UringRecv(fd, lp, &iov, 1, 0);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
     ssize_t ret = g_sys_read_func(fd, buf, nbyte);
     return ret;
   }
-  int timeout = lp->read_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->read_timeout.tv_sec * 1000) +
-                          (lp->read_timeout.tv_usec / 1000);
-
-  struct pollfd pf = {0};
-  pf.fd = fd;
-  pf.events = (POLLIN | POLLERR | POLLHUP);
+  auto deadline = TimeoutDeadline(lp->read_timeout);
 
-  int pollret = poll(&pf, 1, timeout);
-
-  ssize_t readret = g_sys_read_func(fd, (char *)buf, nbyte);
+  ssize_t readret;
+  do {
+    readret = g_sys_read_func(fd, (char *)buf, nbyte);
+  } while (readret < 0 && errno == EAGAIN && WaitFd(fd, POLLIN, deadline));
 
   return readret;
 }
@@ -451,45 +928,40 @@ ssize_t write(int fd, const void *buf, size_t nbyte) {
   HOOK_SYS_FUNC(write);
   // printf("hooking write\n");
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_write_func(fd, buf, nbyte);
   }
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
 
+  if (lp && lp->regular_file) {
+    return pio::fiber::file::write(fd, buf, nbyte);
+  }
+  if (UseUring(lp) && !(O_NONBLOCK & lp->user_flag)) {
+    iovec iov = {(void *)buf, nbyte};
+    ssize_t ret = UringSend(fd, lp, &iov, 1, 0);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
     ssize_t ret = g_sys_write_func(fd, buf, nbyte);
     return ret;
   }
   size_t wrotelen = 0;
-  int timeout = lp->write_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->write_timeout.tv_sec * 1000) +
-                          (lp->write_timeout.tv_usec / 1000);
-
-  ssize_t writeret =
-      g_sys_write_func(fd, (const char *)buf + wrotelen, nbyte - wrotelen);
-
-  if (writeret == 0) {
-    return writeret;
-  }
-
-  if (writeret > 0) {
-    wrotelen += writeret;
-  }
-  while (wrotelen < nbyte) {
-    struct pollfd pf = {0};
-    pf.fd = fd;
-    pf.events = (POLLOUT | POLLERR | POLLHUP);
-    poll(&pf, 1, timeout);
+  auto deadline = TimeoutDeadline(lp->write_timeout);
 
+  ssize_t writeret;
+  do {
     writeret =
         g_sys_write_func(fd, (const char *)buf + wrotelen, nbyte - wrotelen);
-
-    if (writeret <= 0) {
+    if (writeret > 0) {
+      wrotelen += writeret;
+    } else if (!(writeret < 0 && errno == EAGAIN &&
+                 WaitFd(fd, POLLOUT, deadline))) {
       break;
     }
-    wrotelen += writeret;
-  }
+  } while (wrotelen < nbyte);
+
   if (writeret <= 0 && wrotelen == 0) {
     return writeret;
   }
@@ -506,104 +978,99 @@ ssize_t sendto(int socket, const void *message, size_t length, int flags,
           5.try
   */
   HOOK_SYS_FUNC(sendto);
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_sendto_func(socket, message, length, flags, dest_addr,
                              dest_len);
   }
 
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(socket);
+  if (UseUring(lp) && !(O_NONBLOCK & lp->user_flag) &&
+      !(flags & MSG_DONTWAIT) && dest_addr == nullptr) {
+    iovec iov = {(void *)message, length};
+    ssize_t ret = UringSend(socket, lp, &iov, 1, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
     return g_sys_sendto_func(socket, message, length, flags, dest_addr,
                              dest_len);
   }
 
-  ssize_t ret =
-      g_sys_sendto_func(socket, message, length, flags, dest_addr, dest_len);
-  if (ret < 0 && EAGAIN == errno) {
-    int timeout = lp->write_timeout.tv_sec == -1
-                      ? -1
-                      : (lp->write_timeout.tv_sec * 1000) +
-                            (lp->write_timeout.tv_usec / 1000);
-
-    struct pollfd pf = {0};
-    pf.fd = socket;
-    pf.events = (POLLOUT | POLLERR | POLLHUP);
-    poll(&pf, 1, timeout);
-
-    ret =
-        g_sys_sendto_func(socket, message, length, flags, dest_addr, dest_len);
-  }
+  auto deadline = TimeoutDeadline(lp->write_timeout);
+  ssize_t ret;
+  do {
+    ret = g_sys_sendto_func(socket, message, length, flags, dest_addr,
+                            dest_len);
+  } while (ret < 0 && errno == EAGAIN && WaitFd(socket, POLLOUT, deadline));
   return ret;
 }
 
 ssize_t recvfrom(int socket, void *buffer, size_t length, int flags,
                  struct sockaddr *address, socklen_t *address_len) {
   HOOK_SYS_FUNC(recvfrom);
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_recvfrom_func(socket, buffer, length, flags, address,
                                address_len);
   }
 
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(socket);
+  if (UseUring(lp) && !(flags & kUringBypassFlags)) {
+    iovec iov = {buffer, length};
+    ssize_t ret = UringRecv(socket, lp, &iov, 1, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      // 流式套接字不返回对端地址
+      if (ret >= 0 && address_len) *address_len = 0;
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
     return g_sys_recvfrom_func(socket, buffer, length, flags, address,
                                address_len);
   }
 
-  int timeout = lp->read_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->read_timeout.tv_sec * 1000) +
-                          (lp->read_timeout.tv_usec / 1000);
-
-  struct pollfd pf = {0};
-  pf.fd = socket;
-  pf.events = (POLLIN | POLLERR | POLLHUP);
-  poll(&pf, 1, timeout);
-
-  ssize_t ret =
-      g_sys_recvfrom_func(socket, buffer, length, flags, address, address_len);
+  auto deadline = TimeoutDeadline(lp->read_timeout);
+  ssize_t ret;
+  do {
+    ret = g_sys_recvfrom_func(socket, buffer, length, flags, address,
+                              address_len);
+  } while (ret < 0 && errno == EAGAIN && WaitFd(socket, POLLIN, deadline));
   return ret;
 }
 
 ssize_t send(int socket, const void *buffer, size_t length, int flags) {
   HOOK_SYS_FUNC(send);
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_send_func(socket, buffer, length, flags);
   }
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(socket);
 
+  if (UseUring(lp) && !(O_NONBLOCK & lp->user_flag) && !(flags & MSG_DONTWAIT)) {
+    iovec iov = {(void *)buffer, length};
+    ssize_t ret = UringSend(socket, lp, &iov, 1, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
     return g_sys_send_func(socket, buffer, length, flags);
   }
   size_t wrotelen = 0;
-  int timeout = lp->write_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->write_timeout.tv_sec * 1000) +
-                          (lp->write_timeout.tv_usec / 1000);
-
-  ssize_t writeret = g_sys_send_func(socket, buffer, length, flags);
-  if (writeret == 0) {
-    return writeret;
-  }
-
-  if (writeret > 0) {
-    wrotelen += writeret;
-  }
-  while (wrotelen < length) {
-    struct pollfd pf = {0};
-    pf.fd = socket;
-    pf.events = (POLLOUT | POLLERR | POLLHUP);
-    poll(&pf, 1, timeout);
+  auto deadline = TimeoutDeadline(lp->write_timeout);
 
+  ssize_t writeret;
+  do {
     writeret = g_sys_send_func(socket, (const char *)buffer + wrotelen,
                                length - wrotelen, flags);
-
-    if (writeret <= 0) {
+    if (writeret > 0) {
+      wrotelen += writeret;
+    } else if (!(writeret < 0 && errno == EAGAIN &&
+                 WaitFd(socket, POLLOUT, deadline))) {
       break;
     }
-    wrotelen += writeret;
-  }
+  } while (wrotelen < length);
+
   if (writeret <= 0 && wrotelen == 0) {
     return writeret;
   }
@@ -613,39 +1080,417 @@ ssize_t send(int socket, const void *buffer, size_t length, int flags) {
 ssize_t recv(int socket, void *buffer, size_t length, int flags) {
   HOOK_SYS_FUNC(recv);
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_recv_func(socket, buffer, length, flags);
   }
   rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(socket);
 
+  if (UseUring(lp) && !(flags & kUringBypassFlags)) {
+    iovec iov = {buffer, length};
+    ssize_t ret = UringRecv(socket, lp, &iov, 1, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
   if (!lp || (O_NONBLOCK & lp->user_flag)) {
     return g_sys_recv_func(socket, buffer, length, flags);
   }
-  int timeout = lp->read_timeout.tv_sec == -1
-                    ? -1
-                    : (lp->read_timeout.tv_sec * 1000) +
-                          (lp->read_timeout.tv_usec / 1000);
+  auto deadline = TimeoutDeadline(lp->read_timeout);
+
+  ssize_t readret;
+  do {
+    readret = g_sys_recv_func(socket, buffer, length, flags);
+  } while (readret < 0 && errno == EAGAIN && WaitFd(socket, POLLIN, deadline));
 
-  struct pollfd pf = {0};
-  pf.fd = socket;
-  pf.events = (POLLIN | POLLERR | POLLHUP);
+  return readret;
+}
 
-  int pollret = poll(&pf, 1, timeout);
+ssize_t sendmsg(int socket, const struct msghdr *message, int flags) {
+  HOOK_SYS_FUNC(sendmsg);
 
-  ssize_t readret = g_sys_recv_func(socket, buffer, length, flags);
+  if (!HookEnabled()) {
+    return g_sys_sendmsg_func(socket, message, flags);
+  }
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(socket);
+
+  // 辅助数据和目的地址交给系统调用处理
+  if (UseUring(lp) && !(O_NONBLOCK & lp->user_flag) &&
+      !(flags & MSG_DONTWAIT) && message->msg_name == nullptr &&
+      message->msg_controllen == 0) {
+    ssize_t ret = UringSend(socket, lp, message->msg_iov,
+                            (int)message->msg_iovlen, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
+  if (!lp || (O_NONBLOCK & lp->user_flag)) {
+    return g_sys_sendmsg_func(socket, message, flags);
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < message->msg_iovlen; i++) {
+    total += message->msg_iov[i].iov_len;
+  }
+  auto deadline = TimeoutDeadline(lp->write_timeout);
+
+  ssize_t writeret;
+  do {
+    writeret = g_sys_sendmsg_func(socket, message, flags);
+  } while (writeret < 0 && errno == EAGAIN &&
+           WaitFd(socket, POLLOUT, deadline));
+
+  if (writeret <= 0 || (size_t)writeret == total) {
+    return writeret;
+  }
+
+  // 流式套接字只发出了一部分：辅助数据已经随第一个字节发出，剩下的只发普通数据
+  std::vector<iovec> rest(message->msg_iov,
+                          message->msg_iov + message->msg_iovlen);
+  iovec *cur = rest.data();
+  int left = (int)rest.size();
+  size_t wrotelen = writeret;
+  AdvanceIovec(cur, left, writeret);
+  struct msghdr msg = *message;
+  msg.msg_control = nullptr;
+  msg.msg_controllen = 0;
+  while (wrotelen < total) {
+    msg.msg_iov = cur;
+    msg.msg_iovlen = left;
+    writeret = g_sys_sendmsg_func(socket, &msg, flags);
+    if (writeret > 0) {
+      wrotelen += writeret;
+      AdvanceIovec(cur, left, writeret);
+    } else if (!(writeret < 0 && errno == EAGAIN &&
+                 WaitFd(socket, POLLOUT, deadline))) {
+      break;
+    }
+  }
+  return wrotelen;
+}
+
+ssize_t recvmsg(int socket, struct msghdr *message, int flags) {
+  HOOK_SYS_FUNC(recvmsg);
+
+  if (!HookEnabled()) {
+    return g_sys_recvmsg_func(socket, message, flags);
+  }
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(socket);
+
+  // 多发 recv 只保留数据，不会收到辅助数据：要辅助数据时还没有被接管的描述符交给系统调用，
+  // 已经被接管的只能从积压中读取，否则会跳过已经收到的数据
+  if (UseUring(lp) && !(flags & kUringBypassFlags) &&
+      (message->msg_controllen == 0 || UringOwnsRecv(socket))) {
+    ssize_t ret = UringRecv(socket, lp, message->msg_iov,
+                            (int)message->msg_iovlen, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      if (ret >= 0) {
+        message->msg_namelen = 0;
+        message->msg_controllen = 0;
+        message->msg_flags = 0;
+      }
+      return ret;
+    }
+  }
+  if (!lp || (O_NONBLOCK & lp->user_flag)) {
+    return g_sys_recvmsg_func(socket, message, flags);
+  }
+  auto deadline = TimeoutDeadline(lp->read_timeout);
+
+  ssize_t readret;
+  do {
+    readret = g_sys_recvmsg_func(socket, message, flags);
+  } while (readret < 0 && errno == EAGAIN && WaitFd(socket, POLLIN, deadline));
 
   return readret;
 }
 
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  HOOK_SYS_FUNC(sendfile);
+
+  if (!HookEnabled()) {
+    return g_sys_sendfile_func(out_fd, in_fd, offset, count);
+  }
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(out_fd);
+
+  if (!lp || (O_NONBLOCK & lp->user_flag)) {
+    return g_sys_sendfile_func(out_fd, in_fd, offset, count);
+  }
+  // 输入端是普通文件，只有输出端会 EAGAIN；offset 和文件偏移都由内核推进，
+  // 重试时直接用剩余的长度即可
+  size_t sentlen = 0;
+  auto deadline = TimeoutDeadline(lp->write_timeout);
+
+  ssize_t ret;
+  do {
+    ret = g_sys_sendfile_func(out_fd, in_fd, offset, count - sentlen);
+    if (ret > 0) {
+      sentlen += ret;
+    } else if (!(ret < 0 && errno == EAGAIN &&
+                 WaitFd(out_fd, POLLOUT, deadline))) {
+      break;
+    }
+  } while (sentlen < count);
+
+  if (ret <= 0 && sentlen == 0) {
+    return ret;
+  }
+  return sentlen;
+}
+
+/**
+ * @brief 输入端的数据已经被多发 recv 接管时的 splice.
+ * 先窥视积压的数据写入输出端(管道)，再丢弃真正写出去的部分，写不进去的数据留在积压中.
+ *
+ * @return ssize_t 同 splice；本线程不能使用 io_uring 时返回 -1 且 errno 为 ENOSYS
+ */
+static ssize_t UringSplice(int fd_in, const rpchook_t *lpIn, int fd_out,
+                           size_t len, unsigned int flags) {
+  bool nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+  std::vector<char> buf(std::min<size_t>(len, 64 * 1024));
+  iovec iov = {buf.data(), buf.size()};
+  ssize_t got = UringRecv(fd_in, lpIn, &iov, 1,
+                          MSG_PEEK | (nonblock ? MSG_DONTWAIT : 0));
+  if (got <= 0) {
+    return got;
+  }
+
+  rpchook_t *lpOut = FdContextManager::GetInstance().GetContextByFd(fd_out);
+  bool wait = !nonblock && lpOut && !(O_NONBLOCK & lpOut->user_flag);
+  auto deadline = wait ? TimeoutDeadline(lpOut->write_timeout)
+                       : pio::MonotonicClock::time_point::max();
+  ssize_t wrote;
+  do {
+    wrote = g_sys_write_func(fd_out, buf.data(), got);
+  } while (wrote < 0 && errno == EAGAIN && wait &&
+           WaitFd(fd_out, POLLOUT, deadline));
+  if (wrote <= 0) {
+    return wrote;
+  }
+  iovec consumed = {nullptr, (size_t)wrote};
+  UringRecv(fd_in, lpIn, &consumed, 1, MSG_TRUNC | MSG_DONTWAIT);
+  return wrote;
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+               size_t len, unsigned int flags) {
+  HOOK_SYS_FUNC(splice);
+
+  if (!HookEnabled()) {
+    return g_sys_splice_func(fd_in, off_in, fd_out, off_out, len, flags);
+  }
+  rpchook_t *lpIn = FdContextManager::GetInstance().GetContextByFd(fd_in);
+  if (UseUring(lpIn) && UringOwnsRecv(fd_in)) {
+    ssize_t ret = UringSplice(fd_in, lpIn, fd_out, len, flags);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
+  if (flags & SPLICE_F_NONBLOCK) {
+    return g_sys_splice_func(fd_in, off_in, fd_out, off_out, len, flags);
+  }
+  rpchook_t *lpOut = FdContextManager::GetInstance().GetContextByFd(fd_out);
+
+  if (!lpIn || !lpOut || (O_NONBLOCK & lpIn->user_flag) ||
+      (O_NONBLOCK & lpOut->user_flag)) {
+    return g_sys_splice_func(fd_in, off_in, fd_out, off_out, len, flags);
+  }
+  auto deadline = TimeoutDeadline(lpIn->read_timeout);
+
+  // 和 read 一样，搬运了一部分就返回。EAGAIN 可能来自任意一端：
+  // 输入端不可读时等它可读，否则等输出端可写
+  ssize_t ret;
+  for (;;) {
+    ret = g_sys_splice_func(fd_in, off_in, fd_out, off_out, len,
+                            flags | SPLICE_F_NONBLOCK);
+    if (!(ret < 0 && errno == EAGAIN)) {
+      break;
+    }
+    struct pollfd pf = {0};
+    pf.fd = fd_in;
+    pf.events = POLLIN;
+    bool readable = g_sys_poll_func(&pf, 1, 0) > 0;
+    if (!WaitFd(readable ? fd_out : fd_in, readable ? POLLOUT : POLLIN,
+                deadline)) {
+      break;
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief 当前是否是开启了 hook 的普通协程，其他情况下睡眠和名字解析直接调用系统实现.
+ */
+static bool InHookedFiber() {
+  pio::fiber::Fiber *self = pio::fiber::CurrentFiber();
+  return self && !self->IsMain() && self->IsHooked();
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+  HOOK_SYS_FUNC(nanosleep);
+
+  if (!InHookedFiber()) {
+    return g_sys_nanosleep_func(req, rem);
+  }
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+    errno = EINVAL;
+    return -1;
+  }
+  pio::this_fiber::sleep_for(std::chrono::ceil<std::chrono::microseconds>(
+      std::chrono::seconds(req->tv_sec) +
+      std::chrono::nanoseconds(req->tv_nsec)));
+  if (rem) {
+    rem->tv_sec = 0;
+    rem->tv_nsec = 0;
+  }
+  return 0;
+}
+
+int usleep(useconds_t usec) {
+  HOOK_SYS_FUNC(usleep);
+
+  if (!InHookedFiber()) {
+    return g_sys_usleep_func(usec);
+  }
+  pio::this_fiber::sleep_for(std::chrono::microseconds(usec));
+  return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+  HOOK_SYS_FUNC(sleep);
+
+  if (!InHookedFiber()) {
+    return g_sys_sleep_func(seconds);
+  }
+  pio::this_fiber::sleep_for(std::chrono::seconds(seconds));
+  return 0;
+}
+
+/**
+ * @brief 记录协程中新打开的描述符是否是普通文件，之后它的读写转到 fiber::file.
+ * 管道、设备等其他文件保持原来的处理方式.
+ */
+static int TrackOpenedFile(int fd) {
+  if (fd < 0) {
+    return fd;
+  }
+  FdContextManager::GetInstance().DelContextByFd(fd);
+  FdContextManager::GetInstance().CloseEventByFd(fd, false);
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
+    if (lp) lp->regular_file = 1;
+  }
+  return fd;
+}
+
+/**
+ * @brief 取出 open/openat 的可变参数 mode，只有创建文件时才有.
+ */
+static mode_t OpenMode(int flags, va_list args) {
+  if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+    return va_arg(args, int);
+  }
+  return 0;
+}
+
+int open(const char *path, int flags, ...) {
+  HOOK_SYS_FUNC(open);
+
+  va_list args;
+  va_start(args, flags);
+  mode_t mode = OpenMode(flags, args);
+  va_end(args);
+
+  if (!InHookedFiber()) {
+    return g_sys_open_func(path, flags, mode);
+  }
+  return TrackOpenedFile(pio::fiber::file::open(path, flags, mode));
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+  HOOK_SYS_FUNC(openat);
+
+  va_list args;
+  va_start(args, flags);
+  mode_t mode = OpenMode(flags, args);
+  va_end(args);
+
+  if (!InHookedFiber()) {
+    return g_sys_openat_func(dirfd, path, flags, mode);
+  }
+  return TrackOpenedFile(pio::fiber::file::openat(dirfd, path, flags, mode));
+}
+
+/**
+ * @brief 描述符是否是协程中打开的普通文件.
+ */
+static bool IsTrackedFile(int fd) {
+  if (!InHookedFiber()) {
+    return false;
+  }
+  rpchook_t *lp = FdContextManager::GetInstance().GetContextByFd(fd);
+  return lp && lp->regular_file;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  HOOK_SYS_FUNC(pread);
+
+  if (!IsTrackedFile(fd)) {
+    return g_sys_pread_func(fd, buf, count, offset);
+  }
+  return pio::fiber::file::pread(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  HOOK_SYS_FUNC(pwrite);
+
+  if (!IsTrackedFile(fd)) {
+    return g_sys_pwrite_func(fd, buf, count, offset);
+  }
+  return pio::fiber::file::pwrite(fd, buf, count, offset);
+}
+
+int fsync(int fd) {
+  HOOK_SYS_FUNC(fsync);
+
+  if (!IsTrackedFile(fd)) {
+    return g_sys_fsync_func(fd);
+  }
+  return pio::fiber::file::fsync(fd);
+}
+
+int fdatasync(int fd) {
+  HOOK_SYS_FUNC(fdatasync);
+
+  if (!IsTrackedFile(fd)) {
+    return g_sys_fdatasync_func(fd);
+  }
+  return pio::fiber::file::fdatasync(fd);
+}
+
 extern int co_poll_inner(struct pollfd fds[], nfds_t nfds, int timeout,
                          poll_pfn_t pollfunc);
 
-int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-  HOOK_SYS_FUNC(poll);
-
-  if (!pio::this_fiber::co_self()->IsHooked() || timeout == 0) {
-    return g_sys_poll_func(fds, nfds, timeout);
+/**
+ * @brief 借助常驻的 epoll 注册等待单个描述符的一个方向.
+ * 就绪边沿可能早于本次调用，因此被唤醒后总是用非阻塞的 poll 确认.
+ */
+static int PollOneFd(pio::fiber::StFdEvent *ev, struct pollfd *pf, short events,
+                     int timeout) {
+  auto deadline = timeout < 0
+                      ? pio::MonotonicClock::time_point::max()
+                      : pio::fiber::DeadlineAfter(std::chrono::milliseconds(timeout));
+  for (;;) {
+    int ret = g_sys_poll_func(pf, 1, 0);
+    if (ret != 0) return ret;
+    ret = co_fd_event_wait(ev, events, deadline);
+    if (ret <= 0) return ret;
   }
+}
+
+/**
+ * @brief 临时注册到 epoll 等待多个描述符，同一个描述符出现多次时先合并.
+ */
+static int PollMerged(struct pollfd fds[], nfds_t nfds, int timeout) {
   pollfd *fds_merge = NULL;
   nfds_t nfds_merge = 0;
   std::map<int, int> m;  // fd --> idx
@@ -683,11 +1528,97 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
   return ret;
 }
 
+/**
+ * @brief io_uring 后端下等待已经被多发 recv/accept 接管的描述符可读.
+ * 这些描述符的数据已经从内核取走，直接 poll 看不到，只能询问接管者. 等待多个
+ * 描述符时没有统一的唤醒，只能每 10ms 检查一次.
+ *
+ * @return int 同 poll；没有被接管的描述符时返回 -1 且 errno 为 ENOSYS
+ */
+static int PollUring(struct pollfd fds[], nfds_t nfds, int timeout) {
+  std::vector<pio::fiber::StUringSocket *> socks(nfds, nullptr);
+  bool any = false;
+  for (nfds_t i = 0; i < nfds; i++) {
+    if (!(fds[i].events & POLLIN) ||
+        !UseUring(FdContextManager::GetInstance().GetContextByFd(fds[i].fd))) {
+      continue;
+    }
+    pio::fiber::StUringSocket *sock =
+        FdContextManager::GetInstance().FindUringByFd(fds[i].fd);
+    if (sock != nullptr && co_uring_socket_active(sock)) {
+      socks[i] = sock;
+      any = true;
+    }
+  }
+  if (!any) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  auto deadline = timeout < 0
+                      ? pio::MonotonicClock::time_point::max()
+                      : pio::fiber::DeadlineAfter(std::chrono::milliseconds(timeout));
+  if (nfds == 1 && (fds[0].events & (POLLIN | POLLOUT)) == POLLIN) {
+    int ret = co_uring_socket_wait(socks[0], deadline);
+    fds[0].revents = ret > 0 ? POLLIN : 0;
+    return ret;
+  }
+  for (;;) {
+    int ret = g_sys_poll_func(fds, nfds, 0);
+    if (ret < 0) return ret;
+    for (nfds_t i = 0; i < nfds; i++) {
+      if (socks[i] != nullptr &&
+          co_uring_socket_wait(socks[i], pio::MonotonicClock::time_point::min()) > 0) {
+        ret += fds[i].revents == 0;
+        fds[i].revents |= POLLIN;
+      }
+    }
+    auto now = pio::MonotonicClock::now();
+    if (ret > 0 || now >= deadline) return ret;
+    auto slice = std::min<pio::MonotonicClock::duration>(
+        deadline - now, std::chrono::milliseconds(10));
+    ret = PollMerged(
+        fds, nfds,
+        (int)std::chrono::ceil<std::chrono::milliseconds>(slice).count());
+    if (ret < 0) return ret;
+  }
+}
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+  HOOK_SYS_FUNC(poll);
+
+  if (!HookEnabled()) {
+    return g_sys_poll_func(fds, nfds, timeout);
+  }
+  if (pio::fiber::GetIoBackend() == pio::fiber::IoBackend::kUring) {
+    int ret = PollUring(fds, nfds, timeout);
+    if (!(ret < 0 && errno == ENOSYS)) {
+      return ret;
+    }
+  }
+  if (timeout == 0) {
+    return g_sys_poll_func(fds, nfds, timeout);
+  }
+
+  // 只等待一个描述符的一个方向时(例如 accept 之前的 poll)，不需要临时注册到 epoll
+  if (nfds == 1) {
+    short events = fds[0].events & (POLLIN | POLLOUT);
+    pio::fiber::StFdEvent *ev =
+        events == POLLIN || events == POLLOUT
+            ? FdContextManager::GetInstance().GetEventByFd(fds[0].fd)
+            : nullptr;
+    if (ev != nullptr) {
+      return PollOneFd(ev, fds, events, timeout);
+    }
+  }
+  return PollMerged(fds, nfds, timeout);
+}
+
 int setsockopt(int fd, int level, int option_name, const void *option_value,
                socklen_t option_len) {
   HOOK_SYS_FUNC(setsockopt);
 
-  if (!pio::this_fiber::co_self()->IsHooked()) {
+  if (!HookEnabled()) {
     return g_sys_setsockopt_func(fd, level, option_name, option_value,
                                  option_len);
   }
@@ -742,7 +1673,7 @@ int fcntl(int fildes, int cmd, ...) {
     case F_SETFL: {
       int param = va_arg(arg_list, int);
       int flag = param;
-      if (pio::this_fiber::co_self()->IsHooked() && lp) {
+      if (HookEnabled() && lp) {
         flag |= O_NONBLOCK;
       }
       ret = g_sys_fcntl_func(fildes, cmd, flag);
@@ -782,6 +1713,49 @@ int fcntl(int fildes, int cmd, ...) {
   return ret;
 }
 
+// 开启了 hook 的协程中，pthread_getspecific/pthread_setspecific 读写的是协程本地存储，
+// 不同协程即使运行在同一个线程上也互不干扰.
+// 这里不能用 co_self()：它会为没有协程环境的线程创建一个，而线程退出时 pthread
+// 调用析构函数的阶段协程环境已经销毁了.
+
+void *pthread_getspecific(pthread_key_t key) __THROW {
+  HOOK_SYS_FUNC(pthread_getspecific);
+
+  pio::fiber::Fiber *self = pio::fiber::CurrentFiber();
+  if (!self || self->IsMain() || !self->IsHooked()) {
+    return g_sys_pthread_getspecific_func(key);
+  }
+  return self->GetSpecific(key);
+}
+
+int pthread_setspecific(pthread_key_t key, const void *value) __THROW {
+  HOOK_SYS_FUNC(pthread_setspecific);
+
+  pio::fiber::Fiber *self = pio::fiber::CurrentFiber();
+  if (!self || self->IsMain() || !self->IsHooked()) {
+    return g_sys_pthread_setspecific_func(key, value);
+  }
+  return self->SetSpecific(key, value);
+}
+
+// 记录键的析构函数，协程结束时用它释放协程本地存储中的值
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *)) __THROW {
+  HOOK_SYS_FUNC(pthread_key_create);
+
+  int ret = g_sys_pthread_key_create_func(key, destructor);
+  if (ret == 0) {
+    pio::fiber::SetSpecificDestructor(*key, destructor);
+  }
+  return ret;
+}
+
+int pthread_key_delete(pthread_key_t key) __THROW {
+  HOOK_SYS_FUNC(pthread_key_delete);
+
+  pio::fiber::DeleteSpecificKey(key);
+  return g_sys_pthread_key_delete_func(key);
+}
+
 // struct stCoSysEnv_t {
 //   char *name;
 //   char *value;
@@ -822,31 +1796,159 @@ int fcntl(int fildes, int cmd, ...) {
 //   return g_sys_setenv_func(n, value, overwrite);
 // }
 
-// struct hostent *co_gethostbyname(const char *name);
+// 开启了 hook 的协程中，主机名交给 pio::fiber::Resolver 解析，等待名字服务器时只挂起当前协程.
+// 数字形式的地址和服务名的查找不会阻塞，仍然由系统实现完成.
 
-// struct hostent *gethostbyname(const char *name) {
-//   HOOK_SYS_FUNC(gethostbyname);
+/**
+ * @brief 名字是否是数字形式的地址，或者为空.
+ */
+static bool IsNumericHost(const char *name) {
+  unsigned char buf[sizeof(struct in6_addr)];
+  return name == nullptr || inet_aton(name, (struct in_addr *)buf) != 0 ||
+         inet_pton(AF_INET6, name, buf) == 1;
+}
 
-// #if defined(__APPLE__) || defined(__FreeBSD__)
-//   return g_sys_gethostbyname_func(name);
-// #else
-//   if (!pio::this_fiber::co_self()->IsHooked()) {
-//     return g_sys_gethostbyname_func(name);
-//   }
-//   return co_gethostbyname(name);
-// #endif
-// }
+int getaddrinfo(const char *node, const char *service,
+                const struct addrinfo *hints, struct addrinfo **res) {
+  HOOK_SYS_FUNC(getaddrinfo);
 
-// int co_gethostbyname_r(const char *__restrict name,
-//                        struct hostent *__restrict __result_buf,
-//                        char *__restrict __buf, size_t __buflen,
-//                        struct hostent **__restrict __result,
-//                        int *__restrict __h_errnop) {
-//   static __thread clsCoMutex *tls_leaky_dns_lock = NULL;
-//   if (tls_leaky_dns_lock == NULL) {
-//     tls_leaky_dns_lock = new clsCoMutex();
-//   }
-//   clsSmartLock auto_lock(tls_leaky_dns_lock);
-//   return g_sys_gethostbyname_r_func(name, __result_buf, __buf, __buflen,
-//                                     __result, __h_errnop);
-// }
\ No newline at end of file
+  int flags = hints ? hints->ai_flags : 0;
+  int family = hints ? hints->ai_family : AF_UNSPEC;
+  if (!InHookedFiber() || IsNumericHost(node) || (flags & AI_NUMERICHOST) ||
+      (family != AF_UNSPEC && family != AF_INET && family != AF_INET6)) {
+    return g_sys_getaddrinfo_func(node, service, hints, res);
+  }
+
+  auto &&resolver = pio::fiber::Resolver::GetInstance();
+  std::vector<pio::fiber::IpAddress> addrs, part;
+  int err = EAI_NONAME;
+  for (int af : {AF_INET, AF_INET6}) {
+    if (family != AF_UNSPEC && family != af) continue;
+    int ret = resolver.Lookup(node, af, part);
+    if (ret == 0) {
+      addrs.insert(addrs.end(), part.begin(), part.end());
+    } else if (ret == EAI_AGAIN) {
+      err = EAI_AGAIN;
+    }
+  }
+  if (addrs.empty()) {
+    return err;
+  }
+
+  // 每个地址按数字形式交给系统实现，由它处理服务名、套接字类型并分配结果链表
+  struct addrinfo numeric;
+  if (hints) {
+    numeric = *hints;
+  } else {
+    memset(&numeric, 0, sizeof(numeric));
+  }
+  numeric.ai_flags = (flags & ~(AI_CANONNAME | AI_ADDRCONFIG | AI_V4MAPPED | AI_ALL)) |
+                     AI_NUMERICHOST;
+  struct addrinfo *head = nullptr;
+  struct addrinfo **tail = &head;
+  char text[INET6_ADDRSTRLEN];
+  for (auto &&addr : addrs) {
+    inet_ntop(addr.family, addr.family == AF_INET ? (const void *)&addr.v4 : (const void *)&addr.v6,
+              text, sizeof(text));
+    numeric.ai_family = addr.family;
+    int ret = g_sys_getaddrinfo_func(text, service, &numeric, tail);
+    if (ret != 0) {
+      freeaddrinfo(head);
+      return ret;
+    }
+    while (*tail) {
+      tail = &(*tail)->ai_next;
+    }
+  }
+  if (flags & AI_CANONNAME) {
+    head->ai_canonname = strdup(node);
+  }
+  *res = head;
+  return 0;
+}
+
+/**
+ * @brief 把 IPv4 地址按 hostent 的格式填入调用者提供的缓冲区.
+ *
+ * @return int 0 或 ERANGE
+ */
+static int FillHostent(const char *name,
+                       const std::vector<pio::fiber::IpAddress> &addrs,
+                       struct hostent *ret, char *buf, size_t buflen) {
+  size_t ptrs = sizeof(char *) * (addrs.size() + 2);
+  size_t need = ptrs + sizeof(struct in_addr) * addrs.size() + strlen(name) + 1 +
+                alignof(char *);
+  if (buflen < need) {
+    return ERANGE;
+  }
+  char *p = buf + (-(uintptr_t)buf & (alignof(char *) - 1));
+  char **aliases = (char **)p;
+  char **list = aliases + 1;
+  char *data = p + ptrs;
+  aliases[0] = nullptr;
+  for (size_t i = 0; i < addrs.size(); i++) {
+    memcpy(data, &addrs[i].v4, sizeof(struct in_addr));
+    list[i] = data;
+    data += sizeof(struct in_addr);
+  }
+  list[addrs.size()] = nullptr;
+  strcpy(data, name);
+
+  ret->h_name = data;
+  ret->h_aliases = aliases;
+  ret->h_addrtype = AF_INET;
+  ret->h_length = sizeof(struct in_addr);
+  ret->h_addr_list = list;
+  return 0;
+}
+
+int gethostbyname_r(const char *__restrict name,
+                    struct hostent *__restrict __result_buf,
+                    char *__restrict __buf, size_t __buflen,
+                    struct hostent **__restrict __result,
+                    int *__restrict __h_errnop) {
+  HOOK_SYS_FUNC(gethostbyname_r);
+
+  if (!InHookedFiber() || IsNumericHost(name)) {
+    return g_sys_gethostbyname_r_func(name, __result_buf, __buf, __buflen,
+                                      __result, __h_errnop);
+  }
+  *__result = nullptr;
+  std::vector<pio::fiber::IpAddress> addrs;
+  int err = pio::fiber::Resolver::GetInstance().Lookup(name, AF_INET, addrs);
+  if (err != 0) {
+    // 与 glibc 一致：名字不存在时返回 0，结果为空
+    *__h_errnop = err == EAI_AGAIN ? TRY_AGAIN : HOST_NOT_FOUND;
+    return err == EAI_AGAIN ? EAGAIN : 0;
+  }
+  if (FillHostent(name, addrs, __result_buf, __buf, __buflen) != 0) {
+    *__h_errnop = NETDB_INTERNAL;
+    return ERANGE;
+  }
+  *__result = __result_buf;
+  *__h_errnop = 0;
+  return 0;
+}
+
+struct hostent *gethostbyname(const char *name) {
+  HOOK_SYS_FUNC(gethostbyname);
+
+  if (!InHookedFiber() || IsNumericHost(name)) {
+    return g_sys_gethostbyname_func(name);
+  }
+  // 与系统实现一样，结果放在线程私有的缓冲区中，下一次调用时被覆盖.
+  // 查询期间固定在当前线程上，返回的结果才属于调用者此后所在的线程
+  pio::fiber::Fiber *self = pio::fiber::CurrentFiber();
+  bool pinned = self->IsPinned();
+  self->SetPinned(true);
+  static thread_local struct hostent host;
+  static thread_local char buf[8192];
+  struct hostent *result = nullptr;
+  int err = 0;
+  gethostbyname_r(name, &host, buf, sizeof(buf), &result, &err);
+  if (result == nullptr) {
+    h_errno = err;
+  }
+  self->SetPinned(pinned);
+  return result;
+}
@@ -60,12 +60,10 @@ ssize_t HttpConn::read(int* saveErrno) {
   // return len;
   return readBuff_.ReadFd(fd_, saveErrno);
 }
-extern ssize_t writev1(int fd, const iovec* iovec, int count);
-
 ssize_t HttpConn::write(int* saveErrno) {
   ssize_t len = -1;
   // do {
-    len = writev1(fd_, iov_, iovCnt_);
+    len = writev(fd_, iov_, iovCnt_);
     if (len <= 0) {
       *saveErrno = errno;
       // break;
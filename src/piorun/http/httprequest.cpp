@@ -4,6 +4,8 @@
  * @copyleft Apache 2.0
  */
 #include "http/httprequest.h"
+
+#include "fiber/fiber.h"
 using namespace std;
 
 const unordered_set<string> HttpRequest::DEFAULT_HTML{
@@ -127,7 +129,12 @@ void HttpRequest::ParsePost_() {
       LOG_DEBUG("Tag:%d", tag);
       if (tag == 0 || tag == 1) {
         bool isLogin = (tag == 1);
-        if (UserVerify(post_["username"], post_["password"], isLogin)) {
+        // 数据库查询会阻塞整个调度线程，交给阻塞任务线程池执行
+        bool verified = pio::this_fiber::run_blocking(
+            [name = post_["username"], pwd = post_["password"], isLogin] {
+              return UserVerify(name, pwd, isLogin);
+            });
+        if (verified) {
           path_ = "/welcome.html";
         } else {
           path_ = "/error.html";
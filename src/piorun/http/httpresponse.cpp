@@ -5,6 +5,8 @@
  */
 #include "http/httpresponse.h"
 
+#include "fiber/file.h"
+
 using namespace std;
 
 const unordered_map<string, string> HttpResponse::SUFFIX_TYPE = {
@@ -47,6 +49,7 @@ HttpResponse::HttpResponse() {
   path_ = srcDir_ = "";
   isKeepAlive_ = false;
   mmFile_ = nullptr;
+  isMapped_ = false;
   mmFileStat_ = {0};
 };
 
@@ -63,12 +66,13 @@ void HttpResponse::Init(const string& srcDir, string& path, bool isKeepAlive,
   path_ = path;
   srcDir_ = srcDir;
   mmFile_ = nullptr;
+  isMapped_ = false;
   mmFileStat_ = {0};
 }
 
 void HttpResponse::MakeResponse(Buffer& buff) {
   /* 判断请求的资源文件 */
-  if (stat((srcDir_ + path_).data(), &mmFileStat_) < 0 ||
+  if (pio::fiber::file::stat((srcDir_ + path_).data(), &mmFileStat_) < 0 ||
       S_ISDIR(mmFileStat_.st_mode)) {
     code_ = 404;
   } else if (!(mmFileStat_.st_mode & S_IROTH)) {
@@ -89,7 +93,7 @@ size_t HttpResponse::FileLen() const { return mmFileStat_.st_size; }
 void HttpResponse::ErrorHtml_() {
   if (CODE_PATH.count(code_) == 1) {
     path_ = CODE_PATH.find(code_)->second;
-    stat((srcDir_ + path_).data(), &mmFileStat_);
+    pio::fiber::file::stat((srcDir_ + path_).data(), &mmFileStat_);
   }
 }
 
@@ -116,30 +120,59 @@ void HttpResponse::AddHeader_(Buffer& buff) {
 }
 
 void HttpResponse::AddContent_(Buffer& buff) {
-  int srcFd = open((srcDir_ + path_).data(), O_RDONLY);
+  int srcFd = pio::fiber::file::open((srcDir_ + path_).data(), O_RDONLY);
   if (srcFd < 0) {
     ErrorContent(buff, "File NotFound!");
     return;
   }
 
-  /* 将文件映射到内存提高文件的访问速度
-      MAP_PRIVATE 建立一个写入时拷贝的私有映射*/
   LOG_DEBUG("file path %s", (srcDir_ + path_).data());
-  int* mmRet =
-      (int*)mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
-  if (*mmRet == -1) {
-    ErrorContent(buff, "File NotFound!");
-    return;
+  size_t size = mmFileStat_.st_size;
+  if (size <= MAX_READ_SIZE) {
+    /* 小文件直接读到堆上，读盘期间只挂起当前协程；
+        mmap 的缺页发生在之后的 writev 中，会阻塞整个线程 */
+    char* data = (char*)malloc(size > 0 ? size : 1);
+    size_t done = 0;
+    while (data && done < size) {
+      ssize_t n = pio::fiber::file::pread(srcFd, data + done, size - done, done);
+      if (n <= 0) {
+        free(data);
+        data = nullptr;
+        break;
+      }
+      done += n;
+    }
+    close(srcFd);
+    if (data == nullptr) {
+      ErrorContent(buff, "File NotFound!");
+      return;
+    }
+    mmFile_ = data;
+    isMapped_ = false;
+  } else {
+    /* 将文件映射到内存提高文件的访问速度
+        MAP_PRIVATE 建立一个写入时拷贝的私有映射*/
+    void* mmRet = mmap(0, size, PROT_READ, MAP_PRIVATE, srcFd, 0);
+    close(srcFd);
+    if (mmRet == MAP_FAILED) {
+      ErrorContent(buff, "File NotFound!");
+      return;
+    }
+    mmFile_ = (char*)mmRet;
+    isMapped_ = true;
   }
-  mmFile_ = (char*)mmRet;
-  close(srcFd);
   buff.Append("Content-length: " + to_string(mmFileStat_.st_size) + "\r\n\r\n");
 }
 
 void HttpResponse::UnmapFile() {
   if (mmFile_) {
-    munmap(mmFile_, mmFileStat_.st_size);
+    if (isMapped_) {
+      munmap(mmFile_, mmFileStat_.st_size);
+    } else {
+      free(mmFile_);
+    }
     mmFile_ = nullptr;
+    isMapped_ = false;
   }
 }
 
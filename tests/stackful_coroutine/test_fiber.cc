@@ -1,10 +1,17 @@
 #include <cstdio>
+#include <cstring>
+#include <dirent.h>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <memory>
+#include <system_error>
 #include <unistd.h>
 #include <iostream>
 #include <iomanip>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 
 #include "fiber/fiber.h"
 
@@ -127,6 +134,272 @@ int main(int argc, const char* agrv[]) {
     }
   };
 
+  // 5. test shared stack.
+  go [] {
+    for (int i = 0; i < 1000; i++) {
+      go_shared [i] {
+        char buf[1024];
+        memset(buf, i & 0xff, sizeof(buf));
+        this_fiber::sleep_for(std::chrono::milliseconds(i % 10 + 1));
+        for (auto c : buf) {
+          if (c != (char)(i & 0xff)) {
+            LogInfo("shared stack corrupted");
+            break;
+          }
+        }
+      };
+    }
+  };
+
+  // 6. test fiber local.
+  static this_fiber::local<int> id;
+  for (int i = 0; i < 100; i++) {
+    go [i] {
+      *id = i;
+      this_fiber::sleep_for(std::chrono::milliseconds(i % 10 + 1));
+      if (*id != i) {
+        LogInfo("fiber local corrupted");
+      }
+    };
+  }
+
+  // 删除键之后，复用同一个键值的新键读不到旧键的值
+  go [] {
+    static int old = 1;
+    pthread_key_t first, second;
+    pthread_key_create(&first, nullptr);
+    pthread_setspecific(first, &old);
+    pthread_key_delete(first);
+    pthread_key_create(&second, nullptr);
+    void* stale = pthread_getspecific(second);
+    pthread_key_delete(second);
+    LogInfo(std::string("fiber local after key reuse: ") +
+            (first == second ? "same key, " : "new key, ") +
+            (stale == nullptr ? "empty" : "stale value"));
+  };
+
+  // 7. test timed wait and cancel.
+  go [] {
+    static fiber::semaphore sem(0);
+    if (!sem.wait_for(std::chrono::milliseconds(10)) && errno == ETIMEDOUT) {
+      LogInfo("semaphore wait timeout");
+    }
+    auto token = std::make_shared<fiber::cancel_token>();
+    go [token] {
+      *token = this_fiber::get_cancel_token();
+      if (!sem.wait_for(std::chrono::seconds(10)) && errno == ECANCELED) {
+        LogInfo("semaphore wait cancelled");
+      }
+    };
+    this_fiber::sleep_for(std::chrono::milliseconds(10));
+    token->cancel();
+
+    // 不带超时、阻塞在被 hook 的 read 上的协程同样可以被取消；不带超时的 wait 不受影响
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, 0);
+    auto reader = std::make_shared<fiber::cancel_token>();
+    auto waiter = std::make_shared<fiber::cancel_token>();
+    static fiber::semaphore done(0);
+    static std::atomic<bool> posted{false};
+    go [reader, fd = sv[0]] {
+      *reader = this_fiber::get_cancel_token();
+      char c;
+      if (read(fd, &c, 1) < 0 && errno == ECANCELED) {
+        LogInfo("blocking read cancelled");
+      }
+      done.signal();
+    };
+    go [waiter] {
+      *waiter = this_fiber::get_cancel_token();
+      sem.wait();
+      if (posted.load()) LogInfo("untimed wait not cancelled");
+      done.signal();
+    };
+    this_fiber::sleep_for(std::chrono::milliseconds(10));
+    reader->cancel();
+    waiter->cancel();
+    done.wait();
+    posted = true;
+    sem.signal();
+    done.wait();
+    close(sv[0]);
+    close(sv[1]);
+  };
+
+  // 8. test select.
+  go [] {
+    auto msgs = std::make_shared<fiber::channel<int>>(16);
+    auto quit = std::make_shared<fiber::channel<int>>(1);
+    go [msgs, quit] {
+      for (int i = 0; i < 100; i++) msgs->write(i);
+      this_fiber::sleep_for(std::chrono::milliseconds(30));
+      quit->close();
+    };
+    int x, count = 0, heartbeats = 0;
+    for (;;) {
+      int r = fiber::select({fiber::on_read(*msgs, x), fiber::on_read(*quit, x)},
+                            std::chrono::milliseconds(10));
+      if (r == 0) count++;
+      else if (r == 1) break;
+      else heartbeats++;
+    }
+    LogInfo("select got " + std::to_string(count) + " messages, " +
+            std::to_string(heartbeats) + " heartbeats");
+  };
+
+  // 9. test future and task_group.
+  go [] {
+    auto f = fiber::async([] { return 42; });
+    LogInfo("async result " + std::to_string(f.get()));
+    auto results = std::make_shared<std::vector<int>>(100);
+    fiber::task_group g;
+    for (int i = 0; i < 100; i++) {
+      g.spawn([results, i] { (*results)[i] = i * i; });
+    }
+    g.wait();
+    LogInfo("task_group last result " + std::to_string(results->back()));
+
+    // 反复创建、等待、销毁，以及同一个 task_group 上连续多批任务：wait 返回时本批任务都已完成
+    int early = 0;
+    fiber::task_group reused;
+    for (int round = 0; round < 2000; round++) {
+      auto counter = std::make_shared<std::atomic<int>>(0);
+      {
+        auto g = std::make_unique<fiber::task_group>();
+        for (int i = 0; i < 4; i++) g->spawn([counter] { (*counter)++; });
+        g->wait();
+      }
+      if (counter->load() != 4) early++;
+      for (int i = 0; i < 4; i++) {
+        reused.spawn([counter] {
+          if (*counter % 3 == 0) this_fiber::yield();
+          (*counter)++;
+        });
+      }
+      reused.wait();
+      if (counter->load() != 8) early++;
+    }
+    LogInfo("task_group stress early returns " + std::to_string(early));
+  };
+
+  // 10. test run_blocking.
+  go [] {
+    int x = this_fiber::run_blocking([] {
+      ::usleep(10000);
+      return 7;
+    });
+    auto stats = fiber::BlockingPool::GetInstance().GetStats();
+    LogInfo("run_blocking result " + std::to_string(x) + ", pool threads " +
+            std::to_string(stats.threads));
+
+    // 空闲退出的线程池线程在阻塞任务中调用被 hook 的函数，不应泄漏描述符
+    auto countFds = [] {
+      int n = 0;
+      DIR* dir = opendir("/proc/self/fd");
+      while (readdir(dir) != nullptr) n++;
+      closedir(dir);
+      return n;
+    };
+    fiber::BlockingPool::GetInstance().SetIdleTimeout(std::chrono::milliseconds(5));
+    int p[2];
+    pipe(p);
+    int before = countFds();
+    for (int i = 0; i < 20; i++) {
+      this_fiber::run_blocking([&p] {
+        char c = 'x';
+        return write(p[1], &c, 1) + read(p[0], &c, 1);
+      });
+      this_fiber::sleep_for(std::chrono::milliseconds(20));
+    }
+    int after = countFds();
+    close(p[0]);
+    close(p[1]);
+    LogInfo("run_blocking on exiting threads leaked " +
+            std::to_string(after - before) + " fds");
+  };
+
+  // 11. test channel batch, close and capacity.
+  go [] {
+    // 批量写入一个容量不足的管道：写满后阻塞，读者取走之后写完剩余的元素
+    auto ch = std::make_shared<fiber::channel<int>>(5);
+    auto written = std::make_shared<std::atomic<size_t>>(0);
+    go [ch, written] {
+      std::vector<int> xs(10);
+      for (int i = 0; i < 10; i++) xs[i] = i;
+      *written = ch->write_batch(xs.begin(), xs.end());
+    };
+    this_fiber::sleep_for(std::chrono::milliseconds(10));
+    bool blocked = written->load() == 0;
+    std::vector<int> got;
+    int buf[3];
+    while (got.size() < 10) {
+      size_t n = ch->read_batch(buf, 3);
+      got.insert(got.end(), buf, buf + n);
+    }
+    while (written->load() == 0) this_fiber::yield();
+    bool inOrder = true;
+    for (int i = 0; i < 10; i++) inOrder = inOrder && got[i] == i;
+    LogInfo(std::string("channel partial batch: ") +
+            (blocked ? "writer blocked when full" : "writer did not block") +
+            ", wrote " + std::to_string(written->load()) +
+            (inOrder ? ", in order" : ", out of order"));
+
+    // 关闭之后批量读取：先取完剩余的元素，之后返回 0 且 errno 为 EPIPE
+    fiber::channel<int> closing(8);
+    for (int i = 0; i < 5; i++) closing.write(i);
+    closing.close();
+    int rest[8];
+    size_t first = closing.read_batch(rest, 3);
+    size_t second = closing.read_batch(rest, 8);
+    size_t third = closing.read_batch(rest, 8);
+    int err = errno;
+    bool writeFails = !closing.write(5) && errno == EPIPE;
+    LogInfo("channel read_batch after close: " + std::to_string(first) + " " +
+            std::to_string(second) + " " + std::to_string(third) +
+            (err == EPIPE ? " EPIPE" : " no EPIPE") +
+            (writeFails ? ", write fails" : ", write succeeds"));
+
+    // range-for 在管道关闭且取完之后结束
+    auto ranged = std::make_shared<fiber::channel<int>>(2);
+    go [ranged] {
+      for (int i = 1; i <= 100; i++) ranged->write(i);
+      ranged->close();
+    };
+    int sum = 0;
+    for (int x : *ranged) sum += x;
+    LogInfo("channel range-for sum " + std::to_string(sum));
+
+    // 容量不是 2 的幂时按给定的容量写满
+    fiber::channel<int> three(3);
+    int accepted = 0;
+    while (three.try_write(accepted)) accepted++;
+    int x = -1;
+    bool popped = three.try_read(x);
+    bool again = three.try_write(accepted);
+    LogInfo("channel capacity " + std::to_string(three.capacity()) + ", accepted " +
+            std::to_string(accepted) + ", first " + std::to_string(x) +
+            (popped && again && !three.try_write(0) ? ", refills one" : ", wrong refill"));
+
+    // 只能移动、不能默认构造的元素也可以用 read() 读出，关闭后抛出异常
+    struct Ticket {
+      explicit Ticket(int id) : id(new int(id)) {}
+      std::unique_ptr<int> id;
+    };
+    fiber::channel<Ticket> tickets(2);
+    tickets.write(Ticket(7));
+    tickets.close();
+    Ticket t = tickets.read();
+    bool threw = false;
+    try {
+      tickets.read();
+    } catch (const std::system_error& e) {
+      threw = e.code().value() == EPIPE;
+    }
+    LogInfo("channel move-only read " + std::to_string(*t.id) +
+            (threw ? ", EPIPE after close" : ", no error after close"));
+  };
+
   printf("finished test...\n");
 
   return 0;
@@ -0,0 +1,160 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+#include "fiber/fiber.h"
+#include "fiber/resolver.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 本地的 DNS 桩服务器：
+//   www.test   A 10.0.0.1, 10.0.0.2 (TTL 1 秒)，AAAA 没有记录
+//   slow.test  A 10.0.0.3，100ms 之后才应答
+//   drop.test  不应答
+//   其他名字   NXDOMAIN
+std::atomic<int> queries{0};
+
+static std::string QueryName(const unsigned char* msg, size_t len) {
+  std::string name;
+  for (size_t pos = 12; pos < len && msg[pos] != 0; pos += msg[pos] + 1) {
+    if (!name.empty()) name += '.';
+    name.append((const char*)msg + pos + 1, msg[pos]);
+  }
+  return name;
+}
+
+static void Reply(int fd, sockaddr_in peer, std::string query) {
+  auto msg = (const unsigned char*)query.data();
+  std::string name = QueryName(msg, query.size());
+  int qtype = msg[query.size() - 3];
+  if (name == "drop.test") return;
+  if (name == "slow.test") this_fiber::sleep_for(100ms);
+
+  std::string reply = query;
+  reply[2] = (char)0x81;
+  reply[3] = (char)0x80;
+  auto add = [&](std::initializer_list<int> bytes) {
+    for (int b : bytes) reply += (char)b;
+  };
+  if (name == "www.test" && qtype == 1) {
+    reply[7] = 2;
+    add({0xC0, 12, 0, 1, 0, 1, 0, 0, 0, 1, 0, 4, 10, 0, 0, 1});
+    add({0xC0, 12, 0, 1, 0, 1, 0, 0, 0, 1, 0, 4, 10, 0, 0, 2});
+  } else if (name == "slow.test" && qtype == 1) {
+    reply[7] = 1;
+    add({0xC0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10, 0, 0, 3});
+  } else {
+    // NXDOMAIN 或没有该类型的记录，权威部分带一条 SOA，否定应答缓存 60 秒
+    if (name != "www.test") reply[3] = (char)0x83;
+    reply[9] = 1;
+    add({0xC0, 12, 0, 6, 0, 1, 0, 0, 0, 60, 0, 22, 0, 0});
+    add({0, 0, 0, 1, 0, 0, 0, 60, 0, 0, 0, 60, 0, 0, 0, 60, 0, 0, 0, 60});
+  }
+  sendto(fd, reply.data(), reply.size(), 0, (sockaddr*)&peer, sizeof(peer));
+}
+
+static std::string Resolve(const char* name, int family) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* res = nullptr;
+  int err = getaddrinfo(name, "80", &hints, &res);
+  if (err != 0) return gai_strerror(err);
+  std::string s;
+  for (addrinfo* p = res; p; p = p->ai_next) {
+    char text[INET6_ADDRSTRLEN];
+    auto sin = (sockaddr_in*)p->ai_addr;
+    inet_ntop(AF_INET, &sin->sin_addr, text, sizeof(text));
+    s += s.empty() ? "" : " ";
+    s += text;
+    s += ":" + std::to_string(ntohs(sin->sin_port));
+  }
+  freeaddrinfo(res);
+  return s;
+}
+
+int main() {
+  go [] {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (sockaddr*)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr*)&addr, &len);
+
+    auto&& resolver = Resolver::GetInstance();
+    resolver.SetNameservers({"127.0.0.1:" + std::to_string(ntohs(addr.sin_port))});
+    resolver.SetTimeout(200ms, 1);
+
+    go [fd] {
+      char buf[512];
+      for (;;) {
+        sockaddr_in peer;
+        socklen_t plen = sizeof(peer);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr*)&peer, &plen);
+        if (n <= 0) break;
+        queries++;
+        go [fd, peer, query = std::string(buf, n)] { Reply(fd, peer, query); };
+      }
+    };
+
+    // 1. 解析和缓存.
+    printf("www.test: %s\n", Resolve("www.test", AF_INET).c_str());
+    printf("WWW.test.: %s\n", Resolve("WWW.test.", AF_INET).c_str());
+    printf("queries: %d (expect 1)\n", queries.load());
+
+    // 2. TTL 过期后重新查询.
+    this_fiber::sleep_for(1100ms);
+    Resolve("www.test", AF_INET);
+    printf("queries after ttl: %d (expect 2)\n", queries.load());
+
+    // 3. 否定应答也会缓存.
+    printf("missing.test: %s\n", Resolve("missing.test", AF_UNSPEC).c_str());
+    printf("missing.test: %s\n", Resolve("missing.test", AF_UNSPEC).c_str());
+    printf("www.test AAAA: %s\n", Resolve("www.test", AF_INET6).c_str());
+    printf("queries: %d (expect 5)\n", queries.load());
+
+    // 4. 同一个名字的并发查询只发出一次.
+    {
+      task_group g;
+      auto t0 = steady_clock::now();
+      for (int i = 0; i < 100; i++) {
+        g.spawn([] { Resolve("slow.test", AF_INET); });
+      }
+      g.wait();
+      auto cost = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+      printf("slow.test x100: %ldms, queries: %d (expect 6)\n", (long)cost,
+             queries.load());
+    }
+
+    // 5. 名字服务器不应答.
+    printf("drop.test: %s\n", Resolve("drop.test", AF_INET).c_str());
+
+    // 6. gethostbyname.
+    hostent* h = gethostbyname("www.test");
+    printf("gethostbyname: %s, %d addrs, first %s\n", h ? h->h_name : "null",
+           h ? (h->h_addr_list[1] ? 2 : 1) : 0,
+           h ? inet_ntoa(*(in_addr*)h->h_addr_list[0]) : "-");
+
+    // 7. 数字地址和 /etc/hosts 不经过名字服务器.
+    int before = queries.load();
+    printf("127.0.0.1: %s\n", Resolve("127.0.0.1", AF_INET).c_str());
+    printf("localhost: %s\n", Resolve("localhost", AF_INET).c_str());
+    printf("queries unchanged: %d\n", queries.load() == before);
+
+    close(fd);
+  };
+
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "fiber/fiber.h"
+#include "fiber/file.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+int main() {
+  go [] {
+    char path[] = "/tmp/test_fiber_file.XXXXXX";
+    close(mkstemp(path));
+
+    // 1. 协程中 open 得到的普通文件，read/write/pread/fsync 自动转到 fiber::file.
+    int fd = open(path, O_RDWR | O_TRUNC);
+    std::string data(1 << 20, 0);
+    for (size_t i = 0; i < data.size(); i++) data[i] = 'a' + i % 26;
+    printf("write: %zd\n", write(fd, data.data(), data.size()));
+    printf("fsync: %d, fdatasync: %d\n", fsync(fd), fdatasync(fd));
+
+    // 2. 并发的随机读不会阻塞同一线程上的其他协程.
+    std::atomic<int> ticks{0};
+    std::atomic<bool> stop{false};
+    go [&] {
+      while (!stop) {
+        ticks++;
+        this_fiber::sleep_for(100us);
+      }
+    };
+    std::atomic<int> bad{0};
+    task_group g;
+    for (int i = 0; i < 256; i++) {
+      g.spawn([&, i] {
+        char buf[4096];
+        off_t off = (off_t)i * 4096;
+        ssize_t n = pread(fd, buf, sizeof(buf), off);
+        if (n != sizeof(buf) || memcmp(buf, data.data() + off, n) != 0) bad++;
+      });
+    }
+    g.wait();
+    stop = true;
+    printf("pread x256: bad %d, ticker ran %d\n", bad.load(), ticks.load() > 0);
+
+    lseek(fd, 0, SEEK_SET);
+    char head[5] = {};
+    printf("read: %zd %s\n", read(fd, head, 4), head);
+    close(fd);
+
+    // 3. statx 和错误码.
+    struct stat st;
+    int ret = file::stat(path, &st);
+    printf("stat: %d, size %ld\n", ret, (long)st.st_size);
+    ret = file::open("/nonexistent/file", O_RDONLY);
+    printf("open missing: %d, %s\n", ret, strerror(errno));
+    unlink(path);
+  };
+
+  return 0;
+}
@@ -10,6 +10,7 @@
 #include <iostream>
 
 #include "fiber/fiber.h"
+#include "fiber/server.h"
 #include "http/httpconn.h"
 
 using namespace pio;
@@ -58,6 +59,39 @@ static int CreateTcpSocket(const unsigned short shPort, const char *pszIP) {
   return fd;
 }
 
+static void ServeConn(int clifd, sockaddr_in addr) {
+  HttpConn conn = HttpConn();
+  conn.init(clifd, addr);
+  timeval timeout;
+  timeout.tv_sec = 60;
+  timeout.tv_usec = 0;
+  setsockopt(clifd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  do {
+    do {
+      int ret = -1;
+      int readErrno = 0;
+      ret = conn.read(&readErrno);
+      // printf("ret=%d\n", ret);
+      if (ret <= 0 && readErrno != EAGAIN) {
+        conn.Close();
+        return;
+      }
+    } while (!conn.process());
+    do {
+      int ret = -1;
+      int writeErrno = 0;
+      ret = conn.write(&writeErrno);
+      if (ret <= 0 && writeErrno != EAGAIN) {
+        conn.Close();
+        return;
+      }
+    } while (conn.ToWriteBytes() != 0);
+
+  } while (conn.IsKeepAlive());
+
+  conn.Close();
+}
+
 void HttpServer() {
   int listenfd = CreateTcpSocket(1234, "127.0.0.1");
   SetNonBlock(listenfd);
@@ -85,43 +119,22 @@ void HttpServer() {
       inet_ntop(AF_INET, &addr.sin_addr, buf, 32);
     }
 
-    go[clifd, addr] {
-      HttpConn conn = HttpConn();
-      conn.init(clifd, addr);
-      timeval timeout;
-      timeout.tv_sec = 60;
-      timeout.tv_usec = 0;
-      setsockopt(clifd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-      do {
-        do {
-          int ret = -1;
-          int readErrno = 0;
-          ret = conn.read(&readErrno);
-          // printf("ret=%d\n", ret);
-          if (ret <= 0 && readErrno != EAGAIN) {
-            conn.Close();
-            return;
-          }
-        } while (!conn.process());
-        do {
-          int ret = -1;
-          int writeErrno = 0;
-          ret = conn.write(&writeErrno);
-          if (ret <= 0 && writeErrno != EAGAIN) {
-            conn.Close();
-            return;
-          }
-        } while (conn.ToWriteBytes() != 0);
-
-      } while (conn.IsKeepAlive());
-
-      conn.Close();
-    };
+    go[clifd, addr] { ServeConn(clifd, addr); };
   }
 
   close(listenfd);
 }
 
+// 每个调度线程一个 SO_REUSEPORT 监听套接字，连接在接受它的线程上处理
+void ReusePortHttpServer() {
+  ReusePortServer server(ServeConn);
+  int ret = server.Listen("127.0.0.1", 1234);
+  assert(ret == 0);
+  while (!stop) {
+    this_fiber::sleep_for(std::chrono::seconds(1));
+  }
+}
+
 char* srcDir_;
 
 __attribute__((destructor)) void after(void)
@@ -132,11 +145,30 @@ __attribute__((destructor)) void after(void)
 #include <iostream>
 int main(int argc, const char *agrv[]) {
   signal(SIGQUIT, sighdr);
+  // --io=uring/--io=epoll 选择套接字 IO 的后端，便于对比两者的性能
+  // --reuseport 每个调度线程一个监听套接字
+  bool reuseport = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(agrv[i], "--io=uring") == 0) {
+      SetIoBackend(IoBackend::kUring);
+    } else if (strcmp(agrv[i], "--io=epoll") == 0) {
+      SetIoBackend(IoBackend::kEpoll);
+    } else if (strcmp(agrv[i], "--reuseport") == 0) {
+      reuseport = true;
+    }
+  }
+  std::cout << "io backend: "
+            << (GetIoBackend() == IoBackend::kUring ? "uring" : "epoll")
+            << std::endl;
   srcDir_ = getcwd(nullptr, 256);
   strncat(srcDir_, "/resources/", 16);
   HttpConn::userCount = 0;
   HttpConn::srcDir = srcDir_;
-  go HttpServer;
+  if (reuseport) {
+    go ReusePortHttpServer;
+  } else {
+    go HttpServer;
+  }
 
   return 0;
 }
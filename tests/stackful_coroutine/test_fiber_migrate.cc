@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+
+#include "fiber/fiber.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 所有协程都从同一个线程开始运行，被唤醒之后应当有一部分迁移到空闲的线程上；
+// 固定在线程上的协程始终不离开原来的线程. 唤醒协程的信号也在同一个线程上发出，
+// 保证一次唤醒的协程同时出现在该线程的就绪队列中.
+// 注意 pthread_self 被声明为 const，编译器可能只调用一次，这里用 get_thread_id.
+
+static void Spin(microseconds us) {
+  auto end = steady_clock::now() + us;
+  while (steady_clock::now() < end) {
+  }
+}
+
+int main() {
+  go [] {
+    auto&& sc = MultiThreadFiberScheduler::GetInstance();
+    sc.SetMigration(true);
+    const int kFibers = 256;
+    const int kRounds = 50;
+
+    // 1. 同一个线程上的大量协程，每轮等待信号量并做一点计算.
+    {
+      semaphore sem(0);
+      std::atomic<int> done{0};
+      std::atomic<int> moved{0};
+      std::mutex mtx;
+      std::set<int> threads;
+      for (int i = 0; i < kFibers; i++) {
+        sc.ScheduleOn(1, [&] {
+          this_fiber::pin_to_thread(false);
+          int first = this_fiber::get_thread_id();
+          bool away = false;
+          for (int r = 0; r < kRounds; r++) {
+            sem.wait();
+            Spin(microseconds(20));
+            int now = this_fiber::get_thread_id();
+            if (now != first && !away) {
+              away = true;
+              moved++;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            threads.insert(now);
+          }
+          done++;
+        });
+      }
+      auto t0 = steady_clock::now();
+      // 在同一个线程上一次唤醒全部协程，它们同时出现在这个线程的就绪队列中
+      sc.ScheduleOn(1, [&] {
+        for (int r = 0; r < kRounds; r++) {
+          for (int k = 0; k < kFibers; k++) sem.signal();
+          this_fiber::sleep_for(1ms);
+        }
+      });
+      while (done.load() < kFibers) this_fiber::sleep_for(1ms);
+      auto cost = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+      printf("unpinned: moved %d, threads %d, %ldms\n", moved.load() > 0,
+             (int)threads.size() > 1, (long)cost);
+    }
+
+    // 2. 固定在线程上的协程不迁移.
+    {
+      semaphore sem(0);
+      std::atomic<int> done{0};
+      std::atomic<int> moved{0};
+      for (int i = 0; i < kFibers; i++) {
+        sc.ScheduleOn(1, [&] {
+          int first = this_fiber::get_thread_id();
+          for (int r = 0; r < kRounds; r++) {
+            sem.wait();
+            Spin(microseconds(20));
+            if (first != this_fiber::get_thread_id()) moved++;
+          }
+          done++;
+        });
+      }
+      sc.ScheduleOn(1, [&] {
+        for (int r = 0; r < kRounds; r++) {
+          for (int k = 0; k < kFibers; k++) sem.signal();
+          this_fiber::sleep_for(1ms);
+        }
+      });
+      while (done.load() < kFibers) this_fiber::sleep_for(1ms);
+      printf("pinned: moved %d\n", moved.load());
+    }
+
+    // 3. 迁移之后超时等待和被 hook 的 IO(包括 errno)仍然正确.
+    {
+      std::atomic<int> bad{0};
+      std::atomic<int> done{0};
+      condition_variable cond;
+      fiber::mutex mtx;
+      semaphore sem(0);
+      for (int i = 0; i < kFibers; i++) {
+        sc.ScheduleOn(1, [&] {
+          this_fiber::pin_to_thread(false);
+          int fds[2];
+          pipe(fds);
+          for (int r = 0; r < 10; r++) {
+            sem.wait();
+            Spin(microseconds(20));
+            std::unique_lock<fiber::mutex> lock(mtx);
+            if (cond.wait_for(lock, 2ms) != std::cv_status::timeout) bad++;
+            lock.unlock();
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            char c;
+            if (read(fds[0], &c, 1) != -1 || errno != EAGAIN) bad++;
+            fcntl(fds[0], F_SETFL, 0);
+            go [fd = fds[1]] { write(fd, "x", 1); };
+            if (read(fds[0], &c, 1) != 1 || c != 'x') bad++;
+          }
+          close(fds[0]);
+          close(fds[1]);
+          done++;
+        });
+      }
+      sc.ScheduleOn(1, [&] {
+        for (int r = 0; r < 10; r++) {
+          for (int k = 0; k < kFibers; k++) sem.signal();
+          this_fiber::sleep_for(5ms);
+        }
+      });
+      while (done.load() < kFibers) this_fiber::sleep_for(1ms);
+      printf("timed wait and io: bad %d\n", bad.load());
+    }
+  };
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "fiber/fiber.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 互斥锁：多线程计数的正确性、不释放 CPU 的持有者不会让等待者无限期等待、超时加锁.
+
+static const int kThreads = 4;
+static const int kFibersPerThread = 16;
+static const int kIncrements = 2000;
+
+static void PrintStats(const char* name, const fiber::mutex& mtx) {
+  auto s = mtx.GetStats();
+  printf("%s: contended %lu, spinned %lu, parked %lu, handoffs %lu, "
+         "starvations %lu\n",
+         name, (unsigned long)s.contended, (unsigned long)s.spinned,
+         (unsigned long)s.parked, (unsigned long)s.handoffs,
+         (unsigned long)s.starvations);
+}
+
+int main() {
+  go [] {
+    auto&& sc = MultiThreadFiberScheduler::GetInstance();
+
+    // 1. 多个线程上的协程竞争同一把锁计数
+    {
+      fiber::mutex mtx;
+      std::atomic<int> done{0};
+      long counter = 0;
+      for (int t = 0; t < kThreads; t++) {
+        for (int k = 0; k < kFibersPerThread; k++) {
+          sc.ScheduleOn(t + 1, [&, k] {
+            for (int i = 0; i < kIncrements; i++) {
+              std::lock_guard<fiber::mutex> lock(mtx);
+              counter++;
+              if ((i + k) % 16 == 0) this_fiber::yield();
+            }
+            done++;
+          });
+        }
+      }
+      while (done.load() < kThreads * kFibersPerThread) {
+        this_fiber::sleep_for(1ms);
+      }
+      printf("counter %s\n",
+             counter == (long)kThreads * kFibersPerThread * kIncrements ? "ok"
+                                                                        : "wrong");
+      PrintStats("counter", mtx);
+    }
+
+    // 2. 持有者释放后立刻重新加锁、从不让出，另一个线程上的等待者仍然在有限时间内拿到锁
+    {
+      fiber::mutex mtx;
+      std::atomic<bool> stop{false};
+      std::atomic<int> done{0};
+      std::atomic<long> maxWait{0};
+      std::atomic<int> acquired{0};
+      sc.ScheduleOn(1, [&] {
+        while (!stop.load()) {
+          mtx.lock();
+          auto t0 = steady_clock::now();
+          while (steady_clock::now() - t0 < microseconds(50)) {
+          }
+          mtx.unlock();
+        }
+        done++;
+      });
+      sc.ScheduleOn(2, [&] {
+        for (int i = 0; i < 20; i++) {
+          auto t0 = steady_clock::now();
+          mtx.lock();
+          long us = duration_cast<microseconds>(steady_clock::now() - t0).count();
+          mtx.unlock();
+          if (us > maxWait.load()) maxWait = us;
+          acquired++;
+          this_fiber::sleep_for(1ms);
+        }
+        stop = true;
+        done++;
+      });
+      auto t0 = steady_clock::now();
+      while (done.load() < 2 && steady_clock::now() - t0 < seconds(10)) {
+        this_fiber::sleep_for(1ms);
+      }
+      stop = true;
+      while (done.load() < 2) this_fiber::sleep_for(1ms);
+      printf("starvation: acquired %d/20, max wait %s\n", acquired.load(),
+             maxWait.load() < 100000 ? "bounded" : "unbounded");
+      PrintStats("starvation", mtx);
+    }
+
+    // 3. 超时加锁
+    {
+      fiber::mutex mtx;
+      semaphore held(0), release(0);
+      std::atomic<int> done{0};
+      sc.ScheduleOn(1, [&] {
+        mtx.lock();
+        held.signal();
+        release.wait();
+        mtx.unlock();
+        done++;
+      });
+      held.wait();
+      bool ok = mtx.try_lock_for(5ms);
+      int err = errno;
+      printf("try_lock_for while held: %s\n",
+             !ok && err == ETIMEDOUT ? "timeout" : "wrong");
+      printf("try_lock while held: %s\n", mtx.try_lock() ? "wrong" : "busy");
+      release.signal();
+      ok = mtx.try_lock_for(1s);
+      printf("try_lock_for after release: %s\n", ok ? "ok" : "wrong");
+      if (ok) mtx.unlock();
+      while (done.load() < 1) this_fiber::sleep_for(1ms);
+    }
+  };
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "fiber/coctx.h"
+#include "fiber/fiber.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 同一个线程上的两个协程互相唤醒，和直接用 coctx_swap 来回切换的耗时对比.
+// 唤醒同线程协程的一方切出时直接切换到被唤醒的协程，不经过主协程.
+
+static const int kRounds = 1000000;
+
+static FiberContext* mainCtx;
+static FiberContext* peerCtx;
+
+static void* Peer(void*, void*) {
+  for (;;) FiberContext::Swap(peerCtx, mainCtx);
+  return nullptr;
+}
+
+// 每一跳的平均耗时(ns)
+static double PerHop(steady_clock::time_point t0, int hops) {
+  return (double)duration_cast<nanoseconds>(steady_clock::now() - t0).count() /
+         hops;
+}
+
+int main() {
+  // 1. 裸的上下文切换，一来一回两跳
+  {
+    FiberContext self, peer;
+    mainCtx = &self;
+    peerCtx = &peer;
+    peer.Make(Peer, nullptr, nullptr);
+    auto t0 = steady_clock::now();
+    for (int i = 0; i < kRounds; i++) FiberContext::Swap(&self, &peer);
+    printf("raw swap: %.1fns/hop\n", PerHop(t0, 2 * kRounds));
+  }
+
+  go [] {
+    auto&& sc = MultiThreadFiberScheduler::GetInstance();
+
+    // 2. 两个管道上的乒乓
+    {
+      channel<int> ping, pong;
+      std::atomic<int> done{0};
+      std::atomic<long> sum{0};
+      auto t0 = steady_clock::now();
+      sc.ScheduleOn(1, [&] {
+        long s = 0;
+        for (int i = 0; i < kRounds; i++) {
+          ping.write(i);
+          s += pong.read();
+        }
+        sum = s;
+        done++;
+      });
+      sc.ScheduleOn(1, [&] {
+        for (int i = 0; i < kRounds; i++) {
+          pong.write(ping.read() + 1);
+        }
+        done++;
+      });
+      while (done.load() < 2) this_fiber::sleep_for(1ms);
+      printf("channel ping-pong: %.1fns/hop, sum %s\n", PerHop(t0, 2 * kRounds),
+             sum.load() == (long)kRounds * (kRounds + 1) / 2 ? "ok" : "bad");
+    }
+
+    // 3. 两个信号量上的乒乓
+    {
+      semaphore a(0), b(0);
+      std::atomic<int> done{0};
+      auto t0 = steady_clock::now();
+      sc.ScheduleOn(1, [&] {
+        for (int i = 0; i < kRounds; i++) {
+          a.signal();
+          b.wait();
+        }
+        done++;
+      });
+      sc.ScheduleOn(1, [&] {
+        for (int i = 0; i < kRounds; i++) {
+          a.wait();
+          b.signal();
+        }
+        done++;
+      });
+      while (done.load() < 2) this_fiber::sleep_for(1ms);
+      printf("semaphore ping-pong: %.1fns/hop\n", PerHop(t0, 2 * kRounds));
+    }
+
+    // 4. 互斥锁在两个协程之间交替持有
+    {
+      fiber::mutex mtx;
+      std::atomic<int> done{0};
+      long counter = 0;
+      auto t0 = steady_clock::now();
+      for (int k = 0; k < 2; k++) {
+        sc.ScheduleOn(1, [&] {
+          for (int i = 0; i < kRounds / 10; i++) {
+            mtx.lock();
+            counter++;
+            this_fiber::yield();
+            mtx.unlock();
+          }
+          done++;
+        });
+      }
+      while (done.load() < 2) this_fiber::sleep_for(1ms);
+      printf("mutex handoff: %.1fns/round, counter %s\n",
+             PerHop(t0, 2 * (kRounds / 10)),
+             counter == 2 * (kRounds / 10) ? "ok" : "bad");
+    }
+
+    // 5. 接力连续进行时定时器仍然按时触发
+    {
+      channel<int> ping, pong;
+      std::atomic<bool> stop{false};
+      std::atomic<int> done{0};
+      sc.ScheduleOn(1, [&] {
+        int x = 0;
+        while (!stop.load()) {
+          ping.write(x);
+          x = pong.read();
+        }
+        ping.close();
+        done++;
+      });
+      sc.ScheduleOn(1, [&] {
+        int x;
+        while (ping.read(x)) pong.write(x + 1);
+        done++;
+      });
+      std::atomic<long> late{-1};
+      sc.ScheduleOn(1, [&] {
+        auto t0 = steady_clock::now();
+        this_fiber::sleep_for(10ms);
+        late = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+        stop = true;
+      });
+      while (done.load() < 2) this_fiber::sleep_for(1ms);
+      printf("timer during handoff: %s\n",
+             late.load() >= 10 && late.load() < 200 ? "ok" : "late");
+    }
+  };
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "fiber/fiber.h"
+#include "fiber/server.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 用法: test_fiber_reuseport [epoll|uring]
+// 每个调度线程一个监听套接字，连接从接受到关闭都应当在同一个线程上处理.
+
+static int Connect(unsigned short port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "uring") == 0) {
+    SetIoBackend(IoBackend::kUring);
+  } else if (argc > 1) {
+    SetIoBackend(IoBackend::kEpoll);
+  }
+
+  go [] {
+    std::atomic<int> served{0};
+    std::atomic<int> migrated{0};
+    std::mutex mtx;
+    std::set<pthread_t> threads;
+
+    // 回显服务器，处理过程中多次让出，检查连接是否一直在同一个线程上
+    ReusePortServer server([&](int fd, const sockaddr_in&) {
+      pthread_t self = pthread_self();
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        threads.insert(self);
+      }
+      char buf[256];
+      ssize_t n;
+      while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        this_fiber::yield();
+        if (write(fd, buf, n) != n) break;
+        if (!pthread_equal(self, pthread_self())) migrated++;
+      }
+      served++;
+      close(fd);
+    });
+    int ret = server.Listen("127.0.0.1", 0);
+    printf("listen: %d, port set %d\n", ret, server.Port() != 0);
+
+    // 1. 并发的连接和回显.
+    {
+      std::atomic<int> bad{0};
+      task_group g;
+      for (int i = 0; i < 200; i++) {
+        g.spawn([&, i] {
+          int fd = Connect(server.Port());
+          if (fd < 0) {
+            bad++;
+            return;
+          }
+          for (int j = 0; j < 20; j++) {
+            std::string msg = std::to_string(i) + ":" + std::to_string(j);
+            char buf[32];
+            if (write(fd, msg.data(), msg.size()) != (ssize_t)msg.size() ||
+                read(fd, buf, sizeof(buf)) != (ssize_t)msg.size() ||
+                memcmp(buf, msg.data(), msg.size()) != 0) {
+              bad++;
+              break;
+            }
+          }
+          close(fd);
+        });
+      }
+      g.wait();
+      while (served.load() < 200) this_fiber::sleep_for(1ms);
+      printf("echo 200x20: bad %d, migrated %d\n", bad.load(), migrated.load());
+      printf("serving threads: %zu of %d\n", threads.size(),
+             MultiThreadFiberScheduler::GetInstance().ThreadCount());
+    }
+
+    // 2. 重复 Listen.
+    printf("listen again: %s\n", strerror(server.Listen("127.0.0.1", 0)));
+
+    // 3. 停止之后不再接受连接.
+    server.Stop();
+    this_fiber::sleep_for(20ms);
+    int fd = Connect(server.Port());
+    printf("connect after stop: %d\n", fd);
+    if (fd >= 0) close(fd);
+  };
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <shared_mutex>
+#include <thread>
+
+#include "fiber/fiber.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 读写锁：读者分布在不同数量的调度线程上时的读吞吐，以及读写混合时读者看不到写了一半的数据.
+
+static const int kReadsPerFiber = 200000;
+
+int main() {
+  go [] {
+    auto&& sc = MultiThreadFiberScheduler::GetInstance();
+
+    // 1. 只有读者，每个线程一个读者协程
+    for (int n : {1, 2, 4, sc.ThreadCount()}) {
+      if (n > sc.ThreadCount() || (n == 4 && n == sc.ThreadCount())) continue;
+      shared_mutex rw;
+      std::atomic<int> done{0};
+      long value = 1;
+      std::atomic<long> sum{0};
+      auto t0 = steady_clock::now();
+      for (int t = 0; t < n; t++) {
+        sc.ScheduleOn(t, [&] {
+          long s = 0;
+          for (int i = 0; i < kReadsPerFiber; i++) {
+            std::shared_lock<shared_mutex> lock(rw);
+            s += value;
+          }
+          sum += s;
+          done++;
+        });
+      }
+      while (done.load() < n) this_fiber::sleep_for(1ms);
+      double secs = duration<double>(steady_clock::now() - t0).count();
+      printf("readers on %d threads: %.1fM reads/s, sum %s\n", n,
+             n * kReadsPerFiber / secs / 1e6,
+             sum.load() == (long)n * kReadsPerFiber ? "ok" : "wrong");
+    }
+
+    // 2. 读写混合：写者同时修改两个值，读者检查它们始终相等
+    {
+      shared_mutex rw;
+      long a = 0, b = 0;
+      std::atomic<int> done{0};
+      std::atomic<int> bad{0};
+      std::atomic<long> reads{0};
+      int fibers = 0;
+      for (int t = 0; t < sc.ThreadCount(); t++) {
+        for (int k = 0; k < 4; k++, fibers++) {
+          bool writer = k == 0;
+          sc.ScheduleOn(t, [&, writer] {
+            for (int i = 0; i < 5000; i++) {
+              if (writer) {
+                std::lock_guard<shared_mutex> lock(rw);
+                a++;
+                if (i % 64 == 0) this_fiber::yield();
+                b++;
+              } else {
+                std::shared_lock<shared_mutex> lock(rw);
+                if (a != b) bad++;
+                reads++;
+                if (i % 64 == 0) this_fiber::yield();
+              }
+            }
+            done++;
+          });
+        }
+      }
+      while (done.load() < fibers) this_fiber::sleep_for(1ms);
+      printf("mixed: writes %s, torn reads %d\n",
+             a == (long)sc.ThreadCount() * 5000 && a == b ? "ok" : "wrong",
+             bad.load());
+    }
+
+    // 3. 读者持有时 try_lock 失败，写者持有时 try_lock_shared 失败
+    {
+      shared_mutex rw;
+      rw.lock_shared();
+      bool w = rw.try_lock();
+      rw.unlock_shared();
+      bool w2 = rw.try_lock();
+      bool r = rw.try_lock_shared();
+      if (w2) rw.unlock();
+      bool r2 = rw.try_lock_shared();
+      if (r2) rw.unlock_shared();
+      printf("try_lock: %s\n", !w && w2 && !r && r2 ? "ok" : "wrong");
+    }
+
+    // 4. 没有协程环境的普通线程上 try_lock_shared，协程中的写者仍然能等到它离开
+    {
+      shared_mutex rw;
+      std::atomic<int> state{0};
+      std::thread th([&] {
+        bool ok = rw.try_lock_shared();
+        state = ok ? 1 : -1;
+        while (state.load() != 2) std::this_thread::yield();
+        if (ok) rw.unlock_shared();
+      });
+      while (state.load() == 0) this_fiber::sleep_for(1ms);
+      bool shared = state.load() == 1;
+      bool busy = !rw.try_lock();
+      state = 2;
+      th.join();
+      bool w = rw.try_lock();
+      if (w) rw.unlock();
+      printf("plain thread: %s\n", shared && busy && w ? "ok" : "wrong");
+    }
+  };
+  return 0;
+}
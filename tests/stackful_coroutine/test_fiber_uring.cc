@@ -0,0 +1,249 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "fiber/fiber.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 用法: test_fiber_uring [epoll|uring]
+// 两种后端跑同一组用例，输出应当一致(耗时除外).
+
+static sockaddr_in Listen(int& fd) {
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, (sockaddr*)&addr, sizeof(addr));
+  listen(fd, 128);
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (sockaddr*)&addr, &len);
+  return addr;
+}
+
+static int Connect(const sockaddr_in& addr) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool ReadFull(int fd, char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+    if (n <= 0) return false;
+    got += n;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "uring") == 0) {
+    SetIoBackend(IoBackend::kUring);
+  } else if (argc > 1) {
+    SetIoBackend(IoBackend::kEpoll);
+  }
+  printf("backend: %s\n",
+         GetIoBackend() == IoBackend::kUring ? "uring" : "epoll");
+
+  go [] {
+    int lfd;
+    sockaddr_in addr = Listen(lfd);
+
+    // 回显服务器：每个连接一个协程
+    go [lfd] {
+      for (;;) {
+        sockaddr_in peer;
+        socklen_t plen = sizeof(peer);
+        int cli = accept4(lfd, (sockaddr*)&peer, &plen, SOCK_CLOEXEC);
+        if (cli < 0) break;
+        go [cli] {
+          char buf[65536];
+          ssize_t n;
+          while ((n = read(cli, buf, sizeof(buf))) > 0) {
+            if (write(cli, buf, n) != n) break;
+          }
+          close(cli);
+        };
+      }
+    };
+
+    // 1. 并发的小消息回显.
+    {
+      std::atomic<int> bad{0};
+      auto t0 = steady_clock::now();
+      task_group g;
+      for (int i = 0; i < 100; i++) {
+        g.spawn([&, i] {
+          int fd = Connect(addr);
+          if (fd < 0) {
+            bad++;
+            return;
+          }
+          for (int j = 0; j < 100; j++) {
+            std::string msg = std::to_string(i) + ":" + std::to_string(j);
+            char buf[32];
+            if (write(fd, msg.data(), msg.size()) != (ssize_t)msg.size() ||
+                !ReadFull(fd, buf, msg.size()) ||
+                memcmp(buf, msg.data(), msg.size()) != 0) {
+              bad++;
+              break;
+            }
+          }
+          close(fd);
+        });
+      }
+      g.wait();
+      auto cost = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+      printf("echo 100x100: bad %d, %ldms\n", bad.load(), (long)cost);
+    }
+
+    // 2. 大块数据超过接收缓冲区，一边写一边读.
+    {
+      int fd = Connect(addr);
+      std::string data(8 << 20, 0);
+      for (size_t i = 0; i < data.size(); i++) data[i] = 'a' + i % 23;
+      go [fd, &data] { write(fd, data.data(), data.size()); };
+      std::string back(data.size(), 0);
+      bool ok = ReadFull(fd, back.data(), back.size());
+      printf("echo 8MB: %s\n", ok && back == data ? "ok" : "bad");
+      close(fd);
+    }
+
+    // 3. recv 标志、readv 和 SO_RCVTIMEO.
+    {
+      int fd = Connect(addr);
+      timeval tv = {0, 100000};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      send(fd, "hello world", 11, 0);
+      char buf[16] = {};
+      ssize_t n = recv(fd, buf, 11, MSG_PEEK | MSG_WAITALL);
+      printf("peek: %zd %s\n", n, buf);
+      char a[6] = {}, b[6] = {};
+      iovec iov[2] = {{a, 5}, {b, 6}};
+      n = readv(fd, iov, 2);
+      printf("readv: %zd %s%s\n", n, a, b);
+      auto t0 = steady_clock::now();
+      n = recv(fd, buf, sizeof(buf), 0);
+      int err = errno;
+      auto cost = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+      printf("timeout: %zd %s, waited %d\n", n, strerror(err),
+             cost >= 90 && cost < 500);
+      n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+      err = errno;
+      printf("dontwait: %zd %s\n", n, strerror(err));
+
+      // 4. poll 一个和多个描述符.
+      pollfd pf[2] = {{fd, POLLIN, 0}, {lfd, POLLOUT, 0}};
+      printf("poll idle: %d\n", poll(pf, 1, 50));
+      go [fd] {
+        this_fiber::sleep_for(20ms);
+        send(fd, "x", 1, 0);
+      };
+      int ret = poll(pf, 1, 1000);
+      printf("poll one: %d revents %d\n", ret, pf[0].revents);
+      ret = poll(pf, 2, 1000);
+      printf("poll two: %d revents %d %d\n", ret, pf[0].revents, pf[1].revents);
+      recv(fd, buf, 1, 0);
+
+      // 5. 对端关闭.
+      shutdown(fd, SHUT_WR);
+      printf("eof: %zd\n", recv(fd, buf, sizeof(buf), 0));
+      close(fd);
+    }
+
+    // 6. 连接被拒绝.
+    {
+      int tmp;
+      sockaddr_in dead = Listen(tmp);
+      close(tmp);
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      int ret = connect(fd, (sockaddr*)&dead, sizeof(dead));
+      int err = errno;
+      printf("refused: %d %s\n", ret, strerror(err));
+      close(fd);
+    }
+
+    // 7. 关闭正在等待连接的监听套接字.
+    {
+      int tfd;
+      Listen(tfd);
+      std::atomic<int> ret{1};
+      std::atomic<int> err{0};
+      task_group g;
+      g.spawn([&] {
+        ret = accept(tfd, nullptr, nullptr);
+        err = errno;
+      });
+      this_fiber::sleep_for(20ms);
+      close(tfd);
+      g.wait();
+      printf("accept after close: %d %d\n", ret.load(), err.load() != 0);
+    }
+
+    // 8. 数据已经被多发 recv 取走之后，其他标志的 recv、splice、带辅助数据缓冲区的
+    // recvmsg 仍然按顺序读到数据；同一个连接上的两个读者都能被唤醒.
+    {
+      int fd = Connect(addr);
+      send(fd, "12345", 5, 0);
+      char buf[16] = {};
+      ssize_t n = recv(fd, buf, 2, MSG_WAITALL);
+      printf("armed: %zd %.2s\n", n, buf);
+      n = recv(fd, buf, 1, MSG_NOSIGNAL);
+      printf("nosignal: %zd %.1s\n", n, buf);
+      int p[2];
+      pipe2(p, O_CLOEXEC);
+      n = splice(fd, nullptr, p[1], nullptr, 2, 0);
+      ssize_t m = read(p[0], buf, sizeof(buf));
+      printf("splice: %zd %.*s\n", n, (int)std::max<ssize_t>(m, 0), buf);
+      close(p[0]);
+      close(p[1]);
+      send(fd, "67", 2, 0);
+      char control[64];
+      iovec iov = {buf, 2};
+      msghdr msg = {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      n = recvmsg(fd, &msg, MSG_WAITALL);
+      printf("recvmsg: %zd %.2s\n", n, buf);
+
+      std::atomic<int> got{0};
+      task_group g;
+      for (int i = 0; i < 2; i++) {
+        g.spawn([&] {
+          char c;
+          if (recv(fd, &c, 1, 0) == 1) got++;
+        });
+      }
+      this_fiber::sleep_for(20ms);
+      send(fd, "ab", 2, 0);
+      g.wait();
+      printf("two readers: %d\n", got.load());
+      close(fd);
+    }
+
+    shutdown(lfd, SHUT_RDWR);
+    close(lfd);
+  };
+  return 0;
+}
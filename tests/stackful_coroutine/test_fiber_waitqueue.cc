@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+
+#include "fiber/fiber.h"
+
+using namespace pio;
+using namespace pio::fiber;
+using namespace std::chrono;
+
+// 同步原语上的阻塞和唤醒不分配内存：协程都创建好之后，统计若干轮竞争中的内存分配次数.
+
+static std::atomic<bool> counting{false};
+static std::atomic<long> allocs{0};
+
+void* operator new(size_t size) {
+  if (counting.load(std::memory_order_relaxed)) allocs++;
+  void* p = malloc(size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static const int kFibers = 32;
+static const int kRounds = 200;
+
+int main() {
+  go [] {
+    fiber::mutex mtx;
+    condition_variable cond;
+    semaphore sem(0);
+    shared_mutex rw;
+    channel<int> a(1), b(1);
+    semaphore start(0);
+    std::atomic<int> done{0};
+    long counter = 0;
+    int generation = 0;
+    std::atomic<int> bad{0};
+
+    for (int i = 0; i < kFibers; i++) {
+      go [&, i] {
+        for (int r = 0; r < kRounds; r++) {
+          start.wait();
+          // 互斥锁和条件变量：所有协程到齐后一起被 notify_all 唤醒
+          {
+            std::unique_lock<fiber::mutex> lock(mtx);
+            counter++;
+            if (counter % kFibers == 0) {
+              generation++;
+              cond.notify_all();
+            } else {
+              int gen = generation;
+              cond.wait(lock, [&] { return generation != gen; });
+            }
+          }
+          // 读写锁
+          if (i % 4 == 0) {
+            rw.lock();
+            rw.unlock();
+          } else {
+            rw.lock_shared();
+            rw.unlock_shared();
+          }
+          // 信号量上的超时等待
+          if (sem.wait_for(microseconds(50))) bad++;
+          // 管道和 select
+          if (i % 2 == 0) {
+            a.write(i);
+          } else {
+            int x, y;
+            int k = select({on_read(a, x), on_read(b, y)}, milliseconds(100));
+            if (k < 0) bad++;
+          }
+        }
+        done++;
+      };
+    }
+
+    for (int r = 0; r < kRounds; r++) {
+      // 前几轮让协程池、时间轮等一次性的结构分配完毕
+      if (r == 20) counting = true;
+      for (int k = 0; k < kFibers; k++) start.signal();
+      while (done.load() == 0 && counter < (long)(r + 1) * kFibers) {
+        this_fiber::sleep_for(microseconds(200));
+      }
+    }
+    while (done.load() < kFibers) this_fiber::sleep_for(1ms);
+    counting = false;
+    printf("counter %s, bad %d, allocations %ld\n",
+           counter == (long)kFibers * kRounds ? "ok" : "wrong", bad.load(),
+           allocs.load());
+  };
+  return 0;
+}